@@ -16,6 +16,7 @@
 #include "absl/strings/ascii.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
+#include "radish/train/data/pipeline_stats.h"
 #include "radish/utils/logging.h"
 #include "radish/utils/text_tokenizer.h"
 
@@ -26,7 +27,9 @@ static int kMaxLabel = 28;
 ALBertExampleParser::ALBertExampleParser()
     : gen_(std::random_device{}()),
       len_dist_({6, 3, 2}),
-      random_p_dist_(0, 1) {}
+      random_p_dist_(0, 1),
+      max_len_(kMaxLen),
+      seq_len_(kMaxLen) {}
 
 bool ALBertExampleParser::_mask_seq(int maskId, int sepId, int clsId, int len,
                                     Ex& ex) {
@@ -116,25 +119,37 @@ bool ALBertExampleParser::Init(const Json::Value& config) {
   }
   random_id_dist_ =
       std::uniform_int_distribution<>(1, tokenizer_->TotalSize() - 1);
+  max_len_ = config.get("max_len", kMaxLen).asInt();
+  CHECK_GT(max_len_, 3);
+  seq_len_ = max_len_;
   return true;
 }
 
-void ALBertExampleParser::_select_a_b_ids(std::vector<int>& aids,
+bool ALBertExampleParser::SetMaxLength(int len) {
+  if (len <= 0 || len > max_len_) {
+    len = max_len_;
+  }
+  CHECK_GT(len, 3);
+  seq_len_ = len;
+  return true;
+}
+
+void ALBertExampleParser::_select_a_b_ids(int maxLen, std::vector<int>& aids,
                                           std::vector<int>& bids) {
   int alen = aids.size();
   int blen = bids.size();
-  if (alen + blen <= kMaxLen - 3) {
+  if (alen + blen <= maxLen - 3) {
     return;
   }
-  int mustKeep = (kMaxLen - 3) / 3;
+  int mustKeep = (maxLen - 3) / 3;
   if (alen <= mustKeep) {
-    blen = kMaxLen - 3 - alen;
+    blen = maxLen - 3 - alen;
     bids.erase(bids.begin() + blen, bids.end());
   } else if (blen <= mustKeep) {
-    alen = kMaxLen - 3 - blen;
+    alen = maxLen - 3 - blen;
     aids.erase(aids.begin() + alen, aids.end());
   } else {
-    int remainKeep = kMaxLen - 3 - mustKeep * 2;
+    int remainKeep = maxLen - 3 - mustKeep * 2;
     if (alen - mustKeep <= remainKeep) {
       // keep all a
       int keepb = remainKeep - alen + mustKeep;
@@ -164,17 +179,25 @@ bool ALBertExampleParser::ParseOne(std::string line,
 
   std::string ax = ss[1];
   std::string bx = ss[2];
-  auto aids = tokenizer_->Encode(ax);
-  auto bids = tokenizer_->Encode(bx);
-  Ex ex(kMaxLen);
+  std::vector<int> aids;
+  std::vector<int> bids;
+  {
+    data::PipelineStats::Scope stage(data::PipelineStage::kTokenize);
+    aids = tokenizer_->Encode(ax);
+    bids = tokenizer_->Encode(bx);
+  }
+  // 有效内容按当前长度截断, 但总是pad到max_len_, 这样切换长度前后
+  // 预取的样本仍能拼成一个batch, 多出的padding由collate截掉
+  int seqLen = seq_len_;
+  Ex ex(max_len_);
   int clsId = tokenizer_->ClsId();
   int maskId = tokenizer_->MaskId();
   int sepId = tokenizer_->SepId();
   ex.x[0] = clsId;
   ex.types[0] = 0;
   ex.ordered = target;
-  _select_a_b_ids(aids, bids);
-  CHECK_LE(aids.size() + bids.size(), kMaxLen - 3);
+  _select_a_b_ids(seqLen, aids, bids);
+  CHECK_LE(aids.size() + bids.size(), seqLen - 3);
   int k = 1;
   for (size_t i = 0; i < aids.size(); i++) {
     ex.x[k] = aids[i];
@@ -191,13 +214,20 @@ bool ALBertExampleParser::ParseOne(std::string line,
     k += 1;
   }
   ex.x[k] = sepId;
-  for (; k < kMaxLen; k++) {
+  // 最后一个SEP之后都是padding, 只在真实内容里mask,
+  // 否则mask会落在padding上, collate就截不掉这些padding了
+  const int contentLen = k + 1;
+  for (; k < max_len_; k++) {
     ex.types[k] = 1;
   }
-  if (!_mask_seq(maskId, sepId, clsId, k, ex)) {
-    spdlog::warn("mask example error");
-    return false;
+  {
+    data::PipelineStats::Scope stage(data::PipelineStage::kMask);
+    if (!_mask_seq(maskId, sepId, clsId, contentLen, ex)) {
+      spdlog::warn("mask example error");
+      return false;
+    }
   }
+  data::PipelineStats::Scope stage(data::PipelineStage::kTensorize);
   example.features.push_back(
       torch::tensor(ex.x, at::dtype(torch::kInt64).requires_grad(false)));
   example.features.push_back(torch::tensor(
@@ -210,4 +240,13 @@ bool ALBertExampleParser::ParseOne(std::string line,
       torch::tensor(ex.target, at::dtype(torch::kInt64).requires_grad(false));
   return true;
 }
+
+void ALBertExampleParser::SaveState(Json::Value* state) const {
+  (*state)["gen"] = data::RngToString(gen_);
+}
+
+void ALBertExampleParser::LoadState(const Json::Value& state) {
+  data::RngFromString(state.get("gen", "").asString(), &gen_);
+}
+
 }  // namespace radish
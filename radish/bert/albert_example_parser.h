@@ -10,6 +10,7 @@
  */
 
 #pragma once
+#include <atomic>
 #include <memory>
 #include <random>
 #include "radish/train/data/example_parser.h"
@@ -38,15 +39,23 @@ class ALBertExampleParser : public radish::data::ExampleParser {
   bool Init(const Json::Value& config) override;
   bool ParseOne(std::string line,
                 data::LlbExample& example) override;
+  void SaveState(Json::Value* state) const override;
+  void LoadState(const Json::Value& state) override;
+  bool SetMaxLength(int len) override;
 
  private:
   bool _mask_seq(int maskId, int seqId, int clsId, int len, Ex& ex);
-  void _select_a_b_ids(std::vector<int>& aids, std::vector<int>& bids);
+  void _select_a_b_ids(int maxLen, std::vector<int>& aids,
+                       std::vector<int>& bids);
   std::shared_ptr<TextTokenizer> tokenizer_;
   std::mt19937 gen_;
   std::discrete_distribution<> len_dist_;
   std::uniform_int_distribution<> random_id_dist_;
   std::uniform_real_distribution<> random_p_dist_;
+  // 样本pad到的长度, 配置里的 max_len
+  int max_len_;
+  // 当前允许的有效长度, 不超过max_len_
+  std::atomic<int> seq_len_;
 };
 
 }  // namespace radish
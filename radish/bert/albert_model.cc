@@ -64,6 +64,9 @@ static Tensor calc_accuracy_(const Tensor& pred, const Tensor& target,
 }
 
 ALBertModelImpl::ALBertModelImpl(BertOptions options_) : options(options_) {
+  // vocab_proj和word embedding共用权重, 稀疏梯度没有意义
+  CHECK(!options.sparse_embedding())
+      << "sparse_embedding doesn't work with ALBERT's tied vocab_proj";
   bert = BertModel(options);
   register_module("bert", bert);
   vocab_proj = torch::nn::Linear(options.d_wordvec(), options.n_vocab());
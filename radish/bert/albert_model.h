@@ -18,6 +18,12 @@ class TORCH_API ALBertModelImpl : public train::LlbModel {
 
   std::vector<Tensor> forward(std::vector<Tensor> inputs) override;
   bool EvalInBatch() const override;
+  // src_seq和types可以截padding, mask的位置只落在真实内容里
+  std::vector<size_t> SequenceFeatures() const override { return {0, 2}; }
+  std::vector<size_t> PositionFeatures() const override { return {1}; }
+  int64_t MatmulParametersPerToken() const override {
+    return MatrixParameters(*bert->encoder->layer);
+  }
   BertOptions options;
   BertModel bert = nullptr;
   LayerNorm laynorm = nullptr;
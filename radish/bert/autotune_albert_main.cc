@@ -0,0 +1,90 @@
+/*
+ * File: autotune_albert_main.cc
+ * Project: bert
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-13 11:40:05
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+
+#include "radish/utils/logging.h"
+
+#include "radish/bert/albert_example_parser.h"
+#include "radish/bert/albert_model.h"
+#include "radish/train/autotuner.h"
+#include "radish/utils/runtime_flags.h"
+
+ABSL_FLAG(std::string, train_data_path, "/e/data/albert_data/albert/part0",
+          "the data used for timed trials");
+ABSL_FLAG(std::string, parser_conf_path, "bert/parser_conf.json",
+          "the example parser conf path");
+ABSL_FLAG(std::string, output, "autotune.json",
+          "where to write the best config, pass it to --runtime_config");
+ABSL_FLAG(std::string, tune_batch_sizes, "128,256,512",
+          "batch sizes to try, the first one is the starting point");
+ABSL_FLAG(std::string, tune_intra_op_threads, "0",
+          "intra-op threads to try, 0 for the libtorch default");
+ABSL_FLAG(std::string, tune_loader_workers, "1,2,4",
+          "data loader workers to try");
+ABSL_FLAG(std::string, tune_update_per_batches, "1,2",
+          "gradient accumulation steps to try");
+ABSL_FLAG(int32_t, tune_warmup_steps, 5, "untimed batches of each trial");
+ABSL_FLAG(int32_t, tune_measure_steps, 20, "timed batches of each trial");
+ABSL_FLAG(double, max_rss_mb, 0,
+          "skip configs whose peak resident memory exceeds this, 0 no limit");
+ABSL_FLAG(bool, trim_padding, false,
+          "trim sequence features to the longest example in each batch");
+ABSL_FLAG(float, learning_rate, 0.0001, "the learning rate ");
+
+static std::vector<int> ParseIntList(const std::string& str) {
+  std::vector<int> values;
+  for (absl::string_view part :
+       absl::StrSplit(str, ',', absl::SkipWhitespace())) {
+    int v = 0;
+    CHECK(absl::SimpleAtoi(part, &v)) << "bad int list:" << str;
+    values.push_back(v);
+  }
+  CHECK(!values.empty()) << "empty int list";
+  return values;
+}
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
+  radish::ALBertModel model =
+      radish::ALBertModel(radish::BertOptions::kMiniAlbertOpts);
+  radish::train::AutotuneOptions tuneOpts;
+  tuneOpts.batch_sizes(ParseIntList(absl::GetFlag(FLAGS_tune_batch_sizes)));
+  tuneOpts.intra_op_threads(
+      ParseIntList(absl::GetFlag(FLAGS_tune_intra_op_threads)));
+  tuneOpts.loader_workers(
+      ParseIntList(absl::GetFlag(FLAGS_tune_loader_workers)));
+  tuneOpts.update_per_batches(
+      ParseIntList(absl::GetFlag(FLAGS_tune_update_per_batches)));
+  tuneOpts.warmup_steps(absl::GetFlag(FLAGS_tune_warmup_steps));
+  tuneOpts.measure_steps(absl::GetFlag(FLAGS_tune_measure_steps));
+  tuneOpts.max_rss_mb(absl::GetFlag(FLAGS_max_rss_mb));
+  tuneOpts.trim_padding(absl::GetFlag(FLAGS_trim_padding));
+  radish::train::Autotuner<radish::ALBertExampleParser, radish::ALBertModel>
+      tuner(tuneOpts, runtimeOpts);
+  radish::train::AutotuneTrial best =
+      tuner.Search(model, absl::GetFlag(FLAGS_train_data_path),
+                   absl::GetFlag(FLAGS_parser_conf_path),
+                   absl::GetFlag(FLAGS_learning_rate));
+  CHECK(best.ok) << "no trial succeeded, last error:" << best.error;
+  tuner.WriteJson(best, absl::GetFlag(FLAGS_output));
+  spdlog::info("wrote {} after {} trials", absl::GetFlag(FLAGS_output),
+               tuner.trials().size());
+  return 0;
+}
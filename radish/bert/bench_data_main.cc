@@ -0,0 +1,99 @@
+/*
+ * File: bench_data_main.cc
+ * Project: bert
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-16 3:20:18
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+
+#include "radish/utils/logging.h"
+
+#include "radish/bert/albert_example_parser.h"
+#include "radish/bert/span_bert_example_parser.h"
+#include "radish/train/data_pipeline_bench.h"
+#include "radish/utils/runtime_flags.h"
+
+ABSL_FLAG(std::string, parser, "albert",
+          "albert reads plain txt, span_bert reads leveldb");
+ABSL_FLAG(std::string, train_data_path, "/e/data/albert_data/albert/part0",
+          "the data to read");
+ABSL_FLAG(std::string, parser_conf_path, "bert/parser_conf.json",
+          "the example parser conf path");
+ABSL_FLAG(int32_t, batch_size, 32, "the batch size");
+ABSL_FLAG(std::string, bench_workers, "1,2,4",
+          "data loader worker counts to run, one round each");
+ABSL_FLAG(int32_t, warmup_batches, 10, "untimed batches of each round");
+ABSL_FLAG(int64_t, max_batches, 500, "timed batches of each round, 0 all");
+ABSL_FLAG(double, max_seconds, 60, "time limit of each round, 0 no limit");
+ABSL_FLAG(int32_t, prefetch_batches, 2, "batches prepared ahead");
+ABSL_FLAG(bool, trim_padding, false,
+          "trim sequence features to the longest example in each batch");
+
+static std::vector<int> ParseIntList(const std::string& str) {
+  std::vector<int> values;
+  for (absl::string_view part :
+       absl::StrSplit(str, ',', absl::SkipWhitespace())) {
+    int v = 0;
+    CHECK(absl::SimpleAtoi(part, &v)) << "bad int list:" << str;
+    values.push_back(v);
+  }
+  CHECK(!values.empty()) << "empty int list";
+  return values;
+}
+
+template <class SampleParser, bool usePlainTxt>
+static void RunBench(const radish::train::DataPipelineBenchOptions& opts,
+                     const radish::utils::RuntimeOptions& runtimeOpts) {
+  radish::train::DataPipelineBench<SampleParser, usePlainTxt> bench(
+      opts, runtimeOpts);
+  auto results = bench.Run(absl::GetFlag(FLAGS_train_data_path),
+                           absl::GetFlag(FLAGS_parser_conf_path));
+  const radish::train::DataPipelineResult* best = nullptr;
+  for (auto& r : results) {
+    if (best == nullptr || r.examples_per_sec > best->examples_per_sec) {
+      best = &r;
+    }
+  }
+  if (best != nullptr) {
+    spdlog::info("best: {} workers, {:.1f} examples/s", best->workers,
+                 best->examples_per_sec);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
+  radish::train::DataPipelineBenchOptions opts;
+  opts.batch_size(absl::GetFlag(FLAGS_batch_size));
+  opts.workers(ParseIntList(absl::GetFlag(FLAGS_bench_workers)));
+  opts.warmup_batches(absl::GetFlag(FLAGS_warmup_batches));
+  opts.max_batches(absl::GetFlag(FLAGS_max_batches));
+  opts.max_seconds(absl::GetFlag(FLAGS_max_seconds));
+  opts.prefetch_batches(absl::GetFlag(FLAGS_prefetch_batches));
+  opts.trim_padding(absl::GetFlag(FLAGS_trim_padding));
+  std::string parser = absl::GetFlag(FLAGS_parser);
+  if (parser == "albert") {
+    // 和 ALBertModel/SpanBertModel 的 SequenceFeatures/PositionFeatures 一致
+    opts.sequence_features({0, 2}).position_features({1});
+    RunBench<radish::ALBertExampleParser, true>(opts, runtimeOpts);
+  } else if (parser == "span_bert") {
+    opts.sequence_features({0}).position_features({1, 2, 3});
+    RunBench<radish::SpanBertExampleParser, false>(opts, runtimeOpts);
+  } else {
+    spdlog::error("unknown parser:{}", parser);
+    return 1;
+  }
+  return 0;
+}
@@ -9,11 +9,30 @@
  * -----
  */
 #include "radish/bert/finetune/bert_classification_model.h"
+
+#include <algorithm>
+#include <cmath>
+
 #include "radish/train/model_io.h"
 #include "radish/utils/logging.h"
 
 namespace radish {
 
+EarlyExitOptions::EarlyExitOptions(Mode mode) : mode_(mode) {}
+
+EarlyExitHeadImpl::EarlyExitHeadImpl(const BertOptions& options, int n_class) {
+  pooler = register_module("pooler", BertPooler(options));
+  proj = register_module("proj",
+                         torch::nn::Linear(options.hidden_size(), n_class));
+  torch::NoGradGuard guard;
+  torch::nn::init::normal_(proj->weight, 0, options.init_range());
+  torch::nn::init::constant_(proj->bias, 0);
+}
+
+Tensor EarlyExitHeadImpl::forward(Tensor hidden_states) {
+  return proj(pooler(hidden_states));
+}
+
 bool BertClassificationModelImpl::LoadFromPretrain(std::string path) {
   ::radish::train::LoadModel(bert.ptr(), path, "", torch::kCPU, true);
   return true;
@@ -64,6 +83,32 @@ Tensor BertClassificationModelImpl::CalcLoss(const std::vector<Tensor>& inputs,
                                              std::vector<float>& evals,
                                              const Tensor& target) {
   Tensor loss = calc_loss_(logits[0], target);
+  if (!exits.is_empty() && logits.size() > 1) {
+    CHECK_EQ(logits.size(), exits->size() + 1);
+    const bool selfDistill =
+        exit_options.mode() == EarlyExitOptions::kSelfDistill;
+    const double t = exit_options.temperature();
+    Tensor teacher;
+    if (selfDistill) {
+      teacher = torch::softmax(logits[0].detach() / t, -1);
+    }
+    Tensor exitLoss;
+    for (size_t i = 1; i < logits.size(); i++) {
+      Tensor l;
+      if (selfDistill) {
+        l = torch::kl_div(torch::log_softmax(logits[i] / t, -1), teacher,
+                          at::Reduction::Sum) /
+            logits[i].size(0) * (t * t);
+      } else {
+        l = calc_loss_(logits[i], target);
+      }
+      exitLoss = exitLoss.defined() ? exitLoss + l : l;
+    }
+    exitLoss = exitLoss / static_cast<double>(logits.size() - 1);
+    // 自蒸馏时骨干不训练, 只有早退分类器的loss
+    loss = selfDistill ? exitLoss
+                       : loss + exitLoss * exit_options.exit_weight();
+  }
   if (!is_training()) {
     float accuracy = calc_accuracy_(logits[0], target).item().to<float>();
     evals.push_back(accuracy);
@@ -83,9 +128,135 @@ std::vector<Tensor> BertClassificationModelImpl::forward(std::vector<Tensor> inp
   Tensor mask = src_seq.ne(0).toType(torch::kFloat32).to(src_seq.device()).detach();
   // types
   Tensor& types = inputs[1];
-  auto rets = bert(src_seq, mask, types);
-  Tensor hiddens = rets[1];  // pooled
-  return {final_proj(hiddens)};
+  if (!exits.is_empty() && !is_training() &&
+      exit_options.entropy_threshold() > 0) {
+    return {forward_early_exit(inputs, exit_options.entropy_threshold())[0]};
+  }
+  if (exits.is_empty() || !is_training()) {
+    auto rets = bert(src_seq, mask, types);
+    Tensor hiddens = rets[1];  // pooled
+    return {final_proj(hiddens)};
+  }
+  // 训练时每个早退分类器都算
+  std::vector<Tensor> outs(1);
+  auto hook = [this, &outs](int64_t i, Tensor* hidden, Tensor*) {
+    if (exit_index_[i] >= 0) {
+      outs.push_back(exits->ptr<EarlyExitHeadImpl>(exit_index_[i])
+                         ->forward(*hidden));
+    }
+    return true;
+  };
+  auto rets = bert->forward(src_seq, mask, types, {}, {}, hook);
+  outs[0] = final_proj(rets[1]);
+  return outs;
+}
+
+std::vector<Tensor> BertClassificationModelImpl::forward_early_exit(
+    const std::vector<Tensor>& inputs, double threshold) {
+  CHECK(inputs.size() >= 2);
+  CHECK(!exits.is_empty()) << "early exit is not enabled";
+  torch::NoGradGuard guard;
+  Tensor src_seq = inputs[0];
+  const int64_t batch = src_seq.size(0);
+  const double maxEntropy = std::log(static_cast<double>(n_class));
+  Tensor logits = torch::zeros(
+      {batch, n_class}, torch::TensorOptions().device(src_seq.device()));
+  Tensor layers = torch::full({batch}, options.num_layers(),
+                              torch::TensorOptions(torch::kInt64));
+  // 还没退出的样本在原batch里的下标
+  Tensor alive = torch::arange(
+      batch, torch::TensorOptions(torch::kInt64).device(src_seq.device()));
+  auto hook = [&](int64_t i, Tensor* hidden, Tensor* mask) {
+    if (exit_index_[i] < 0) {
+      return true;
+    }
+    Tensor l = exits->ptr<EarlyExitHeadImpl>(exit_index_[i])->forward(*hidden);
+    Tensor entropy =
+        -(torch::softmax(l, -1) * torch::log_softmax(l, -1)).sum(-1) /
+        maxEntropy;
+    Tensor done = entropy.lt(threshold);
+    Tensor doneIdx = done.nonzero().view(-1);
+    if (doneIdx.numel() == 0) {
+      return true;
+    }
+    Tensor exited = alive.index_select(0, doneIdx);
+    logits.index_copy_(0, exited, l.index_select(0, doneIdx));
+    layers.index_fill_(0, exited.to(torch::kCPU), i + 1);
+    Tensor keep = done.logical_not().nonzero().view(-1);
+    if (keep.numel() == 0) {
+      alive = keep;
+      return false;
+    }
+    // 剩下的样本挑出来, padding在末尾, 截到它们里最长的长度
+    alive = alive.index_select(0, keep);
+    src_seq = src_seq.index_select(0, keep);
+    int64_t len = src_seq.ne(0).sum(1).max().item<int64_t>();
+    len = std::max<int64_t>(len, 1);
+    src_seq = src_seq.narrow(1, 0, len);
+    *hidden = hidden->index_select(0, keep).narrow(1, 0, len);
+    *mask = mask->index_select(0, keep).narrow(-1, 0, len);
+    return true;
+  };
+  Tensor mask = src_seq.ne(0).toType(torch::kFloat32);
+  auto rets = bert->forward(src_seq, mask, inputs[1], {}, {}, hook);
+  if (alive.numel() > 0) {
+    logits.index_copy_(0, alive, final_proj(rets[1]));
+  }
+  return {logits, layers};
+}
+
+void BertClassificationModelImpl::enable_early_exit(
+    EarlyExitOptions exit_options_) {
+  CHECK(exits.is_empty()) << "early exit already enabled";
+  exit_options = exit_options_;
+  const int64_t numLayers = options.num_layers();
+  std::vector<int64_t> at = exit_options.layers();
+  if (at.empty()) {
+    for (int64_t i = 0; i + 1 < numLayers; i++) {
+      at.push_back(i);
+    }
+  }
+  exit_index_.assign(numLayers, -1);
+  exits = torch::nn::ModuleList();
+  for (int64_t i : at) {
+    CHECK(i >= 0 && i + 1 < numLayers) << "bad early exit layer:" << i;
+    CHECK_LT(exit_index_[i], 0) << "duplicated early exit layer:" << i;
+    exit_index_[i] = exits->size();
+    exits->push_back(EarlyExitHead(options, n_class));
+  }
+  register_module("exits", exits);
+  if (exit_options.mode() == EarlyExitOptions::kSelfDistill) {
+    for (auto& p : bert->parameters()) {
+      p.set_requires_grad(false);
+    }
+    for (auto& p : final_proj->parameters()) {
+      p.set_requires_grad(false);
+    }
+  }
+}
+
+std::vector<Tensor> BertClassificationModelImpl::DistillForward(
+    std::vector<Tensor> inputs) {
+  CHECK(inputs.size() >= 2);
+  CHECK(exits.is_empty()) << "distillation doesn't support early exit";
+  Tensor& src_seq = inputs[0];
+  Tensor mask = src_seq.ne(0).toType(torch::kFloat32).detach();
+  auto rets = bert(src_seq, mask, inputs[1]);
+  Tensor hiddens = rets[1];
+  Tensor logits = final_proj(hiddens);
+  if (!distill_proj.is_empty()) {
+    hiddens = distill_proj(hiddens);
+  }
+  return {logits, hiddens};
+}
+
+void BertClassificationModelImpl::enable_hidden_distill(
+    int64_t teacher_hidden) {
+  if (teacher_hidden == options.hidden_size()) {
+    return;
+  }
+  distill_proj = torch::nn::Linear(options.hidden_size(), teacher_hidden);
+  register_module("distill_proj", distill_proj);
 }
 
 }  // namespace radish
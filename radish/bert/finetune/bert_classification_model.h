@@ -11,11 +11,40 @@
 
 #pragma once
 
+#include <vector>
+
 #include "radish/bert/model/bert_model.h"
 #include "radish/train/llb_model.h"
 namespace radish {
 using Tensor = torch::Tensor;
 
+/// Options for `BertClassificationModelImpl::enable_early_exit`.
+struct TORCH_API EarlyExitOptions {
+  enum Mode { kJoint, kSelfDistill };
+  /* implicit */ EarlyExitOptions(Mode mode = kJoint);
+  TORCH_ARG(Mode, mode);
+  // 挂早退分类器的层, 从0开始, 不含最后一层; 空时除最后一层外每层都挂
+  TORCH_ARG(std::vector<int64_t>, layers);
+  // kJoint: loss = 最终分类器的loss + exit_weight * 各早退分类器loss的平均
+  TORCH_ARG(double, exit_weight) = 1.0;
+  // kSelfDistill: 早退分类器学最终分类器 softmax(logits/T) 的分布
+  TORCH_ARG(double, temperature) = 1.0;
+  // 大于0时eval的forward走早退, 见 forward_early_exit
+  TORCH_ARG(double, entropy_threshold) = 0;
+};
+
+// 早退分类器: 和bert的pooler一样取[CLS]过dense+tanh, 再接分类层
+class TORCH_API EarlyExitHeadImpl : public torch::nn::Module {
+ public:
+  EarlyExitHeadImpl(const BertOptions& options, int n_class);
+  Tensor forward(Tensor hidden_states);
+
+  BertPooler pooler = nullptr;
+  torch::nn::Linear proj = nullptr;
+};
+
+TORCH_MODULE(EarlyExitHead);
+
 class TORCH_API BertClassificationModelImpl : public train::LlbModel {
  public:
   BertClassificationModelImpl(BertOptions options, int n_class);
@@ -24,11 +53,44 @@ class TORCH_API BertClassificationModelImpl : public train::LlbModel {
                   std::vector<float> &evals, const Tensor &target = {}) override;
 
   std::vector<Tensor> forward(std::vector<Tensor> inputs) override;
+  std::vector<size_t> SequenceFeatures() const override { return {0, 1}; }
+  int64_t MatmulParametersPerToken() const override {
+    return MatrixParameters(*bert->encoder->layer);
+  }
+  // 蒸馏: 返回 {logits, pooled}, 开了隐层匹配时pooled先投影到teacher的维度
+  std::vector<Tensor> DistillForward(std::vector<Tensor> inputs) override;
+  // 学生比teacher窄时加一个投影层, 让pooled可以和teacher的pooled算MSE
+  void enable_hidden_distill(int64_t teacher_hidden);
+
+  /**
+   * 在中间层后面挂早退分类器. 训练时forward返回 {最终logits, 各早退logits},
+   * kJoint 和骨干一起用标注训练; kSelfDistill 骨干和最终分类器不动,
+   * 早退分类器学最终分类器的输出, 要先加载fine tune好的模型再调用.
+   * 保存的模型要先调用这个函数再 LoadModel
+   */
+  void enable_early_exit(EarlyExitOptions exit_options);
+
+  /**
+   * 早退推理: 每个早退分类器输出的归一化熵(除以log(n_class))小于
+   * threshold 的样本在这一层退出, 剩下的样本从batch里挑出来继续算,
+   * padding也截到剩下样本的最长长度. 返回 {logits, 每个样本算了几层}
+   */
+  std::vector<Tensor> forward_early_exit(const std::vector<Tensor>& inputs,
+                                         double threshold);
   bool LoadFromPretrain(std::string path) override;
+  // 推理用: bert的全连接层换成int8, 之后不能再训练
+  void quantize_int8() { bert->quantize_int8(); }
   BertOptions options;
   int n_class;
   BertModel bert = nullptr;
   torch::nn::Linear final_proj = nullptr;
+  torch::nn::Linear distill_proj = nullptr;
+  EarlyExitOptions exit_options;
+  torch::nn::ModuleList exits = nullptr;
+
+ private:
+  // 第i层后面的早退分类器在 exits 里的下标, 没有时是-1
+  std::vector<int64_t> exit_index_;
 };
 
 TORCH_MODULE(BertClassificationModel);
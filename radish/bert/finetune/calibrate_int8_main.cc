@@ -0,0 +1,146 @@
+/*
+ * File: calibrate_int8_main.cc
+ * Project: finetune
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 4:02:51
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "json/json.h"
+#include "torch/torch.h"
+
+#include "radish/bert/finetune/bert_classification_model.h"
+#include "radish/bert/finetune/query_same_model.h"
+#include "radish/bert/finetune/query_same_parser.h"
+#include "radish/bert/finetune/xnli_example_parser.h"
+#include "radish/layers/quantized_linear.h"
+#include "radish/train/collate.h"
+#include "radish/train/data/leveldb_dataset.h"
+#include "radish/train/data/txt_dataset.h"
+#include "radish/train/model_io.h"
+#include "radish/utils/logging.h"
+#include "radish/utils/runtime_flags.h"
+
+ABSL_FLAG(std::string, model, "bert_cls",
+          "bert_cls for the xnli bert model, query_same for the small encoder");
+ABSL_FLAG(std::string, model_path, "logs/best_model.ptc",
+          "the fine tuned fp32 model");
+ABSL_FLAG(std::string, calib_data_path, "/e/data/chineseGLUE/xnli/dev.tsv",
+          "the calibration data path");
+ABSL_FLAG(bool, leveldb, false, "calibration data is a leveldb dataset");
+ABSL_FLAG(std::string, parser_conf_path, "radish/bert/parser_conf.json",
+          "the example parser conf path");
+ABSL_FLAG(int32_t, batch_size, 32, "batch size of calibration");
+ABSL_FLAG(int32_t, calib_batches, 32, "how many batches to calibrate with");
+ABSL_FLAG(std::string, observer, "percentile",
+          "how to pick activation ranges: minmax or percentile");
+ABSL_FLAG(double, percentile, 99.99, "percentile of |x| used as the range");
+ABSL_FLAG(std::string, output, "logs/int8_model.ptc",
+          "where to save the static int8 model");
+ABSL_FLAG(bool, for_xnli, false, "query_same model fine tuned on xnli");
+ABSL_FLAG(int32_t, n_vocab, 32003, "query_same: vocab number of input tokens");
+ABSL_FLAG(int32_t, max_seq_len, 512, "query_same: seq len of input");
+
+namespace {
+
+template <class Dataset, class Model>
+void Calibrate(Model model, const Json::Value& parserConf) {
+  radish::train::LoadModel(model.ptr(), absl::GetFlag(FLAGS_model_path));
+  model->quantize_int8();
+  radish::ObserverOptions observe(absl::GetFlag(FLAGS_observer) == "minmax"
+                                      ? radish::ObserverOptions::kMinMax
+                                      : radish::ObserverOptions::kPercentile);
+  observe.percentile(absl::GetFlag(FLAGS_percentile));
+  int64_t layers = radish::StartCalibration(model.ptr(), observe);
+  CHECK_GT(layers, 0) << "no int8 layer in the model";
+
+  torch::NoGradGuard guard;
+  model->eval();
+  auto loader = torch::data::make_data_loader(
+      Dataset(absl::GetFlag(FLAGS_calib_data_path), parserConf),
+      torch::data::DataLoaderOptions()
+          .batch_size(absl::GetFlag(FLAGS_batch_size))
+          .workers(1));
+  radish::train::CollateOptions collateOpts;
+  collateOpts.with_target = false;
+  int32_t batches = 0;
+  int64_t examples = 0;
+  for (auto& inputs : *loader) {
+    radish::train::CollatedBatch batch;
+    if (!radish::train::CollateBatch(inputs, torch::kCPU, collateOpts,
+                                     &batch)) {
+      continue;
+    }
+    model->forward(batch.examples);
+    examples += batch.size;
+    if (++batches >= absl::GetFlag(FLAGS_calib_batches)) {
+      break;
+    }
+  }
+  CHECK_GT(batches, 0) << "no calibration data";
+  radish::FinishCalibration(model.ptr());
+  spdlog::info("calibrated {} int8 layers with {} examples ({} observer)",
+               layers, examples, absl::GetFlag(FLAGS_observer));
+  radish::train::SaveModel(model.ptr(), absl::GetFlag(FLAGS_output));
+  spdlog::info("saved static int8 model to {}", absl::GetFlag(FLAGS_output));
+}
+
+template <class Parser, class Model>
+void Run(Model model, const Json::Value& parserConf) {
+  if (absl::GetFlag(FLAGS_leveldb)) {
+    Calibrate<radish::data::LeveldbDataset<Parser>>(model, parserConf);
+  } else {
+    Calibrate<radish::data::TxtDataset<Parser>>(model, parserConf);
+  }
+}
+
+}  // namespace
+
+/**
+ * 静态int8量化的校准: 加载fine tune好的fp32模型, 动态量化后用
+ * 若干batch的数据统计每个int8层输入的范围, 保存成静态量化的模型.
+ * 加载时先构造模型并调用 quantize_int8(), 再 LoadModel
+ */
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
+  Json::Value parserConf;
+  std::string parserConfPath = absl::GetFlag(FLAGS_parser_conf_path);
+  if (!parserConfPath.empty()) {
+    Json::Reader reader;
+    std::ifstream ifs(parserConfPath);
+    CHECK(ifs) << "can't read " << parserConfPath << " ?";
+    CHECK(reader.parse(ifs, parserConf)) << "config file can't be parsed!";
+  }
+  parserConf["parser.preload"] = 0;
+  parserConf["eval"] = 1;
+
+  std::string modelType = absl::GetFlag(FLAGS_model);
+  if (modelType == "bert_cls") {
+    Run<radish::XNLIExampleParser>(
+        radish::BertClassificationModel(radish::BertOptions::kBertBaseOpts, 3),
+        parserConf);
+  } else if (modelType == "query_same") {
+    auto opt = radish::QuerySameOptions(absl::GetFlag(FLAGS_n_vocab))
+                   .len_max_seq(absl::GetFlag(FLAGS_max_seq_len));
+    if (absl::GetFlag(FLAGS_for_xnli)) {
+      opt.n_class(3);
+      Run<radish::XNLIExampleParser>(radish::QuerySameModel(opt), parserConf);
+    } else {
+      Run<radish::QSExampleParser>(radish::QuerySameModel(opt), parserConf);
+    }
+  } else {
+    LOG(FATAL) << "unknown model:" << modelType;
+  }
+  return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * File: early_exit_eval_main.cc
+ * Project: finetune
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-23 3:17:45
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "json/json.h"
+#include "torch/torch.h"
+
+#include "radish/bert/finetune/bert_classification_model.h"
+#include "radish/bert/finetune/xnli_example_parser.h"
+#include "radish/train/collate.h"
+#include "radish/train/data/txt_dataset.h"
+#include "radish/train/model_io.h"
+#include "radish/utils/logging.h"
+#include "radish/utils/runtime_flags.h"
+
+ABSL_FLAG(std::string, model_path, "logs/best_model.ptc",
+          "model trained with early exit classifiers");
+ABSL_FLAG(std::string, student, "", "empty for bert base, or mini_albert");
+ABSL_FLAG(std::string, exit_layers, "",
+          "the --exit_layers the model was trained with");
+ABSL_FLAG(std::string, test_data_path, "/e/data/chineseGLUE/xnli/test.tsv",
+          "the test data path");
+ABSL_FLAG(std::string, parser_conf_path, "radish/bert/parser_conf.json",
+          "the example parser conf path");
+ABSL_FLAG(int32_t, batch_size, 32, "batch size");
+ABSL_FLAG(int64_t, max_test_num, 0, "max test examples, 0 for all");
+ABSL_FLAG(std::string, thresholds, "0,0.05,0.1,0.2,0.3,0.4,0.5,0.6,0.8",
+          "normalized entropy thresholds, 0 runs the model without exits");
+ABSL_FLAG(std::string, output, "", "write the curve as csv here");
+
+using Tensor = torch::Tensor;
+
+namespace {
+
+std::vector<double> ParseDoubleList(const std::string& str) {
+  std::vector<double> values;
+  for (absl::string_view part :
+       absl::StrSplit(str, ',', absl::SkipWhitespace())) {
+    double v = 0;
+    CHECK(absl::SimpleAtod(part, &v)) << "bad number list:" << str;
+    values.push_back(v);
+  }
+  return values;
+}
+
+struct CurvePoint {
+  double threshold = 0;
+  double accuracy = 0;
+  double ms_per_example = 0;
+  double avg_layers = 0;
+};
+
+CurvePoint Evaluate(radish::BertClassificationModel model,
+                    const std::vector<radish::train::CollatedBatch>& batches,
+                    double threshold) {
+  torch::NoGradGuard guard;
+  int64_t correct = 0;
+  int64_t total = 0;
+  int64_t layers = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (auto& batch : batches) {
+    Tensor logits;
+    if (threshold > 0) {
+      auto rets = model->forward_early_exit(batch.examples, threshold);
+      logits = rets[0];
+      layers += rets[1].sum().item<int64_t>();
+    } else {
+      // 不早退时不算早退分类器, 就是原来的模型
+      logits = model->forward(batch.examples)[0];
+      layers += model->options.num_layers() * batch.size;
+    }
+    correct += logits.argmax(-1)
+                   .eq(batch.target.view(-1))
+                   .sum()
+                   .item<int64_t>();
+    total += batch.size;
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  CurvePoint point;
+  point.threshold = threshold;
+  point.accuracy = static_cast<double>(correct) / total;
+  point.ms_per_example = seconds * 1000 / total;
+  point.avg_layers = static_cast<double>(layers) / total;
+  return point;
+}
+
+}  // namespace
+
+/**
+ * 早退的延迟-准确率曲线: 在测试集上对每个熵阈值跑一遍早退推理,
+ * 输出准确率, 每个样本的毫秒数, 平均算了几层, 和阈值0(全部层)比的加速
+ */
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
+  Json::Value parserConf;
+  std::string parserConfPath = absl::GetFlag(FLAGS_parser_conf_path);
+  if (!parserConfPath.empty()) {
+    Json::Reader reader;
+    std::ifstream ifs(parserConfPath);
+    CHECK(ifs) << "can't read " << parserConfPath << " ?";
+    CHECK(reader.parse(ifs, parserConf)) << "config file can't be parsed!";
+  }
+  parserConf["parser.preload"] = 0;
+  parserConf["eval"] = 1;
+
+  radish::BertOptions options = radish::BertOptions::kBertBaseOpts;
+  if (absl::GetFlag(FLAGS_student) == "mini_albert") {
+    options = radish::BertOptions::kMiniAlbertOpts;
+  }
+  radish::BertClassificationModel model(options, 3);
+  std::vector<int64_t> exitLayers;
+  for (absl::string_view part : absl::StrSplit(
+           absl::GetFlag(FLAGS_exit_layers), ',', absl::SkipWhitespace())) {
+    int64_t v = 0;
+    CHECK(absl::SimpleAtoi(part, &v)) << "bad exit layer:" << part;
+    exitLayers.push_back(v);
+  }
+  model->enable_early_exit(radish::EarlyExitOptions().layers(exitLayers));
+  radish::train::LoadModel(model.ptr(), absl::GetFlag(FLAGS_model_path));
+  model->eval();
+
+  auto loader = torch::data::make_data_loader(
+      radish::data::TxtDataset<radish::XNLIExampleParser>(
+          absl::GetFlag(FLAGS_test_data_path), parserConf),
+      torch::data::DataLoaderOptions()
+          .batch_size(absl::GetFlag(FLAGS_batch_size))
+          .workers(1));
+  std::vector<radish::train::CollatedBatch> batches;
+  int64_t examples = 0;
+  const int64_t maxTestNum = absl::GetFlag(FLAGS_max_test_num);
+  for (auto& inputs : *loader) {
+    radish::train::CollatedBatch batch;
+    if (radish::train::CollateBatch(inputs, torch::kCPU,
+                                    radish::train::CollateOptions(), &batch)) {
+      examples += batch.size;
+      batches.push_back(std::move(batch));
+    }
+    if (maxTestNum > 0 && examples >= maxTestNum) {
+      break;
+    }
+  }
+  CHECK(!batches.empty()) << "no test data";
+
+  std::vector<double> thresholds =
+      ParseDoubleList(absl::GetFlag(FLAGS_thresholds));
+  CHECK(!thresholds.empty()) << "no thresholds";
+  // 先热身一遍, 第一次的内存分配不算进去
+  Evaluate(model, batches, 0);
+  CurvePoint full = Evaluate(model, batches, 0);
+  std::vector<CurvePoint> curve;
+  for (double threshold : thresholds) {
+    curve.push_back(threshold > 0 ? Evaluate(model, batches, threshold)
+                                  : full);
+  }
+  spdlog::info("{} examples, {} layers", examples, options.num_layers());
+  std::string csv = "threshold,accuracy,ms_per_example,avg_layers,speedup\n";
+  for (auto& point : curve) {
+    double speedup = full.ms_per_example / point.ms_per_example;
+    spdlog::info(
+        "threshold={:.3f}: accuracy={:.4f}, {:.2f} ms/example, "
+        "{:.2f} layers, {:.2f}x",
+        point.threshold, point.accuracy, point.ms_per_example,
+        point.avg_layers, speedup);
+    csv += absl::StrFormat("%g,%g,%g,%g,%g\n", point.threshold,
+                           point.accuracy, point.ms_per_example,
+                           point.avg_layers, speedup);
+  }
+  std::string output = absl::GetFlag(FLAGS_output);
+  if (!output.empty()) {
+    std::ofstream ofs(output);
+    CHECK(ofs) << "can't write " << output;
+    ofs << csv;
+    spdlog::info("wrote curve to {}", output);
+  }
+  return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * File: prune_heads_main.cc
+ * Project: finetune
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-21 5:48:09
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_join.h"
+#include "json/json.h"
+#include "torch/torch.h"
+
+#include "radish/bert/finetune/bert_classification_model.h"
+#include "radish/bert/finetune/xnli_example_parser.h"
+#include "radish/bert/model/head_pruning.h"
+#include "radish/train/collate.h"
+#include "radish/train/data/txt_dataset.h"
+#include "radish/train/model_io.h"
+#include "radish/utils/logging.h"
+#include "radish/utils/runtime_flags.h"
+
+ABSL_FLAG(std::string, model_path, "logs/best_model.ptc",
+          "the fine tuned model");
+ABSL_FLAG(std::string, dev_data_path, "/e/data/chineseGLUE/xnli/dev.tsv",
+          "the data used to score heads and check accuracy");
+ABSL_FLAG(std::string, parser_conf_path, "radish/bert/parser_conf.json",
+          "the example parser conf path");
+ABSL_FLAG(int32_t, batch_size, 32, "batch size");
+ABSL_FLAG(int32_t, max_batches, 100, "how many dev batches to use");
+ABSL_FLAG(double, prune_ratio, 0.3, "fraction of all heads to remove");
+ABSL_FLAG(int32_t, min_heads, 1, "heads kept in every layer at least");
+ABSL_FLAG(std::string, output, "logs/pruned_model.ptc",
+          "where to save the pruned model");
+
+using Tensor = torch::Tensor;
+
+namespace {
+
+// 和 BertClassificationModelImpl::forward 相同, 多传一个head_mask
+Tensor Logits(radish::BertClassificationModel model,
+              const std::vector<Tensor>& inputs, const Tensor& headMask) {
+  const Tensor& src = inputs[0];
+  Tensor mask = src.ne(0).toType(torch::kFloat32);
+  auto rets = model->bert->forward(src, mask, inputs[1], {}, headMask);
+  return model->final_proj(rets[1]);
+}
+
+// 开发集上的准确率和每个样本的毫秒数
+std::pair<double, double> Evaluate(
+    radish::BertClassificationModel model,
+    const std::vector<radish::train::CollatedBatch>& batches) {
+  torch::NoGradGuard guard;
+  model->eval();
+  int64_t correct = 0;
+  int64_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (auto& batch : batches) {
+    Tensor logits = model->forward(batch.examples)[0];
+    correct += logits.argmax(-1)
+                   .eq(batch.target.view(-1))
+                   .sum()
+                   .item<int64_t>();
+    total += batch.size;
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return {static_cast<double>(correct) / total, seconds * 1000 / total};
+}
+
+}  // namespace
+
+/**
+ * attention head剪枝: 在开发集上按loss对head_mask的梯度给各head打分,
+ * 去掉最不重要的 prune_ratio 的head, 物理地切小qkv和output.dense,
+ * 保存剪过的模型, 并输出剪枝前后的准确率和速度
+ */
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
+  Json::Value parserConf;
+  std::string parserConfPath = absl::GetFlag(FLAGS_parser_conf_path);
+  if (!parserConfPath.empty()) {
+    Json::Reader reader;
+    std::ifstream ifs(parserConfPath);
+    CHECK(ifs) << "can't read " << parserConfPath << " ?";
+    CHECK(reader.parse(ifs, parserConf)) << "config file can't be parsed!";
+  }
+  parserConf["parser.preload"] = 0;
+  parserConf["eval"] = 1;
+
+  radish::BertOptions options = radish::BertOptions::kBertBaseOpts;
+  radish::BertClassificationModel model(options, 3);
+  radish::train::LoadModel(model.ptr(), absl::GetFlag(FLAGS_model_path));
+
+  auto loader = torch::data::make_data_loader(
+      radish::data::TxtDataset<radish::XNLIExampleParser>(
+          absl::GetFlag(FLAGS_dev_data_path), parserConf),
+      torch::data::DataLoaderOptions()
+          .batch_size(absl::GetFlag(FLAGS_batch_size))
+          .workers(1));
+  std::vector<radish::train::CollatedBatch> batches;
+  for (auto& inputs : *loader) {
+    radish::train::CollatedBatch batch;
+    if (radish::train::CollateBatch(inputs, torch::kCPU,
+                                    radish::train::CollateOptions(), &batch)) {
+      batches.push_back(std::move(batch));
+    }
+    if (static_cast<int32_t>(batches.size()) >=
+        absl::GetFlag(FLAGS_max_batches)) {
+      break;
+    }
+  }
+  CHECK(!batches.empty()) << "no dev data";
+
+  // dropout关掉, 只对head_mask求梯度
+  model->eval();
+  radish::HeadImportance importance(options);
+  for (auto& batch : batches) {
+    Tensor logits = Logits(model, batch.examples, importance.mask());
+    std::vector<float> evals;
+    Tensor loss =
+        model->CalcLoss(batch.examples, {logits}, evals, batch.target);
+    importance.Accumulate(
+        torch::autograd::grad({loss}, {importance.mask()})[0]);
+  }
+  Tensor scores = importance.scores();
+  auto pruned = radish::SelectHeadsToPrune(
+      scores, absl::GetFlag(FLAGS_prune_ratio), absl::GetFlag(FLAGS_min_heads));
+  for (size_t i = 0; i < pruned.size(); i++) {
+    spdlog::info("layer {}: prune heads [{}]", i,
+                 absl::StrJoin(pruned[i], ","));
+  }
+
+  // 先热身一遍, 第一次的内存分配不算进前后任何一次的计时
+  Evaluate(model, batches);
+  auto before = Evaluate(model, batches);
+  model->bert->prune_heads(pruned);
+  Evaluate(model, batches);
+  auto after = Evaluate(model, batches);
+  spdlog::info("heads per layer after pruning: [{}]",
+               absl::StrJoin(model->bert->num_heads(), ","));
+  spdlog::info("before: accuracy={:.4f}, {:.2f} ms/example", before.first,
+               before.second);
+  spdlog::info("after: accuracy={:.4f}, {:.2f} ms/example", after.first,
+               after.second);
+  radish::train::SaveModel(model.ptr(), absl::GetFlag(FLAGS_output));
+  spdlog::info("saved pruned model to {}", absl::GetFlag(FLAGS_output));
+  return 0;
+}
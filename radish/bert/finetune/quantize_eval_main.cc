@@ -0,0 +1,209 @@
+/*
+ * File: quantize_eval_main.cc
+ * Project: finetune
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 10:21:37
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "json/json.h"
+#include "torch/torch.h"
+
+#include "radish/bert/finetune/bert_classification_model.h"
+#include "radish/bert/finetune/query_same_model.h"
+#include "radish/bert/finetune/query_same_parser.h"
+#include "radish/bert/finetune/xnli_example_parser.h"
+#include "radish/layers/quantized_linear.h"
+#include "radish/train/data/txt_dataset.h"
+#include "radish/train/model_io.h"
+#include "radish/utils/logging.h"
+#include "radish/utils/runtime_flags.h"
+
+ABSL_FLAG(std::string, model, "bert_cls",
+          "bert_cls for the xnli bert model, query_same for the small encoder");
+ABSL_FLAG(std::string, model_path, "logs/best_model.ptc",
+          "the fine tuned fp32 model");
+ABSL_FLAG(std::string, int8_model_path, "",
+          "static int8 model from calibrate_int8_main, empty for dynamic");
+ABSL_FLAG(std::string, test_data_path, "/e/data/chineseGLUE/xnli/test.tsv",
+          "the test data path");
+ABSL_FLAG(std::string, parser_conf_path, "radish/bert/parser_conf.json",
+          "the example parser conf path");
+ABSL_FLAG(int32_t, batch_size, 32, "batch size of inference");
+ABSL_FLAG(int64_t, max_test_num, 0, "max test examples allowed");
+ABSL_FLAG(bool, for_xnli, false, "query_same model fine tuned on xnli");
+ABSL_FLAG(int32_t, n_vocab, 32003, "query_same: vocab number of input tokens");
+ABSL_FLAG(int32_t, max_seq_len, 512, "query_same: seq len of input");
+
+using Tensor = torch::Tensor;
+
+namespace {
+
+struct EvalStat {
+  Tensor preds;
+  double accuracy = 0;
+  double seconds = 0;
+};
+
+template <class Parser>
+int64_t LoadTestSet(const std::string& path, const Json::Value& parserConf,
+                    int64_t maxTestNum, std::vector<Tensor>* examples,
+                    Tensor* targets) {
+  auto loader = torch::data::make_data_loader(
+      radish::data::TxtDataset<Parser>(path, parserConf),
+      torch::data::DataLoaderOptions().batch_size(1).workers(1));
+  std::vector<std::vector<Tensor>> columns;
+  std::vector<Tensor> golds;
+  for (auto& input : *loader) {
+    auto& ex = input[0];
+    if (ex.features.empty()) {
+      continue;
+    }
+    columns.resize(ex.features.size());
+    for (size_t i = 0; i < columns.size(); i++) {
+      columns[i].push_back(ex.features[i]);
+    }
+    golds.push_back(ex.target);
+    if (maxTestNum > 0 && static_cast<int64_t>(golds.size()) >= maxTestNum) {
+      break;
+    }
+  }
+  CHECK(!golds.empty()) << "no test example in " << path;
+  for (auto& c : columns) {
+    examples->push_back(torch::stack(c, 0));
+  }
+  *targets = torch::stack(golds, 0).view(-1);
+  return targets->size(0);
+}
+
+template <class Model>
+EvalStat Evaluate(Model model, const std::vector<Tensor>& examples,
+                  const Tensor& targets, int64_t batchSize) {
+  torch::NoGradGuard guard;
+  model->eval();
+  const int64_t total = targets.size(0);
+  std::vector<Tensor> preds;
+  auto start = std::chrono::steady_clock::now();
+  for (int64_t off = 0; off < total; off += batchSize) {
+    int64_t len = std::min(batchSize, total - off);
+    std::vector<Tensor> batch;
+    for (auto& t : examples) {
+      batch.push_back(t.narrow(0, off, len));
+    }
+    Tensor logits = model->forward(batch)[0];
+    preds.push_back(logits.view({len, -1}).argmax(1));
+  }
+  EvalStat stat;
+  stat.seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  stat.preds = torch::cat(preds, 0);
+  stat.accuracy =
+      stat.preds.eq(targets).toType(torch::kFloat32).mean().item<float>();
+  return stat;
+}
+
+// 参数和buffer占用的字节数, int8的权重在buffer里
+template <class Model>
+double ModelMegaBytes(Model model) {
+  int64_t bytes = 0;
+  for (auto& t : model->parameters()) {
+    bytes += t.numel() * t.element_size();
+  }
+  for (auto& t : model->buffers()) {
+    bytes += t.numel() * t.element_size();
+  }
+  return bytes / 1048576.0;
+}
+
+template <class Parser, class Factory>
+void Run(Factory factory, const Json::Value& parserConf) {
+  auto model = factory();
+  radish::train::LoadModel(model.ptr(), absl::GetFlag(FLAGS_model_path));
+  std::vector<Tensor> examples;
+  Tensor targets;
+  int64_t total = LoadTestSet<Parser>(absl::GetFlag(FLAGS_test_data_path),
+                                      parserConf,
+                                      absl::GetFlag(FLAGS_max_test_num),
+                                      &examples, &targets);
+  spdlog::info("loaded {} test examples", total);
+  const int64_t batchSize = absl::GetFlag(FLAGS_batch_size);
+  double fp32Mb = ModelMegaBytes(model);
+  EvalStat fp32 = Evaluate(model, examples, targets, batchSize);
+  std::string int8Path = absl::GetFlag(FLAGS_int8_model_path);
+  if (int8Path.empty()) {
+    model->quantize_int8();
+  } else {
+    model = factory();
+    model->quantize_int8();
+    radish::train::LoadModel(model.ptr(), int8Path);
+  }
+  double int8Mb = ModelMegaBytes(model);
+  EvalStat int8 = Evaluate(model, examples, targets, batchSize);
+  double agree =
+      fp32.preds.eq(int8.preds).toType(torch::kFloat32).mean().item<float>();
+  spdlog::info("fp32: accuracy={:.4f}, {:.2f} ms/example, {:.1f} MB",
+               fp32.accuracy, fp32.seconds * 1000 / total, fp32Mb);
+  spdlog::info("int8({}, {}): accuracy={:.4f}, {:.2f} ms/example, {:.1f} MB",
+               radish::Int8GemmIsa(), int8Path.empty() ? "dynamic" : "static",
+               int8.accuracy,
+               int8.seconds * 1000 / total, int8Mb);
+  spdlog::info("accuracy delta={:.4f}, prediction agreement={:.4f}",
+               int8.accuracy - fp32.accuracy, agree);
+}
+
+}  // namespace
+
+/**
+ * 对比fine tune好的模型在fp32和int8量化下的准确率, 延迟和内存.
+ * 默认是动态量化, 给了 --int8_model_path 时用校准好的静态量化模型.
+ * int8的结果和fp32的逐样本预测一致率也一起输出
+ */
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
+  Json::Value parserConf;
+  std::string parserConfPath = absl::GetFlag(FLAGS_parser_conf_path);
+  if (!parserConfPath.empty()) {
+    Json::Reader reader;
+    std::ifstream ifs(parserConfPath);
+    CHECK(ifs) << "can't read " << parserConfPath << " ?";
+    CHECK(reader.parse(ifs, parserConf)) << "config file can't be parsed!";
+  }
+  parserConf["parser.preload"] = 0;
+  parserConf["eval"] = 1;
+
+  std::string modelType = absl::GetFlag(FLAGS_model);
+  if (modelType == "bert_cls") {
+    Run<radish::XNLIExampleParser>(
+        []() {
+          return radish::BertClassificationModel(
+              radish::BertOptions::kBertBaseOpts, 3);
+        },
+        parserConf);
+  } else if (modelType == "query_same") {
+    auto opt = radish::QuerySameOptions(absl::GetFlag(FLAGS_n_vocab))
+                   .len_max_seq(absl::GetFlag(FLAGS_max_seq_len));
+    auto factory = [&opt]() { return radish::QuerySameModel(opt); };
+    if (absl::GetFlag(FLAGS_for_xnli)) {
+      opt.n_class(3);
+      Run<radish::XNLIExampleParser>(factory, parserConf);
+    } else {
+      Run<radish::QSExampleParser>(factory, parserConf);
+    }
+  } else {
+    LOG(FATAL) << "unknown model:" << modelType;
+  }
+  return 0;
+}
@@ -53,7 +53,8 @@ QuerySameModelImpl::QuerySameModelImpl(QuerySameOptions options_)
           options.n_src_vocab(), options.len_max_seq(), options.d_word_vec(),
           options.n_layers(), options.n_head(), options.d_k(), options.d_v(),
           options.d_model(), options.d_inner(), options.dropout())
-          .need_factor_embedding(true));
+          .need_factor_embedding(true)
+          .sparse_embedding(options.sparse_embedding()));
   register_module("transformer_encoder", encoder);
   final_proj = torch::nn::Linear(options.d_model(), options.n_class());
   register_module("final_proj", final_proj);
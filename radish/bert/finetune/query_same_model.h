@@ -29,6 +29,7 @@ struct TORCH_API QuerySameOptions {
   TORCH_ARG(int64_t, d_inner)=1280;
   TORCH_ARG(int64_t, n_class)=2; // for XNLI, there are 3 classes
   TORCH_ARG(double, dropout) = 0.1;
+  TORCH_ARG(bool, sparse_embedding) = false;
 };
 
 class TORCH_API QuerySameModelImpl : public train::LlbModel {
@@ -44,6 +45,12 @@ class TORCH_API QuerySameModelImpl : public train::LlbModel {
                                       const Tensor &target = {}) override;
 
   std::vector<Tensor> forward(std::vector<Tensor> inputs) override;
+  std::vector<size_t> SequenceFeatures() const override { return {0, 1}; }
+  int64_t MatmulParametersPerToken() const override {
+    return MatrixParameters(*encoder->encoder_stack);
+  }
+  // 推理用: encoder的全连接层换成int8, 之后不能再训练
+  void quantize_int8() { encoder->quantize_int8(); }
 
   QuerySameOptions options;
   TransformerEncoder encoder = nullptr;
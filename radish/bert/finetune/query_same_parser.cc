@@ -151,4 +151,13 @@ bool QSExampleParser::CreateNoLabel(const std::string& a, const std::string& b,
       torch::tensor(ex.types, at::dtype(torch::kInt64).requires_grad(false)));
   return true;
 }
+
+void QSExampleParser::SaveState(Json::Value* state) const {
+  (*state)["gen"] = data::RngToString(gen_);
+}
+
+void QSExampleParser::LoadState(const Json::Value& state) {
+  data::RngFromString(state.get("gen", "").asString(), &gen_);
+}
+
 }  // namespace radish
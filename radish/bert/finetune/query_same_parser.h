@@ -35,6 +35,8 @@ class QSExampleParser : public radish::data::ExampleParser {
   virtual ~QSExampleParser();
   bool Init(const Json::Value& config) override;
   bool ParseOne(std::string line, data::LlbExample& example) override;
+  void SaveState(Json::Value* state) const override;
+  void LoadState(const Json::Value& state) override;
   // For inference
   bool CreateNoLabel(const std::string& a, const std::string& b,
                      data::LlbExample& example);
@@ -14,14 +14,19 @@
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
 
 #include "radish/utils/logging.h"
 
 #include "radish/bert/finetune/bert_classification_model.h"
 #include "radish/bert/finetune/xnli_example_parser.h"
 #include "radish/train/benchmark_submiter.h"
+#include "radish/train/distillation.h"
 #include "radish/train/llb_trainer.h"
+#include "radish/train/model_io.h"
 #include "radish/train/progress_reporter.h"
+#include "radish/utils/runtime_flags.h"
 
 ABSL_FLAG(std::string, train_data_path, "/e/data/chineseGLUE/xnli/train.tsv",
           "the train data path");
@@ -40,12 +45,73 @@ ABSL_FLAG(float, learning_rate, 0.0001, "the learning rate ");
 ABSL_FLAG(bool, benchmark_test, false,
           "whether to do benchmark on test dataset");
 ABSL_FLAG(int32_t, warmup_steps, 1000, "the warmup steps");
+ABSL_FLAG(std::string, student, "",
+          "empty to fine tune bert base, mini_albert to train a small albert "
+          "student, usually with --teacher_model_path");
+ABSL_FLAG(std::string, teacher_model_path, "",
+          "fine tuned bert base teacher, enables distillation");
+ABSL_FLAG(double, distill_temperature, 2.0, "softmax temperature of distill");
+ABSL_FLAG(double, distill_soft_weight, 0.5,
+          "weight of the soft loss, 1 - it for the hard loss");
+ABSL_FLAG(double, distill_hidden_weight, 0.0,
+          "weight of the pooled hidden state MSE, needs a teacher model");
+ABSL_FLAG(std::string, teacher_cache_path, "",
+          "cache teacher logits in this file, reused by later epochs and runs");
+ABSL_FLAG(std::string, early_exit, "",
+          "joint to train early exit classifiers with the model, self_distill "
+          "to train only them on a fine tuned model (--init_model_path)");
+ABSL_FLAG(std::string, exit_layers, "",
+          "comma separated layers (from 0) with an early exit classifier, "
+          "empty for every layer but the last");
+ABSL_FLAG(double, exit_weight, 1.0, "joint: weight of the early exit losses");
+ABSL_FLAG(double, exit_temperature, 1.0, "self_distill: softmax temperature");
+ABSL_FLAG(std::string, init_model_path, "",
+          "fine tuned model loaded before adding early exit classifiers, use a "
+          "new logdir with it");
+
+static radish::EarlyExitOptions EarlyExitOptionsFromFlags() {
+  std::string mode = absl::GetFlag(FLAGS_early_exit);
+  radish::EarlyExitOptions opts;
+  if (mode == "self_distill") {
+    opts.mode(radish::EarlyExitOptions::kSelfDistill);
+  } else {
+    CHECK_EQ(mode, "joint") << "unknown early exit mode";
+  }
+  std::vector<int64_t> layers;
+  for (absl::string_view part : absl::StrSplit(
+           absl::GetFlag(FLAGS_exit_layers), ',', absl::SkipWhitespace())) {
+    int64_t v = 0;
+    CHECK(absl::SimpleAtoi(part, &v)) << "bad exit layer:" << part;
+    layers.push_back(v);
+  }
+  return opts.layers(layers)
+      .exit_weight(absl::GetFlag(FLAGS_exit_weight))
+      .temperature(absl::GetFlag(FLAGS_exit_temperature));
+}
+
 int main(int argc, char* argv[]) {
   // Passing params by value does NOT work correctly.
   absl::ParseCommandLine(argc, argv);
+  // 线程数和cpu绑定要在创建模型之前生效
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
 
+  std::string student = absl::GetFlag(FLAGS_student);
+  radish::BertOptions options = radish::BertOptions::kBertBaseOpts;
+  if (student == "mini_albert") {
+    options = radish::BertOptions::kMiniAlbertOpts;
+  } else {
+    CHECK(student.empty()) << "unknown student:" << student;
+  }
   radish::BertClassificationModel model =
-      radish::BertClassificationModel(radish::BertOptions::kBertBaseOpts, 3);
+      radish::BertClassificationModel(options, 3);
+  if (!absl::GetFlag(FLAGS_init_model_path).empty()) {
+    radish::train::LoadModel(model.ptr(), absl::GetFlag(FLAGS_init_model_path));
+  }
+  if (!absl::GetFlag(FLAGS_early_exit).empty()) {
+    model->enable_early_exit(EarlyExitOptionsFromFlags());
+  }
   std::string logdir = absl::GetFlag(FLAGS_logdir);
   CHECK(!logdir.empty()) << "logdir should not be empty";
   std::string parserConfPath = absl::GetFlag(FLAGS_parser_conf_path);
@@ -58,7 +124,32 @@ int main(int argc, char* argv[]) {
 
   radish::train::LlbTrainer<radish::XNLIExampleParser,
                             radish::BertClassificationModel, false, 10, true>
-      trainner(logdir);
+      trainner(logdir,
+               radish::train::LlbTrainerOptions().runtime(runtimeOpts));
+  std::string teacherPath = absl::GetFlag(FLAGS_teacher_model_path);
+  std::string cachePath = absl::GetFlag(FLAGS_teacher_cache_path);
+  if (!absl::GetFlag(FLAGS_benchmark_test) &&
+      (!teacherPath.empty() || !cachePath.empty())) {
+    std::shared_ptr<radish::BertClassificationModelImpl> teacher;
+    if (!teacherPath.empty()) {
+      teacher = radish::BertClassificationModel(
+                    radish::BertOptions::kBertBaseOpts, 3)
+                    .ptr();
+      radish::train::LoadModel(teacher, teacherPath);
+    }
+    auto distillOpts =
+        radish::train::DistillOptions()
+            .temperature(absl::GetFlag(FLAGS_distill_temperature))
+            .soft_weight(absl::GetFlag(FLAGS_distill_soft_weight))
+            .hidden_weight(absl::GetFlag(FLAGS_distill_hidden_weight))
+            .cache_path(cachePath);
+    if (distillOpts.hidden_weight() > 0) {
+      model->enable_hidden_distill(
+          radish::BertOptions::kBertBaseOpts.hidden_size());
+    }
+    trainner.SetDistiller(
+        std::make_shared<radish::train::Distiller>(teacher, distillOpts));
+  }
   if (absl::GetFlag(FLAGS_benchmark_test)) {
     radish::train::FileBenchmarkSubmiter submiter(logdir + "/benchmark.txt");
     trainner.Benchmark(model, testDataPath, absl::GetFlag(FLAGS_batch_size),
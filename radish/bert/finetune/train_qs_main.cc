@@ -22,6 +22,7 @@
 #include "radish/bert/finetune/xnli_example_parser.h"
 #include "radish/train/llb_trainer.h"
 #include "radish/train/progress_reporter.h"
+#include "radish/utils/runtime_flags.h"
 
 ABSL_FLAG(std::string, train_data_path, "/data/query/LCQMC/train.txt",
           "the train data path");
@@ -45,13 +46,20 @@ ABSL_FLAG(int32_t, eval_every, 1000,
 ABSL_FLAG(float, learning_rate, 0.0001, "the learning rate ");
 ABSL_FLAG(int32_t, warmup_steps, 3000, "the warmup steps");
 ABSL_FLAG(bool, for_xnli, false, "whether fine tune the xnli dataset");
+ABSL_FLAG(bool, sparse_embedding, false,
+          "sparse word embedding grads, optimizer only updates touched rows");
 int main(int argc, char* argv[]) {
   // Passing params by value does NOT work correctly.
   absl::ParseCommandLine(argc, argv);
+  // 线程数和cpu绑定要在创建模型之前生效
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
   auto opt = radish::QuerySameOptions(absl::GetFlag(FLAGS_n_vocab))
                  .len_max_seq(absl::GetFlag(FLAGS_max_seq_len))
                  .dropout(absl::GetFlag(FLAGS_dropout))
-                 .d_word_vec(absl::GetFlag(FLAGS_d_word_vec));
+                 .d_word_vec(absl::GetFlag(FLAGS_d_word_vec))
+                 .sparse_embedding(absl::GetFlag(FLAGS_sparse_embedding));
   if (absl::GetFlag(FLAGS_for_xnli)) {
     opt.n_class(3);
   }
@@ -68,7 +76,8 @@ int main(int argc, char* argv[]) {
   if (absl::GetFlag(FLAGS_for_xnli)) {
     radish::train::LlbTrainer<radish::XNLIExampleParser, radish::QuerySameModel,
                               false, 10, true>
-        trainner(logdir);
+        trainner(logdir,
+                 radish::train::LlbTrainerOptions().runtime(runtimeOpts));
     trainner.MainLoop(
         model, trainDataPath, testDataPath, absl::GetFlag(FLAGS_learning_rate),
         absl::GetFlag(FLAGS_batch_size), absl::GetFlag(FLAGS_eval_every),
@@ -80,7 +89,8 @@ int main(int argc, char* argv[]) {
   } else {
     radish::train::LlbTrainer<radish::QSExampleParser, radish::QuerySameModel,
                               false, 10, true>
-        trainner(logdir);
+        trainner(logdir,
+                 radish::train::LlbTrainerOptions().runtime(runtimeOpts));
     trainner.MainLoop(
         model, trainDataPath, testDataPath, absl::GetFlag(FLAGS_learning_rate),
         absl::GetFlag(FLAGS_batch_size), absl::GetFlag(FLAGS_eval_every),
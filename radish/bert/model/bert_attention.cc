@@ -10,6 +10,8 @@
  */
 #include "radish/bert/model/bert_attention.h"
 
+#include "radish/layers/flash_attention.h"
+#include "radish/layers/unpad.h"
 #include "radish/utils/logging.h"
 #include "torch/nn/init.h"
 namespace radish {
@@ -21,49 +23,69 @@ BertSelfAttentionImpl::BertSelfAttentionImpl(const BertOptions& options_)
 
 void BertSelfAttentionImpl::reset() {
   attention_head_size_ = options.hidden_size() / options.num_heads();
-  all_head_size_ = options.num_heads() * attention_head_size_;
-  query = torch::nn::Linear(
-      torch::nn::LinearOptions(options.hidden_size(), all_head_size_));
-  register_module("query", query);
-  key = torch::nn::Linear(
-      torch::nn::LinearOptions(options.hidden_size(), all_head_size_));
-  register_module("key", key);
-  value = torch::nn::Linear(
-      torch::nn::LinearOptions(options.hidden_size(), all_head_size_));
-  register_module("value", value);
+  qkv = torch::nn::Linear(torch::nn::LinearOptions(
+      options.hidden_size(), 3 * options.num_heads() * attention_head_size_));
+  register_module("qkv", qkv);
   dropout = torch::nn::Dropout(options.dropout());
   register_module("dropout", dropout);
   torch::NoGradGuard guard;
-  torch::nn::init::normal_(query->weight, 0, options.init_range());
-  torch::nn::init::normal_(key->weight, 0, options.init_range());
-  torch::nn::init::normal_(value->weight, 0, options.init_range());
-  torch::nn::init::constant_(query->bias, 0);
-  torch::nn::init::constant_(key->bias, 0);
-  torch::nn::init::constant_(value->bias, 0);
+  torch::nn::init::normal_(qkv->weight, 0, options.init_range());
+  torch::nn::init::constant_(qkv->bias, 0);
 }
 
 /// Pretty prints the `BertSelfAttention` module into the given `stream`.
 void BertSelfAttentionImpl::pretty_print(std::ostream& stream) const {}
 
-Tensor BertSelfAttentionImpl::transpose_for_scores(Tensor x) {
-  int bsz = x.size(0);
-  int seqlen = x.size(1);
-  torch::IntArrayRef new_x_shape = {bsz, seqlen, options.num_heads(),
-                                    attention_head_size_};
-  x = x.view(new_x_shape);
-  return x.permute({0, 2, 1, 3});
+int64_t BertSelfAttentionImpl::num_heads() const {
+  const int64_t rows = qkv_int8.is_empty() ? qkv->weight.size(0)
+                                           : qkv_int8->options.out();
+  return rows / (3 * attention_head_size_);
 }
 
 std::vector<Tensor> BertSelfAttentionImpl::forward(Tensor hidden_states,
                                                    Tensor attention_mask,
-                                                   Tensor head_mask) {
-  auto mixed_query_layer = query(hidden_states);
-  auto mixed_key_layer = key(hidden_states);
-  auto mixed_value_layer = value(hidden_states);
-
-  auto query_layer = transpose_for_scores(mixed_query_layer);
-  auto key_layer = transpose_for_scores(mixed_key_layer);
-  auto value_layer = transpose_for_scores(mixed_value_layer);
+                                                   Tensor head_mask,
+                                                   Tensor cu_seqlens) {
+  const int64_t numHeads = num_heads();
+  const int64_t allHeadSize = numHeads * attention_head_size_;
+  if (cu_seqlens.defined()) {
+    CHECK_EQ(hidden_states.dim(), 2) << "packed input should be [T, H]";
+    auto mixed_layer = (qkv_int8.is_empty() ? qkv(hidden_states)
+                                             : qkv_int8(hidden_states))
+                           .view({-1, 3, numHeads, attention_head_size_});
+    auto context_layer = VarlenAttention(
+        mixed_layer.select(1, 0), mixed_layer.select(1, 1),
+        mixed_layer.select(1, 2), cu_seqlens,
+        1.0 / std::sqrt(attention_head_size_), options.dropout(),
+        is_training());
+    return {context_layer.view({-1, allHeadSize})};
+  }
+  int64_t bsz = hidden_states.size(0);
+  int64_t seqlen = hidden_states.size(1);
+  auto mixed_layer = (qkv_int8.is_empty() ? qkv(hidden_states)
+                                           : qkv_int8(hidden_states))
+                         .view({bsz, seqlen, 3, numHeads,
+                                attention_head_size_});
+  if (options.flash_attention() && !options.output_attentions() &&
+      head_mask.numel() == 0 && FlashAttentionAvailable(hidden_states)) {
+    // 分块kernel直接读 [B, heads, L, head_size] 的strided view,
+    // 输出本来就是 [B, L, heads, head_size] 连续的, 不需要任何重排
+    auto context_layer = FlashAttention(
+        mixed_layer.select(2, 0).permute({0, 2, 1, 3}),
+        mixed_layer.select(2, 1).permute({0, 2, 1, 3}),
+        mixed_layer.select(2, 2).permute({0, 2, 1, 3}),
+        attention_mask.numel() > 0 ? attention_mask : Tensor(), Tensor(),
+        1.0 / std::sqrt(attention_head_size_), options.dropout(),
+        is_training());
+    return {context_layer.permute({0, 2, 1, 3})
+                .reshape({bsz, seqlen, allHeadSize})};
+  }
+  // [B, L, 3*H] -> [3, B, heads, L, head_size], 三个一起只拷贝一次,
+  // 之后的q/k/v都是连续的view
+  mixed_layer = mixed_layer.permute({2, 0, 3, 1, 4}).contiguous();
+  auto query_layer = mixed_layer[0];
+  auto key_layer = mixed_layer[1];
+  auto value_layer = mixed_layer[2];
 
   //  Take the dot product between "query" and "key" to get the raw
   //  attention scores.
@@ -84,15 +106,16 @@ std::vector<Tensor> BertSelfAttentionImpl::forward(Tensor hidden_states,
   attention_probs = dropout(attention_probs);
 
   // Mask heads if we want to
+  // 不能原地乘: softmax的反向要用它的输出, 算head重要性时要对mask求梯度
   if (head_mask.numel() > 0) {
-    attention_probs.mul_(head_mask);
+    attention_probs = attention_probs.mul(head_mask);
   }
   auto context_layer = torch::matmul(attention_probs, value_layer);
   context_layer = context_layer.permute({0, 2, 1, 3}).contiguous();
 
   // new_context_layer_shape = context_layer.size()[:-2] + (self.all_head_size,)
   context_layer = context_layer.view(
-      {context_layer.size(0), context_layer.size(1), all_head_size_});
+      {context_layer.size(0), context_layer.size(1), allHeadSize});
   if (options.output_attentions()) {
     return {context_layer, attention_probs};
   } else {
@@ -100,6 +123,10 @@ std::vector<Tensor> BertSelfAttentionImpl::forward(Tensor hidden_states,
   }
 }
 
+void BertSelfAttentionImpl::quantize_int8() {
+  qkv_int8 = register_module("qkv_int8", QuantizeLinear(qkv));
+}
+
 BertSelfOutputImpl::BertSelfOutputImpl(const BertOptions& options_)
     : options(options_) {
   reset();
@@ -118,8 +145,13 @@ void BertSelfOutputImpl::reset() {
   torch::nn::init::constant_(dense->bias, 0);
 }
 
+void BertSelfOutputImpl::quantize_int8() {
+  dense_int8 = register_module("dense_int8", QuantizeLinear(dense));
+}
+
 Tensor BertSelfOutputImpl::forward(Tensor hidden_states, Tensor input_tensor) {
-  hidden_states = dense(hidden_states);
+  hidden_states = dense_int8.is_empty() ? dense(hidden_states)
+                                        : dense_int8(hidden_states);
   hidden_states = dropout(hidden_states);
   hidden_states = layer_norm(hidden_states.add(input_tensor));
   return hidden_states;
@@ -137,10 +169,55 @@ void BertAttentionImpl::reset() {
   register_module("output", output);
 }
 
+namespace {
+// 按 index 留下Linear权重的行(dim=0, bias一起)或列(dim=1)
+void SliceLinear(torch::nn::Linear& linear, int64_t dim, const Tensor& index) {
+  linear->weight.set_(linear->weight.index_select(dim, index).contiguous());
+  if (dim == 0) {
+    linear->bias.set_(linear->bias.index_select(0, index).contiguous());
+    linear->options.out(index.numel());
+  } else {
+    linear->options.in(index.numel());
+  }
+}
+}  // namespace
+
+void BertAttentionImpl::prune_heads(const std::vector<int64_t>& heads) {
+  CHECK(self->qkv_int8.is_empty() && output->dense_int8.is_empty())
+      << "prune heads before quantize_int8";
+  const int64_t numHeads = self->num_heads();
+  const int64_t headSize = self->head_size();
+  std::vector<bool> removed(numHeads, false);
+  for (int64_t h : heads) {
+    CHECK(h >= 0 && h < numHeads) << "no head " << h << " to prune";
+    removed[h] = true;
+  }
+  std::vector<int64_t> keep;
+  for (int64_t h = 0; h < numHeads; h++) {
+    if (!removed[h]) {
+      keep.push_back(h);
+    }
+  }
+  CHECK(!keep.empty()) << "can't prune all heads of a layer";
+  if (static_cast<int64_t>(keep.size()) == numHeads) {
+    return;
+  }
+  // 留下的head在 [heads*head_size] 里的列, qkv的行是三份这样的排列
+  Tensor cols = (torch::tensor(keep, torch::kLong).mul(headSize).unsqueeze(1) +
+                 torch::arange(headSize, torch::kLong))
+                    .view(-1);
+  const int64_t allHeadSize = numHeads * headSize;
+  Tensor rows = torch::cat({cols, cols + allHeadSize, cols + 2 * allHeadSize});
+  torch::NoGradGuard guard;
+  SliceLinear(self->qkv, 0, rows);
+  SliceLinear(output->dense, 1, cols);
+}
+
 std::vector<Tensor> BertAttentionImpl::forward(Tensor input_tensor,
                                                Tensor attention_mask,
-                                               Tensor head_mask) {
-  auto self_outputs = self(input_tensor, attention_mask, head_mask);
+                                               Tensor head_mask,
+                                               Tensor cu_seqlens) {
+  auto self_outputs = self(input_tensor, attention_mask, head_mask, cu_seqlens);
   auto attention_output = output(self_outputs[0], input_tensor);
   if (options.output_attentions()) {
     return {attention_output, self_outputs[1]};
@@ -15,6 +15,7 @@
 
 #include "radish/bert/model/bert_options.h"
 #include "radish/layers/layer_norm.h"
+#include "radish/layers/quantized_linear.h"
 
 #include "torch/nn/cloneable.h"
 #include "torch/nn/modules/dropout.h"
@@ -38,17 +39,29 @@ class TORCH_API BertSelfAttentionImpl
   /// Pretty prints the `Embedding` module into the given `stream`.
   void pretty_print(std::ostream& stream) const override;
 
-  std::vector<Tensor> forward(Tensor  hidden_states, Tensor attention_mask={}, Tensor head_mask={});
+  /**
+   * 传了 cu_seqlens 时 hidden_states 是打包的 [T, H](见 layers/unpad.h),
+   * cu_seqlens 是各序列的起点, attention只在序列内部计算, 不用
+   * attention_mask 和 head_mask
+   */
+  std::vector<Tensor> forward(Tensor hidden_states, Tensor attention_mask = {},
+                              Tensor head_mask = {}, Tensor cu_seqlens = {});
+
+  // 推理时把qkv换成int8的, 见 BertModelImpl::quantize_int8
+  void quantize_int8();
+
+  // 剪枝之后各层的head数不同, 由qkv的形状决定
+  int64_t num_heads() const;
+  int64_t head_size() const { return attention_head_size_; }
 
   BertOptions options;
-  torch::nn::Linear  query=nullptr;
-  torch::nn::Linear  key=nullptr;
-  torch::nn::Linear  value=nullptr;
+  // query/key/value 打包成一个 [3*H, H] 的权重, 一次GEMM算出来.
+  // 旧的分开保存的checkpoint在加载时拼起来, 见 train/model_io.h
+  torch::nn::Linear qkv = nullptr;
+  QuantizedLinear qkv_int8 = nullptr;
   torch::nn::Dropout dropout=nullptr;
 private:
-  Tensor transpose_for_scores(Tensor x);
   int attention_head_size_;
-  int all_head_size_;
 };
 TORCH_MODULE(BertSelfAttention);
 
@@ -61,8 +74,11 @@ class TORCH_API BertSelfOutputImpl
 
   Tensor forward(Tensor hidden_states, Tensor input_tensor);
 
+  void quantize_int8();
+
   BertOptions options;
   torch::nn::Linear dense = nullptr;
+  QuantizedLinear dense_int8 = nullptr;
   // should register as name  'LayerNorm'
   LayerNorm layer_norm = nullptr;
   torch::nn::Dropout dropout = nullptr;
@@ -77,8 +93,16 @@ class TORCH_API BertAttentionImpl
 
   void reset() override;
 
+  // cu_seqlens 见 BertSelfAttentionImpl::forward
   std::vector<Tensor> forward(Tensor hidden_states, Tensor attention_mask = {},
-                              Tensor head_mask = {});
+                              Tensor head_mask = {}, Tensor cu_seqlens = {});
+
+  /**
+   * 去掉 heads 里的head(按当前的编号): qkv的权重按行, output.dense的
+   * 权重按列切掉对应的部分, 计算量按比例减少. 要在 quantize_int8 之前,
+   * 至少留一个head
+   */
+  void prune_heads(const std::vector<int64_t>& heads);
 
   BertOptions options;
   BertSelfAttention self = nullptr;
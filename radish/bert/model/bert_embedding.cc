@@ -25,8 +25,9 @@ void BertEmbeddingImpl::reset() {
   if (options.need_factor_embedding()) {
     emdsz = options.d_wordvec();
   }
-  word_embeddings =
-      Embedding(EmbeddingOptions(options.n_vocab(), emdsz).padding_idx(0));
+  word_embeddings = Embedding(EmbeddingOptions(options.n_vocab(), emdsz)
+                                  .padding_idx(0)
+                                  .sparse(options.sparse_embedding()));
   register_module("word_embeddings", word_embeddings);
   position_embeddings =
       Embedding(EmbeddingOptions(options.max_pos(), options.hidden_size()));
@@ -11,6 +11,7 @@
 #include "radish/bert/model/bert_encoder.h"
 
 #include "radish/bert/model/bert_layer.h"
+#include "radish/utils/logging.h"
 namespace radish {
 
 BertEncoderImpl::BertEncoderImpl(const BertOptions& options_)
@@ -26,8 +27,15 @@ void BertEncoderImpl::reset() {
 }
 std::vector<Tensor> BertEncoderImpl::forward(Tensor hidden_states,
                                              Tensor attention_mask,
-                                             Tensor head_mask) {
+                                             Tensor head_mask,
+                                             const LayerHook& hook,
+                                             Tensor cu_seqlens) {
+  CHECK(!hook || !cu_seqlens.defined()) << "layer hook needs padded input";
   std::vector<Tensor> enc_slf_attn_list;
+  // head_mask 是 [num_layers, 1, heads, 1, 1], 每层用自己的那一份
+  auto layer_head_mask = [&head_mask](int64_t i) {
+    return head_mask.numel() > 0 ? head_mask[i] : head_mask;
+  };
   if (is_training() && options.repeat_stochastic_layers() > 1) {
     std::uniform_real_distribution<> randomP(0, 1.0);
     float randomness =
@@ -36,7 +44,8 @@ std::vector<Tensor> BertEncoderImpl::forward(Tensor hidden_states,
       auto elayer = layer->ptr<BertLayerImpl>(i);
       for (int j = 0; j < options.repeat_stochastic_layers(); j++) {
         if (randomP(gen_) <= randomness) {
-          auto rets = elayer->forward(hidden_states, attention_mask, head_mask);
+          auto rets = elayer->forward(hidden_states, attention_mask,
+                                      layer_head_mask(i), cu_seqlens);
           hidden_states = rets[0];
           const auto& enc_slf_attn = rets[1];
           if (options.output_attentions()) {
@@ -44,17 +53,23 @@ std::vector<Tensor> BertEncoderImpl::forward(Tensor hidden_states,
           }
         }
       }
+      if (hook && !hook(i, &hidden_states, &attention_mask)) {
+        break;
+      }
     }
   } else {
     for (auto i = 0; i < options.num_layers(); i++) {
       auto elayer = layer->ptr<BertLayerImpl>(i);
-      std::vector<Tensor> rets =
-          elayer->forward(hidden_states, attention_mask, head_mask);
+      std::vector<Tensor> rets = elayer->forward(
+          hidden_states, attention_mask, layer_head_mask(i), cu_seqlens);
       hidden_states = rets[0];
       const auto& enc_slf_attn = rets[1];
       if (options.output_attentions()) {
         enc_slf_attn_list.push_back(enc_slf_attn);
       }
+      if (hook && !hook(i, &hidden_states, &attention_mask)) {
+        break;
+      }
     }
   }
   if (options.output_attentions()) {
@@ -11,6 +11,7 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 #include <random>
 #include <vector>
 
@@ -28,10 +29,21 @@ using Tensor = torch::Tensor;
 
 class TORCH_API BertEncoderImpl : public torch::nn::Cloneable<BertEncoderImpl> {
  public:
+  /**
+   * 每层之后调用, 可以改写 hidden_states 和 attention_mask
+   * (比如去掉已经早退的样本), 返回false时后面的层不再执行
+   */
+  using LayerHook =
+      std::function<bool(int64_t layer, Tensor* hidden_states,
+                         Tensor* attention_mask)>;
+
   explicit BertEncoderImpl(const BertOptions& options_);
   void reset() override;
+  // cu_seqlens 见 BertSelfAttentionImpl::forward, 打包输入时不支持hook
   std::vector<Tensor> forward(Tensor hidden_states, Tensor attention_mask = {},
-                              Tensor head_mask = {});
+                              Tensor head_mask = {},
+                              const LayerHook& hook = nullptr,
+                              Tensor cu_seqlens = {});
 
   BertOptions options;
   torch::nn::ModuleList layer = nullptr;
@@ -35,7 +35,15 @@ void BertIntermediateImpl::reset() {
   torch::nn::init::normal_(dense->weight, 0, options.init_range());
   torch::nn::init::constant_(dense->bias, 0);
 }
+void BertIntermediateImpl::quantize_int8() {
+  dense_int8 = register_module("dense_int8", QuantizeLinear(dense));
+}
+
 Tensor BertIntermediateImpl::forward(Tensor hidden_states) {
+  if (!dense_int8.is_empty()) {
+    // GELU由 BertOutput 的int8层做, 静态量化时和量化合成一次查表
+    return dense_int8(hidden_states);
+  }
   hidden_states = dense(hidden_states);
   hidden_states = torch::gelu(hidden_states);
   return hidden_states;
@@ -58,8 +66,14 @@ void BertOutputImpl::reset() {
   torch::nn::init::constant_(dense->bias, 0);
 }
 
+void BertOutputImpl::quantize_int8() {
+  dense_int8 = register_module("dense_int8",
+                               QuantizeLinear(dense, true, true /*gelu*/));
+}
+
 Tensor BertOutputImpl::forward(Tensor hidden_states, Tensor input_tensor) {
-  hidden_states = dense(hidden_states);
+  hidden_states = dense_int8.is_empty() ? dense(hidden_states)
+                                        : dense_int8(hidden_states);
   hidden_states = dropout(hidden_states);
   hidden_states.add_(input_tensor);
   hidden_states = layer_norm(hidden_states);
@@ -81,8 +95,10 @@ void BertLayerImpl::reset() {
 
 std::vector<Tensor> BertLayerImpl::forward(Tensor hidden_states,
                                            Tensor attention_mask,
-                                           Tensor head_mask) {
-  auto attention_outputs = attention(hidden_states, attention_mask, head_mask);
+                                           Tensor head_mask,
+                                           Tensor cu_seqlens) {
+  auto attention_outputs =
+      attention(hidden_states, attention_mask, head_mask, cu_seqlens);
   auto attention_output = attention_outputs[0];
   auto intermediate_output = intermediate(attention_output);
   auto layer_output = output(intermediate_output, attention_output);
@@ -32,10 +32,14 @@ class TORCH_API BertIntermediateImpl
  public:
   explicit BertIntermediateImpl(const BertOptions& options_);
   void reset() override;
+  // 量化之后输出的是GELU之前的值, 要和量化过的 BertOutput 一起用
   Tensor forward(Tensor hidden_states);
 
+  void quantize_int8();
+
   BertOptions options;
   torch::nn::Linear dense = nullptr;
+  QuantizedLinear dense_int8 = nullptr;
 };
 
 TORCH_MODULE(BertIntermediate);
@@ -48,8 +52,11 @@ class TORCH_API BertOutputImpl : public torch::nn::Cloneable<BertOutputImpl> {
 
   Tensor forward(Tensor hidden_states, Tensor input_tensor);
 
+  void quantize_int8();
+
   BertOptions options;
   torch::nn::Linear dense = nullptr;
+  QuantizedLinear dense_int8 = nullptr;
   // should register as name  'LayerNorm'
   LayerNorm layer_norm = nullptr;
   torch::nn::Dropout dropout = nullptr;
@@ -63,8 +70,9 @@ class TORCH_API BertLayerImpl : public torch::nn::Cloneable<BertLayerImpl> {
 
   void reset() override;
 
+  // cu_seqlens 见 BertSelfAttentionImpl::forward
   std::vector<Tensor> forward(Tensor hidden_states, Tensor attention_mask = {},
-                 Tensor head_mask = {});
+                              Tensor head_mask = {}, Tensor cu_seqlens = {});
 
   BertOptions options;
   BertAttention attention = nullptr;
@@ -10,6 +10,8 @@
  */
 
 #include "radish/bert/model/bert_model.h"
+#include "radish/bert/model/bert_layer.h"
+#include "radish/layers/unpad.h"
 #include "radish/utils/logging.h"
 
 namespace radish {
@@ -27,11 +29,10 @@ void BertModelImpl::reset() {
   register_module("pooler", pooler);
 }
 
-std::vector<Tensor> BertModelImpl::forward(Tensor input_ids,
-                                           Tensor attention_mask,
-                                           Tensor token_type_ids,
-                                           Tensor position_ids,
-                                           Tensor head_mask) {
+std::vector<Tensor> BertModelImpl::forward(
+    Tensor input_ids, Tensor attention_mask, Tensor token_type_ids,
+    Tensor position_ids, Tensor head_mask,
+    const BertEncoderImpl::LayerHook& hook) {
   if (attention_mask.numel() == 0) {
     attention_mask = torch::ones_like(input_ids);
   }
@@ -75,11 +76,49 @@ std::vector<Tensor> BertModelImpl::forward(Tensor input_ids,
     }
   }
   auto embedding_output = embeddings(input_ids, token_type_ids, position_ids);
+  if (options.unpad_input() && !options.output_attentions() &&
+      head_mask.numel() == 0 && !hook) {
+    // 各层只算真实token, pad的位置输出0
+    UnpadIndex index = MakeUnpadIndex(attention_mask);
+    auto encoder_outputs =
+        encoder->forward(UnpadInput(embedding_output, index), {}, {}, nullptr,
+                         index.cu_seqlens);
+    auto sequence_output = PadOutput(encoder_outputs[0], index);
+    auto pooled_output = pooler(sequence_output);
+    return {sequence_output, pooled_output};
+  }
   auto encoder_outputs =
-      encoder(embedding_output, extended_attention_mask, head_mask);
+      encoder(embedding_output, extended_attention_mask, head_mask, hook);
   auto sequence_output = encoder_outputs[0];
   auto pooled_output = pooler(sequence_output);
   return {sequence_output, pooled_output};
 }
 
+void BertModelImpl::quantize_int8() {
+  for (size_t i = 0; i < encoder->layer->size(); i++) {
+    auto layer = encoder->layer->ptr<BertLayerImpl>(i);
+    layer->attention->self->quantize_int8();
+    layer->attention->output->quantize_int8();
+    layer->intermediate->quantize_int8();
+    layer->output->quantize_int8();
+  }
+}
+
+void BertModelImpl::prune_heads(
+    const std::vector<std::vector<int64_t>>& heads) {
+  CHECK_EQ(heads.size(), encoder->layer->size());
+  for (size_t i = 0; i < heads.size(); i++) {
+    encoder->layer->ptr<BertLayerImpl>(i)->attention->prune_heads(heads[i]);
+  }
+}
+
+std::vector<int64_t> BertModelImpl::num_heads() const {
+  std::vector<int64_t> heads;
+  for (size_t i = 0; i < encoder->layer->size(); i++) {
+    heads.push_back(
+        encoder->layer->ptr<BertLayerImpl>(i)->attention->self->num_heads());
+  }
+  return heads;
+}
+
 }  // namespace radish
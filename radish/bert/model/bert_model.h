@@ -31,9 +31,30 @@ class TORCH_API BertModelImpl : public torch::nn::Cloneable<BertModelImpl> {
 
   void reset() override;
 
-  std::vector<Tensor> forward(Tensor input_ids, Tensor attention_mask = {},
-                              Tensor token_type_ids = {},
-                              Tensor position_ids = {}, Tensor head_mask = {});
+  // hook 见 BertEncoderImpl::LayerHook, 设置了hook时不走unpad,
+  // hook改写的mask是 [batch, 1, 1, len] 的加性mask
+  std::vector<Tensor> forward(
+      Tensor input_ids, Tensor attention_mask = {}, Tensor token_type_ids = {},
+      Tensor position_ids = {}, Tensor head_mask = {},
+      const BertEncoderImpl::LayerHook& hook = nullptr);
+
+  /**
+   * 动态int8量化, 只用于推理: encoder里attention/intermediate/output的
+   * Linear换成按通道量化的int8权重, 激活在forward时按行量化.
+   * 原来的float权重被释放, 要在加载完模型之后调用.
+   * 再用 StartCalibration/FinishCalibration 校准就是静态量化, 保存的模型
+   * 先构造并调用这个函数, 再用 LoadModel 加载
+   */
+  void quantize_int8();
+
+  /**
+   * 按层去掉attention head, heads[i] 是第i层要去掉的head(当前编号),
+   * 见 BertAttentionImpl::prune_heads. 剪过的模型用 SaveModel 保存,
+   * LoadModel 会按checkpoint里的形状加载, 各层的head数由权重的形状决定
+   */
+  void prune_heads(const std::vector<std::vector<int64_t>>& heads);
+  // 各层当前的head数
+  std::vector<int64_t> num_heads() const;
 
   BertOptions options;
   BertEmbedding embeddings = nullptr;
@@ -41,6 +41,16 @@ struct TORCH_API BertOptions {
   TORCH_ARG(int64_t, d_wordvec) = 128;
   TORCH_ARG(bool, need_factor_embedding) = false;
   TORCH_ARG(int64_t, repeat_stochastic_layers) = 0;
+  // word embedding输出稀疏梯度, 配合优化器只更新出现过的行.
+  // 输出层和word embedding绑定权重的模型(ALBERT)不支持, 输出层的稠密梯度
+  // 会让整个梯度变回稠密, 这类模型构造时会报错
+  TORCH_ARG(bool, sparse_embedding) = false;
+  // CPU上用分块的attention kernel, 不生成 L*L 的分数矩阵.
+  // 需要 output_attentions=false 且不用head_mask, 否则仍走原来的实现
+  TORCH_ARG(bool, flash_attention) = false;
+  // 不补齐执行: BertModel把真实token打包成 [T, H] 跑encoder, 出口再补齐,
+  // attention按序列分段算. 同样需要 output_attentions=false 且不用head_mask
+  TORCH_ARG(bool, unpad_input) = false;
 
  public:
   static BertOptions kBertBaseOpts;
@@ -0,0 +1,79 @@
+/*
+ * File: head_pruning.cc
+ * Project: model
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-21 3:17:45
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/bert/model/head_pruning.h"
+
+#include <algorithm>
+
+#include "radish/utils/logging.h"
+#include "torch/torch.h"
+
+namespace radish {
+
+HeadImportance::HeadImportance(int64_t num_layers, int64_t num_heads) {
+  mask_ = torch::ones({num_layers, num_heads}, torch::requires_grad());
+  sum_ = torch::zeros({num_layers, num_heads});
+}
+
+void HeadImportance::Accumulate() {
+  CHECK(mask_.grad().defined()) << "call backward before Accumulate";
+  Accumulate(mask_.grad());
+  mask_.grad().zero_();
+}
+
+void HeadImportance::Accumulate(const Tensor& grad) {
+  torch::NoGradGuard guard;
+  sum_.add_(grad.detach().to(torch::kCPU).abs());
+}
+
+Tensor HeadImportance::scores(bool normalize) const {
+  Tensor s = sum_.clone();
+  if (normalize) {
+    // 各层的梯度量级差别很大, 归一之后才能跨层比较
+    s.div_(s.norm(2, {1}, true).add_(1e-20));
+  }
+  return s;
+}
+
+std::vector<std::vector<int64_t>> SelectHeadsToPrune(const Tensor& scores,
+                                                     double ratio,
+                                                     int64_t min_heads) {
+  CHECK_EQ(scores.dim(), 2);
+  const int64_t layers = scores.size(0);
+  const int64_t heads = scores.size(1);
+  CHECK(min_heads >= 1 && min_heads <= heads);
+  Tensor s = scores.to(torch::kCPU, torch::kFloat).contiguous();
+  const float* sp = s.data_ptr<float>();
+  std::vector<int64_t> order(layers * heads);
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [sp](int64_t a, int64_t b) { return sp[a] < sp[b]; });
+  int64_t budget = static_cast<int64_t>(ratio * layers * heads);
+  std::vector<std::vector<int64_t>> pruned(layers);
+  for (int64_t idx : order) {
+    if (budget <= 0) {
+      break;
+    }
+    auto& layer = pruned[idx / heads];
+    if (heads - static_cast<int64_t>(layer.size()) <= min_heads) {
+      continue;
+    }
+    layer.push_back(idx % heads);
+    budget -= 1;
+  }
+  for (auto& layer : pruned) {
+    std::sort(layer.begin(), layer.end());
+  }
+  return pruned;
+}
+
+}  // namespace radish
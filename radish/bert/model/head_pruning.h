@@ -0,0 +1,58 @@
+/*
+ * File: head_pruning.h
+ * Project: model
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-21 3:17:45
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "radish/bert/model/bert_options.h"
+#include "torch/types.h"
+
+namespace radish {
+using Tensor = torch::Tensor;
+
+/**
+ * attention head的重要性(Michel et al. 2019, "Are Sixteen Heads Really
+ * Better than One?"): 把全1的 head_mask 传给 BertModel::forward,
+ * 重要性是loss对mask的梯度的绝对值在开发集上的累加, 每层再按L2归一.
+ * 用法: 每个batch用 mask() 前向, loss backward(或autograd::grad)之后
+ * 调用 Accumulate()
+ */
+class TORCH_API HeadImportance {
+ public:
+  HeadImportance(int64_t num_layers, int64_t num_heads);
+  explicit HeadImportance(const BertOptions& options)
+      : HeadImportance(options.num_layers(), options.num_heads()) {}
+
+  // [num_layers, num_heads], 需要梯度
+  const Tensor& mask() const { return mask_; }
+  // 累加 mask 的梯度, 并清零
+  void Accumulate();
+  // 梯度由调用方算出时直接累加
+  void Accumulate(const Tensor& grad);
+  // [num_layers, num_heads]
+  Tensor scores(bool normalize = true) const;
+
+ private:
+  Tensor mask_;
+  Tensor sum_;
+};
+
+/**
+ * 按重要性从低到高去掉 ratio 比例的head, 每层至少留 min_heads 个,
+ * 返回每层要去掉的head, 可以直接传给 BertModelImpl::prune_heads
+ */
+std::vector<std::vector<int64_t>> SelectHeadsToPrune(const Tensor& scores,
+                                                     double ratio,
+                                                     int64_t min_heads = 1);
+
+}  // namespace radish
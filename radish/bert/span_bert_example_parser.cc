@@ -13,6 +13,7 @@
 
 #include "absl/strings/ascii.h"
 #include "sentencepiece/sentencepiece_processor.h"
+#include "radish/train/data/pipeline_stats.h"
 #include "radish/utils/logging.h"
 
 namespace radish {
@@ -129,7 +130,11 @@ bool SpanBertExampleParser::ParseOne(train::TrainExample& protoData,
     return false;
   }
   std::string x = absl::AsciiStrToLower(it->second);
-  auto ids = spp_->EncodeAsIds(x);
+  std::vector<int> ids;
+  {
+    data::PipelineStats::Scope stage(data::PipelineStage::kTokenize);
+    ids = spp_->EncodeAsIds(x);
+  }
   int totalVocabSize = spp_->GetPieceSize();
   Ex ex(kMaxLen + 2);
   int clsId = totalVocabSize;
@@ -145,10 +150,14 @@ bool SpanBertExampleParser::ParseOne(train::TrainExample& protoData,
     ex.x[i] = ids[i - 1];
   }
   ex.x[i] = sepId;
-  if (!_mask_seq(maskId, totalVocabSize, i, ex)) {
-    spdlog::warn("mask example error");
-    return false;
+  {
+    data::PipelineStats::Scope stage(data::PipelineStage::kMask);
+    if (!_mask_seq(maskId, totalVocabSize, i, ex)) {
+      spdlog::warn("mask example error");
+      return false;
+    }
   }
+  data::PipelineStats::Scope stage(data::PipelineStage::kTensorize);
   example.features.push_back(
       torch::tensor(ex.x, at::dtype(torch::kInt64).requires_grad(false)));
   example.features.push_back(torch::tensor(
@@ -161,4 +170,13 @@ bool SpanBertExampleParser::ParseOne(train::TrainExample& protoData,
       torch::tensor(ex.target, at::dtype(torch::kInt64).requires_grad(false));
   return true;
 }
+
+void SpanBertExampleParser::SaveState(Json::Value* state) const {
+  (*state)["gen"] = data::RngToString(gen_);
+}
+
+void SpanBertExampleParser::LoadState(const Json::Value& state) {
+  data::RngFromString(state.get("gen", "").asString(), &gen_);
+}
+
 }  // namespace radish
@@ -37,6 +37,8 @@ class SpanBertExampleParser : public radish::data::ExampleParser {
   bool Init(const Json::Value& config) override;
   bool ParseOne(train::TrainExample& protoData,
                 data::LlbExample& example) override;
+  void SaveState(Json::Value* state) const override;
+  void LoadState(const Json::Value& state) override;
 
  private:
   bool _mask_seq(int maskId, int totalVocabSize, int len, Ex& ex);
@@ -77,6 +77,8 @@ SpanBertModelImpl::SpanBertModelImpl(SpanBertOptions options_)
 
   laynorm = LayerNorm(options.d_model());
   register_module("laynorm", laynorm);
+  CHECK(!encoder->options.sparse_embedding())
+      << "sparse_embedding doesn't work with SpanBERT's tied final_proj";
   torch::NoGradGuard guard;
   proj->weight = encoder->src_word_emb->weight;
 }
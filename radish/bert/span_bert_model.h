@@ -47,6 +47,12 @@ class TORCH_API SpanBertModelImpl : public train::LlbModel {
                   const Tensor& target = {}) override;
 
   std::vector<Tensor> forward(std::vector<Tensor> inputs) override;
+  // mask和span边界的位置都在真实内容里
+  std::vector<size_t> SequenceFeatures() const override { return {0}; }
+  std::vector<size_t> PositionFeatures() const override { return {1, 2, 3}; }
+  int64_t MatmulParametersPerToken() const override {
+    return MatrixParameters(*encoder->encoder_stack);
+  }
 
   SpanBertOptions options;
   TransformerEncoder encoder = nullptr;
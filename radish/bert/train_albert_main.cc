@@ -19,6 +19,7 @@
 
 #include "radish/train/llb_trainer.h"
 #include "radish/train/progress_reporter.h"
+#include "radish/utils/runtime_flags.h"
 
 ABSL_FLAG(std::string, train_data_path,
           "/e/data/albert_data/albert/part0,/e/data/albert_data/albert/part1,/"
@@ -32,34 +33,103 @@ ABSL_FLAG(std::string, test_data_path, "/e/data/albert_data/albert/valid0",
 ABSL_FLAG(std::string, parser_conf_path, "bert/parser_conf.json",
           "the example parser conf path");
 ABSL_FLAG(std::string, logdir, "logs", "the model log dir ");
-ABSL_FLAG(int32_t, batch_size, 512, "batch size of trainning steps ");
+ABSL_FLAG(int32_t, batch_size, 0,
+          "batch size of trainning steps, 0 to use the tuned value in "
+          "--runtime_config or 512");
+ABSL_FLAG(int64_t, update_per_batches, 0,
+          "batches accumulated per update, 0 to use the tuned value in "
+          "--runtime_config or 2");
 ABSL_FLAG(int64_t, max_test_num, 0, "max test examples allowed");
 ABSL_FLAG(int32_t, eval_every, 6000,
           "every X steps , evaluate once for test loss");
 ABSL_FLAG(float, learning_rate, 0.0001, "the learning rate ");
 ABSL_FLAG(int32_t, warmup_steps, 20000, "the warmup steps");
+ABSL_FLAG(std::string, optimizer_state_format, "fp32",
+          "storage of optimizer moments: fp32, bf16 or int8");
+ABSL_FLAG(bool, async_checkpoint, false,
+          "write the best model on a background thread");
+ABSL_FLAG(int64_t, checkpoint_every, 0,
+          "every X steps, save the full train state for resume, 0 to disable");
+ABSL_FLAG(bool, resume, false,
+          "resume from logdir/train_state.ptc if exists");
+ABSL_FLAG(int64_t, seed, -1, "torch random seed, < 0 to leave unseeded");
+ABSL_FLAG(bool, async_eval, false,
+          "evaluate on a weight snapshot in background while training");
+ABSL_FLAG(int64_t, trace_start_step, -1,
+          "dump chrome trace of step phases from this step, -1 to disable");
+ABSL_FLAG(bool, trace_ops, false, "also trace every op in the trace window");
+ABSL_FLAG(std::string, metrics_file, "",
+          "also write throughput metrics to this .csv or .jsonl file");
+ABSL_FLAG(int32_t, metrics_port, 0,
+          "serve prometheus metrics on 127.0.0.1:port, 0 to disable");
+ABSL_FLAG(int64_t, max_tokens_per_batch, 0,
+          "if > 0, group examples into micro batches by this token budget, "
+          "batch_size becomes the pool size for grouping");
+ABSL_FLAG(bool, trim_padding, false,
+          "trim sequence features to the longest example in each batch");
+ABSL_FLAG(int32_t, curriculum_max_len, 0,
+          "if > 0, limit examples to this length for the first "
+          "curriculum_steps steps, then switch to full length");
+ABSL_FLAG(int64_t, curriculum_steps, 0,
+          "number of steps trained at curriculum_max_len");
+ABSL_FLAG(int32_t, preprocess_processes, 0,
+          "if > 0, parse examples in this many processes via shared memory");
 
 int main(int argc, char* argv[]) {
   // Passing params by value does NOT work correctly.
   absl::ParseCommandLine(argc, argv);
+  // 线程数和cpu绑定要在创建模型之前生效
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
   radish::ALBertModel model =
       radish::ALBertModel(radish::BertOptions::kMiniAlbertOpts);
   std::string logdir = absl::GetFlag(FLAGS_logdir);
   CHECK(!logdir.empty()) << "logdir should not be empty";
   std::string parserConfPath = absl::GetFlag(FLAGS_parser_conf_path);
   radish::train::ProgressReporter reporter;
+  radish::train::LlbTrainerOptions trainerOpts;
+  trainerOpts.runtime(runtimeOpts);
+  trainerOpts.optim_state_format(radish::optim::StateFormatFromString(
+      absl::GetFlag(FLAGS_optimizer_state_format)));
+  trainerOpts.async_checkpoint(absl::GetFlag(FLAGS_async_checkpoint));
+  trainerOpts.checkpoint_every(absl::GetFlag(FLAGS_checkpoint_every));
+  trainerOpts.resume(absl::GetFlag(FLAGS_resume));
+  trainerOpts.seed(absl::GetFlag(FLAGS_seed));
+  trainerOpts.async_eval(absl::GetFlag(FLAGS_async_eval));
+  trainerOpts.trace_start_step(absl::GetFlag(FLAGS_trace_start_step));
+  trainerOpts.trace_ops(absl::GetFlag(FLAGS_trace_ops));
+  trainerOpts.metrics_file(absl::GetFlag(FLAGS_metrics_file));
+  trainerOpts.metrics_port(absl::GetFlag(FLAGS_metrics_port));
+  trainerOpts.max_tokens_per_batch(absl::GetFlag(FLAGS_max_tokens_per_batch));
+  trainerOpts.trim_padding(absl::GetFlag(FLAGS_trim_padding));
+  trainerOpts.curriculum_max_len(absl::GetFlag(FLAGS_curriculum_max_len));
+  trainerOpts.curriculum_steps(absl::GetFlag(FLAGS_curriculum_steps));
+  trainerOpts.preprocess_processes(absl::GetFlag(FLAGS_preprocess_processes));
   radish::train::LlbTrainer<radish::ALBertExampleParser, radish::ALBertModel,
                             false, 10, true>
-      trainner(logdir);
+      trainner(logdir, trainerOpts);
+  trainner.SetEvalReplicaFactory([]() {
+    return radish::ALBertModel(radish::BertOptions::kMiniAlbertOpts);
+  });
   std::string trainDataPath = absl::GetFlag(FLAGS_train_data_path);
   std::string testDataPath = absl::GetFlag(FLAGS_test_data_path);
   CHECK(!trainDataPath.empty()) << "train data path is empty";
   CHECK(!testDataPath.empty()) << "test data path is empty";
-  trainner.MainLoop(
-      model, trainDataPath, testDataPath, absl::GetFlag(FLAGS_learning_rate),
-      absl::GetFlag(FLAGS_batch_size), absl::GetFlag(FLAGS_eval_every),
-      &reporter, parserConfPath, 100 /** epoch */,
-      absl::GetFlag(FLAGS_warmup_steps), absl::GetFlag(FLAGS_max_test_num),
-      2 /** update per batchs */);
+  int batchSize = absl::GetFlag(FLAGS_batch_size);
+  int64_t updatePerBatches = absl::GetFlag(FLAGS_update_per_batches);
+  radish::utils::TunedTrainConfigFromFlags(&batchSize, &updatePerBatches);
+  if (batchSize <= 0) {
+    batchSize = 512;
+  }
+  if (updatePerBatches <= 0) {
+    updatePerBatches = 2;
+  }
+  trainner.MainLoop(model, trainDataPath, testDataPath,
+                    absl::GetFlag(FLAGS_learning_rate), batchSize,
+                    absl::GetFlag(FLAGS_eval_every), &reporter,
+                    parserConfPath, 100 /** epoch */,
+                    absl::GetFlag(FLAGS_warmup_steps),
+                    absl::GetFlag(FLAGS_max_test_num), updatePerBatches);
   return 0;
 }
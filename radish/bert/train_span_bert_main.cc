@@ -22,6 +22,7 @@
 
 #include "radish/train/llb_trainer.h"
 #include "radish/train/progress_reporter.h"
+#include "radish/utils/runtime_flags.h"
 
 ABSL_FLAG(std::string, train_data_path, "spanbert_leveldb/valid",
           "the train data path");
@@ -43,6 +44,10 @@ ABSL_FLAG(int32_t, warmup_steps, 40000, "the warmup steps");
 int main(int argc, char* argv[]) {
   // Passing params by value does NOT work correctly.
   absl::ParseCommandLine(argc, argv);
+  // 线程数和cpu绑定要在创建模型之前生效
+  radish::utils::RuntimeOptions runtimeOpts =
+      radish::utils::RuntimeOptionsFromFlags();
+  radish::utils::ApplyRuntimeOptions(runtimeOpts);
   radish::SpanBertModel model = radish::SpanBertModel(
       absl::GetFlag(FLAGS_n_vocab), absl::GetFlag(FLAGS_max_seq_len),
       absl::GetFlag(FLAGS_d_word_vec));
@@ -52,7 +57,8 @@ int main(int argc, char* argv[]) {
   radish::train::ProgressReporter reporter;
   radish::train::LlbTrainer<radish::SpanBertExampleParser,
                             radish::SpanBertModel, false, 8, false>
-      trainner(logdir);
+      trainner(logdir,
+               radish::train::LlbTrainerOptions().runtime(runtimeOpts));
   std::string trainDataPath = absl::GetFlag(FLAGS_train_data_path);
   std::string testDataPath = absl::GetFlag(FLAGS_test_data_path);
   CHECK(!trainDataPath.empty()) << "train data path is empty";
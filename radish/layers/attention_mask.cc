@@ -0,0 +1,62 @@
+/*
+ * File: attention_mask.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 3:20:14
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/layers/attention_mask.h"
+
+#include <cmath>
+#include <vector>
+
+#include "torch/torch.h"
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+
+Tensor SequenceLengths(const Tensor& seq) {
+  CHECK_EQ(seq.dim(), 2);
+  return seq.ne(0).sum(1).to(torch::kLong);
+}
+
+void MaskScores(Tensor scores, const AttentionMask& mask) {
+  CHECK_GE(scores.dim(), 3);
+  const int64_t lenK = scores.size(-1);
+  if (mask.key_lengths.defined()) {
+    Tensor lengths = mask.key_lengths.to(scores.device(), torch::kLong);
+    CHECK_EQ(lengths.numel(), scores.size(0));
+    // [B, 1, ..., 1, Lk], 按head和query广播
+    std::vector<int64_t> shape(scores.dim(), 1);
+    shape[0] = scores.size(0);
+    shape.back() = lenK;
+    Tensor keyPad = torch::arange(lenK, lengths.options())
+                        .unsqueeze(0)
+                        .ge(lengths.unsqueeze(1))
+                        .view(shape);
+    scores.masked_fill_(keyPad, -INFINITY);
+  }
+  if (mask.causal) {
+    scores.masked_fill_(CausalMask(scores.size(-2), lenK, scores.device()),
+                        -INFINITY);
+  }
+}
+
+Tensor CausalMask(int64_t len_q, int64_t len_k, torch::Device device) {
+  // 每层每次调用都用同样大小的mask, 只在大小变化时重建
+  thread_local Tensor cached;
+  if (!cached.defined() || cached.size(0) != len_q ||
+      cached.size(1) != len_k || cached.device() != device) {
+    torch::NoGradGuard guard;
+    cached = torch::ones({len_q, len_k}, torch::TensorOptions().device(device))
+                 .triu(1)
+                 .to(torch::kBool);
+  }
+  return cached;
+}
+
+}  // namespace radish
@@ -0,0 +1,46 @@
+/*
+ * File: attention_mask.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 2:51:37
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include "torch/types.h"
+
+namespace radish {
+using Tensor = ::torch::Tensor;
+
+/**
+ * 紧凑的attention mask, 代替 [B, Lq, Lk] 的bool mask:
+ * 每个序列的key长度(pad都在末尾) 加上是否因果, 大小是O(B).
+ * 分块kernel里直接跳过被mask的key块, 普通实现在softmax之前
+ * 用可广播的mask原地填-inf, 也不生成 B*H*L*L 的mask.
+ */
+struct AttentionMask {
+  // [B] int64, 序列b只attend前 key_lengths[b] 个key, 为空表示不限制
+  Tensor key_lengths;
+  // query i 只attend j <= i 的key
+  bool causal = false;
+  // 不补齐的打包输入时各序列的起点 [B+1], 见 layers/unpad.h
+  Tensor cu_seqlens;
+
+  AttentionMask() = default;
+  explicit AttentionMask(Tensor keyLengths, bool isCausal = false)
+      : key_lengths(keyLengths), causal(isCausal) {}
+};
+
+// pad id 为0的 [B, L] 序列的长度, int64 [B]
+Tensor SequenceLengths(const Tensor& seq);
+
+// scores [B, ..., Lq, Lk], 被mask的位置原地置为-inf
+void MaskScores(Tensor scores, const AttentionMask& mask);
+
+// [Lq, Lk] 的bool上三角(不含对角线), 按大小和设备缓存
+Tensor CausalMask(int64_t len_q, int64_t len_k, torch::Device device);
+
+}  // namespace radish
@@ -0,0 +1,359 @@
+/*
+ * File: flash_attention.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 6:02:45
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/layers/flash_attention.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "ATen/Parallel.h"
+#include "torch/csrc/autograd/custom_function.h"
+#include "torch/torch.h"
+
+#include "radish/layers/flash_attention_kernel.h"
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace {
+using torch::autograd::AutogradContext;
+using torch::autograd::Variable;
+using torch::autograd::variable_list;
+
+typedef void (*RangeFn)(const flash::FlashArgs&, int64_t, int64_t);
+struct Kernels {
+  const char* isa;
+  RangeFn forward;
+  RangeFn backward;
+};
+
+const Kernels& GetKernels() {
+  static const Kernels kernels = []() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return Kernels{"avx512", flash::avx512::ForwardRange,
+                     flash::avx512::BackwardRange};
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return Kernels{"avx2", flash::avx2::ForwardRange,
+                     flash::avx2::BackwardRange};
+    }
+    return Kernels{"scalar", flash::scalar::ForwardRange,
+                   flash::scalar::BackwardRange};
+  }();
+  return kernels;
+}
+
+Tensor LastDimContiguous(const Tensor& t) {
+  return t.stride(-1) == 1 ? t : t.contiguous();
+}
+
+void CopyStrides(const Tensor& t, int64_t n, int64_t* strides) {
+  for (int64_t i = 0; i < n; i++) {
+    strides[i] = t.stride(i);
+  }
+}
+
+// 广播成 [B, H, Lq, Lk] 的view, 不拷贝
+Tensor Broadcast(Tensor t, torch::IntArrayRef sizes) {
+  while (t.dim() < 4) {
+    t = t.unsqueeze(0);
+  }
+  return t.expand(sizes);
+}
+
+// 除了out/lse和反向的梯度以外的参数
+flash::FlashArgs MakeArgs(const Tensor& q, const Tensor& k, const Tensor& v,
+                          const Tensor& bias, const Tensor& mask,
+                          const Tensor& keyLengths, bool causal,
+                          double scale, double dropout, int64_t seed) {
+  flash::FlashArgs args;
+  args.batch = q.size(0);
+  args.heads = q.size(1);
+  args.len_q = q.size(2);
+  args.len_k = k.size(2);
+  args.dim = q.size(3);
+  args.dim_v = v.size(3);
+  args.scale = scale;
+  args.dropout = dropout;
+  args.seed = static_cast<uint64_t>(seed);
+  args.q = q.data_ptr<float>();
+  CopyStrides(q, 3, args.q_stride);
+  args.k = k.data_ptr<float>();
+  CopyStrides(k, 3, args.k_stride);
+  args.v = v.data_ptr<float>();
+  CopyStrides(v, 3, args.v_stride);
+  if (bias.defined()) {
+    args.bias = bias.data_ptr<float>();
+    CopyStrides(bias, 4, args.bias_stride);
+  }
+  if (mask.defined()) {
+    args.mask = mask.data_ptr<bool>();
+    CopyStrides(mask, 4, args.mask_stride);
+  }
+  if (keyLengths.defined()) {
+    args.key_lengths = keyLengths.data_ptr<int64_t>();
+  }
+  args.causal = causal;
+  return args;
+}
+
+// 打包的 [T, H, D]: 按 (batch, head, 位置) 给步长, batch维不用
+void PackedStrides(const Tensor& t, int64_t* strides) {
+  strides[0] = 0;
+  strides[1] = t.stride(1);
+  strides[2] = t.stride(0);
+}
+
+flash::FlashArgs MakeVarlenArgs(const Tensor& q, const Tensor& k,
+                                const Tensor& v, const Tensor& cuSeqlens,
+                                double scale, double dropout, int64_t seed) {
+  flash::FlashArgs args;
+  const int64_t* cu = cuSeqlens.data_ptr<int64_t>();
+  args.batch = cuSeqlens.numel() - 1;
+  args.heads = q.size(1);
+  for (int64_t b = 0; b < args.batch; b++) {
+    args.len_q = std::max(args.len_q, cu[b + 1] - cu[b]);
+  }
+  args.len_k = args.len_q;
+  args.dim = q.size(2);
+  args.dim_v = v.size(2);
+  args.scale = scale;
+  args.dropout = dropout;
+  args.seed = static_cast<uint64_t>(seed);
+  args.cu_seqlens = cu;
+  args.q = q.data_ptr<float>();
+  PackedStrides(q, args.q_stride);
+  args.k = k.data_ptr<float>();
+  PackedStrides(k, args.k_stride);
+  args.v = v.data_ptr<float>();
+  PackedStrides(v, args.v_stride);
+  return args;
+}
+
+class FlashAttentionFunction
+    : public torch::autograd::Function<FlashAttentionFunction> {
+ public:
+  static Variable forward(AutogradContext* ctx, Variable q, Variable k,
+                          Variable v, Variable bias, Variable mask,
+                          Variable keyLengths, bool causal, double scale,
+                          double dropout, int64_t seed) {
+    Tensor qc = LastDimContiguous(q);
+    Tensor kc = LastDimContiguous(k);
+    Tensor vc = LastDimContiguous(v);
+    const int64_t batch = qc.size(0);
+    const int64_t heads = qc.size(1);
+    const int64_t lenQ = qc.size(2);
+    std::vector<int64_t> scoreSizes = {batch, heads, lenQ, kc.size(2)};
+    Tensor biasc;
+    if (bias.defined()) {
+      biasc = Broadcast(bias.to(torch::kFloat), scoreSizes);
+    }
+    Tensor maskc;
+    if (mask.defined()) {
+      maskc = Broadcast(mask.to(torch::kBool), scoreSizes);
+    }
+    Tensor lengths;
+    if (keyLengths.defined()) {
+      CHECK_EQ(keyLengths.numel(), batch);
+      lengths = keyLengths.to(torch::kCPU, torch::kLong).contiguous();
+    }
+    Tensor out = torch::empty({batch, lenQ, heads, vc.size(3)}, qc.options());
+    Tensor lse = torch::empty({batch, heads, lenQ}, qc.options());
+    flash::FlashArgs args = MakeArgs(qc, kc, vc, biasc, maskc, lengths, causal,
+                                     scale, dropout, seed);
+    args.out = out.data_ptr<float>();
+    // out 的 (batch, head, 位置) 步长
+    args.out_stride[0] = out.stride(0);
+    args.out_stride[1] = out.stride(2);
+    args.out_stride[2] = out.stride(1);
+    args.lse = lse.data_ptr<float>();
+    const Kernels& kernels = GetKernels();
+    at::parallel_for(0, flash::ForwardTasks(args), 1,
+                     [&](int64_t begin, int64_t end) {
+                       kernels.forward(args, begin, end);
+                     });
+    ctx->save_for_backward({qc, kc, vc, biasc, maskc, lengths, out, lse});
+    ctx->saved_data["causal"] = causal;
+    ctx->saved_data["scale"] = scale;
+    ctx->saved_data["dropout"] = dropout;
+    ctx->saved_data["seed"] = seed;
+    return out;
+  }
+
+  static variable_list backward(AutogradContext* ctx, variable_list grads) {
+    auto saved = ctx->get_saved_variables();
+    Tensor q = saved[0];
+    Tensor k = saved[1];
+    Tensor v = saved[2];
+    Tensor out = saved[6];
+    Tensor lse = saved[7];
+    flash::FlashArgs args =
+        MakeArgs(q, k, v, saved[3], saved[4], saved[5],
+                 ctx->saved_data["causal"].toBool(),
+                 ctx->saved_data["scale"].toDouble(),
+                 ctx->saved_data["dropout"].toDouble(),
+                 ctx->saved_data["seed"].toInt());
+    args.out = out.data_ptr<float>();
+    args.out_stride[0] = out.stride(0);
+    args.out_stride[1] = out.stride(2);
+    args.out_stride[2] = out.stride(1);
+    args.lse = lse.data_ptr<float>();
+    Tensor dout = grads[0].contiguous();
+    args.dout = dout.data_ptr<float>();
+    args.dout_stride[0] = dout.stride(0);
+    args.dout_stride[1] = dout.stride(2);
+    args.dout_stride[2] = dout.stride(1);
+    Tensor dq = torch::zeros(q.sizes(), q.options());
+    Tensor dk = torch::zeros(k.sizes(), k.options());
+    Tensor dv = torch::zeros(v.sizes(), v.options());
+    args.dq = dq.data_ptr<float>();
+    CopyStrides(dq, 3, args.dq_stride);
+    args.dk = dk.data_ptr<float>();
+    CopyStrides(dk, 3, args.dk_stride);
+    args.dv = dv.data_ptr<float>();
+    CopyStrides(dv, 3, args.dv_stride);
+    const Kernels& kernels = GetKernels();
+    at::parallel_for(0, flash::BackwardTasks(args), 1,
+                     [&](int64_t begin, int64_t end) {
+                       kernels.backward(args, begin, end);
+                     });
+    // bias/mask 不求梯度, 非tensor参数也要占位
+    return {dq,         dk,         dv,         Variable(), Variable(),
+            Variable(), Variable(), Variable(), Variable(), Variable()};
+  }
+};
+
+class FlashAttentionVarlenFunction
+    : public torch::autograd::Function<FlashAttentionVarlenFunction> {
+ public:
+  static Variable forward(AutogradContext* ctx, Variable q, Variable k,
+                          Variable v, Variable cuSeqlens, double scale,
+                          double dropout, int64_t seed) {
+    Tensor qc = LastDimContiguous(q);
+    Tensor kc = LastDimContiguous(k);
+    Tensor vc = LastDimContiguous(v);
+    Tensor cu = cuSeqlens.to(torch::kLong).contiguous();
+    flash::FlashArgs args =
+        MakeVarlenArgs(qc, kc, vc, cu, scale, dropout, seed);
+    Tensor out = torch::empty({qc.size(0), args.heads, args.dim_v},
+                              qc.options());
+    Tensor lse =
+        torch::empty({args.batch, args.heads, args.len_q}, qc.options());
+    args.out = out.data_ptr<float>();
+    PackedStrides(out, args.out_stride);
+    args.lse = lse.data_ptr<float>();
+    const Kernels& kernels = GetKernels();
+    at::parallel_for(0, flash::ForwardTasks(args), 1,
+                     [&](int64_t begin, int64_t end) {
+                       kernels.forward(args, begin, end);
+                     });
+    ctx->save_for_backward({qc, kc, vc, cu, out, lse});
+    ctx->saved_data["scale"] = scale;
+    ctx->saved_data["dropout"] = dropout;
+    ctx->saved_data["seed"] = seed;
+    return out;
+  }
+
+  static variable_list backward(AutogradContext* ctx, variable_list grads) {
+    auto saved = ctx->get_saved_variables();
+    Tensor q = saved[0];
+    Tensor k = saved[1];
+    Tensor v = saved[2];
+    Tensor out = saved[4];
+    Tensor lse = saved[5];
+    flash::FlashArgs args =
+        MakeVarlenArgs(q, k, v, saved[3], ctx->saved_data["scale"].toDouble(),
+                       ctx->saved_data["dropout"].toDouble(),
+                       ctx->saved_data["seed"].toInt());
+    args.out = out.data_ptr<float>();
+    PackedStrides(out, args.out_stride);
+    args.lse = lse.data_ptr<float>();
+    Tensor dout = grads[0].contiguous();
+    args.dout = dout.data_ptr<float>();
+    PackedStrides(dout, args.dout_stride);
+    Tensor dq = torch::zeros(q.sizes(), q.options());
+    Tensor dk = torch::zeros(k.sizes(), k.options());
+    Tensor dv = torch::zeros(v.sizes(), v.options());
+    args.dq = dq.data_ptr<float>();
+    PackedStrides(dq, args.dq_stride);
+    args.dk = dk.data_ptr<float>();
+    PackedStrides(dk, args.dk_stride);
+    args.dv = dv.data_ptr<float>();
+    PackedStrides(dv, args.dv_stride);
+    const Kernels& kernels = GetKernels();
+    at::parallel_for(0, flash::BackwardTasks(args), 1,
+                     [&](int64_t begin, int64_t end) {
+                       kernels.backward(args, begin, end);
+                     });
+    return {dq, dk, dv, Variable(), Variable(), Variable(), Variable()};
+  }
+};
+
+// Function::apply 只把Variable类型的参数当作输入
+Variable AsVariable(Tensor t) { return torch::autograd::as_variable_ref(t); }
+
+// 不训练时dropout置0, 需要dropout时返回一个新的种子
+int64_t DropoutSeed(double* dropout, bool training) {
+  if (!training) {
+    *dropout = 0;
+  }
+  CHECK(*dropout >= 0 && *dropout < 1) << "bad attention dropout:" << *dropout;
+  if (*dropout == 0) {
+    return 0;
+  }
+  return torch::randint(std::numeric_limits<int64_t>::max(), {1}, torch::kLong)
+      .item<int64_t>();
+}
+
+}  // namespace
+
+bool FlashAttentionAvailable(const Tensor& q) {
+  return q.defined() && q.device().is_cpu() &&
+         q.scalar_type() == torch::kFloat;
+}
+
+const char* FlashAttentionIsa() { return GetKernels().isa; }
+
+Tensor FlashAttention(const Tensor& q, const Tensor& k, const Tensor& v,
+                      const Tensor& bias, const Tensor& mask, double scale,
+                      double dropout, bool training,
+                      const Tensor& key_lengths, bool causal) {
+  CHECK(FlashAttentionAvailable(q)) << "flash attention needs cpu float32";
+  CHECK_EQ(q.dim(), 4);
+  CHECK_EQ(k.dim(), 4);
+  CHECK_EQ(v.dim(), 4);
+  CHECK_EQ(q.size(3), k.size(3));
+  CHECK_EQ(k.size(2), v.size(2));
+  int64_t seed = DropoutSeed(&dropout, training);
+  Tensor out = FlashAttentionFunction::apply(
+      AsVariable(q), AsVariable(k), AsVariable(v), AsVariable(bias),
+      AsVariable(mask), AsVariable(key_lengths), causal, scale, dropout, seed);
+  return out.permute({0, 2, 1, 3});
+}
+
+Tensor FlashAttentionVarlen(const Tensor& q, const Tensor& k, const Tensor& v,
+                            const Tensor& cu_seqlens, double scale,
+                            double dropout, bool training) {
+  CHECK(FlashAttentionAvailable(q)) << "flash attention needs cpu float32";
+  CHECK_EQ(q.dim(), 3);
+  CHECK_EQ(q.sizes(), k.sizes());
+  CHECK_EQ(k.size(0), v.size(0));
+  CHECK_EQ(k.size(1), v.size(1));
+  CHECK(cu_seqlens.device().is_cpu() && cu_seqlens.dim() == 1 &&
+        cu_seqlens.numel() >= 2)
+      << "cu_seqlens should be a cpu tensor of batch+1 offsets";
+  int64_t seed = DropoutSeed(&dropout, training);
+  return FlashAttentionVarlenFunction::apply(
+      AsVariable(q), AsVariable(k), AsVariable(v), AsVariable(cu_seqlens),
+      scale, dropout, seed);
+}
+
+}  // namespace radish
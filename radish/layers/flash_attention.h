@@ -0,0 +1,55 @@
+/*
+ * File: flash_attention.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 5:16:33
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include "torch/types.h"
+
+namespace radish {
+using Tensor = ::torch::Tensor;
+
+/**
+ * 分块(flash式)的 dropout(softmax(q k^T * scale + bias, mask)) v,
+ * 按块在线softmax, 不生成 L*L 的分数矩阵; 反向按块重算分数,
+ * 只多存每行一个log-sum-exp. 按CPU支持的指令集选AVX-512/AVX2/标量kernel.
+ *
+ * q [B, H, Lq, D], k [B, H, Lk, D], v [B, H, Lk, Dv], 可以是任意步长的view
+ * (最后一维不连续时会拷贝). bias 是加到分数上的float, mask 是bool,
+ * true的位置不参与attention, 两者都可以为空, 都按广播规则对齐到
+ * [B, H, Lq, Lk], 比如BERT的 [B, 1, 1, Lk]. 整行都被mask时输出0.
+ * dropout 只在 training 时生效, 不存mask, 反向用同一个种子重算.
+ * 紧凑的mask: key_lengths [B] 表示序列b只attend前 key_lengths[b] 个key,
+ * causal 时query i 只attend j <= i 的key, 两者在kernel里直接跳过被mask的块,
+ * 不需要任何 L*L 的mask.
+ * 返回 [B, H, Lq, Dv], 它是 [B, Lq, H, Dv] 连续tensor的view,
+ * permute(0, 2, 1, 3) 之后可以直接view成 [B, Lq, H*Dv].
+ */
+Tensor FlashAttention(const Tensor& q, const Tensor& k, const Tensor& v,
+                      const Tensor& bias, const Tensor& mask, double scale,
+                      double dropout = 0, bool training = false,
+                      const Tensor& key_lengths = {}, bool causal = false);
+
+/**
+ * 不补齐的变长自注意力: 各序列的token打包成 q/k/v [T, H, D] (可以是
+ * qkv投影 [T, 3, H, D] 的select, 最后一维连续即可), 序列b占
+ * [cu_seqlens[b], cu_seqlens[b+1]) 行, attention只在序列内部计算.
+ * cu_seqlens 是CPU上的int64 [B+1]. 返回 [T, H, Dv] 连续的tensor
+ */
+Tensor FlashAttentionVarlen(const Tensor& q, const Tensor& k, const Tensor& v,
+                            const Tensor& cu_seqlens, double scale,
+                            double dropout = 0, bool training = false);
+
+// 只支持CPU上的float32, 其他情况调用方走原来的实现
+bool FlashAttentionAvailable(const Tensor& q);
+
+// 当前机器选中的kernel: "avx512", "avx2" 或 "scalar"
+const char* FlashAttentionIsa();
+
+}  // namespace radish
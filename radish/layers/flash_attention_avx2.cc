@@ -0,0 +1,13 @@
+/*
+ * File: flash_attention_avx2.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 4:40:12
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+// 用 -mavx2 -mfma 编译
+#define RADISH_FLASH_ISA avx2
+#include "radish/layers/flash_attention_kernel_impl.h"
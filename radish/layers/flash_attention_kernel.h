@@ -0,0 +1,98 @@
+/*
+ * File: flash_attention_kernel.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 10:42:16
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include <cstdint>
+
+namespace radish {
+namespace flash {
+
+// 分块的大小, 一个分数块 kBlockQ*kBlockK 个float, 放得进L2
+constexpr int64_t kBlockQ = 64;
+constexpr int64_t kBlockK = 128;
+
+/**
+ * 分块attention的参数, 全是裸指针和步长, 不依赖ATen,
+ * 这样各指令集版本的kernel可以用不同的编译选项单独编译.
+ * q/k/v/out/dout/dq/dk/dv 的步长按 (batch, head, 位置) 给出, 最后一维连续;
+ * bias/mask 的步长按 (batch, head, i, j), 广播的维度步长为0, 指针可以为空.
+ * cu_seqlens 不为空时是不补齐的变长自注意力: 序列b是打包行里的
+ * [cu_seqlens[b], cu_seqlens[b+1]), batch维的步长不用,
+ * len_q/len_k 是最长序列的长度, 不支持bias/mask.
+ * 紧凑的mask: key_lengths 不为空时序列b只attend前 key_lengths[b] 个key,
+ * causal 时query i 只attend j <= i 的key, 都不需要 L*L 的mask, 被mask的
+ * key块直接跳过
+ */
+struct FlashArgs {
+  int64_t batch = 0;
+  int64_t heads = 0;
+  int64_t len_q = 0;
+  int64_t len_k = 0;
+  int64_t dim = 0;
+  int64_t dim_v = 0;
+  float scale = 1.0f;
+  float dropout = 0;
+  uint64_t seed = 0;
+
+  const float* q = nullptr;
+  int64_t q_stride[3] = {0, 0, 0};
+  const float* k = nullptr;
+  int64_t k_stride[3] = {0, 0, 0};
+  const float* v = nullptr;
+  int64_t v_stride[3] = {0, 0, 0};
+  const float* bias = nullptr;
+  int64_t bias_stride[4] = {0, 0, 0, 0};
+  const bool* mask = nullptr;
+  int64_t mask_stride[4] = {0, 0, 0, 0};
+  const int64_t* cu_seqlens = nullptr;
+  const int64_t* key_lengths = nullptr;
+  bool causal = false;
+
+  // 前向的输出, 以及每行softmax的log-sum-exp([batch, head, len_q]连续,
+  // 变长时按最长序列补齐)
+  float* out = nullptr;
+  int64_t out_stride[3] = {0, 0, 0};
+  float* lse = nullptr;
+
+  // 反向: dout 输入, dq/dk/dv 输出(调用方清零)
+  const float* dout = nullptr;
+  int64_t dout_stride[3] = {0, 0, 0};
+  float* dq = nullptr;
+  int64_t dq_stride[3] = {0, 0, 0};
+  float* dk = nullptr;
+  int64_t dk_stride[3] = {0, 0, 0};
+  float* dv = nullptr;
+  int64_t dv_stride[3] = {0, 0, 0};
+};
+
+// 前向的任务数: 每个(batch, head, query块)一个
+inline int64_t ForwardTasks(const FlashArgs& args) {
+  return args.batch * args.heads * ((args.len_q + kBlockQ - 1) / kBlockQ);
+}
+
+// 反向的任务数: 每个(batch, head)一个, 同一个head的dk/dv只由一个线程写
+inline int64_t BackwardTasks(const FlashArgs& args) {
+  return args.batch * args.heads;
+}
+
+// 各指令集的实现, 处理编号在 [begin, end) 的任务
+#define RADISH_FLASH_DECLARE(isa)                                       \
+  namespace isa {                                                       \
+  void ForwardRange(const FlashArgs& args, int64_t begin, int64_t end); \
+  void BackwardRange(const FlashArgs& args, int64_t begin, int64_t end); \
+  }
+RADISH_FLASH_DECLARE(avx512)
+RADISH_FLASH_DECLARE(avx2)
+RADISH_FLASH_DECLARE(scalar)
+#undef RADISH_FLASH_DECLARE
+
+}  // namespace flash
+}  // namespace radish
@@ -0,0 +1,460 @@
+/*
+ * File: flash_attention_kernel_impl.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 4:27:51
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+// 不加 #pragma once: 每个指令集的.cc定义 RADISH_FLASH_ISA 后各包含一次,
+// 用各自的编译选项(-mavx512f / -mavx2 -mfma / 无)编译成不同的namespace.
+// 只依赖标准库和intrinsics, 不包含ATen的头文件, 避免不同编译选项下的
+// inline函数违反ODR.
+#ifndef RADISH_FLASH_ISA
+#error "define RADISH_FLASH_ISA before including flash_attention_kernel_impl.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "radish/layers/flash_attention_kernel.h"
+
+namespace radish {
+namespace flash {
+namespace RADISH_FLASH_ISA {
+namespace {
+
+#if defined(__AVX512F__)
+constexpr int64_t kWidth = 16;
+typedef __m512 Vec;
+inline Vec Load(const float* p) { return _mm512_loadu_ps(p); }
+inline void Store(float* p, Vec v) { _mm512_storeu_ps(p, v); }
+inline Vec Set1(float x) { return _mm512_set1_ps(x); }
+inline Vec Add(Vec a, Vec b) { return _mm512_add_ps(a, b); }
+inline Vec Mul(Vec a, Vec b) { return _mm512_mul_ps(a, b); }
+inline Vec Fma(Vec a, Vec b, Vec c) { return _mm512_fmadd_ps(a, b, c); }
+inline Vec Max(Vec a, Vec b) { return _mm512_max_ps(a, b); }
+inline Vec Min(Vec a, Vec b) { return _mm512_min_ps(a, b); }
+inline float ReduceAdd(Vec v) { return _mm512_reduce_add_ps(v); }
+inline float ReduceMax(Vec v) { return _mm512_reduce_max_ps(v); }
+inline Vec Floor(Vec v) {
+  return _mm512_roundscale_ps(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+// n是整数值的float, 返回2^n
+inline Vec Pow2n(Vec n) {
+  __m512i e =
+      _mm512_add_epi32(_mm512_cvttps_epi32(n), _mm512_set1_epi32(127));
+  return _mm512_castsi512_ps(_mm512_slli_epi32(e, 23));
+}
+// x < t (含NaN) 的位置置0
+inline Vec ZeroBelow(Vec y, Vec x, float t) {
+  return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, Set1(t), _CMP_GE_OQ), y);
+}
+#elif defined(__AVX2__)
+constexpr int64_t kWidth = 8;
+typedef __m256 Vec;
+inline Vec Load(const float* p) { return _mm256_loadu_ps(p); }
+inline void Store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+inline Vec Set1(float x) { return _mm256_set1_ps(x); }
+inline Vec Add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+inline Vec Mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+inline Vec Fma(Vec a, Vec b, Vec c) { return _mm256_fmadd_ps(a, b, c); }
+inline Vec Max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+inline Vec Min(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+inline float ReduceAdd(Vec v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_hadd_ps(s, s);
+  s = _mm_hadd_ps(s, s);
+  return _mm_cvtss_f32(s);
+}
+inline float ReduceMax(Vec v) {
+  __m128 s = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_max_ps(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+inline Vec Floor(Vec v) { return _mm256_floor_ps(v); }
+inline Vec Pow2n(Vec n) {
+  __m256i e =
+      _mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+}
+inline Vec ZeroBelow(Vec y, Vec x, float t) {
+  return _mm256_and_ps(y, _mm256_cmp_ps(x, Set1(t), _CMP_GE_OQ));
+}
+#else
+constexpr int64_t kWidth = 1;
+typedef float Vec;
+inline Vec Load(const float* p) { return *p; }
+inline void Store(float* p, Vec v) { *p = v; }
+inline Vec Set1(float x) { return x; }
+inline Vec Add(Vec a, Vec b) { return a + b; }
+inline Vec Fma(Vec a, Vec b, Vec c) { return a * b + c; }
+inline Vec Max(Vec a, Vec b) { return std::max(a, b); }
+inline float ReduceAdd(Vec v) { return v; }
+inline float ReduceMax(Vec v) { return v; }
+#endif
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+constexpr float kExpLow = -87.3f;
+// Cephes expf 的多项式近似, 相对误差约1e-7, 低于kExpLow的返回0
+inline Vec Exp(Vec x) {
+  Vec in = x;
+  x = Min(Max(x, Set1(kExpLow)), Set1(88.3f));
+  Vec fx = Floor(Fma(x, Set1(1.44269504088896341f), Set1(0.5f)));
+  x = Fma(fx, Set1(-0.693359375f), x);
+  x = Fma(fx, Set1(2.12194440e-4f), x);
+  Vec z = Mul(x, x);
+  Vec y = Set1(1.9875691500E-4f);
+  y = Fma(y, x, Set1(1.3981999507E-3f));
+  y = Fma(y, x, Set1(8.3334519073E-3f));
+  y = Fma(y, x, Set1(4.1665795894E-2f));
+  y = Fma(y, x, Set1(1.6666665459E-1f));
+  y = Fma(y, x, Set1(5.0000001201E-1f));
+  y = Fma(y, z, Add(x, Set1(1.0f)));
+  return ZeroBelow(Mul(y, Pow2n(fx)), in, kExpLow);
+}
+#else
+inline Vec Exp(Vec x) { return std::exp(x); }
+#endif
+
+constexpr float kNegInf = -std::numeric_limits<float>::infinity();
+
+inline float Dot(const float* a, const float* b, int64_t n) {
+  Vec acc0 = Set1(0);
+  Vec acc1 = Set1(0);
+  int64_t i = 0;
+  for (; i + 2 * kWidth <= n; i += 2 * kWidth) {
+    acc0 = Fma(Load(a + i), Load(b + i), acc0);
+    acc1 = Fma(Load(a + i + kWidth), Load(b + i + kWidth), acc1);
+  }
+  for (; i + kWidth <= n; i += kWidth) {
+    acc0 = Fma(Load(a + i), Load(b + i), acc0);
+  }
+  float s = ReduceAdd(Add(acc0, acc1));
+  for (; i < n; i++) {
+    s += a[i] * b[i];
+  }
+  return s;
+}
+
+// y += alpha * x
+inline void Axpy(int64_t n, float alpha, const float* x, float* y) {
+  Vec va = Set1(alpha);
+  int64_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    Store(y + i, Fma(va, Load(x + i), Load(y + i)));
+  }
+  for (; i < n; i++) {
+    y[i] += alpha * x[i];
+  }
+}
+
+// y *= alpha
+inline void Scal(int64_t n, float alpha, float* y) {
+  Vec va = Set1(alpha);
+  Vec zero = Set1(0);
+  int64_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    Store(y + i, Fma(va, Load(y + i), zero));
+  }
+  for (; i < n; i++) {
+    y[i] *= alpha;
+  }
+}
+
+inline float RowMax(const float* x, int64_t n) {
+  float m = kNegInf;
+  int64_t i = 0;
+  if (n >= kWidth) {
+    Vec vm = Load(x);
+    for (i = kWidth; i + kWidth <= n; i += kWidth) {
+      vm = Max(vm, Load(x + i));
+    }
+    m = ReduceMax(vm);
+  }
+  for (; i < n; i++) {
+    m = std::max(m, x[i]);
+  }
+  return m;
+}
+
+// x = exp(x - m), 返回新的和
+inline float ExpSub(float* x, int64_t n, float m) {
+  Vec vm = Set1(-m);
+  Vec sum = Set1(0);
+  int64_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    Vec e = Exp(Add(Load(x + i), vm));
+    Store(x + i, e);
+    sum = Add(sum, e);
+  }
+  float s = ReduceAdd(sum);
+  for (; i < n; i++) {
+    x[i] = std::exp(x[i] - m);
+    s += x[i];
+  }
+  return s;
+}
+
+/**
+ * attention dropout 不存mask: 按 (seed, 元素编号) 做hash,
+ * 前向和反向重算时得到同样的结果
+ */
+inline bool Keep(uint64_t seed, uint64_t index, uint64_t threshold) {
+  uint64_t z = seed + index * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (z >> 32) >= threshold;
+}
+
+struct Head {
+  int64_t b;
+  int64_t h;
+  // 在打包行里的起点, 补齐的输入为0
+  int64_t start;
+  int64_t len_q;
+  int64_t len_k;
+  const float* q;
+  const float* k;
+  const float* v;
+};
+
+// (batch, head, 起点) 在按 stride 排布的tensor里的偏移
+inline int64_t Offset(const Head& head, const int64_t* stride) {
+  return head.b * stride[0] + head.h * stride[1] + head.start * stride[2];
+}
+
+inline Head GetHead(const FlashArgs& a, int64_t bh) {
+  Head head;
+  head.b = bh / a.heads;
+  head.h = bh % a.heads;
+  if (a.cu_seqlens != nullptr) {
+    head.start = a.cu_seqlens[head.b];
+    head.len_q = a.cu_seqlens[head.b + 1] - head.start;
+    head.len_k = head.len_q;
+  } else {
+    head.start = 0;
+    head.len_q = a.len_q;
+    head.len_k = a.len_k;
+  }
+  if (a.key_lengths != nullptr) {
+    head.len_k = std::min(head.len_k, a.key_lengths[head.b]);
+  }
+  head.q = a.q + Offset(head, a.q_stride);
+  head.k = a.k + Offset(head, a.k_stride);
+  head.v = a.v + Offset(head, a.v_stride);
+  return head;
+}
+
+// query块 [i0, i0+rows) 需要扫描的key范围 [0, 返回值)
+inline int64_t KeyEnd(const FlashArgs& a, const Head& head, int64_t i0,
+                      int64_t rows) {
+  return a.causal ? std::min(head.len_k, i0 + rows) : head.len_k;
+}
+
+// s[r, c] = scale * q[i0+r] . k[j0+c] + bias, 被mask的位置为-inf
+void Scores(const FlashArgs& a, const Head& head, int64_t i0, int64_t rows,
+            int64_t j0, int64_t cols, float* s) {
+  for (int64_t r = 0; r < rows; r++) {
+    const float* qi = head.q + (i0 + r) * a.q_stride[2];
+    float* row = s + r * cols;
+    // causal时对角线右边的key不用算
+    const int64_t valid =
+        a.causal ? std::min(std::max<int64_t>(i0 + r + 1 - j0, 0), cols)
+                 : cols;
+    std::fill(row + valid, row + cols, kNegInf);
+    for (int64_t c = 0; c < valid; c++) {
+      row[c] = a.scale * Dot(qi, head.k + (j0 + c) * a.k_stride[2], a.dim);
+    }
+    if (a.bias != nullptr) {
+      const float* bp = a.bias + head.b * a.bias_stride[0] +
+                        head.h * a.bias_stride[1] +
+                        (i0 + r) * a.bias_stride[2] + j0 * a.bias_stride[3];
+      for (int64_t c = 0; c < valid; c++) {
+        row[c] += bp[c * a.bias_stride[3]];
+      }
+    }
+    if (a.mask != nullptr) {
+      const bool* mp = a.mask + head.b * a.mask_stride[0] +
+                       head.h * a.mask_stride[1] +
+                       (i0 + r) * a.mask_stride[2] + j0 * a.mask_stride[3];
+      for (int64_t c = 0; c < valid; c++) {
+        if (mp[c * a.mask_stride[3]]) {
+          row[c] = kNegInf;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * 一个(batch, head, query块)的前向: 按key块扫描, 在线softmax,
+ * 维护每行的最大值m和指数和l, 输出行随m的变化重新缩放.
+ * 分数块只有 kBlockQ*kBlockK, 不生成 L*L 的矩阵
+ */
+void ForwardTask(const FlashArgs& a, int64_t task, float* s) {
+  const int64_t qBlocks = (a.len_q + kBlockQ - 1) / kBlockQ;
+  const Head head = GetHead(a, task / qBlocks);
+  const int64_t i0 = (task % qBlocks) * kBlockQ;
+  if (i0 >= head.len_q) {
+    return;
+  }
+  const int64_t rows = std::min(kBlockQ, head.len_q - i0);
+  const int64_t bh = head.b * a.heads + head.h;
+  float* out = a.out + Offset(head, a.out_stride);
+  float* lse = a.lse + bh * a.len_q;
+  const uint64_t threshold = static_cast<uint64_t>(a.dropout * 4294967296.0);
+  const float keepScale = a.dropout > 0 ? 1.0f / (1.0f - a.dropout) : 1.0f;
+  float m[kBlockQ];
+  float l[kBlockQ];
+  for (int64_t r = 0; r < rows; r++) {
+    m[r] = kNegInf;
+    l[r] = 0;
+    std::fill_n(out + (i0 + r) * a.out_stride[2], a.dim_v, 0.0f);
+  }
+  const int64_t keyEnd = KeyEnd(a, head, i0, rows);
+  for (int64_t j0 = 0; j0 < keyEnd; j0 += kBlockK) {
+    const int64_t cols = std::min(kBlockK, keyEnd - j0);
+    Scores(a, head, i0, rows, j0, cols, s);
+    for (int64_t r = 0; r < rows; r++) {
+      float* row = s + r * cols;
+      float mnew = std::max(m[r], RowMax(row, cols));
+      if (mnew == kNegInf) {
+        continue;
+      }
+      float alpha = m[r] == kNegInf ? 0.0f : std::exp(m[r] - mnew);
+      l[r] = l[r] * alpha + ExpSub(row, cols, mnew);
+      m[r] = mnew;
+      float* o = out + (i0 + r) * a.out_stride[2];
+      if (alpha != 1.0f) {
+        Scal(a.dim_v, alpha, o);
+      }
+      if (a.dropout > 0) {
+        uint64_t base = (bh * a.len_q + i0 + r) * a.len_k + j0;
+        for (int64_t c = 0; c < cols; c++) {
+          row[c] = Keep(a.seed, base + c, threshold) ? row[c] * keepScale : 0;
+        }
+      }
+      for (int64_t c = 0; c < cols; c++) {
+        if (row[c] != 0) {
+          Axpy(a.dim_v, row[c], head.v + (j0 + c) * a.v_stride[2], o);
+        }
+      }
+    }
+  }
+  for (int64_t r = 0; r < rows; r++) {
+    float* o = out + (i0 + r) * a.out_stride[2];
+    if (l[r] > 0) {
+      Scal(a.dim_v, 1.0f / l[r], o);
+      lse[i0 + r] = m[r] + std::log(l[r]);
+    } else {
+      // 整行都被mask, 输出0
+      std::fill_n(o, a.dim_v, 0.0f);
+      lse[i0 + r] = kNegInf;
+    }
+  }
+}
+
+/**
+ * 一个(batch, head)的反向, 按块重算分数和概率 P = exp(S - lse):
+ *   dV += (P*Z)^T dO,  dP = dO V^T,  dS = P * (dP*Z - rowsum(dO*O)),
+ *   dQ += scale * dS K,  dK += scale * dS^T Q
+ * Z是dropout的缩放(0或1/(1-p)), 和前向用同样的hash重算
+ */
+void BackwardTask(const FlashArgs& a, int64_t task, float* s, float* dp,
+                  std::vector<float>* dterm) {
+  const Head head = GetHead(a, task);
+  const int64_t bh = task;
+  const float* out = a.out + Offset(head, a.out_stride);
+  const float* dout = a.dout + Offset(head, a.dout_stride);
+  float* dq = a.dq + Offset(head, a.dq_stride);
+  float* dk = a.dk + Offset(head, a.dk_stride);
+  float* dv = a.dv + Offset(head, a.dv_stride);
+  const float* lse = a.lse + bh * a.len_q;
+  const uint64_t threshold = static_cast<uint64_t>(a.dropout * 4294967296.0);
+  const float keepScale = a.dropout > 0 ? 1.0f / (1.0f - a.dropout) : 1.0f;
+  dterm->resize(head.len_q);
+  for (int64_t i = 0; i < head.len_q; i++) {
+    (*dterm)[i] = Dot(dout + i * a.dout_stride[2], out + i * a.out_stride[2],
+                      a.dim_v);
+  }
+  for (int64_t i0 = 0; i0 < head.len_q; i0 += kBlockQ) {
+    const int64_t rows = std::min(kBlockQ, head.len_q - i0);
+    const int64_t keyEnd = KeyEnd(a, head, i0, rows);
+    for (int64_t j0 = 0; j0 < keyEnd; j0 += kBlockK) {
+      const int64_t cols = std::min(kBlockK, keyEnd - j0);
+      Scores(a, head, i0, rows, j0, cols, s);
+      for (int64_t r = 0; r < rows; r++) {
+        float* row = s + r * cols;
+        if (lse[i0 + r] == kNegInf) {
+          std::fill_n(row, cols, 0.0f);
+          continue;
+        }
+        ExpSub(row, cols, lse[i0 + r]);
+        const float* doi = dout + (i0 + r) * a.dout_stride[2];
+        for (int64_t c = 0; c < cols; c++) {
+          dp[r * cols + c] =
+              Dot(doi, head.v + (j0 + c) * a.v_stride[2], a.dim_v);
+        }
+      }
+      for (int64_t r = 0; r < rows; r++) {
+        const int64_t i = i0 + r;
+        const float* qi = head.q + i * a.q_stride[2];
+        const float* doi = dout + i * a.dout_stride[2];
+        float* dqi = dq + i * a.dq_stride[2];
+        uint64_t base = (bh * a.len_q + i) * a.len_k + j0;
+        for (int64_t c = 0; c < cols; c++) {
+          const float p = s[r * cols + c];
+          if (p == 0) {
+            continue;
+          }
+          const int64_t j = j0 + c;
+          float z = 1.0f;
+          if (a.dropout > 0) {
+            z = Keep(a.seed, base + c, threshold) ? keepScale : 0.0f;
+          }
+          if (z != 0) {
+            Axpy(a.dim_v, p * z, doi, dv + j * a.dv_stride[2]);
+          }
+          float ds = a.scale * p * (dp[r * cols + c] * z - (*dterm)[i]);
+          Axpy(a.dim, ds, head.k + j * a.k_stride[2], dqi);
+          Axpy(a.dim, ds, qi, dk + j * a.dk_stride[2]);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+void ForwardRange(const FlashArgs& args, int64_t begin, int64_t end) {
+  std::vector<float> s(kBlockQ * kBlockK);
+  for (int64_t task = begin; task < end; task++) {
+    ForwardTask(args, task, s.data());
+  }
+}
+
+void BackwardRange(const FlashArgs& args, int64_t begin, int64_t end) {
+  std::vector<float> s(kBlockQ * kBlockK);
+  std::vector<float> dp(kBlockQ * kBlockK);
+  std::vector<float> dterm;
+  for (int64_t task = begin; task < end; task++) {
+    BackwardTask(args, task, s.data(), dp.data(), &dterm);
+  }
+}
+
+}  // namespace RADISH_FLASH_ISA
+}  // namespace flash
+}  // namespace radish
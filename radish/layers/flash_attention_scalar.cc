@@ -0,0 +1,13 @@
+/*
+ * File: flash_attention_scalar.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 4:40:12
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+// 不加指令集选项, 没有AVX2的机器上用
+#define RADISH_FLASH_ISA scalar
+#include "radish/layers/flash_attention_kernel_impl.h"
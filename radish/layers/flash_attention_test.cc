@@ -0,0 +1,132 @@
+/*
+ * File: flash_attention_test.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 7:35:20
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "gtest/gtest.h"
+
+#include "torch/torch.h"
+
+#include "radish/layers/flash_attention.h"
+#include "radish/layers/unpad.h"
+
+namespace {
+// 直接算 L*L 分数矩阵的参考实现
+torch::Tensor Reference(torch::Tensor q, torch::Tensor k, torch::Tensor v,
+                        torch::Tensor bias, torch::Tensor mask,
+                        double scale) {
+  torch::Tensor s = torch::matmul(q, k.transpose(-1, -2)) * scale + bias;
+  s = s.masked_fill(mask, -INFINITY);
+  return torch::matmul(torch::softmax(s, -1), v);
+}
+}  // namespace
+
+TEST(FlashAttentionTest, TestMatchesReference) {
+  // 长度不是块大小的整数倍, head_size也不是向量宽度的整数倍
+  const int64_t B = 2, H = 3, Lq = 150, Lk = 201, D = 25;
+  torch::Tensor q = torch::randn({B, H, Lq, D}, torch::requires_grad());
+  torch::Tensor k = torch::randn({B, H, Lk, D}, torch::requires_grad());
+  torch::Tensor v = torch::randn({B, H, Lk, D}, torch::requires_grad());
+  torch::Tensor bias = torch::zeros({B, 1, 1, Lk});
+  bias.narrow(3, 180, Lk - 180).fill_(-10000);
+  torch::Tensor mask =
+      torch::ones({Lq, Lk}, torch::kBool).triu(21).unsqueeze(0);
+  double scale = 1.0 / std::sqrt(D);
+  torch::Tensor grad = torch::randn({B, H, Lq, D});
+
+  torch::Tensor ref = Reference(q, k, v, bias, mask, scale);
+  auto refGrads = torch::autograd::grad({ref}, {q, k, v}, {grad});
+  torch::Tensor out = radish::FlashAttention(q, k, v, bias, mask, scale);
+  auto grads = torch::autograd::grad({out}, {q, k, v}, {grad});
+
+  EXPECT_TRUE(out.allclose(ref, 1e-4, 1e-5));
+  for (size_t i = 0; i < grads.size(); i++) {
+    EXPECT_TRUE(grads[i].allclose(refGrads[i], 1e-3, 1e-4)) << i;
+  }
+}
+
+TEST(FlashAttentionTest, TestDropoutGradient) {
+  // 同一次前向的dropout在反向里重算, 梯度和有限差分一致
+  torch::manual_seed(7);
+  torch::Tensor q = torch::randn({1, 2, 40, 16}, torch::requires_grad());
+  torch::Tensor k = torch::randn({1, 2, 40, 16});
+  torch::Tensor v = torch::randn({1, 2, 40, 16});
+  torch::manual_seed(11);
+  torch::Tensor out =
+      radish::FlashAttention(q, k, v, {}, {}, 0.25, 0.3, /*training*/ true);
+  torch::Tensor dq = torch::autograd::grad({out.sum()}, {q})[0];
+  torch::NoGradGuard guard;
+  const double eps = 1e-2;
+  torch::Tensor qp = q.clone();
+  qp[0][1][5][3] += eps;
+  torch::manual_seed(11);
+  double lp = radish::FlashAttention(qp, k, v, {}, {}, 0.25, 0.3, true)
+                  .sum()
+                  .item<double>();
+  qp[0][1][5][3] -= 2 * eps;
+  torch::manual_seed(11);
+  double lm = radish::FlashAttention(qp, k, v, {}, {}, 0.25, 0.3, true)
+                  .sum()
+                  .item<double>();
+  EXPECT_NEAR((lp - lm) / (2 * eps), dq[0][1][5][3].item<double>(), 1e-2);
+}
+
+TEST(FlashAttentionTest, TestVarlenMatchesPadded) {
+  // 打包后按序列分段算, 和补齐加mask的结果在真实token上一致
+  const int64_t B = 3, L = 90, H = 2, D = 16;
+  torch::Tensor lengths = torch::tensor({37, 1, 90}, torch::kLong);
+  torch::Tensor keep = torch::arange(L).unsqueeze(0).lt(lengths.unsqueeze(1));
+  torch::Tensor qkv = torch::randn({B, L, 3, H, D}, torch::requires_grad());
+  torch::Tensor keep4 = keep.to(torch::kFloat).view({B, L, 1, 1});
+  torch::Tensor grad = torch::randn({B, L, H, D}) * keep4;
+  double scale = 1.0 / std::sqrt(D);
+
+  auto head = [&](int64_t i) { return qkv.select(2, i).permute({0, 2, 1, 3}); };
+  torch::Tensor padded =
+      radish::FlashAttention(head(0), head(1), head(2), {},
+                             keep.logical_not().view({B, 1, 1, L}), scale)
+          .permute({0, 2, 1, 3});
+  auto refGrad = torch::autograd::grad({padded}, {qkv}, {grad})[0];
+
+  radish::UnpadIndex index = radish::MakeUnpadIndex(keep);
+  torch::Tensor packed = radish::UnpadInput(qkv, index);
+  EXPECT_EQ(packed.size(0), 128);
+  torch::Tensor out = radish::PadOutput(
+      radish::VarlenAttention(packed.select(1, 0), packed.select(1, 1),
+                              packed.select(1, 2), index.cu_seqlens, scale),
+      index);
+  auto outGrad = torch::autograd::grad({out}, {qkv}, {grad})[0];
+
+  EXPECT_TRUE((padded * keep4).allclose(out, 1e-5, 1e-6));
+  EXPECT_TRUE(refGrad.allclose(outGrad, 1e-4, 1e-5));
+}
+
+TEST(FlashAttentionTest, TestCompactMask) {
+  // key长度加因果标记, 和等价的 [B, 1, L, L] mask结果一致
+  const int64_t B = 3, H = 2, L = 150, D = 16;
+  torch::Tensor q = torch::randn({B, H, L, D}, torch::requires_grad());
+  torch::Tensor k = torch::randn({B, H, L, D}, torch::requires_grad());
+  torch::Tensor v = torch::randn({B, H, L, D}, torch::requires_grad());
+  torch::Tensor lengths = torch::tensor({150, 70, 1}, torch::kLong);
+  torch::Tensor grad = torch::randn({B, H, L, D});
+  torch::Tensor keyPad =
+      torch::arange(L).unsqueeze(0).ge(lengths.unsqueeze(1)).view({B, 1, 1, L});
+  torch::Tensor causal = torch::ones({L, L}, torch::kBool).triu(1);
+  torch::Tensor dense = keyPad.__or__(causal);
+
+  torch::Tensor ref = radish::FlashAttention(q, k, v, {}, dense, 0.25);
+  auto refGrads = torch::autograd::grad({ref}, {q, k, v}, {grad});
+  torch::Tensor out =
+      radish::FlashAttention(q, k, v, {}, {}, 0.25, 0, false, lengths, true);
+  auto grads = torch::autograd::grad({out}, {q, k, v}, {grad});
+
+  EXPECT_TRUE(out.allclose(ref, 1e-5, 1e-6));
+  for (size_t i = 0; i < grads.size(); i++) {
+    EXPECT_TRUE(grads[i].allclose(refGrads[i], 1e-4, 1e-5)) << i;
+  }
+}
@@ -0,0 +1,13 @@
+/*
+ * File: int8_gemm_avx2.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 10:21:05
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+// 用 -mavx2 -mfma 编译
+#define RADISH_QGEMM_ISA avx2
+#include "radish/layers/int8_gemm_kernel_impl.h"
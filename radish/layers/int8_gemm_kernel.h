@@ -0,0 +1,103 @@
+/*
+ * File: int8_gemm_kernel.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 9:12:40
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include <cstdint>
+
+namespace radish {
+namespace qgemm {
+
+// 权重按 kBlockN 个输出通道一组打包, 组内每个通道连续放 kGroupK 个k:
+// [n/kBlockN, k/kGroupK, kBlockN, kGroupK], VNNI一次读一组是64字节.
+// k 按 kGroupK, n 按 kBlockN 补0对齐, kernel不处理尾巴
+constexpr int64_t kBlockN = 16;
+constexpr int64_t kGroupK = 4;
+// 一个任务算的输出列数, 两个打包的组
+constexpr int64_t kTaskN = 2 * kBlockN;
+
+inline int64_t AlignK(int64_t k) {
+  return (k + kGroupK - 1) / kGroupK * kGroupK;
+}
+inline int64_t AlignN(int64_t n) {
+  return (n + kBlockN - 1) / kBlockN * kBlockN;
+}
+
+// 按行存的int8权重 w [n, k] 打包进 packed [AlignN(n) * AlignK(k)]
+inline void PackWeight(const int8_t* w, int64_t n, int64_t k,
+                       int8_t* packed) {
+  const int64_t kPad = AlignK(k);
+  for (int64_t r = 0; r < AlignN(n); r++) {
+    int8_t* block = packed + (r / kBlockN) * kBlockN * kPad;
+    for (int64_t i = 0; i < kPad; i++) {
+      block[(i / kGroupK) * kBlockN * kGroupK + (r % kBlockN) * kGroupK +
+            i % kGroupK] = (r < n && i < k) ? w[r * k + i] : 0;
+    }
+  }
+}
+
+/**
+ * C[m, n] = a_scale[m] * b_scale[n] * sum_k A[m, k] * B[n, k] + bias[n].
+ * A 是按行动态量化的激活, 行内连续, 长度 k 已经对齐;
+ * B 是按输出通道量化并用 PackWeight 打包的权重, 都是对称的int8.
+ * b_scale/b_sum/bias 的长度是 AlignN(n), b_sum 是B每行的和, VNNI的
+ * uint8*int8 指令要把激活平移128, 用它补偿. 和 flash_attention_kernel.h
+ * 一样只有裸指针, 各指令集版本用不同的编译选项单独编译
+ */
+struct GemmArgs {
+  int64_t m = 0;
+  int64_t n = 0;
+  int64_t k = 0;
+  const int8_t* a = nullptr;
+  int64_t lda = 0;
+  const float* a_scale = nullptr;
+  const int8_t* b = nullptr;
+  const float* b_scale = nullptr;
+  const int32_t* b_sum = nullptr;
+  // 可以为空
+  const float* bias = nullptr;
+  float* c = nullptr;
+  int64_t ldc = 0;
+};
+
+inline int64_t GemmTasks(const GemmArgs& args) {
+  return (args.n + kTaskN - 1) / kTaskN;
+}
+
+/**
+ * 各指令集的实现. QuantizeRows 把 x 的 [begin, end) 行量化进A
+ * (VNNI版本存的是平移了 ZeroPoint() 的uint8, 只能和同一指令集的
+ * GemmRange搭配), 补齐的列是0; QuantizeRowsStatic 用校准好的
+ * 固定scale(传倒数), 不用先求每行的最大值; LookupRows 按固定scale
+ * 量化后再查256项的表, 表的下标和内容都是int8量化值的补码
+ * (和零点无关, 可以和模型一起保存), 用于把激活函数和下一层的
+ * 量化合成一步; GemmRange 算编号在
+ * [begin, end) 的 kTaskN 列
+ */
+#define RADISH_QGEMM_DECLARE(isa)                                            \
+  namespace isa {                                                            \
+  int32_t ZeroPoint();                                                       \
+  void QuantizeRows(const float* x, int64_t ldx, int64_t k, int64_t begin,   \
+                    int64_t end, int8_t* a, int64_t lda, float* a_scale);    \
+  void QuantizeRowsStatic(const float* x, int64_t ldx, int64_t k,            \
+                          int64_t begin, int64_t end, float inv, int8_t* a,  \
+                          int64_t lda);                                      \
+  void LookupRows(const float* x, int64_t ldx, int64_t k, int64_t begin,     \
+                  int64_t end, float inv, const uint8_t* table, int8_t* a,   \
+                  int64_t lda);                                              \
+  void GemmRange(const GemmArgs& args, int64_t begin, int64_t end);          \
+  }
+RADISH_QGEMM_DECLARE(avx512vnni)
+RADISH_QGEMM_DECLARE(avx2)
+RADISH_QGEMM_DECLARE(scalar)
+#undef RADISH_QGEMM_DECLARE
+
+}  // namespace qgemm
+}  // namespace radish
@@ -0,0 +1,337 @@
+/*
+ * File: int8_gemm_kernel_impl.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 10:03:18
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+// 和 flash_attention_kernel_impl.h 一样, 每个指令集的.cc定义
+// RADISH_QGEMM_ISA 后各包含一次, 不包含ATen的头文件
+#ifndef RADISH_QGEMM_ISA
+#error "define RADISH_QGEMM_ISA before including int8_gemm_kernel_impl.h"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX512VNNI__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "radish/layers/int8_gemm_kernel.h"
+
+namespace radish {
+namespace qgemm {
+namespace RADISH_QGEMM_ISA {
+namespace {
+
+inline int32_t Load4(const int8_t* p) {
+  int32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+#if defined(__AVX512VNNI__)
+// vpdpbusd 是 uint8*int8, 激活存成 q+128, 结果减去 128*b_sum
+constexpr int32_t kZeroPoint = 128;
+// 一次算 MR 行 x 2组(32列), 每4个k一次 vpdpbusd, 累加器不用横向归约.
+// 小循环要展开, 累加器才能都放在寄存器里(-O2不会自动展开)
+constexpr int kRows = 8;
+
+template <int MR, int NV>
+inline void Tile(const GemmArgs& g, int64_t m0, int64_t blk) {
+  __m512i acc[MR][NV];
+  for (int i = 0; i < MR; i++) {
+    for (int v = 0; v < NV; v++) {
+      acc[i][v] = _mm512_setzero_si512();
+    }
+  }
+  const int8_t* a = g.a + m0 * g.lda;
+  const int8_t* b = g.b + blk * kBlockN * g.k;
+  for (int64_t k = 0; k < g.k; k += kGroupK) {
+    __m512i bv[NV];
+#pragma GCC unroll 8
+    for (int v = 0; v < NV; v++) {
+      bv[v] = _mm512_loadu_si512(b + v * kBlockN * g.k + k * kBlockN);
+    }
+#pragma GCC unroll 8
+    for (int i = 0; i < MR; i++) {
+      __m512i av = _mm512_set1_epi32(Load4(a + i * g.lda + k));
+#pragma GCC unroll 8
+      for (int v = 0; v < NV; v++) {
+        acc[i][v] = _mm512_dpbusd_epi32(acc[i][v], av, bv[v]);
+      }
+    }
+  }
+  for (int v = 0; v < NV; v++) {
+    const int64_t n0 = (blk + v) * kBlockN;
+    if (n0 >= g.n) {
+      break;
+    }
+    const __mmask16 keep = g.n - n0 >= kBlockN
+                               ? static_cast<__mmask16>(0xffff)
+                               : static_cast<__mmask16>((1 << (g.n - n0)) - 1);
+    __m512i corr = _mm512_slli_epi32(_mm512_loadu_si512(g.b_sum + n0), 7);
+    __m512 scale = _mm512_loadu_ps(g.b_scale + n0);
+    __m512 bias =
+        g.bias ? _mm512_loadu_ps(g.bias + n0) : _mm512_setzero_ps();
+    for (int i = 0; i < MR; i++) {
+      __m512 dot = _mm512_cvtepi32_ps(_mm512_sub_epi32(acc[i][v], corr));
+      __m512 s = _mm512_mul_ps(scale, _mm512_set1_ps(g.a_scale[m0 + i]));
+      _mm512_mask_storeu_ps(g.c + (m0 + i) * g.ldc + n0, keep,
+                            _mm512_fmadd_ps(dot, s, bias));
+    }
+  }
+}
+#elif defined(__AVX2__)
+// 扩展成int16再 vpmaddwd, 不会像 vpmaddubsw 那样饱和.
+// 一个向量是4个通道 x 4个k, 每个通道得到两个部分和, 最后横向加一次
+constexpr int32_t kZeroPoint = 0;
+constexpr int kRows = 2;
+
+template <int MR, int NV>
+inline void Tile(const GemmArgs& g, int64_t m0, int64_t blk) {
+  static_assert(NV == 1, "avx2 kernel works on one block");
+  __m256i acc[MR][4];
+  for (int i = 0; i < MR; i++) {
+    for (int j = 0; j < 4; j++) {
+      acc[i][j] = _mm256_setzero_si256();
+    }
+  }
+  const int8_t* a = g.a + m0 * g.lda;
+  const int8_t* b = g.b + blk * kBlockN * g.k;
+  for (int64_t k = 0; k < g.k; k += kGroupK) {
+    __m256i av[MR];
+#pragma GCC unroll 8
+    for (int i = 0; i < MR; i++) {
+      av[i] = _mm256_broadcastq_epi64(_mm_cvtepi8_epi16(
+          _mm_cvtsi32_si128(Load4(a + i * g.lda + k))));
+    }
+#pragma GCC unroll 8
+    for (int j = 0; j < 4; j++) {
+      __m256i bv = _mm256_cvtepi8_epi16(_mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(b + k * kBlockN + j * 16)));
+#pragma GCC unroll 8
+      for (int i = 0; i < MR; i++) {
+        acc[i][j] = _mm256_add_epi32(acc[i][j], _mm256_madd_epi16(av[i], bv));
+      }
+    }
+  }
+  const int64_t n0 = blk * kBlockN;
+  const int64_t valid = std::min<int64_t>(kBlockN, g.n - n0);
+  for (int i = 0; i < MR; i++) {
+    float out[kBlockN];
+    for (int h = 0; h < 2; h++) {
+      // hadd之后是 c0 c1 c4 c5 | c2 c3 c6 c7, 按64位重排
+      __m256i sum = _mm256_permute4x64_epi64(
+          _mm256_hadd_epi32(acc[i][2 * h], acc[i][2 * h + 1]), 0xd8);
+      __m256 s = _mm256_mul_ps(_mm256_loadu_ps(g.b_scale + n0 + 8 * h),
+                               _mm256_set1_ps(g.a_scale[m0 + i]));
+      __m256 bias = g.bias ? _mm256_loadu_ps(g.bias + n0 + 8 * h)
+                           : _mm256_setzero_ps();
+      _mm256_storeu_ps(out + 8 * h,
+                       _mm256_fmadd_ps(_mm256_cvtepi32_ps(sum), s, bias));
+    }
+    std::memcpy(g.c + (m0 + i) * g.ldc + n0, out, valid * sizeof(float));
+  }
+}
+#else
+constexpr int32_t kZeroPoint = 0;
+constexpr int kRows = 1;
+
+template <int MR, int NV>
+inline void Tile(const GemmArgs& g, int64_t m0, int64_t blk) {
+  const int64_t n0 = blk * kBlockN;
+  const int64_t valid = std::min<int64_t>(kBlockN, g.n - n0);
+  const int8_t* b = g.b + blk * kBlockN * g.k;
+  for (int i = 0; i < MR; i++) {
+    const int8_t* a = g.a + (m0 + i) * g.lda;
+    int32_t acc[kBlockN] = {0};
+    for (int64_t k = 0; k < g.k; k += kGroupK) {
+      const int8_t* bk = b + k * kBlockN;
+      for (int64_t c = 0; c < kBlockN; c++) {
+        for (int64_t t = 0; t < kGroupK; t++) {
+          acc[c] += a[k + t] * bk[c * kGroupK + t];
+        }
+      }
+    }
+    float* out = g.c + (m0 + i) * g.ldc + n0;
+    for (int64_t c = 0; c < valid; c++) {
+      float v = acc[c] * g.a_scale[m0 + i] * g.b_scale[n0 + c];
+      out[c] = g.bias ? v + g.bias[n0 + c] : v;
+    }
+  }
+}
+#endif
+
+inline uint8_t QuantizeOne(float v) {
+  int32_t q = static_cast<int32_t>(std::nearbyint(v));
+  return static_cast<uint8_t>(std::min(127, std::max(-127, q)) + kZeroPoint);
+}
+
+// 行内 |x| 的最大值, 和把 x*inv 舍入到 [-127, 127] 再加上零点
+#if defined(__AVX512VNNI__)
+inline float AbsMax(const float* x, int64_t k) {
+  __m512 m = _mm512_setzero_ps();
+  int64_t i = 0;
+  for (; i + 16 <= k; i += 16) {
+    m = _mm512_max_ps(m, _mm512_abs_ps(_mm512_loadu_ps(x + i)));
+  }
+  float amax = _mm512_reduce_max_ps(m);
+  for (; i < k; i++) {
+    amax = std::max(amax, std::fabs(x[i]));
+  }
+  return amax;
+}
+
+inline void QuantizeRow(const float* x, int64_t k, float inv, uint8_t* out) {
+  const __m512 scale = _mm512_set1_ps(inv);
+  int64_t i = 0;
+  for (; i + 16 <= k; i += 16) {
+    __m512i q =
+        _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_loadu_ps(x + i), scale));
+    q = _mm512_min_epi32(_mm512_max_epi32(q, _mm512_set1_epi32(-127)),
+                         _mm512_set1_epi32(127));
+    q = _mm512_add_epi32(q, _mm512_set1_epi32(kZeroPoint));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm512_cvtepi32_epi8(q));
+  }
+  for (; i < k; i++) {
+    out[i] = QuantizeOne(x[i] * inv);
+  }
+}
+#elif defined(__AVX2__)
+inline float AbsMax(const float* x, int64_t k) {
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 m = _mm256_setzero_ps();
+  int64_t i = 0;
+  for (; i + 8 <= k; i += 8) {
+    m = _mm256_max_ps(m, _mm256_andnot_ps(sign, _mm256_loadu_ps(x + i)));
+  }
+  __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+  h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+  h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+  float amax = _mm_cvtss_f32(h);
+  for (; i < k; i++) {
+    amax = std::max(amax, std::fabs(x[i]));
+  }
+  return amax;
+}
+
+inline void QuantizeRow(const float* x, int64_t k, float inv, uint8_t* out) {
+  const __m256 scale = _mm256_set1_ps(inv);
+  int64_t i = 0;
+  for (; i + 8 <= k; i += 8) {
+    __m256i q =
+        _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(x + i), scale));
+    // 饱和打包到int8, 再把 -128 钳到 -127
+    __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                  _mm256_extracti128_si256(q, 1));
+    __m128i q8 = _mm_max_epi8(_mm_packs_epi16(q16, q16), _mm_set1_epi8(-127));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), q8);
+  }
+  for (; i < k; i++) {
+    out[i] = QuantizeOne(x[i] * inv);
+  }
+}
+#else
+inline float AbsMax(const float* x, int64_t k) {
+  float amax = 0;
+  for (int64_t i = 0; i < k; i++) {
+    amax = std::max(amax, std::fabs(x[i]));
+  }
+  return amax;
+}
+
+inline void QuantizeRow(const float* x, int64_t k, float inv, uint8_t* out) {
+  for (int64_t i = 0; i < k; i++) {
+    out[i] = QuantizeOne(x[i] * inv);
+  }
+}
+#endif
+
+template <int NV>
+inline void Rows(const GemmArgs& g, int64_t blk) {
+  int64_t m = 0;
+  for (; m + kRows <= g.m; m += kRows) {
+    Tile<kRows, NV>(g, m, blk);
+  }
+  for (; m < g.m; m++) {
+    Tile<1, NV>(g, m, blk);
+  }
+}
+
+}  // namespace
+
+void QuantizeRows(const float* x, int64_t ldx, int64_t k, int64_t begin,
+                  int64_t end, int8_t* a, int64_t lda, float* a_scale) {
+  const int64_t kPad = AlignK(k);
+  for (int64_t r = begin; r < end; r++) {
+    const float* xr = x + r * ldx;
+    uint8_t* ar = reinterpret_cast<uint8_t*>(a + r * lda);
+    const float amax = AbsMax(xr, k);
+    QuantizeRow(xr, k, amax > 0 ? 127.0f / amax : 0.0f, ar);
+    for (int64_t i = k; i < kPad; i++) {
+      ar[i] = static_cast<uint8_t>(kZeroPoint);
+    }
+    a_scale[r] = amax / 127.0f;
+  }
+}
+
+int32_t ZeroPoint() { return kZeroPoint; }
+
+void QuantizeRowsStatic(const float* x, int64_t ldx, int64_t k, int64_t begin,
+                        int64_t end, float inv, int8_t* a, int64_t lda) {
+  const int64_t kPad = AlignK(k);
+  for (int64_t r = begin; r < end; r++) {
+    uint8_t* ar = reinterpret_cast<uint8_t*>(a + r * lda);
+    QuantizeRow(x + r * ldx, k, inv, ar);
+    for (int64_t i = k; i < kPad; i++) {
+      ar[i] = static_cast<uint8_t>(kZeroPoint);
+    }
+  }
+}
+
+void LookupRows(const float* x, int64_t ldx, int64_t k, int64_t begin,
+                int64_t end, float inv, const uint8_t* table, int8_t* a,
+                int64_t lda) {
+  const int64_t kPad = AlignK(k);
+  for (int64_t r = begin; r < end; r++) {
+    uint8_t* ar = reinterpret_cast<uint8_t*>(a + r * lda);
+    QuantizeRow(x + r * ldx, k, inv, ar);
+#pragma GCC unroll 8
+    for (int64_t i = 0; i < k; i++) {
+      // 表按零点为0存, 零点是128时异或0x80就是加减128
+      ar[i] = static_cast<uint8_t>(table[ar[i] ^ kZeroPoint] ^ kZeroPoint);
+    }
+    for (int64_t i = k; i < kPad; i++) {
+      ar[i] = static_cast<uint8_t>(kZeroPoint);
+    }
+  }
+}
+
+void GemmRange(const GemmArgs& args, int64_t begin, int64_t end) {
+  const int64_t blocks = AlignN(args.n) / kBlockN;
+  for (int64_t task = begin; task < end; task++) {
+    int64_t blk = task * (kTaskN / kBlockN);
+    const int64_t last = std::min(blocks, blk + kTaskN / kBlockN);
+#if defined(__AVX512VNNI__)
+    for (; blk + 2 <= last; blk += 2) {
+      Rows<2>(args, blk);
+    }
+#endif
+    for (; blk < last; blk++) {
+      Rows<1>(args, blk);
+    }
+  }
+}
+
+}  // namespace RADISH_QGEMM_ISA
+}  // namespace qgemm
+}  // namespace radish
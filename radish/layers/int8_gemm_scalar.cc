@@ -0,0 +1,13 @@
+/*
+ * File: int8_gemm_scalar.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 10:21:05
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+// 不加指令集选项, 没有AVX2的机器上用
+#define RADISH_QGEMM_ISA scalar
+#include "radish/layers/int8_gemm_kernel_impl.h"
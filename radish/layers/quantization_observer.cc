@@ -0,0 +1,73 @@
+/*
+ * File: quantization_observer.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-19 9:40:12
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/layers/quantization_observer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+
+ObserverOptions::ObserverOptions(Method method) : method_(method) {}
+
+ActivationObserver::ActivationObserver(ObserverOptions options)
+    : options_(options) {
+  CHECK(options_.bins() >= 2 && options_.bins() % 2 == 0)
+      << "bins should be even";
+  CHECK(options_.percentile() > 0 && options_.percentile() <= 100);
+}
+
+void ActivationObserver::Observe(const torch::Tensor& x) {
+  torch::NoGradGuard guard;
+  if (x.numel() == 0) {
+    return;
+  }
+  torch::Tensor v = x.detach().to(torch::kCPU, torch::kFloat);
+  min_ = std::min<double>(min_, v.min().item<float>());
+  max_ = std::max<double>(max_, v.max().item<float>());
+  count_ += 1;
+  if (options_.method() != ObserverOptions::kPercentile) {
+    return;
+  }
+  const double amax = std::max(-min_, max_);
+  if (amax <= 0) {
+    return;
+  }
+  const int64_t bins = options_.bins();
+  if (!hist_.defined()) {
+    hist_range_ = amax;
+    hist_ = torch::zeros({bins}, torch::kDouble);
+  }
+  while (hist_range_ < amax) {
+    // 范围翻倍, 旧的桶两两合并进前一半
+    hist_ = torch::cat({hist_.view({bins / 2, 2}).sum(1),
+                        torch::zeros({bins - bins / 2}, torch::kDouble)});
+    hist_range_ *= 2;
+  }
+  hist_.add_(torch::histc(v.abs(), bins, 0, hist_range_).to(torch::kDouble));
+}
+
+double ActivationObserver::Range() const {
+  const double amax = std::max(-min_, max_);
+  if (options_.method() != ObserverOptions::kPercentile || !hist_.defined()) {
+    return amax;
+  }
+  torch::Tensor cdf = hist_.cumsum(0);
+  const double total = cdf[-1].item<double>();
+  const double target = total * options_.percentile() / 100.0;
+  const int64_t bin = cdf.lt(target).sum().item<int64_t>();
+  // 取分位数所在桶的上沿
+  double range = hist_range_ * (bin + 1) / options_.bins();
+  return std::min(range, amax);
+}
+
+}  // namespace radish
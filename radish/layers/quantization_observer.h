@@ -0,0 +1,54 @@
+/*
+ * File: quantization_observer.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-19 9:40:12
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include "torch/torch.h"
+
+namespace radish {
+
+/// Options for `ActivationObserver`.
+struct TORCH_API ObserverOptions {
+  enum Method { kMinMax, kPercentile };
+  /* implicit */ ObserverOptions(Method method = kPercentile);
+  TORCH_ARG(Method, method);
+  // kPercentile: 取 |x| 的这个分位数作为范围
+  TORCH_ARG(double, percentile) = 99.99;
+  // kPercentile: 直方图的桶数
+  TORCH_ARG(int64_t, bins) = 2048;
+};
+
+/**
+ * 静态量化的校准: 累计多个batch里激活的范围, 对称量化时映射到127.
+ * kMinMax 取见过的 |x| 最大值, 对离群值敏感;
+ * kPercentile 用 |x| 的直方图取分位数, 超出当前范围时范围翻倍,
+ * 相邻的桶两两合并, 桶数不变
+ */
+class TORCH_API ActivationObserver {
+ public:
+  explicit ActivationObserver(ObserverOptions options = ObserverOptions());
+
+  void Observe(const torch::Tensor& x);
+
+  // 量化范围, 没有观察到非0的数据时是0
+  double Range() const;
+  int64_t count() const { return count_; }
+
+ private:
+  ObserverOptions options_;
+  int64_t count_ = 0;
+  double min_ = 0;
+  double max_ = 0;
+  double hist_range_ = 0;
+  torch::Tensor hist_;
+};
+
+}  // namespace radish
@@ -0,0 +1,306 @@
+/*
+ * File: quantized_linear.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 3:02:51
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/layers/quantized_linear.h"
+
+#include <cmath>
+#include <ostream>
+#include <tuple>
+#include <vector>
+
+#include "ATen/Parallel.h"
+#include "torch/torch.h"
+
+#include "radish/layers/int8_gemm_kernel.h"
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace {
+
+typedef void (*QuantizeFn)(const float*, int64_t, int64_t, int64_t, int64_t,
+                           int8_t*, int64_t, float*);
+typedef void (*QuantizeStaticFn)(const float*, int64_t, int64_t, int64_t,
+                                 int64_t, float, int8_t*, int64_t);
+typedef void (*LookupFn)(const float*, int64_t, int64_t, int64_t, int64_t,
+                         float, const uint8_t*, int8_t*, int64_t);
+typedef void (*GemmFn)(const qgemm::GemmArgs&, int64_t, int64_t);
+struct Kernels {
+  const char* isa;
+  QuantizeFn quantize;
+  QuantizeStaticFn quantize_static;
+  LookupFn lookup;
+  GemmFn gemm;
+};
+
+const Kernels& GetKernels() {
+  static const Kernels kernels = []() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") &&
+        __builtin_cpu_supports("avx512bw")) {
+      return Kernels{"avx512vnni",
+                     qgemm::avx512vnni::QuantizeRows,
+                     qgemm::avx512vnni::QuantizeRowsStatic,
+                     qgemm::avx512vnni::LookupRows,
+                     qgemm::avx512vnni::GemmRange};
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return Kernels{"avx2",
+                     qgemm::avx2::QuantizeRows,
+                     qgemm::avx2::QuantizeRowsStatic,
+                     qgemm::avx2::LookupRows,
+                     qgemm::avx2::GemmRange};
+    }
+    return Kernels{"scalar",
+                   qgemm::scalar::QuantizeRows,
+                   qgemm::scalar::QuantizeRowsStatic,
+                   qgemm::scalar::LookupRows,
+                   qgemm::scalar::GemmRange};
+  }();
+  return kernels;
+}
+
+inline float Gelu(float x) {
+  return 0.5f * x * (1.0f + std::erf(x * static_cast<float>(M_SQRT1_2)));
+}
+
+// 静态量化的scale, 动态量化时是0
+inline float ScaleOf(const Tensor& t) {
+  return t.defined() ? t.data_ptr<float>()[0] : 0.0f;
+}
+
+}  // namespace
+
+QuantizedLinearOptions::QuantizedLinearOptions(int64_t in, int64_t out)
+    : in_(in), out_(out) {}
+
+QuantizedLinearImpl::QuantizedLinearImpl(QuantizedLinearOptions options_)
+    : options(options_) {
+  reset();
+}
+
+void QuantizedLinearImpl::reset() {
+  const int64_t nPad = qgemm::AlignN(options.out());
+  weight = register_buffer(
+      "weight",
+      torch::zeros({nPad * qgemm::AlignK(options.in())}, torch::kChar));
+  scale = register_buffer("scale", torch::zeros({nPad}));
+  row_sum = register_buffer("row_sum", torch::zeros({nPad}, torch::kInt));
+  if (options.with_bias()) {
+    bias = register_buffer("bias", torch::zeros({nPad}));
+  }
+  input_scale = register_buffer("input_scale", torch::zeros({1}));
+  if (options.gelu_input()) {
+    gelu_scale = register_buffer("gelu_scale", torch::zeros({1}));
+    gelu_table =
+        register_buffer("gelu_table", torch::zeros({256}, torch::kByte));
+  }
+}
+
+void QuantizedLinearImpl::pretty_print(std::ostream& stream) const {
+  stream << "radish::QuantizedLinear(in=" << options.in()
+         << ", out=" << options.out() << ", with_bias=" << options.with_bias()
+         << ", gelu_input=" << options.gelu_input()
+         << ", static=" << is_static() << ")";
+}
+
+void QuantizedLinearImpl::quantize_from(const Tensor& float_weight,
+                                        const Tensor& float_bias) {
+  torch::NoGradGuard guard;
+  const int64_t n = options.out();
+  const int64_t k = options.in();
+  CHECK_EQ(float_weight.size(0), n);
+  CHECK_EQ(float_weight.numel(), n * k);
+  Tensor w = float_weight.to(torch::kCPU, torch::kFloat).reshape({n, k});
+  Tensor amax = std::get<0>(w.abs().max(1));
+  Tensor s = (amax / 127.0).masked_fill_(amax.eq(0), 1.0);
+  Tensor q = w.div(s.unsqueeze(1))
+                 .round_()
+                 .clamp_(-127, 127)
+                 .to(torch::kChar)
+                 .contiguous();
+  qgemm::PackWeight(q.data_ptr<int8_t>(), n, k, weight.data_ptr<int8_t>());
+  scale.narrow(0, 0, n).copy_(s);
+  row_sum.narrow(0, 0, n).copy_(q.to(torch::kInt).sum(1));
+  if (options.with_bias()) {
+    CHECK(float_bias.defined());
+    bias.narrow(0, 0, n).copy_(float_bias);
+  }
+}
+
+void QuantizedLinearImpl::start_calibration(ObserverOptions observe) {
+  observer_ = std::make_shared<ActivationObserver>(observe);
+  if (options.gelu_input()) {
+    gelu_observer_ = std::make_shared<ActivationObserver>(observe);
+  }
+}
+
+void QuantizedLinearImpl::finish_calibration() {
+  CHECK(observer_) << "start_calibration first";
+  torch::NoGradGuard guard;
+  if (observer_->count() == 0) {
+    spdlog::warn("{} saw no calibration data, keep dynamic quantization",
+                 name());
+  } else {
+    // 范围是0(如全0的输入)时scale随便取, 量化结果都是0
+    double range = observer_->Range();
+    input_scale.fill_(range > 0 ? range / 127.0 : 1.0);
+    if (gelu_observer_) {
+      range = gelu_observer_->Range();
+      gelu_scale.fill_(range > 0 ? range / 127.0 : 1.0);
+      build_gelu_table_();
+    }
+  }
+  observer_.reset();
+  gelu_observer_.reset();
+}
+
+bool QuantizedLinearImpl::is_static() const { return ScaleOf(input_scale) > 0; }
+
+void QuantizedLinearImpl::build_gelu_table_() {
+  const float inScale = ScaleOf(gelu_scale);
+  const float outScale = ScaleOf(input_scale);
+  // 下标和内容都是int8量化值的补码, 和kernel的零点无关
+  uint8_t* table = gelu_table.data_ptr<uint8_t>();
+  for (int32_t e = 0; e < 256; e++) {
+    int32_t q = static_cast<int8_t>(static_cast<uint8_t>(e));
+    int32_t o =
+        static_cast<int32_t>(std::nearbyint(Gelu(q * inScale) / outScale));
+    table[e] = static_cast<uint8_t>(
+        static_cast<int8_t>(std::min(127, std::max(-127, o))));
+  }
+}
+
+Tensor QuantizedLinearImpl::forward(const Tensor& input) {
+  CHECK(input.device().is_cpu() && input.scalar_type() == torch::kFloat)
+      << "int8 linear needs cpu float32 input";
+  const int64_t k = options.in();
+  const int64_t kPad = qgemm::AlignK(k);
+  CHECK_EQ(input.size(-1), k);
+  Tensor x = input.reshape({-1, k});
+  if (x.stride(1) != 1) {
+    x = x.contiguous();
+  }
+  const bool staticQuant = is_static();
+  if (options.gelu_input() && (observer_ || !staticQuant)) {
+    if (gelu_observer_) {
+      gelu_observer_->Observe(x);
+    }
+    x = torch::gelu(x);
+  }
+  if (observer_) {
+    observer_->Observe(x);
+  }
+  const int64_t m = x.size(0);
+  Tensor a = torch::empty({m, kPad}, torch::kChar);
+  Tensor aScale = torch::empty({m}, torch::kFloat);
+  Tensor out = torch::empty({m, options.out()}, torch::kFloat);
+  const Kernels& kernels = GetKernels();
+  const float* xp = x.data_ptr<float>();
+  const int64_t ldx = x.stride(0);
+  int8_t* ap = a.data_ptr<int8_t>();
+  float* asp = aScale.data_ptr<float>();
+  if (!staticQuant || observer_) {
+    // 校准时仍用动态量化, 前面各层的输出和没有校准时一致
+    at::parallel_for(0, m, 16, [&](int64_t begin, int64_t end) {
+      kernels.quantize(xp, ldx, k, begin, end, ap, kPad, asp);
+    });
+  } else if (options.gelu_input()) {
+    const float inv = 1.0f / ScaleOf(gelu_scale);
+    const uint8_t* table = gelu_table.data_ptr<uint8_t>();
+    at::parallel_for(0, m, 16, [&](int64_t begin, int64_t end) {
+      kernels.lookup(xp, ldx, k, begin, end, inv, table, ap, kPad);
+    });
+    aScale.fill_(ScaleOf(input_scale));
+  } else {
+    const float inv = 1.0f / ScaleOf(input_scale);
+    at::parallel_for(0, m, 16, [&](int64_t begin, int64_t end) {
+      kernels.quantize_static(xp, ldx, k, begin, end, inv, ap, kPad);
+    });
+    aScale.fill_(ScaleOf(input_scale));
+  }
+
+  qgemm::GemmArgs args;
+  args.m = m;
+  args.n = options.out();
+  args.k = kPad;
+  args.a = ap;
+  args.lda = kPad;
+  args.a_scale = asp;
+  args.b = weight.data_ptr<int8_t>();
+  args.b_scale = scale.data_ptr<float>();
+  args.b_sum = row_sum.data_ptr<int32_t>();
+  args.bias = options.with_bias() ? bias.data_ptr<float>() : nullptr;
+  args.c = out.data_ptr<float>();
+  args.ldc = options.out();
+  at::parallel_for(0, qgemm::GemmTasks(args), 1,
+                   [&](int64_t begin, int64_t end) {
+                     kernels.gemm(args, begin, end);
+                   });
+  std::vector<int64_t> sizes = input.sizes().vec();
+  sizes.back() = options.out();
+  return out.view(sizes);
+}
+
+QuantizedLinear QuantizeLinear(const Tensor& weight, const Tensor& bias,
+                               bool release, bool gelu_input) {
+  torch::NoGradGuard guard;
+  const bool withBias = bias.defined() && bias.numel() > 0;
+  QuantizedLinear quantized(
+      QuantizedLinearOptions(weight.numel() / weight.size(0), weight.size(0))
+          .with_bias(withBias)
+          .gelu_input(gelu_input));
+  quantized->quantize_from(weight, bias);
+  if (release) {
+    weight.set_();
+    if (withBias) {
+      bias.set_();
+    }
+  }
+  return quantized;
+}
+
+QuantizedLinear QuantizeLinear(const torch::nn::Linear& linear, bool release,
+                               bool gelu_input) {
+  return QuantizeLinear(linear->weight, linear->bias, release, gelu_input);
+}
+
+const char* Int8GemmIsa() { return GetKernels().isa; }
+
+namespace {
+std::vector<std::shared_ptr<QuantizedLinearImpl>> QuantizedLayers(
+    const std::shared_ptr<torch::nn::Module>& model) {
+  std::vector<std::shared_ptr<QuantizedLinearImpl>> layers;
+  for (auto& m : model->modules()) {
+    if (auto q = std::dynamic_pointer_cast<QuantizedLinearImpl>(m)) {
+      layers.push_back(q);
+    }
+  }
+  return layers;
+}
+}  // namespace
+
+int64_t StartCalibration(const std::shared_ptr<torch::nn::Module>& model,
+                         ObserverOptions options) {
+  auto layers = QuantizedLayers(model);
+  for (auto& q : layers) {
+    q->start_calibration(options);
+  }
+  return layers.size();
+}
+
+int64_t FinishCalibration(const std::shared_ptr<torch::nn::Module>& model) {
+  auto layers = QuantizedLayers(model);
+  for (auto& q : layers) {
+    q->finish_calibration();
+  }
+  return layers.size();
+}
+
+}  // namespace radish
@@ -0,0 +1,117 @@
+/*
+ * File: quantized_linear.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-20 2:15:37
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include "torch/nn/cloneable.h"
+#include "torch/nn/modules/linear.h"
+#include "torch/nn/pimpl.h"
+#include "torch/types.h"
+
+#include "radish/layers/quantization_observer.h"
+
+namespace radish {
+using Tensor = torch::Tensor;
+/// Options for the `QuantizedLinear` module.
+struct TORCH_API QuantizedLinearOptions {
+  QuantizedLinearOptions(int64_t in, int64_t out);
+  TORCH_ARG(int64_t, in);
+  TORCH_ARG(int64_t, out);
+  TORCH_ARG(bool, with_bias) = true;
+  // 输入先过GELU, 静态量化时和输入的量化合成一次查表
+  TORCH_ARG(bool, gelu_input) = false;
+};
+
+/**
+ * 推理用的int8 Linear: 权重按输出通道对称量化成int8并打包
+ * (见 int8_gemm_kernel.h), 激活在每次forward时按行动态量化,
+ * 按CPU选VNNI/AVX2/标量kernel做int32累加, 再乘两边的scale还原成float.
+ * 只支持CPU上的float32输入, 没有反向. 量化的结果都是buffer,
+ * 可以和模型一起保存/加载.
+ * 校准(start_calibration ... finish_calibration)之后激活改用固定的
+ * scale量化(静态量化), 不再逐行求最大值; gelu_input 时GELU输入的
+ * 量化, GELU和这一层输入的量化是一次查256项的表
+ */
+class TORCH_API QuantizedLinearImpl
+    : public torch::nn::Cloneable<QuantizedLinearImpl> {
+ public:
+  QuantizedLinearImpl(int64_t in, int64_t out)
+      : QuantizedLinearImpl(QuantizedLinearOptions(in, out)) {}
+  explicit QuantizedLinearImpl(QuantizedLinearOptions options);
+
+  void reset() override;
+
+  void pretty_print(std::ostream& stream) const override;
+
+  // [..., in] -> [..., out]
+  Tensor forward(const Tensor& input);
+
+  // 量化float的权重 [out, in](或kernel为1的Conv1d [out, in, 1]) 和bias
+  void quantize_from(const Tensor& float_weight, const Tensor& float_bias);
+
+  // 之后的forward仍按动态量化计算, 同时记录输入的范围
+  void start_calibration(ObserverOptions observe);
+  // 把记录的范围写进 input_scale(和 gelu_scale), 之后是静态量化
+  void finish_calibration();
+  bool is_static() const;
+
+  /// The options used to configure this module.
+  QuantizedLinearOptions options;
+  // 打包的int8权重, AlignN(out)*AlignK(in) 个
+  Tensor weight;
+  // [AlignN(out)]: 每个输出通道的scale, int8权重每行的和, bias
+  Tensor scale;
+  Tensor row_sum;
+  Tensor bias;
+  // [1]: 静态量化时输入的scale, 0表示动态量化
+  Tensor input_scale;
+  // [1]: gelu_input 时GELU之前的输入的scale
+  Tensor gelu_scale;
+  // [256] uint8: gelu_input 时按上面两个scale生成的查表, 见 LookupRows.
+  // 在 finish_calibration 里生成, 和模型一起保存, forward只读
+  Tensor gelu_table;
+
+ private:
+  void build_gelu_table_();
+
+  std::shared_ptr<ActivationObserver> observer_;
+  std::shared_ptr<ActivationObserver> gelu_observer_;
+};
+
+/// A `ModuleHolder` subclass for `QuantizedLinearImpl`.
+/// See the documentation for `QuantizedLinearImpl` class to learn what
+/// methods it provides, or the documentation for `ModuleHolder` to learn about
+/// PyTorch's module storage semantics.
+TORCH_MODULE(QuantizedLinear);
+
+/**
+ * 量化训练好的float权重和bias(可以为空), 见 quantize_from.
+ * release 时释放它们的内存, 参数还在(变成空的), 原来的层不能再用
+ */
+QuantizedLinear QuantizeLinear(const Tensor& weight, const Tensor& bias,
+                               bool release = true, bool gelu_input = false);
+QuantizedLinear QuantizeLinear(const torch::nn::Linear& linear,
+                               bool release = true, bool gelu_input = false);
+
+// 当前机器选中的kernel: "avx512vnni", "avx2" 或 "scalar"
+const char* Int8GemmIsa();
+
+/**
+ * 模型里所有的 QuantizedLinear 开始/结束校准, 返回层数.
+ * 在 quantize_int8() 之后, 用若干batch的数据在两者之间跑forward
+ */
+int64_t StartCalibration(const std::shared_ptr<torch::nn::Module>& model,
+                         ObserverOptions options = ObserverOptions());
+int64_t FinishCalibration(const std::shared_ptr<torch::nn::Module>& model);
+
+}  // namespace radish
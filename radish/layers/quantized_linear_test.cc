@@ -0,0 +1,89 @@
+/*
+ * File: quantized_linear_test.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-18 9:02:44
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "gtest/gtest.h"
+
+#include "torch/torch.h"
+
+#include "radish/layers/quantized_linear.h"
+
+TEST(QuantizedLinearTest, TestMatchesFloatLinear) {
+  // in/out都不是打包块大小的整数倍, 输入带batch维
+  torch::manual_seed(3);
+  torch::nn::Linear linear(75, 37);
+  torch::Tensor x = torch::randn({3, 13, 75});
+  torch::Tensor ref = linear(x).detach();
+  radish::QuantizedLinear q = radish::QuantizeLinear(linear, false);
+  torch::Tensor out = q(x);
+  ASSERT_EQ(out.sizes(), ref.sizes());
+  // 两边各有约1/254的量化误差
+  float err = (out - ref).abs().max().item<float>();
+  EXPECT_LT(err, 0.02 * ref.abs().max().item<float>()) << radish::Int8GemmIsa();
+}
+
+TEST(QuantizedLinearTest, TestNoBiasAndRelease) {
+  torch::Tensor w = torch::randn({16, 64});
+  torch::Tensor x = torch::randn({5, 64});
+  torch::Tensor ref = torch::matmul(x, w.t());
+  radish::QuantizedLinear q = radish::QuantizeLinear(w.clone(), {});
+  torch::Tensor out = q(x);
+  float err = (out - ref).abs().max().item<float>();
+  EXPECT_LT(err, 0.02 * ref.abs().max().item<float>());
+  // 全0的行量化后仍然是0
+  EXPECT_EQ(q(torch::zeros({2, 64})).abs().max().item<float>(), 0);
+}
+
+TEST(QuantizedLinearTest, TestStaticGeluLookup) {
+  // 校准之后用固定的scale, GELU和量化合成查表
+  torch::manual_seed(5);
+  torch::nn::Linear linear(64, 48);
+  torch::Tensor x = torch::randn({8, 20, 64});
+  torch::Tensor ref = linear(torch::gelu(x)).detach();
+  radish::QuantizedLinear q = radish::QuantizeLinear(linear, false, true);
+  EXPECT_FALSE(q->is_static());
+  q->start_calibration(radish::ObserverOptions::kMinMax);
+  torch::Tensor dyn = q(x);
+  q->finish_calibration();
+  ASSERT_TRUE(q->is_static());
+  torch::Tensor out = q(x);
+  float range = ref.abs().max().item<float>();
+  EXPECT_LT((dyn - ref).abs().max().item<float>(), 0.02 * range);
+  EXPECT_LT((out - ref).abs().max().item<float>(), 0.03 * range);
+
+  // 查表和scale都是buffer, 拷到新的层(相当于加载保存的模型)直接可用
+  radish::QuantizedLinear loaded(
+      radish::QuantizedLinearOptions(64, 48).gelu_input(true));
+  {
+    torch::NoGradGuard guard;
+    auto buffers = q->named_buffers();
+    for (auto& item : loaded->named_buffers()) {
+      item.value().copy_(buffers[item.key()]);
+    }
+  }
+  ASSERT_TRUE(loaded->is_static());
+  EXPECT_TRUE(torch::equal(loaded(x), out));
+}
+
+TEST(QuantizedLinearTest, TestPercentileObserver) {
+  radish::ActivationObserver minmax(radish::ObserverOptions::kMinMax);
+  radish::ActivationObserver percentile(
+      radish::ObserverOptions().percentile(99.0));
+  for (int i = 0; i < 4; i++) {
+    // 范围一次比一次大, 直方图要翻倍几次
+    torch::Tensor x = torch::rand({10000}) * (i + 1);
+    x[0] = 100.0 * (i + 1);
+    minmax.Observe(x);
+    percentile.Observe(x);
+  }
+  EXPECT_FLOAT_EQ(minmax.Range(), 400);
+  // 离群值被去掉, 99%分位数在4附近
+  EXPECT_GT(percentile.Range(), 3);
+  EXPECT_LT(percentile.Range(), 5);
+}
@@ -0,0 +1,82 @@
+/*
+ * File: unpad.cc
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-19 10:14:05
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/layers/unpad.h"
+
+#include <vector>
+
+#include "torch/torch.h"
+
+#include "radish/layers/flash_attention.h"
+#include "radish/utils/logging.h"
+
+namespace radish {
+
+UnpadIndex MakeUnpadIndex(const Tensor& keep_mask) {
+  CHECK_EQ(keep_mask.dim(), 2);
+  torch::NoGradGuard guard;
+  Tensor keep = keep_mask.ne(0);
+  UnpadIndex index;
+  index.batch = keep.size(0);
+  index.seqlen = keep.size(1);
+  index.indices = keep.reshape({-1}).nonzero().squeeze(1);
+  Tensor lengths = keep.sum(1).to(torch::kCPU, torch::kLong);
+  index.cu_seqlens = torch::cat({torch::zeros({1}, torch::kLong),
+                                 lengths.cumsum(0)});
+  return index;
+}
+
+Tensor UnpadInput(const Tensor& x, const UnpadIndex& index) {
+  CHECK_EQ(x.size(0), index.batch);
+  CHECK_EQ(x.size(1), index.seqlen);
+  return x.flatten(0, 1).index_select(0, index.indices);
+}
+
+Tensor PadOutput(const Tensor& x, const UnpadIndex& index) {
+  std::vector<int64_t> sizes = x.sizes().vec();
+  sizes[0] = index.batch * index.seqlen;
+  Tensor padded = torch::zeros(sizes, x.options()).index_copy(
+      0, index.indices, x);
+  sizes[0] = index.seqlen;
+  sizes.insert(sizes.begin(), index.batch);
+  return padded.view(sizes);
+}
+
+Tensor VarlenAttention(const Tensor& q, const Tensor& k, const Tensor& v,
+                       const Tensor& cu_seqlens, double scale,
+                       double dropout, bool training) {
+  if (FlashAttentionAvailable(q)) {
+    return FlashAttentionVarlen(q, k, v, cu_seqlens, scale, dropout,
+                                training);
+  }
+  auto cu = cu_seqlens.accessor<int64_t, 1>();
+  std::vector<Tensor> outputs;
+  for (int64_t b = 0; b + 1 < cu.size(0); b++) {
+    const int64_t start = cu[b];
+    const int64_t len = cu[b + 1] - start;
+    if (len == 0) {
+      continue;
+    }
+    // [len, H, D] -> [H, len, D]
+    auto qb = q.narrow(0, start, len).transpose(0, 1);
+    auto kb = k.narrow(0, start, len).transpose(0, 1);
+    auto vb = v.narrow(0, start, len).transpose(0, 1);
+    auto probs = torch::softmax(torch::matmul(qb, kb.transpose(1, 2)) * scale,
+                                -1);
+    probs = torch::dropout(probs, dropout, training);
+    outputs.push_back(torch::matmul(probs, vb).transpose(0, 1));
+  }
+  if (outputs.empty()) {
+    return torch::empty({0, q.size(1), v.size(2)}, q.options());
+  }
+  return torch::cat(outputs, 0).contiguous();
+}
+
+}  // namespace radish
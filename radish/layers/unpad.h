@@ -0,0 +1,49 @@
+/*
+ * File: unpad.h
+ * Project: layers
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-19 9:36:52
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include "torch/types.h"
+
+namespace radish {
+using Tensor = ::torch::Tensor;
+
+/**
+ * 不补齐的执行: 把一个batch里真实的token打包成 [T, ...],
+ * T 是真实token的总数, 各层的GEMM只算真实token, 在模型的出口再补齐.
+ * cu_seqlens 是各序列在打包行里的起点, 序列b占 [cu[b], cu[b+1]).
+ */
+struct UnpadIndex {
+  // 真实token在 [B*L] 里的下标, 和输入在同一个设备上
+  Tensor indices;
+  // CPU上的int64 [B+1]
+  Tensor cu_seqlens;
+  int64_t batch = 0;
+  int64_t seqlen = 0;
+};
+
+// keep_mask [B, L], 非0的位置是真实token
+UnpadIndex MakeUnpadIndex(const Tensor& keep_mask);
+
+// [B, L, ...] -> [T, ...]
+Tensor UnpadInput(const Tensor& x, const UnpadIndex& index);
+
+// [T, ...] -> [B, L, ...], 补齐的位置为0
+Tensor PadOutput(const Tensor& x, const UnpadIndex& index);
+
+/**
+ * 打包输入上按序列分段的自注意力, q/k/v [T, H, D], 返回 [T, H, Dv].
+ * CPU float32 用分块的变长kernel, 其他情况逐个序列算
+ */
+Tensor VarlenAttention(const Tensor& q, const Tensor& k, const Tensor& v,
+                       const Tensor& cu_seqlens, double scale,
+                       double dropout = 0, bool training = false);
+
+}  // namespace radish
@@ -0,0 +1,269 @@
+/*
+ * File: compressed_state.cc
+ * Project: optimization
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-04 3:40:18
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#include "radish/optimization/compressed_state.h"
+
+#include "absl/strings/ascii.h"
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace optim {
+
+using Tensor = ::torch::Tensor;
+
+StateFormat StateFormatFromString(const std::string& name) {
+  std::string lname = absl::AsciiStrToLower(name);
+  if (lname.empty() || lname == "fp32" || lname == "float32") {
+    return StateFormat::kFloat32;
+  } else if (lname == "bf16" || lname == "bfloat16") {
+    return StateFormat::kBFloat16;
+  } else if (lname == "int8" || lname == "block_int8") {
+    return StateFormat::kBlockInt8;
+  }
+  LOG(FATAL) << "unknown optimizer state format:" << name;
+  return StateFormat::kFloat32;
+}
+
+std::string StateFormatName(StateFormat format) {
+  switch (format) {
+    case StateFormat::kBFloat16:
+      return "bf16";
+    case StateFormat::kBlockInt8:
+      return "int8";
+    default:
+      return "fp32";
+  }
+}
+
+// [nblocks, block_size] 按block做absmax量化, scale是 [nblocks]
+static Tensor QuantizeBlocks(Tensor blocks, bool non_negative, Tensor* scale) {
+  if (non_negative) {
+    // 二阶矩的量级跨度很大, 在sqrt域量化等价于把可表示范围平方
+    blocks = blocks.clamp_min(0).sqrt();
+  }
+  Tensor absmax = std::get<0>(blocks.abs().max(1, true)).clamp_min_(1e-20);
+  float levels = non_negative ? 255.0 : 127.0;
+  Tensor s = absmax.div(levels);
+  Tensor q = blocks.div(s);
+  *scale = s.view({-1});
+  if (non_negative) {
+    // 随机舍入, 期望等于原值. 每步都重新量化整个block, 就近舍入或向上
+    // 取整时衰减中的sqrt(v)每步只缩小约0.05%, 会一直停在原来的级别上.
+    // 正的值至少保留一级, 避免被量化成0导致步长爆掉
+    Tensor positive = q.gt(0).to(q.scalar_type());
+    q.add_(torch::rand_like(q)).floor_();
+    return torch::max(q, positive).clamp_(0, 255).to(torch::kUInt8);
+  }
+  return q.round_().clamp_(-127, 127).to(torch::kInt8);
+}
+
+Tensor CompressState(const Tensor& value, StateFormat format,
+                     int64_t block_size, bool non_negative, Tensor* scale) {
+  torch::NoGradGuard guard;
+  if (format == StateFormat::kFloat32) {
+    return value;
+  }
+  if (format == StateFormat::kBFloat16) {
+    return value.to(torch::kBFloat16);
+  }
+  CHECK_GT(block_size, 0);
+  int64_t total = value.numel();
+  int64_t nblocks = (total + block_size - 1) / block_size;
+  Tensor flat = value.reshape({-1});
+  if (nblocks * block_size > total) {
+    flat = torch::cat(
+        {flat, torch::zeros({nblocks * block_size - total}, flat.options())});
+  }
+  return QuantizeBlocks(flat.view({nblocks, block_size}), non_negative, scale);
+}
+
+Tensor DecompressState(const Tensor& data, const Tensor& scale,
+                       StateFormat format, bool non_negative,
+                       const Tensor& like) {
+  torch::NoGradGuard guard;
+  if (format == StateFormat::kFloat32) {
+    return data;
+  }
+  if (format == StateFormat::kBFloat16) {
+    return data.to(like.scalar_type());
+  }
+  Tensor blocks = data.to(like.scalar_type()).mul_(scale.view({-1, 1}));
+  if (non_negative) {
+    blocks.mul_(blocks);
+  }
+  return blocks.view({-1}).narrow(0, 0, like.numel()).view(like.sizes());
+}
+
+Tensor LoadState(const std::vector<Tensor>& parameters, StateFormat format,
+                 std::vector<Tensor>* datas, std::vector<Tensor>* scales,
+                 size_t index, bool non_negative) {
+  const Tensor& p = parameters.at(index);
+  if (format == StateFormat::kFloat32) {
+    // 和 Optimizer::buffer_at 相同: 缺的补0, 转到参数的device和dtype
+    while (datas->size() <= index) {
+      datas->push_back(torch::zeros_like(parameters.at(datas->size())));
+    }
+    Tensor& buffer = (*datas)[index];
+    if (buffer.device() != p.device() || buffer.dtype() != p.dtype()) {
+      buffer = buffer.to(p.device(), p.scalar_type());
+    }
+    return buffer;
+  }
+  // 压缩格式不能转换回参数的dtype
+  while (datas->size() <= index) {
+    datas->push_back(torch::empty({0}));
+    scales->push_back(torch::empty({0}));
+  }
+  if ((*datas)[index].numel() == 0) {
+    return torch::zeros_like(p);
+  }
+  return DecompressState((*datas)[index].to(p.device()),
+                         (*scales)[index].to(p.device()), format,
+                         non_negative, p);
+}
+
+void StoreState(StateFormat format, int64_t block_size,
+                std::vector<Tensor>* datas, std::vector<Tensor>* scales,
+                size_t index, bool non_negative, const Tensor& value) {
+  if (format == StateFormat::kFloat32) {
+    return;
+  }
+  Tensor scale = torch::empty({0});
+  (*datas)[index] =
+      CompressState(value, format, block_size, non_negative, &scale);
+  (*scales)[index] = scale;
+}
+
+StateRows LoadStateRows(const std::vector<Tensor>& parameters,
+                        StateFormat format, int64_t block_size,
+                        std::vector<Tensor>* datas,
+                        std::vector<Tensor>* scales, size_t index,
+                        bool non_negative, const Tensor& rows) {
+  torch::NoGradGuard guard;
+  const Tensor& p = parameters.at(index);
+  const int64_t nrows = p.size(0);
+  StateRows state;
+  if (format == StateFormat::kFloat32) {
+    Tensor buffer =
+        LoadState(parameters, format, datas, scales, index, non_negative);
+    state.value = buffer.view({nrows, -1}).index_select(0, rows);
+    return state;
+  }
+  while (datas->size() <= index) {
+    datas->push_back(torch::empty({0}));
+    scales->push_back(torch::empty({0}));
+  }
+  Tensor& data = (*datas)[index];
+  Tensor& scale = (*scales)[index];
+  if (data.numel() == 0) {
+    // 全0的状态直接建, 不用先量化一遍整张表
+    if (format == StateFormat::kBFloat16) {
+      data = torch::zeros_like(p, p.options().dtype(torch::kBFloat16));
+    } else {
+      CHECK_GT(block_size, 0);
+      int64_t nblocks = (p.numel() + block_size - 1) / block_size;
+      data = torch::zeros(
+          {nblocks, block_size},
+          p.options().dtype(non_negative ? torch::kUInt8 : torch::kInt8));
+      scale = torch::zeros({nblocks}, p.options());
+    }
+  } else if (data.device() != p.device()) {
+    data = data.to(p.device());
+    if (scale.numel() > 0) {
+      scale = scale.to(p.device());
+    }
+  }
+  if (format == StateFormat::kBFloat16) {
+    state.value =
+        data.view({nrows, -1}).index_select(0, rows).to(p.scalar_type());
+    return state;
+  }
+  const int64_t rowSize = p.numel() / nrows;
+  const int64_t blockSize = data.size(1);
+  Tensor elements = rows.unsqueeze(1)
+                        .mul(rowSize)
+                        .add(torch::arange(rowSize, rows.options()))
+                        .view({-1});
+  // rows升序, 元素所在的block编号不减, 相邻的行可能共用一个block
+  Tensor blockOf = elements.div(blockSize);
+  auto unique = torch::unique_consecutive(blockOf, /*return_inverse=*/true);
+  state.blocks = std::get<0>(unique);
+  state.offsets = std::get<1>(unique).mul_(blockSize).add_(
+      elements.sub(blockOf.mul(blockSize)));
+  state.block_values =
+      data.index_select(0, state.blocks)
+          .to(p.scalar_type())
+          .mul_(scale.index_select(0, state.blocks).view({-1, 1}));
+  if (non_negative) {
+    state.block_values.mul_(state.block_values);
+  }
+  state.value = state.block_values.view({-1})
+                    .index_select(0, state.offsets)
+                    .view({rows.numel(), rowSize});
+  return state;
+}
+
+void StoreStateRows(const std::vector<Tensor>& parameters, StateFormat format,
+                    std::vector<Tensor>* datas, std::vector<Tensor>* scales,
+                    size_t index, bool non_negative, const Tensor& rows,
+                    const StateRows& state) {
+  torch::NoGradGuard guard;
+  const int64_t nrows = parameters.at(index).size(0);
+  Tensor& data = (*datas)[index];
+  if (format == StateFormat::kFloat32) {
+    data.view({nrows, -1}).index_copy_(0, rows, state.value);
+    return;
+  }
+  if (format == StateFormat::kBFloat16) {
+    data.view({nrows, -1})
+        .index_copy_(0, rows, state.value.to(data.scalar_type()));
+    return;
+  }
+  // block里不属于这些行的元素保持解压出的值, 和整个重新量化时一样
+  state.block_values.view({-1}).index_copy_(0, state.offsets,
+                                            state.value.view({-1}));
+  Tensor scale;
+  Tensor q = QuantizeBlocks(state.block_values, non_negative, &scale);
+  data.index_copy_(0, state.blocks, q);
+  (*scales)[index].index_copy_(0, state.blocks, scale);
+}
+
+Tensor& RowStepAt(const std::vector<Tensor>& parameters,
+                  std::vector<Tensor>* row_steps, size_t index,
+                  int64_t step) {
+  while (row_steps->size() <= index) {
+    row_steps->push_back(torch::empty({0}, torch::kInt64));
+  }
+  const Tensor& p = parameters.at(index);
+  Tensor& last_step = (*row_steps)[index];
+  if (last_step.numel() != p.size(0)) {
+    last_step = torch::full({p.size(0)}, step - 1,
+                            p.options().dtype(torch::kInt64));
+  } else if (last_step.device() != p.device()) {
+    last_step = last_step.to(p.device());
+  }
+  return last_step;
+}
+
+double StateBytesPerElement(StateFormat format, int64_t block_size) {
+  switch (format) {
+    case StateFormat::kBFloat16:
+      return 2.0 * 2;
+    case StateFormat::kBlockInt8:
+      return 2.0 * (1.0 + 4.0 / static_cast<double>(block_size));
+    default:
+      return 2.0 * 4;
+  }
+}
+
+}  // namespace optim
+}  // namespace radish
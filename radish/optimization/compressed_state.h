@@ -0,0 +1,103 @@
+/*
+ * File: compressed_state.h
+ * Project: optimization
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-04 3:12:40
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "torch/torch.h"
+
+namespace radish {
+namespace optim {
+
+/**
+ * 优化器一阶/二阶矩的存储格式
+ * kFloat32    -> 和参数相同, 每个元素4字节
+ * kBFloat16   -> bf16存储, 每个元素2字节
+ * kBlockInt8  -> 按block做absmax量化的8bit, 每个元素1字节 + 每个block一个float
+ *                scale; 二阶矩非负, 在sqrt域上用uint8量化以保留动态范围,
+ *                随机舍入, 正的值最少一级
+ */
+enum class StateFormat { kFloat32 = 0, kBFloat16 = 1, kBlockInt8 = 2 };
+
+StateFormat StateFormatFromString(const std::string& name);
+std::string StateFormatName(StateFormat format);
+
+/// 单个参数的一阶或二阶矩, 以压缩格式存储
+/// `data` 和 `scale` 直接参与优化器的序列化
+torch::Tensor CompressState(const torch::Tensor& value, StateFormat format,
+                            int64_t block_size, bool non_negative,
+                            torch::Tensor* scale);
+
+/// 解压成和 `like` 同shape的fp32 tensor
+torch::Tensor DecompressState(const torch::Tensor& data,
+                              const torch::Tensor& scale, StateFormat format,
+                              bool non_negative, const torch::Tensor& like);
+
+/**
+ * 优化器里按参数编号存放的矩: 取出第index个参数的fp32值, 不存在时是全0.
+ * kFloat32 时返回的就是 datas 里的buffer, 原地更新即可;
+ * 压缩格式时是解压出的拷贝, 更新之后要调用 StoreState 写回
+ */
+torch::Tensor LoadState(const std::vector<torch::Tensor>& parameters,
+                        StateFormat format, std::vector<torch::Tensor>* datas,
+                        std::vector<torch::Tensor>* scales, size_t index,
+                        bool non_negative);
+
+/// 压缩格式时把更新后的矩写回 datas/scales, kFloat32 时什么都不做
+void StoreState(StateFormat format, int64_t block_size,
+                std::vector<torch::Tensor>* datas,
+                std::vector<torch::Tensor>* scales, size_t index,
+                bool non_negative, const torch::Tensor& value);
+
+/// 稀疏更新时取出的部分矩, 见 LoadStateRows
+struct StateRows {
+  // [行数, 行大小] 的fp32, 原地更新之后用 StoreStateRows 写回
+  torch::Tensor value;
+  // kBlockInt8: 这些行所在的block编号, 解压出的这些block,
+  // value 的每个元素在 block_values 里的位置
+  torch::Tensor blocks;
+  torch::Tensor block_values;
+  torch::Tensor offsets;
+};
+
+/**
+ * 稀疏更新只取出第index个参数里 rows(升序, 不重复) 这些行的矩,
+ * 压缩格式时只解压这些行所在的block, 不解压整张embedding表.
+ * 还没有状态时按 block_size 建一份全0的
+ */
+StateRows LoadStateRows(const std::vector<torch::Tensor>& parameters,
+                        StateFormat format, int64_t block_size,
+                        std::vector<torch::Tensor>* datas,
+                        std::vector<torch::Tensor>* scales, size_t index,
+                        bool non_negative, const torch::Tensor& rows);
+
+/// 把更新后的这些行写回, kBlockInt8 时只重新量化它们所在的block
+void StoreStateRows(const std::vector<torch::Tensor>& parameters,
+                    StateFormat format, std::vector<torch::Tensor>* datas,
+                    std::vector<torch::Tensor>* scales, size_t index,
+                    bool non_negative, const torch::Tensor& rows,
+                    const StateRows& state);
+
+/**
+ * 稀疏梯度(embedding)第index个参数每一行最后一次更新时的step.
+ * 第一次稀疏更新时创建, 之前的步都当作所有行已经更新过
+ */
+torch::Tensor& RowStepAt(const std::vector<torch::Tensor>& parameters,
+                         std::vector<torch::Tensor>* row_steps, size_t index,
+                         int64_t step);
+
+/// 一个参数元素对应的两个矩一共占用的字节数, 用来估算节省的内存
+double StateBytesPerElement(StateFormat format, int64_t block_size);
+
+}  // namespace optim
+}  // namespace radish
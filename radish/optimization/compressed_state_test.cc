@@ -0,0 +1,83 @@
+/*
+ * File: compressed_state_test.cc
+ * Project: optimization
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-04 4:21:02
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <cmath>
+
+#include "gtest/gtest.h"
+
+#include "radish/optimization/compressed_state.h"
+
+using radish::optim::CompressState;
+using radish::optim::DecompressState;
+using radish::optim::StateFormat;
+
+TEST(CompressedStateTest, TestBlockInt8RoundTrip) {
+  torch::Tensor m = torch::randn({300, 17});
+  torch::Tensor scale;
+  torch::Tensor q =
+      CompressState(m, StateFormat::kBlockInt8, 256, false, &scale);
+  EXPECT_EQ(q.scalar_type(), torch::kInt8);
+  EXPECT_EQ(scale.numel(), (300 * 17 + 255) / 256);
+  torch::Tensor back =
+      DecompressState(q, scale, StateFormat::kBlockInt8, false, m);
+  EXPECT_EQ(back.sizes(), m.sizes());
+  // 每个block的误差不超过半个量化step
+  float maxErr = (back - m).abs().max().item().to<float>();
+  float maxStep = scale.max().item().to<float>();
+  EXPECT_LE(maxErr, maxStep * 0.5 + 1e-6);
+}
+
+TEST(CompressedStateTest, TestBlockInt8SecondMomentNeverZero) {
+  torch::Tensor v = torch::rand({1000}).pow_(4).mul_(1e-6);
+  torch::Tensor scale;
+  torch::Tensor q =
+      CompressState(v, StateFormat::kBlockInt8, 128, true, &scale);
+  EXPECT_EQ(q.scalar_type(), torch::kUInt8);
+  torch::Tensor back =
+      DecompressState(q, scale, StateFormat::kBlockInt8, true, v);
+  // 正的二阶矩解压后仍然是正的
+  EXPECT_TRUE(back.gt(0).eq(v.gt(0)).all().item().to<bool>());
+}
+
+TEST(CompressedStateTest, TestBlockInt8DecayingSecondMomentDecays) {
+  torch::manual_seed(3);
+  // 第0个元素每步都有梯度, 一直是block的absmax; 其他元素没有梯度,
+  // 只按beta2衰减, 每步解压, 衰减, 再压缩
+  const double beta2 = 0.999;
+  const int steps = 2000;
+  torch::Tensor v = torch::full({128}, 0.25f);
+  v[0] = 1.0;
+  torch::Tensor scale;
+  torch::Tensor q =
+      CompressState(v, StateFormat::kBlockInt8, 128, true, &scale);
+  for (int i = 0; i < steps; i++) {
+    torch::Tensor cur =
+        DecompressState(q, scale, StateFormat::kBlockInt8, true, v);
+    cur.mul_(beta2);
+    cur[0] = 1.0;
+    q = CompressState(cur, StateFormat::kBlockInt8, 128, true, &scale);
+  }
+  torch::Tensor back =
+      DecompressState(q, scale, StateFormat::kBlockInt8, true, v);
+  // 随机舍入在sqrt域上无偏, 按sqrt的平均值比较
+  float expected = std::sqrt(0.25 * std::pow(beta2, steps));
+  float got = back.narrow(0, 1, 127).sqrt().mean().item().to<float>();
+  EXPECT_NEAR(got, expected, expected * 0.15);
+  EXPECT_NEAR(back[0].item().to<float>(), 1.0, 1e-5);
+}
+
+TEST(CompressedStateTest, TestBytesPerElement) {
+  EXPECT_DOUBLE_EQ(
+      radish::optim::StateBytesPerElement(StateFormat::kFloat32, 2048), 8.0);
+  EXPECT_DOUBLE_EQ(
+      radish::optim::StateBytesPerElement(StateFormat::kBFloat16, 2048), 4.0);
+  EXPECT_LT(
+      radish::optim::StateBytesPerElement(StateFormat::kBlockInt8, 2048), 2.01);
+}
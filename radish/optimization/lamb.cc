@@ -56,33 +56,113 @@ void Lamb::step() {
       continue;
     }
     auto lr = options.learning_rate();
-    auto& exp_average = buffer_at(exp_average_buffers, i);
-    auto& exp_average_sq = buffer_at(exp_average_sq_buffers, i);
     buffer_at(step_buffers, i) += 1;
-    float beta2_t = std::pow(options.beta2(), buffer_at(step_buffers, i));
-    float beta1_t = std::pow(options.beta1(), buffer_at(step_buffers, i));
+    int64_t step = buffer_at(step_buffers, i);
+    double weight_decay = 0;
+    if (options.weight_decay() > 0 && need_weight_decay) {
+      weight_decay = options.weight_decay();
+    }
 
+    if (p.grad().is_sparse()) {
+      sparse_update_(i, step, lr, weight_decay);
+      continue;
+    }
+    Tensor exp_average =
+        LoadState(parameters_, options.state_format(), &exp_average_buffers,
+                  &exp_average_scales, i, false);
+    Tensor exp_average_sq =
+        LoadState(parameters_, options.state_format(), &exp_average_sq_buffers,
+                  &exp_average_sq_scales, i, true);
     exp_average.mul_(options.beta1()).add_(p.grad(), 1 - options.beta1());
     exp_average_sq.mul_(options.beta2())
         .addcmul_(p.grad(), p.grad(), 1 - options.beta2());
 
     auto adam_step = exp_average.div(exp_average_sq.sqrt().add(options.eps()));
-    if (options.weight_decay() > 0 && need_weight_decay) {
-      adam_step.add_(p, options.weight_decay());
+    if (weight_decay > 0) {
+      adam_step.add_(p, weight_decay);
     }
     {
       torch::NoGradGuard guard;
-      auto adam_norm = adam_step.pow(2).sum().sqrt().item().to<float>();
-      auto weight_norm =
-          p.pow(2).sum().sqrt_().clamp_(0, 10).item().to<float>();
-      float trust_ratio = weight_norm / adam_norm;
-      if ((weight_norm < 1e-8 && weight_norm > -1e-8) ||
-          (adam_norm < 1e-8 && adam_norm > -1e-8)) {
-        trust_ratio = 1.0;
+      p.add_(adam_step, -lr * trust_ratio_(p, adam_step));
+      if (i < row_step_buffers.size() && row_step_buffers[i].numel() > 0) {
+        row_step_buffers[i].fill_(step);
       }
-      p.add_(adam_step, -lr * trust_ratio);
     }
+    StoreState(options.state_format(), options.state_block_size(),
+               &exp_average_buffers, &exp_average_scales, i, false,
+               exp_average);
+    StoreState(options.state_format(), options.state_block_size(),
+               &exp_average_sq_buffers, &exp_average_sq_scales, i, true,
+               exp_average_sq);
+  }
+}
+
+float Lamb::trust_ratio_(const Tensor& weight, const Tensor& adam_step) {
+  torch::NoGradGuard guard;
+  auto adam_norm = adam_step.pow(2).sum().sqrt().item().to<float>();
+  auto weight_norm =
+      weight.pow(2).sum().sqrt_().clamp_(0, 10).item().to<float>();
+  float trust_ratio = weight_norm / adam_norm;
+  if ((weight_norm < 1e-8 && weight_norm > -1e-8) ||
+      (adam_norm < 1e-8 && adam_norm > -1e-8)) {
+    trust_ratio = 1.0;
+  }
+  return trust_ratio;
+}
+
+void Lamb::sparse_update_(size_t index, int64_t step, double lr,
+                          double weight_decay) {
+  torch::NoGradGuard guard;
+  Tensor p = parameters_.at(index);
+  Tensor grad = p.grad().coalesce();
+  CHECK_EQ(grad.sparse_dim(), 1) << "only row sparse grad supported for:"
+                                 << names_[index];
+  int64_t nnz = grad._nnz();
+  if (nnz == 0) {
+    return;
   }
+  int64_t nrows = p.size(0);
+  Tensor rows = grad._indices().select(0, 0);
+  Tensor values = grad._values().reshape({nnz, -1});
+  Tensor& last_step = RowStepAt(parameters_, &row_step_buffers, index, step);
+  // 上次更新之后这些行跳过的步数, 那些步梯度为0, 矩只需要补上衰减
+  Tensor skipped = last_step.index_select(0, rows)
+                       .neg_()
+                       .add_(step - 1)
+                       .to(values.scalar_type())
+                       .unsqueeze(1);
+  StateRows m_rows = LoadStateRows(
+      parameters_, options.state_format(), options.state_block_size(),
+      &exp_average_buffers, &exp_average_scales, index, false, rows);
+  StateRows v_rows = LoadStateRows(
+      parameters_, options.state_format(), options.state_block_size(),
+      &exp_average_sq_buffers, &exp_average_sq_scales, index, true, rows);
+  Tensor& m = m_rows.value;
+  Tensor& v = v_rows.value;
+  m.mul_(torch::pow(options.beta1(), skipped + 1))
+      .add_(values, 1 - options.beta1());
+  v.mul_(torch::pow(options.beta2(), skipped + 1))
+      .addcmul_(values, values, 1 - options.beta2());
+
+  Tensor p_rows = p.view({nrows, -1});
+  Tensor w = p_rows.index_select(0, rows);
+  auto adam_step = m.div(v.sqrt().add(options.eps()));
+  if (weight_decay > 0) {
+    adam_step.add_(w, weight_decay);
+  }
+  // trust ratio只在这次出现的行上计算
+  w.add_(adam_step, -lr * trust_ratio_(w, adam_step));
+  p_rows.index_copy_(0, rows, w);
+  StoreStateRows(parameters_, options.state_format(), &exp_average_buffers,
+                 &exp_average_scales, index, false, rows, m_rows);
+  StoreStateRows(parameters_, options.state_format(), &exp_average_sq_buffers,
+                 &exp_average_sq_scales, index, true, rows, v_rows);
+  last_step.index_fill_(0, rows, step);
+}
+
+double Lamb::StateBytesPerParameter() const {
+  return StateBytesPerElement(options.state_format(),
+                              options.state_block_size());
 }
 
 void Lamb::save(::torch::serialize::OutputArchive& archive) const {
@@ -62,40 +62,120 @@ void RAdam::step() {
       continue;
     }
     auto lr = options.learning_rate();
-    auto& exp_average = buffer_at(exp_average_buffers, i);
-    auto& exp_average_sq = buffer_at(exp_average_sq_buffers, i);
     buffer_at(step_buffers, i) += 1;
-    if (buffer_at(step_buffers, i) < options.warmup_steps()) {
-      lr *= buffer_at(step_buffers, i) / (options.warmup_steps() + 0.0001);
+    int64_t step = buffer_at(step_buffers, i);
+    if (step < options.warmup_steps()) {
+      lr *= step / (options.warmup_steps() + 0.0001);
     }
-    float beta2_t = std::pow(options.beta2(), buffer_at(step_buffers, i));
-    float beta1_t = std::pow(options.beta1(), buffer_at(step_buffers, i));
+    float beta2_t = std::pow(options.beta2(), step);
+    float beta1_t = std::pow(options.beta1(), step);
 
+    const auto pt = p_inf_ - (2.0 * step * beta2_t) / (1 - beta2_t);
+    const bool rectified = pt > 5.0;
+    double step_size = lr / (1.0 - beta1_t);
+    if (rectified) {
+      double r =
+          ((pt - 4) * (pt - 2) * p_inf_) / ((p_inf_ - 4) * (p_inf_ - 2) * pt);
+      step_size *= sqrt(r);
+    }
+    double decay = 0;
+    if (options.weight_decay() > 0 && need_weight_decay) {
+      decay = options.weight_decay() * lr;
+    }
+
+    if (p.grad().is_sparse()) {
+      sparse_update_(i, step, decay, step_size, rectified);
+      continue;
+    }
+    Tensor exp_average =
+        LoadState(parameters_, options.state_format(), &exp_average_buffers,
+                  &exp_average_scales, i, false);
+    Tensor exp_average_sq =
+        LoadState(parameters_, options.state_format(), &exp_average_sq_buffers,
+                  &exp_average_sq_scales, i, true);
     exp_average.mul_(options.beta1()).add_(p.grad(), 1 - options.beta1());
     exp_average_sq.mul_(options.beta2())
         .addcmul_(p.grad(), p.grad(), 1 - options.beta2());
-
-    const auto pt =
-        p_inf_ - (2.0 * buffer_at(step_buffers, i) * beta2_t) / (1 - beta2_t);
-    if (options.weight_decay() > 0 && need_weight_decay) {
+    {
       torch::NoGradGuard guard;
-      p.add_(p, -options.weight_decay() * lr);
+      // 和稀疏更新里补的 (1-decay)^k 写法一致, 结果逐位相同
+      if (decay > 0) {
+        p.mul_(1 - decay);
+      }
+      if (rectified) {
+        const auto denorm = exp_average_sq.sqrt().add_(options.eps());
+        p.add_(torch::div(exp_average, denorm), -step_size);
+      } else {
+        p.add_(exp_average, -step_size);
+      }
+      if (i < row_step_buffers.size() && row_step_buffers[i].numel() > 0) {
+        row_step_buffers[i].fill_(step);
+      }
     }
+    StoreState(options.state_format(), options.state_block_size(),
+               &exp_average_buffers, &exp_average_scales, i, false,
+               exp_average);
+    StoreState(options.state_format(), options.state_block_size(),
+               &exp_average_sq_buffers, &exp_average_sq_scales, i, true,
+               exp_average_sq);
+  }
+}
 
-    if (pt > 5.0) {
-      const auto denorm = exp_average_sq.sqrt().add_(options.eps());
-      double r =
-          ((pt - 4) * (pt - 2) * p_inf_) / ((p_inf_ - 4) * (p_inf_ - 2) * pt);
-      r = sqrt(r);
-      torch::NoGradGuard guard;
-      const auto step_size = (lr * r) / (1.0 - beta1_t);
-      p.add_(torch::div(exp_average, denorm), -step_size);
-    } else {
-      torch::NoGradGuard guard;
-      const auto step_size = lr / (1.0 - beta1_t);
-      p.add_(exp_average, -step_size);
-    }
+void RAdam::sparse_update_(size_t index, int64_t step, double decay,
+                           double step_size, bool rectified) {
+  torch::NoGradGuard guard;
+  Tensor p = parameters_.at(index);
+  Tensor grad = p.grad().coalesce();
+  CHECK_EQ(grad.sparse_dim(), 1) << "only row sparse grad supported for:"
+                                 << names_[index];
+  int64_t nnz = grad._nnz();
+  if (nnz == 0) {
+    return;
+  }
+  int64_t nrows = p.size(0);
+  Tensor rows = grad._indices().select(0, 0);
+  Tensor values = grad._values().reshape({nnz, -1});
+  Tensor& last_step = RowStepAt(parameters_, &row_step_buffers, index, step);
+  // 上次更新之后这些行跳过的步数, 那些步梯度为0, 矩只需要补上衰减
+  Tensor skipped = last_step.index_select(0, rows)
+                       .neg_()
+                       .add_(step - 1)
+                       .to(values.scalar_type())
+                       .unsqueeze(1);
+  StateRows m_rows = LoadStateRows(
+      parameters_, options.state_format(), options.state_block_size(),
+      &exp_average_buffers, &exp_average_scales, index, false, rows);
+  StateRows v_rows = LoadStateRows(
+      parameters_, options.state_format(), options.state_block_size(),
+      &exp_average_sq_buffers, &exp_average_sq_scales, index, true, rows);
+  Tensor& m = m_rows.value;
+  Tensor& v = v_rows.value;
+  m.mul_(torch::pow(options.beta1(), skipped + 1))
+      .add_(values, 1 - options.beta1());
+  v.mul_(torch::pow(options.beta2(), skipped + 1))
+      .addcmul_(values, values, 1 - options.beta2());
+
+  Tensor p_rows = p.view({nrows, -1});
+  Tensor w = p_rows.index_select(0, rows);
+  if (decay > 0) {
+    w.mul_(torch::pow(1.0 - decay, skipped + 1));
+  }
+  if (rectified) {
+    w.add_(torch::div(m, v.sqrt().add_(options.eps())), -step_size);
+  } else {
+    w.add_(m, -step_size);
   }
+  p_rows.index_copy_(0, rows, w);
+  StoreStateRows(parameters_, options.state_format(), &exp_average_buffers,
+                 &exp_average_scales, index, false, rows, m_rows);
+  StoreStateRows(parameters_, options.state_format(), &exp_average_sq_buffers,
+                 &exp_average_sq_scales, index, true, rows, v_rows);
+  last_step.index_fill_(0, rows, step);
+}
+
+double RAdam::StateBytesPerParameter() const {
+  return StateBytesPerElement(options.state_format(),
+                              options.state_block_size());
 }
 
 void RAdam::save(::torch::serialize::OutputArchive& archive) const {
@@ -18,6 +18,7 @@
 #include "torch/nn/module.h"
 #include "torch/optim/optimizer.h"
 #include "torch/optim/serialize.h"
+#include "radish/optimization/compressed_state.h"
 #include "radish/utils/logging.h"
 
 namespace torch {
@@ -38,6 +39,10 @@ struct TORCH_API RAdamOptions {
   TORCH_ARG(double, weight_decay) = 0.01;
   TORCH_ARG(double, eps) = 1e-8;
   TORCH_ARG(double, clip_norm) = 3.0;
+  // 一阶/二阶矩的存储格式, 见 compressed_state.h
+  TORCH_ARG(StateFormat, state_format) = StateFormat::kFloat32;
+  // kBlockInt8时每个量化block的元素个数
+  TORCH_ARG(int64_t, state_block_size) = 2048;
   TORCH_ARG(int64_t, warmup_steps) = 1;
 };
 
@@ -56,6 +61,14 @@ class TORCH_API RAdam : public ::torch::optim::Optimizer {
   std::vector<int64_t> step_buffers;
   std::vector<::torch::Tensor> exp_average_buffers;
   std::vector<::torch::Tensor> exp_average_sq_buffers;
+  // 仅kBlockInt8时有内容, 每个block的scale
+  std::vector<::torch::Tensor> exp_average_scales;
+  std::vector<::torch::Tensor> exp_average_sq_scales;
+  // 稀疏梯度(embedding)每一行最后一次更新时的step, 用于补上跳过的衰减
+  std::vector<::torch::Tensor> row_step_buffers;
+
+  // 每个参数元素的优化器状态占用的字节数
+  double StateBytesPerParameter() const;
   double p_inf_;
 
  private:
@@ -63,11 +76,19 @@ class TORCH_API RAdam : public ::torch::optim::Optimizer {
   std::vector<std::string> names_;
   std::vector<bool> need_weight_decay_;
 
+  // 只更新稀疏梯度里出现的行, 以及这些行的一阶/二阶矩,
+  // 压缩格式时也只解压和写回这些行所在的部分
+  void sparse_update_(size_t index, int64_t step, double decay,
+                      double step_size, bool rectified);
+
   template <typename Self, typename Archive>
   static void serialize(Self& self, Archive& archive) {
     _TORCH_OPTIM_SERIALIZE(step_buffers);
     _TORCH_OPTIM_SERIALIZE(exp_average_buffers);
     _TORCH_OPTIM_SERIALIZE(exp_average_sq_buffers);
+    _TORCH_OPTIM_SERIALIZE(exp_average_scales);
+    _TORCH_OPTIM_SERIALIZE(exp_average_sq_scales);
+    _TORCH_OPTIM_SERIALIZE(row_step_buffers);
   }
 };
 }  // namespace optim
@@ -0,0 +1,168 @@
+/*
+ * File: radam_test.cc
+ * Project: optimization
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-04 5:02:17
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "radish/optimization/lamb.h"
+#include "radish/optimization/radam.h"
+
+using radish::optim::Lamb;
+using radish::optim::LambOptions;
+using radish::optim::RAdam;
+using radish::optim::RAdamOptions;
+using radish::optim::StateFormat;
+
+namespace {
+
+// 线性回归 Y = XW + 噪声, 全batch训练, 返回最后的MSE
+template <class Optimizer, class Options>
+float TrainRegression(Options options, int steps) {
+  torch::manual_seed(1);
+  torch::Tensor x = torch::randn({512, 64});
+  torch::Tensor truth = torch::randn({64, 16});
+  torch::Tensor y = x.mm(truth).add_(torch::randn({512, 16}), 0.01);
+  torch::Tensor w = torch::zeros({64, 16}, torch::requires_grad());
+  Optimizer opt({w}, {"weight"}, options.weight_decay(0).clip_norm(0));
+  float loss = 0;
+  for (int i = 0; i < steps; i++) {
+    opt.zero_grad();
+    torch::Tensor l = (x.mm(w) - y).pow(2).mean();
+    l.backward();
+    opt.step();
+    loss = l.item().to<float>();
+  }
+  return loss;
+}
+
+// embedding按行训练steps步, 每步用到 ids 里的行, 返回最后的权重.
+// sparse时梯度是稀疏的, 走优化器的按行更新
+template <class Optimizer, class Options>
+torch::Tensor TrainEmbedding(Options options, bool sparse, int steps) {
+  torch::manual_seed(2);
+  torch::Tensor coeffs = torch::randn({steps, 10, 8});
+  torch::Tensor w = torch::randn({10, 8}, torch::requires_grad());
+  torch::Tensor ids = torch::arange(10, torch::kInt64);
+  Optimizer opt({w}, {"embedding"}, options.clip_norm(0));
+  for (int i = 0; i < steps; i++) {
+    opt.zero_grad();
+    torch::Tensor out = torch::embedding(w, ids, -1, false, sparse);
+    out.mul(coeffs[i]).sum().backward();
+    opt.step();
+  }
+  return w.detach().clone();
+}
+
+}  // namespace
+
+TEST(RAdamTest, TestCompressedStateConverges) {
+  const int steps = 1500;
+  float initial = TrainRegression<RAdam>(RAdamOptions(0.01), 1);
+  float fp32 = TrainRegression<RAdam>(RAdamOptions(0.01), steps);
+  ASSERT_LT(fp32, initial * 0.05);
+  for (StateFormat format : {StateFormat::kBFloat16, StateFormat::kBlockInt8}) {
+    float loss = TrainRegression<RAdam>(
+        RAdamOptions(0.01).state_format(format).state_block_size(256), steps);
+    EXPECT_LT(loss, fp32 * 2 + initial * 1e-3)
+        << radish::optim::StateFormatName(format);
+  }
+}
+
+TEST(LambTest, TestCompressedStateConverges) {
+  const int steps = 1500;
+  float initial = TrainRegression<Lamb>(LambOptions(0.01), 1);
+  float fp32 = TrainRegression<Lamb>(LambOptions(0.01), steps);
+  ASSERT_LT(fp32, initial * 0.05);
+  for (StateFormat format : {StateFormat::kBFloat16, StateFormat::kBlockInt8}) {
+    float loss = TrainRegression<Lamb>(
+        LambOptions(0.01).state_format(format).state_block_size(256), steps);
+    EXPECT_LT(loss, fp32 * 2 + initial * 1e-3)
+        << radish::optim::StateFormatName(format);
+  }
+}
+
+TEST(RAdamTest, TestSparseUpdateMatchesDenseWhenAllRowsTouched) {
+  for (StateFormat format : {StateFormat::kFloat32, StateFormat::kBFloat16,
+                             StateFormat::kBlockInt8}) {
+    // block比一行小也比一行大, 覆盖一行跨block和多行共用block
+    for (int64_t block : {6, 32}) {
+      auto options = RAdamOptions(0.01)
+                         .weight_decay(0.1)
+                         .state_format(format)
+                         .state_block_size(block);
+      torch::Tensor dense = TrainEmbedding<RAdam>(options, false, 12);
+      torch::Tensor sparse = TrainEmbedding<RAdam>(options, true, 12);
+      EXPECT_TRUE(torch::equal(dense, sparse))
+          << radish::optim::StateFormatName(format) << " block:" << block;
+    }
+  }
+}
+
+TEST(LambTest, TestSparseUpdateMatchesDenseWhenAllRowsTouched) {
+  for (StateFormat format : {StateFormat::kFloat32, StateFormat::kBFloat16,
+                             StateFormat::kBlockInt8}) {
+    for (int64_t block : {6, 32}) {
+      auto options = LambOptions(0.01)
+                         .weight_decay(0.1)
+                         .state_format(format)
+                         .state_block_size(block);
+      torch::Tensor dense = TrainEmbedding<Lamb>(options, false, 12);
+      torch::Tensor sparse = TrainEmbedding<Lamb>(options, true, 12);
+      EXPECT_TRUE(torch::equal(dense, sparse))
+          << radish::optim::StateFormatName(format) << " block:" << block;
+    }
+  }
+}
+
+TEST(RAdamTest, TestSkippedRowsCatchUpDecay) {
+  const double lr = 0.01;
+  const double weightDecay = 0.1;
+  const double beta1 = 0.9;
+  const double beta2 = 0.999;
+  const int k = 2;
+  torch::manual_seed(3);
+  torch::Tensor w = torch::randn({4, 8}, torch::requires_grad());
+  RAdam opt({w}, {"embedding"},
+            RAdamOptions(lr).weight_decay(weightDecay).clip_norm(0));
+  auto sparseStep = [&](torch::Tensor ids, torch::Tensor coeff) {
+    opt.zero_grad();
+    torch::Tensor out = torch::embedding(w, ids, -1, false, true);
+    out.mul(coeff).sum().backward();
+    opt.step();
+  };
+  torch::Tensor all = torch::arange(4, torch::kInt64);
+  sparseStep(all, torch::randn({4, 8}));
+  torch::Tensor m1 = opt.exp_average_buffers[0][1].clone();
+  torch::Tensor v1 = opt.exp_average_sq_buffers[0][1].clone();
+  torch::Tensor w1 = w.detach()[1].clone();
+  // 第1行跳过k步
+  for (int i = 0; i < k; i++) {
+    sparseStep(torch::tensor({0}, torch::kInt64), torch::randn({1, 8}));
+  }
+  ASSERT_TRUE(torch::equal(w.detach()[1], w1));
+  // 第1行的梯度是0, 只剩补上的衰减和用衰减后的矩算的更新
+  torch::Tensor coeff = torch::randn({4, 8});
+  coeff[1].zero_();
+  sparseStep(all, coeff);
+
+  const int64_t step = k + 2;
+  torch::Tensor m = m1 * std::pow(beta1, k + 1);
+  torch::Tensor v = v1 * std::pow(beta2, k + 1);
+  EXPECT_TRUE(torch::allclose(opt.exp_average_buffers[0][1], m, 1e-5, 1e-10));
+  EXPECT_TRUE(
+      torch::allclose(opt.exp_average_sq_buffers[0][1], v, 1e-5, 1e-12));
+  // 前几步没有rectify, 更新是 step_size * m
+  const double stepSize = lr / (1 - std::pow(beta1, step));
+  torch::Tensor expected =
+      w1 * std::pow(1 - weightDecay * lr, k + 1) - m * stepSize;
+  EXPECT_TRUE(torch::allclose(w.detach()[1], expected, 1e-5, 1e-7));
+}
@@ -0,0 +1,163 @@
+/*
+ * File: async_evaluator.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-07 2:41:09
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/types/optional.h"
+#include "torch/torch.h"
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace train {
+
+/**
+ * 在独立线程上做eval, 训练不用停下来等.
+ * Submit 把训练模型的权重拷贝到replica(同设备上的memcpy)后立刻返回,
+ * eval在后台线程上对replica进行; 同一时间只有一个eval在跑,
+ * 上一个还没跑完时新的Submit会被跳过.
+ * 结果由训练线程通过 Poll 取回, 取回之前replica不会被覆盖,
+ * 可以直接用它保存最优模型.
+ */
+template <class Model>
+class AsyncEvaluator {
+ public:
+  struct Result {
+    int64_t step;
+    float train_loss;
+    float loss;
+    std::vector<float> evals;
+  };
+  // 在replica上跑一遍测试集, 返回loss, 其它指标放在evals里
+  typedef std::function<float(Model, std::vector<float>&)> EvalFn;
+
+  AsyncEvaluator(Model replica, EvalFn fn)
+      : replica_(replica),
+        fn_(fn),
+        worker_(&AsyncEvaluator::run_, this) {}
+
+  ~AsyncEvaluator() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    worker_.join();
+  }
+
+  bool Submit(Model model, int64_t step, float trainLoss) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (busy_) {
+      skipped_ += 1;
+      return false;
+    }
+    {
+      torch::NoGradGuard guard;
+      auto src = model->parameters();
+      auto dst = replica_->parameters();
+      CHECK_EQ(src.size(), dst.size()) << "replica is not the same model";
+      for (size_t i = 0; i < src.size(); i++) {
+        dst[i].copy_(src[i]);
+      }
+      auto srcBuffers = model->buffers();
+      auto dstBuffers = replica_->buffers();
+      CHECK_EQ(srcBuffers.size(), dstBuffers.size());
+      for (size_t i = 0; i < srcBuffers.size(); i++) {
+        dstBuffers[i].copy_(srcBuffers[i]);
+      }
+    }
+    pending_.step = step;
+    pending_.train_loss = trainLoss;
+    busy_ = true;
+    has_request_ = true;
+    lock.unlock();
+    cond_.notify_all();
+    return true;
+  }
+
+  // 有完成的eval结果时返回, 不阻塞
+  absl::optional<Result> Poll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return take_();
+  }
+
+  // 等待进行中的eval完成
+  absl::optional<Result> Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return !has_request_ && !running_; });
+    return take_();
+  }
+
+  // 保存的是最近一次取回的结果对应的权重
+  Model replica() const { return replica_; }
+  int64_t skipped() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return skipped_;
+  }
+
+ private:
+  absl::optional<Result> take_() {
+    if (!done_) {
+      return absl::nullopt;
+    }
+    done_ = false;
+    busy_ = false;
+    return pending_;
+  }
+
+  void run_() {
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stop_ || has_request_; });
+      if (stop_) {
+        return;
+      }
+      has_request_ = false;
+      running_ = true;
+      lock.unlock();
+
+      std::vector<float> evals;
+      float loss = fn_(replica_, evals);
+
+      lock.lock();
+      pending_.loss = loss;
+      pending_.evals = evals;
+      running_ = false;
+      done_ = true;
+      lock.unlock();
+      cond_.notify_all();
+    }
+  }
+
+  Model replica_;
+  EvalFn fn_;
+  Result pending_;
+  // busy_ 从Submit一直到结果被取回
+  bool busy_ = false;
+  bool has_request_ = false;
+  bool running_ = false;
+  bool done_ = false;
+  bool stop_ = false;
+  int64_t skipped_ = 0;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread worker_;
+};
+
+}  // namespace train
+}  // namespace radish
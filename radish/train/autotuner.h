@@ -0,0 +1,325 @@
+/*
+ * File: autotuner.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-13 10:22:31
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ATen/Parallel.h"
+#include "json/json.h"
+#include "torch/arg.h"
+#include "torch/torch.h"
+
+#include "radish/optimization/radam.h"
+#include "radish/train/batch_prefetcher.h"
+#include "radish/train/collate.h"
+#include "radish/train/llb_trainer.h"
+#include "radish/train/metrics_sink.h"
+#include "radish/utils/logging.h"
+#include "radish/utils/runtime_config.h"
+
+namespace radish {
+namespace train {
+
+/// 搜索空间和每次试跑的长度, 每个维度的第一个值作为起点
+struct TORCH_API AutotuneOptions {
+  TORCH_ARG(std::vector<int>, batch_sizes) = std::vector<int>({32});
+  // 0表示libtorch的默认线程数
+  TORCH_ARG(std::vector<int>, intra_op_threads) = std::vector<int>({0});
+  TORCH_ARG(std::vector<int>, loader_workers) = std::vector<int>({2});
+  TORCH_ARG(std::vector<int>, update_per_batches) = std::vector<int>({1});
+  // 不计时的预热batch数, 之后计时measure_steps个batch
+  TORCH_ARG(int, warmup_steps) = 5;
+  TORCH_ARG(int, measure_steps) = 20;
+  // 峰值常驻内存超过这个值(MB)的配置不选, 0表示不限制
+  TORCH_ARG(double, max_rss_mb) = 0;
+  TORCH_ARG(bool, trim_padding) = false;
+};
+
+struct AutotuneTrial {
+  int batch_size = 0;
+  int intra_op_threads = 0;
+  int loader_workers = 0;
+  int update_per_batches = 1;
+  bool ok = false;
+  std::string error;
+  double examples_per_sec = 0;
+  double tokens_per_sec = 0;
+  double step_ms = 0;
+  double peak_rss_mb = 0;
+};
+
+/**
+ * 在本机上试跑几组 (batch size, intra-op线程数, loader worker数, 梯度累积)
+ * 找吞吐最高的配置. 每组配置预热后计时measure_steps个batch,
+ * 包括取数据, forward/backward和优化器更新, 和MainLoop一样经过
+ * BatchPrefetcher. 按维度依次做坐标搜索: 固定其他维度, 换这个维度的取值,
+ * 保留最好的, 试跑次数是各维度取值数之和而不是乘积.
+ * inter-op线程数在第一次计算后就不能改, 不在搜索范围内.
+ * 显存不够等错误会让这组配置失败, 不影响其他配置.
+ */
+template <class SampleParser, class Model, bool usePlainTxt = true>
+class Autotuner {
+ public:
+  typedef LlbTrainer<SampleParser, Model, false, 8, usePlainTxt> TrainerT;
+  typedef typename TrainerT::DatasetT DatasetT;
+  typedef typename TrainerT::DataSamplerT DataSamplerT;
+
+  Autotuner(AutotuneOptions options,
+            utils::RuntimeOptions runtime = utils::RuntimeOptions())
+      : options_(options),
+        runtime_(runtime),
+        default_threads_(at::get_num_threads()) {
+    CHECK(!options_.batch_sizes().empty());
+    CHECK(!options_.intra_op_threads().empty());
+    CHECK(!options_.loader_workers().empty());
+    CHECK(!options_.update_per_batches().empty());
+  }
+
+  AutotuneTrial Search(Model model, const std::string& datasetPath,
+                       const std::string& parserConfPath,
+                       double learningRate) {
+    if (!parserConfPath.empty()) {
+      Json::Reader reader;
+      std::ifstream ifs(parserConfPath);
+      CHECK(ifs) << "can't read " << parserConfPath << " ?";
+      CHECK(reader.parse(ifs, parser_conf_)) << "config file can't be parsed!";
+    }
+    device_ = torch::cuda::is_available() ? torch::kCUDA : torch::kCPU;
+    model->to(device_);
+    AutotuneTrial best;
+    best.batch_size = options_.batch_sizes()[0];
+    best.intra_op_threads = options_.intra_op_threads()[0];
+    best.loader_workers = options_.loader_workers()[0];
+    best.update_per_batches = options_.update_per_batches()[0];
+    best = run_trial_(model, datasetPath, learningRate, best);
+    for (int dim = 0; dim < 4; dim++) {
+      for (int value : dimension_values_(dim)) {
+        AutotuneTrial cand = best;
+        if (*dimension_field_(&cand, dim) == value) {
+          continue;
+        }
+        *dimension_field_(&cand, dim) = value;
+        cand = run_trial_(model, datasetPath, learningRate, cand);
+        if (better_(cand, best)) {
+          best = cand;
+        }
+      }
+    }
+    torch::set_num_threads(default_threads_);
+    spdlog::info(
+        "autotune best: batch size:{}, intra-op threads:{}, loader "
+        "workers:{}, update per batches:{}, {:.1f} examples/s",
+        best.batch_size, best.intra_op_threads, best.loader_workers,
+        best.update_per_batches, best.examples_per_sec);
+    return best;
+  }
+
+  const std::vector<AutotuneTrial>& trials() const { return trials_; }
+
+  /**
+   * 写成 --runtime_config 能读的json: 运行时配置加上
+   * batch_size/update_per_batches, 所有试跑的结果放在trials里供参考
+   */
+  void WriteJson(const AutotuneTrial& best, const std::string& path) const {
+    utils::RuntimeOptions runtime = runtime_;
+    runtime.intra_op_threads(best.intra_op_threads);
+    runtime.loader_workers(best.loader_workers);
+    Json::Value json;
+    utils::RuntimeOptionsToJson(runtime, &json);
+    json["batch_size"] = best.batch_size;
+    json["update_per_batches"] = best.update_per_batches;
+    Json::Value trials(Json::arrayValue);
+    for (auto& t : trials_) {
+      Json::Value v;
+      v["batch_size"] = t.batch_size;
+      v["intra_op_threads"] = t.intra_op_threads;
+      v["loader_workers"] = t.loader_workers;
+      v["update_per_batches"] = t.update_per_batches;
+      v["ok"] = t.ok;
+      if (!t.ok) {
+        v["error"] = t.error;
+      }
+      v["examples_per_sec"] = t.examples_per_sec;
+      v["tokens_per_sec"] = t.tokens_per_sec;
+      v["step_ms"] = t.step_ms;
+      v["peak_rss_mb"] = t.peak_rss_mb;
+      trials.append(v);
+    }
+    json["trials"] = trials;
+    std::ofstream ofs(path);
+    CHECK(ofs) << "can't write " << path;
+    Json::StyledStreamWriter writer;
+    writer.write(ofs, json);
+  }
+
+ private:
+  const std::vector<int>& dimension_values_(int dim) const {
+    switch (dim) {
+      case 0:
+        return options_.intra_op_threads();
+      case 1:
+        return options_.loader_workers();
+      case 2:
+        return options_.batch_sizes();
+      default:
+        return options_.update_per_batches();
+    }
+  }
+
+  static int* dimension_field_(AutotuneTrial* trial, int dim) {
+    switch (dim) {
+      case 0:
+        return &trial->intra_op_threads;
+      case 1:
+        return &trial->loader_workers;
+      case 2:
+        return &trial->batch_size;
+      default:
+        return &trial->update_per_batches;
+    }
+  }
+
+  bool fits_memory_(const AutotuneTrial& t) const {
+    return options_.max_rss_mb() <= 0 || t.peak_rss_mb <= options_.max_rss_mb();
+  }
+
+  // 有token数时比较token吞吐, 截padding后样本数不能反映真实计算量
+  bool better_(const AutotuneTrial& a, const AutotuneTrial& b) const {
+    if (!a.ok || !fits_memory_(a)) {
+      return false;
+    }
+    if (!b.ok || !fits_memory_(b)) {
+      return true;
+    }
+    if (a.tokens_per_sec > 0 && b.tokens_per_sec > 0) {
+      return a.tokens_per_sec > b.tokens_per_sec;
+    }
+    return a.examples_per_sec > b.examples_per_sec;
+  }
+
+  AutotuneTrial run_trial_(Model model, const std::string& datasetPath,
+                           double learningRate, AutotuneTrial trial) {
+    torch::set_num_threads(trial.intra_op_threads > 0 ? trial.intra_op_threads
+                                                       : default_threads_);
+    ResetPeakRss();
+    try {
+      measure_(model, datasetPath, learningRate, &trial);
+      trial.ok = true;
+    } catch (const std::exception& e) {
+      trial.error = e.what();
+    }
+    trial.peak_rss_mb = PeakRssBytes() / 1048576.0;
+    if (trial.ok) {
+      spdlog::info(
+          "trial batch size:{}, intra-op threads:{}, loader workers:{}, "
+          "update per batches:{} -> {:.1f} examples/s, {:.1f} tokens/s, "
+          "{:.1f}ms/batch, peak rss {:.1f}MB",
+          trial.batch_size, trial.intra_op_threads, trial.loader_workers,
+          trial.update_per_batches, trial.examples_per_sec,
+          trial.tokens_per_sec, trial.step_ms, trial.peak_rss_mb);
+    } else {
+      spdlog::warn("trial batch size:{}, intra-op threads:{} failed: {}",
+                   trial.batch_size, trial.intra_op_threads, trial.error);
+    }
+    trials_.push_back(trial);
+    return trial;
+  }
+
+  void measure_(Model model, const std::string& datasetPath,
+                double learningRate, AutotuneTrial* trial) {
+    std::vector<Tensor> paramters;
+    std::vector<std::string> names;
+    for (auto kv : model->named_parameters()) {
+      paramters.push_back(kv.value());
+      names.push_back(kv.key());
+    }
+    // 每组配置新建优化器, 让它的状态计入峰值内存
+    radish::optim::RAdam radam(paramters, names,
+                               radish::optim::RAdamOptions(learningRate));
+    radam.zero_grad();
+    CollateOptions collateOpts;
+    collateOpts.trim_padding = options_.trim_padding();
+    collateOpts.sequence_features = model->SequenceFeatures();
+    collateOpts.position_features = model->PositionFeatures();
+    auto modelPtr = model.ptr();
+    collateOpts.count_tokens = [modelPtr](const std::vector<Tensor>& inputs) {
+      return modelPtr->CountTokens(inputs);
+    };
+    const int64_t upb = std::max(1, trial->update_per_batches);
+    const int64_t warmup = options_.warmup_steps() * upb;
+    const int64_t total = warmup + options_.measure_steps() * upb;
+    int64_t batches = 0;
+    int64_t examples = 0;
+    int64_t tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    model->train();
+    while (batches < total) {
+      DatasetT dataset(datasetPath, parser_conf_);
+      DataSamplerT sampler(dataset.size().value());
+      utils::ScopedCpuAffinity dataAffinity(runtime_.data_cpus());
+      auto loader = torch::data::make_data_loader(
+          std::move(dataset), std::move(sampler),
+          torch::data::DataLoaderOptions()
+              .batch_size(trial->batch_size)
+              .workers(trial->loader_workers)
+              .enforce_ordering(false));
+      BatchPrefetcher<typename decltype(loader)::element_type> prefetcher(
+          loader.get(), device_, 2, collateOpts);
+      dataAffinity.Restore();
+      CollatedBatch batch;
+      int64_t epochBatches = 0;
+      while (batches < total && prefetcher.Next(&batch)) {
+        std::vector<Tensor> logits = model->forward(batch.examples);
+        std::vector<float> evals;
+        Tensor loss =
+            model->CalcLoss(batch.examples, logits, evals, batch.target);
+        loss.backward();
+        batches += 1;
+        epochBatches += 1;
+        if (batches % upb == 0) {
+          radam.step();
+          radam.zero_grad();
+        }
+        loss.item();
+        if (batches == warmup) {
+          start = std::chrono::steady_clock::now();
+        } else if (batches > warmup) {
+          examples += batch.size;
+          tokens += batch.tokens;
+        }
+      }
+      if (epochBatches == 0) {
+        throw std::runtime_error("no batch from dataset:" + datasetPath);
+      }
+    }
+    radam.zero_grad();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double seconds = std::max(elapsed.count(), 1e-9);
+    trial->examples_per_sec = examples / seconds;
+    trial->tokens_per_sec = tokens / seconds;
+    trial->step_ms = seconds * 1000 / std::max<int64_t>(1, total - warmup);
+  }
+
+  AutotuneOptions options_;
+  utils::RuntimeOptions runtime_;
+  int default_threads_;
+  Json::Value parser_conf_;
+  torch::Device device_ = torch::kCPU;
+  std::vector<AutotuneTrial> trials_;
+};
+
+}  // namespace train
+}  // namespace radish
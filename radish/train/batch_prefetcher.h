@@ -0,0 +1,182 @@
+/*
+ * File: batch_prefetcher.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-08 11:40:02
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "torch/torch.h"
+
+#include "radish/train/collate.h"
+#include "radish/train/step_profiler.h"
+
+namespace radish {
+namespace train {
+
+// 训练循环取batch的接口
+class BatchSource {
+ public:
+  virtual ~BatchSource() {}
+  // 取下一个batch, 数据读完时返回false
+  virtual bool Next(CollatedBatch* batch) = 0;
+  // 训练线程在Next里等数据的累计时间
+  virtual double wait_seconds() const = 0;
+};
+
+/**
+ * 后台线程从DataLoader取数据, 拼batch并拷贝到device, 放入一个有界队列;
+ * 训练线程只需要从队列里取已经准备好的batch. 队列满时后台线程等待,
+ * 所以最多提前准备 capacity 个batch.
+ * maxTokens > 0 时按token预算重新分组(见 SplitByTokenBudget),
+ * DataLoader的batch只是分组用的样本池, 没装满的最后一组留给下一个池.
+ */
+template <class Loader>
+class BatchPrefetcher : public BatchSource {
+ public:
+  BatchPrefetcher(Loader* loader, torch::Device device, size_t capacity = 2,
+                  CollateOptions collate = CollateOptions(),
+                  StepProfiler* profiler = nullptr, int64_t maxTokens = 0,
+                  bool paddedBudget = true)
+      : loader_(loader),
+        device_(device),
+        capacity_(capacity > 0 ? capacity : 1),
+        collate_(collate),
+        profiler_(profiler),
+        max_tokens_(maxTokens),
+        padded_budget_(paddedBudget),
+        worker_(&BatchPrefetcher::run_, this) {}
+
+  ~BatchPrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    worker_.join();
+  }
+
+  bool Next(CollatedBatch* batch) override {
+    auto start = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return !queue_.empty() || finished_; });
+    wait_seconds_ += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (queue_.empty()) {
+      return false;
+    }
+    *batch = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    cond_.notify_all();
+    return true;
+  }
+
+  double wait_seconds() const override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return wait_seconds_;
+  }
+
+ private:
+  void run_() {
+    std::vector<data::LlbExample> carry;
+    bool stopped = false;
+    for (auto& inputs : *loader_) {
+      if (max_tokens_ <= 0) {
+        if (!push_(inputs)) {
+          stopped = true;
+          break;
+        }
+        continue;
+      }
+      for (auto& ex : inputs) {
+        if (ex.features.empty()) {
+          // SplitByTokenBudget 会丢掉, 计到下一个batch上
+          pending_consumed_ += 1;
+        }
+      }
+      carry.insert(carry.end(), inputs.begin(), inputs.end());
+      auto groups =
+          SplitByTokenBudget(std::move(carry), max_tokens_, padded_budget_);
+      carry.clear();
+      if (!groups.empty()) {
+        carry = std::move(groups.back());
+        groups.pop_back();
+      }
+      for (auto& group : groups) {
+        if (!push_(group)) {
+          stopped = true;
+          break;
+        }
+      }
+      if (stopped) {
+        break;
+      }
+    }
+    if (!stopped && !carry.empty()) {
+      push_(carry);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    cond_.notify_all();
+  }
+
+  // 拼好一个batch放进队列, 需要退出时返回false
+  bool push_(const std::vector<data::LlbExample>& inputs) {
+    CollatedBatch batch;
+    pending_consumed_ += inputs.size();
+    {
+      StepProfiler::ScopedPhase phase(profiler_, "collate");
+      if (!CollateBatch(inputs, device_, collate_, &batch)) {
+        return true;
+      }
+    }
+    batch.consumed = pending_consumed_;
+    pending_consumed_ = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return stop_ || queue_.size() < capacity_; });
+    if (stop_) {
+      return false;
+    }
+    queue_.push_back(std::move(batch));
+    lock.unlock();
+    cond_.notify_all();
+    return true;
+  }
+
+  Loader* loader_;
+  torch::Device device_;
+  size_t capacity_;
+  CollateOptions collate_;
+  StepProfiler* profiler_;
+  int64_t max_tokens_;
+  bool padded_budget_;
+  // 后台线程里已经取出, 还没算到某个batch上的样本数
+  int64_t pending_consumed_ = 0;
+  std::deque<CollatedBatch> queue_;
+  bool stop_ = false;
+  bool finished_ = false;
+  double wait_seconds_ = 0;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread worker_;
+};
+
+}  // namespace train
+}  // namespace radish
@@ -0,0 +1,140 @@
+/*
+ * File: checkpoint_writer.cc
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-05 11:03:27
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/train/checkpoint_writer.h"
+
+#include <utility>
+
+#include "radish/train/model_io.h"
+#include "radish/utils/logging.h"
+#include "radish/utils/tensor_util.h"
+
+namespace radish {
+namespace train {
+
+AsyncCheckpointWriter::AsyncCheckpointWriter()
+    : worker_(&AsyncCheckpointWriter::run_, this) {}
+
+AsyncCheckpointWriter::~AsyncCheckpointWriter() {
+  Flush();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  worker_.join();
+}
+
+void AsyncCheckpointWriter::Submit(std::shared_ptr<torch::nn::Module> module,
+                                   const std::string& path) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  int slot = pending_;
+  if (slot >= 0) {
+    // 上一个snapshot还没开始写, 直接被覆盖
+    skipped_ += 1;
+  } else {
+    slot = writing_ == 0 ? 1 : 0;
+  }
+  // 拷贝期间持有锁, 后台线程不会同时拿走这个slot
+  stage_(module, &slots_[slot]);
+  slots_[slot].path = path;
+  pending_ = slot;
+  lock.unlock();
+  cond_.notify_all();
+}
+
+void AsyncCheckpointWriter::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return pending_ < 0 && writing_ < 0; });
+}
+
+int64_t AsyncCheckpointWriter::written() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return written_;
+}
+
+int64_t AsyncCheckpointWriter::skipped() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return skipped_;
+}
+
+void AsyncCheckpointWriter::stage_(
+    const std::shared_ptr<torch::nn::Module>& module, Snapshot* snapshot) {
+  torch::NoGradGuard guard;
+  std::vector<std::string> names;
+  std::vector<bool> isBuffer;
+  std::vector<torch::Tensor> sources;
+  for (const auto& val : module->named_parameters(true /*recurse*/)) {
+    if (!radish::utils::IsEmpty(val.value())) {
+      names.push_back(val.key());
+      isBuffer.push_back(false);
+      sources.push_back(val.value());
+    }
+  }
+  for (const auto& val : module->named_buffers(true /*recurse*/)) {
+    if (!radish::utils::IsEmpty(val.value())) {
+      names.push_back(val.key());
+      isBuffer.push_back(true);
+      sources.push_back(val.value());
+    }
+  }
+  bool reuse = snapshot->names == names;
+  for (size_t i = 0; reuse && i < sources.size(); i++) {
+    reuse = snapshot->tensors[i].sizes() == sources[i].sizes() &&
+            snapshot->tensors[i].scalar_type() == sources[i].scalar_type();
+  }
+  if (!reuse) {
+    snapshot->tensors.clear();
+    for (const auto& src : sources) {
+      auto opts = src.options().device(torch::kCPU);
+      snapshot->tensors.push_back(torch::empty(
+          src.sizes(), opts.pinned_memory(src.device().is_cuda())));
+    }
+    snapshot->names = names;
+    snapshot->is_buffer = isBuffer;
+  }
+  for (size_t i = 0; i < sources.size(); i++) {
+    snapshot->tensors[i].copy_(sources[i]);
+  }
+}
+
+void AsyncCheckpointWriter::run_() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return stop_ || pending_ >= 0; });
+    if (pending_ < 0) {
+      return;
+    }
+    writing_ = pending_;
+    pending_ = -1;
+    const Snapshot& snapshot = slots_[writing_];
+    lock.unlock();
+
+    torch::serialize::OutputArchive archive;
+    for (size_t i = 0; i < snapshot.tensors.size(); i++) {
+      archive.write(snapshot.names[i], snapshot.tensors[i],
+                    snapshot.is_buffer[i]);
+    }
+    try {
+      SaveArchiveAtomic(archive, snapshot.path);
+    } catch (const std::exception& e) {
+      spdlog::error("write checkpoint {} error:{}", snapshot.path, e.what());
+    }
+
+    lock.lock();
+    written_ += 1;
+    writing_ = -1;
+    lock.unlock();
+    cond_.notify_all();
+  }
+}
+
+}  // namespace train
+}  // namespace radish
@@ -0,0 +1,71 @@
+/*
+ * File: checkpoint_writer.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-05 10:12:40
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "torch/torch.h"
+
+namespace radish {
+namespace train {
+
+/**
+ * 后台写checkpoint
+ * Submit 只把参数拷贝到staging buffer(CUDA参数用pinned memory)就返回,
+ * 序列化和写文件在后台线程完成, 先写 path.tmp 再rename, 保证文件完整.
+ * 写盘期间如果又提交了新的snapshot, 只保留最新的一个, 旧的直接丢弃.
+ */
+class AsyncCheckpointWriter {
+ public:
+  AsyncCheckpointWriter();
+  ~AsyncCheckpointWriter();
+
+  void Submit(std::shared_ptr<torch::nn::Module> module,
+              const std::string& path);
+  // 阻塞直到所有已提交的snapshot都写完
+  void Flush();
+
+  int64_t written() const;
+  // 被更新的snapshot覆盖而没有写盘的个数
+  int64_t skipped() const;
+
+ private:
+  struct Snapshot {
+    std::string path;
+    std::vector<std::string> names;
+    std::vector<bool> is_buffer;
+    std::vector<torch::Tensor> tensors;
+  };
+
+  void run_();
+  void stage_(const std::shared_ptr<torch::nn::Module>& module,
+              Snapshot* snapshot);
+
+  // 两份staging buffer轮流使用, 一份在写盘时另一份接收新的snapshot
+  Snapshot slots_[2];
+  int writing_ = -1;
+  int pending_ = -1;
+  bool stop_ = false;
+  int64_t written_ = 0;
+  int64_t skipped_ = 0;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread worker_;
+};
+
+}  // namespace train
+}  // namespace radish
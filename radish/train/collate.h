@@ -0,0 +1,193 @@
+/*
+ * File: collate.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-11 2:13:40
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "torch/torch.h"
+
+#include "radish/train/data/llb_example.h"
+#include "radish/train/data/pipeline_stats.h"
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace train {
+
+// 拼好并已经放到目标设备上的一个batch
+struct CollatedBatch {
+  std::vector<torch::Tensor> examples;
+  torch::Tensor target;
+  int64_t size = 0;
+  // 非padding的token数, 以及(去掉多余padding后)的总token数
+  int64_t tokens = 0;
+  int64_t padded_tokens = 0;
+  // 从DataLoader取出的样本数, 包括解析失败被丢掉的, 续训时按它回退读头.
+  // 只有 BatchPrefetcher 设置
+  int64_t consumed = 0;
+};
+
+typedef std::function<std::pair<int64_t, int64_t>(
+    const std::vector<torch::Tensor>&)>
+    TokenCounter;
+
+struct CollateOptions {
+  bool with_target = true;
+  // sequence_features 截到batch里最长的真实长度, 假设padding(0)在右边
+  bool trim_padding = false;
+  // 要截padding的feature下标, 长度按其中第一个的非0位置算; 为空时不截.
+  // 一般是 LlbModel::SequenceFeatures
+  std::vector<size_t> sequence_features;
+  // 存着序列位置下标的feature, 截padding后检查下标都在截后的长度内.
+  // 一般是 LlbModel::PositionFeatures
+  std::vector<size_t> position_features;
+  // 在CPU上统计token数, 一般是 LlbModel::CountTokens
+  TokenCounter count_tokens;
+};
+
+// 单个样本的真实长度: 第一个feature里非0的个数
+inline int64_t ExampleLength(const data::LlbExample& ex) {
+  if (ex.features.empty() || ex.features[0].dim() != 1) {
+    return 0;
+  }
+  return ex.features[0].ne(0).sum().item<int64_t>();
+}
+
+/**
+ * 按token预算把样本重新分组: 先按长度排序, 再贪心地装,
+ * padded=true 时约束的是 样本数*组内最大长度, 否则是真实token数之和.
+ * 单个样本超过预算时单独成组.
+ */
+inline std::vector<std::vector<data::LlbExample>> SplitByTokenBudget(
+    std::vector<data::LlbExample> inputs, int64_t maxTokens, bool padded) {
+  std::vector<std::pair<int64_t, size_t>> lens;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (!inputs[i].features.empty()) {
+      lens.emplace_back(ExampleLength(inputs[i]), i);
+    }
+  }
+  std::sort(lens.begin(), lens.end());
+  std::vector<std::vector<data::LlbExample>> groups;
+  std::vector<data::LlbExample> cur;
+  int64_t curTokens = 0;
+  for (auto& kv : lens) {
+    // 长度递增, 组内最大长度就是当前样本的长度
+    int64_t next = padded ? kv.first * static_cast<int64_t>(cur.size() + 1)
+                          : curTokens + kv.first;
+    if (!cur.empty() && next > maxTokens) {
+      groups.push_back(std::move(cur));
+      cur.clear();
+      next = kv.first;
+    }
+    cur.push_back(std::move(inputs[kv.second]));
+    curTokens = next;
+  }
+  if (!cur.empty()) {
+    groups.push_back(std::move(cur));
+  }
+  return groups;
+}
+
+/**
+ * 已经按feature拼好的batch(在CPU上): 按需截掉多余的padding, 统计token数,
+ * 再拷贝到device. device为CUDA时先pin memory, 拷贝是异步的.
+ * `target` 未定义表示没有标签
+ */
+inline void FinishBatch(std::vector<torch::Tensor> stacked,
+                        torch::Tensor target, torch::Device device,
+                        const CollateOptions& options, CollatedBatch* batch) {
+  const auto& seqs = options.sequence_features;
+  if (options.trim_padding && !seqs.empty()) {
+    const torch::Tensor& first = stacked.at(seqs[0]);
+    CHECK_EQ(first.dim(), 2) << "sequence feature should be [batch, len]";
+    int64_t fullLen = first.size(1);
+    torch::Tensor used = first.ne(0).sum(0).nonzero();
+    int64_t len = used.numel() > 0 ? used.max().item<int64_t>() + 1 : 1;
+    if (len < fullLen) {
+      for (size_t i : seqs) {
+        torch::Tensor& t = stacked.at(i);
+        CHECK(t.dim() >= 2 && t.size(1) == fullLen)
+            << "sequence feature " << i << " has a different length";
+        t = t.narrow(1, 0, len).contiguous();
+      }
+      for (size_t i : options.position_features) {
+        const torch::Tensor& t = stacked.at(i);
+        CHECK(t.numel() == 0 || t.max().item<int64_t>() < len)
+            << "feature " << i << " points past the trimmed length " << len;
+      }
+    }
+  }
+  if (options.count_tokens) {
+    auto counts = options.count_tokens(stacked);
+    batch->tokens = counts.first;
+    batch->padded_tokens = counts.second;
+  }
+  bool pinned = device.is_cuda();
+  auto stage = [&](torch::Tensor t) {
+    if (pinned) {
+      t = t.pin_memory();
+    }
+    return t.to(device, /*non_blocking=*/pinned);
+  };
+  batch->examples.clear();
+  for (auto& t : stacked) {
+    batch->examples.push_back(stage(t));
+  }
+  batch->target = target.defined() ? stage(target) : torch::Tensor();
+  batch->size = stacked[0].size(0);
+}
+
+/**
+ * 把DataLoader给出的样本按feature拼成batch, 并拷贝到device.
+ * 解析失败(features为空)的样本会被丢掉, 整个batch都为空时返回false.
+ */
+inline bool CollateBatch(const std::vector<data::LlbExample>& inputs,
+                         torch::Device device, const CollateOptions& options,
+                         CollatedBatch* batch) {
+  data::PipelineStats::Scope stage(data::PipelineStage::kCollate);
+  std::vector<std::vector<torch::Tensor>> batchDatas;
+  std::vector<torch::Tensor> batchTargets;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    auto& ex = inputs[i];
+    if (ex.features.empty()) {
+      continue;
+    }
+    if (batchDatas.empty()) {
+      batchDatas.resize(ex.features.size());
+    } else {
+      CHECK_EQ(batchDatas.size(), ex.features.size());
+    }
+    for (size_t j = 0; j < ex.features.size(); j++) {
+      batchDatas[j].push_back(ex.features[j]);
+    }
+    if (options.with_target) {
+      batchTargets.push_back(ex.target);
+    }
+  }
+  if (batchDatas.empty()) {
+    return false;
+  }
+  std::vector<torch::Tensor> stacked;
+  for (size_t j = 0; j < batchDatas.size(); j++) {
+    stacked.push_back(torch::stack(batchDatas[j], 0));
+  }
+  FinishBatch(std::move(stacked),
+              options.with_target ? torch::stack(batchTargets, 0)
+                                  : torch::Tensor(),
+              device, options, batch);
+  return true;
+}
+
+}  // namespace train
+}  // namespace radish
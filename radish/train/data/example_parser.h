@@ -7,6 +7,8 @@
  */
 #pragma once
 #include <memory>
+#include <random>
+#include <sstream>
 #include <string>
 
 #include "json/json.h"
@@ -26,7 +28,28 @@ class ExampleParser {
   virtual bool ParseOne(std::string line, LlbExample& example) {
     return false;
   };
+  // 断点续训时保存/恢复parser内部的状态(随机数等)
+  virtual void SaveState(Json::Value* state) const {}
+  virtual void LoadState(const Json::Value& state) {}
+  // 课程学习: 运行时限制样本的有效长度, 样本仍pad到配置的最大长度,
+  // len<=0 表示恢复最大长度. 返回false表示parser不支持
+  virtual bool SetMaxLength(int len) { return false; }
 };
+
+inline std::string RngToString(const std::mt19937& gen) {
+  std::ostringstream oss;
+  oss << gen;
+  return oss.str();
+}
+
+inline bool RngFromString(const std::string& str, std::mt19937* gen) {
+  if (str.empty()) {
+    return false;
+  }
+  std::istringstream iss(str);
+  iss >> *gen;
+  return !iss.fail();
+}
 }  // namespace data
 
 }  // namespace radish
@@ -21,6 +21,7 @@
 #include "torch/types.h"
 #include "radish/train/data/example_parser.h"
 #include "radish/train/data/llb_example.h"
+#include "radish/train/data/pipeline_stats.h"
 #include "radish/train/proto/example.pb.h"
 #include "radish/utils/logging.h"
 
@@ -48,14 +49,18 @@ class LeveldbDataset
     leveldb::ReadOptions ropt;
     std::string rawData;
     LlbExample ret;
-    leveldb::Status st =
-        db_->Get(ropt, leveldb::Slice(std::to_string(index + 1)), &rawData);
-    if (!st.ok()) {
-      spdlog::warn("key not found:{}", index + 1);
-      return ret;
-    }
     radish::train::TrainExample exampleProto;
-    exampleProto.ParseFromString(rawData);
+    {
+      PipelineStats::Scope stage(PipelineStage::kRead);
+      leveldb::Status st =
+          db_->Get(ropt, leveldb::Slice(std::to_string(index + 1)), &rawData);
+      if (!st.ok()) {
+        spdlog::warn("key not found:{}", index + 1);
+        return ret;
+      }
+      exampleProto.ParseFromString(rawData);
+    }
+    PipelineStats::Scope stage(PipelineStage::kParse);
     if (!parser_->ParseOne(exampleProto, ret)) {
       spdlog::warn("Parser example error");
       ret.features.clear();
@@ -80,6 +85,21 @@ class LeveldbDataset
     }
   }
 
+  // 读的位置由sampler决定, 这里只有parser的状态
+  void SaveState(Json::Value* state) const {
+    Json::Value parserState;
+    parser_->SaveState(&parserState);
+    (*state)["parser"] = parserState;
+  }
+  void LoadState(const Json::Value& state) {
+    parser_->LoadState(state["parser"]);
+  }
+  // 按下标读, 续训时的位置由sampler恢复
+  void Skip(size_t n) {}
+  bool SetMaxLength(int len) { return parser_->SetMaxLength(len); }
+  // 读哪些key由sampler决定, 分片需要调用方按batch来分
+  bool SetShard(int index, int count) { return false; }
+
  private:
   std::shared_ptr<leveldb::DB> db_;
   std::shared_ptr<ExampleParser> parser_;
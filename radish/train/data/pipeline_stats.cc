@@ -0,0 +1,73 @@
+/*
+ * File: pipeline_stats.cc
+ * Project: data
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-16 10:31:07
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/train/data/pipeline_stats.h"
+
+#include <atomic>
+
+namespace radish {
+namespace data {
+
+namespace {
+constexpr int kNumStages = static_cast<int>(PipelineStage::kNumStages);
+std::atomic<bool> gEnabled{false};
+std::atomic<int64_t> gCounts[kNumStages];
+std::atomic<int64_t> gNanos[kNumStages];
+}  // namespace
+
+void PipelineStats::Enable(bool enabled) { gEnabled = enabled; }
+
+bool PipelineStats::enabled() {
+  return gEnabled.load(std::memory_order_relaxed);
+}
+
+void PipelineStats::Add(PipelineStage stage, int64_t nanos) {
+  int i = static_cast<int>(stage);
+  gCounts[i].fetch_add(1, std::memory_order_relaxed);
+  gNanos[i].fetch_add(nanos, std::memory_order_relaxed);
+}
+
+void PipelineStats::Reset() {
+  for (int i = 0; i < kNumStages; i++) {
+    gCounts[i] = 0;
+    gNanos[i] = 0;
+  }
+}
+
+PipelineStats::Snapshot PipelineStats::Get() {
+  Snapshot snapshot;
+  for (int i = 0; i < kNumStages; i++) {
+    snapshot.count[i] = gCounts[i].load();
+    snapshot.nanos[i] = gNanos[i].load();
+  }
+  return snapshot;
+}
+
+const char* PipelineStats::StageName(PipelineStage stage) {
+  switch (stage) {
+    case PipelineStage::kRead:
+      return "read";
+    case PipelineStage::kParse:
+      return "parse";
+    case PipelineStage::kTokenize:
+      return "tokenize";
+    case PipelineStage::kMask:
+      return "mask";
+    case PipelineStage::kTensorize:
+      return "tensorize";
+    case PipelineStage::kCollate:
+      return "collate";
+    default:
+      return "unknown";
+  }
+}
+
+}  // namespace data
+}  // namespace radish
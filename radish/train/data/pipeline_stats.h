@@ -0,0 +1,74 @@
+/*
+ * File: pipeline_stats.h
+ * Project: data
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-16 10:14:52
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace radish {
+namespace data {
+
+// 数据管道各阶段, parse包含tokenize/mask/tensorize
+enum class PipelineStage {
+  kRead = 0,
+  kParse = 1,
+  kTokenize = 2,
+  kMask = 3,
+  kTensorize = 4,
+  kCollate = 5,
+  kNumStages = 6,
+};
+
+/**
+ * 进程内各阶段的累计耗时和次数, 多个worker线程的时间相加.
+ * 默认关闭, 关闭时 Scope 只多一次原子读, 不取时间
+ */
+class PipelineStats {
+ public:
+  struct Snapshot {
+    int64_t count[static_cast<int>(PipelineStage::kNumStages)];
+    int64_t nanos[static_cast<int>(PipelineStage::kNumStages)];
+  };
+
+  static void Enable(bool enabled);
+  static bool enabled();
+  static void Add(PipelineStage stage, int64_t nanos);
+  static void Reset();
+  static Snapshot Get();
+  static const char* StageName(PipelineStage stage);
+
+  class Scope {
+   public:
+    explicit Scope(PipelineStage stage)
+        : stage_(stage), enabled_(PipelineStats::enabled()) {
+      if (enabled_) {
+        start_ = std::chrono::steady_clock::now();
+      }
+    }
+    ~Scope() {
+      if (enabled_) {
+        PipelineStats::Add(
+            stage_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start_)
+                        .count());
+      }
+    }
+
+   private:
+    PipelineStage stage_;
+    bool enabled_;
+    std::chrono::steady_clock::time_point start_;
+  };
+};
+
+}  // namespace data
+}  // namespace radish
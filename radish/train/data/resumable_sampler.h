@@ -0,0 +1,111 @@
+/*
+ * File: resumable_sampler.h
+ * Project: data
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-06 3:18:52
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "torch/data/samplers/base.h"
+#include "torch/serialize/archive.h"
+#include "torch/torch.h"
+
+namespace radish {
+namespace data {
+
+/**
+ * 和 torch::data::samplers::RandomSampler 一样随机打乱,
+ * 但状态放在shared_ptr里, sampler被move进DataLoader后, 调用方留的拷贝
+ * 仍然可以保存当前位置. load之后的第一次reset不会重新打乱,
+ * 从保存的位置继续. 保存时还没reset过(没有indices)的状态当作没有保存.
+ */
+class ResumableRandomSampler : public torch::data::samplers::Sampler<> {
+ public:
+  explicit ResumableRandomSampler(int64_t size)
+      : state_(std::make_shared<State>()) {
+    state_->size = size;
+  }
+
+  void reset(torch::optional<size_t> new_size = torch::nullopt) override {
+    std::lock_guard<std::mutex> _(state_->lock);
+    if (new_size) {
+      state_->size = *new_size;
+    }
+    if (state_->resumed) {
+      state_->resumed = false;
+      return;
+    }
+    state_->indices = torch::randperm(state_->size, torch::kInt64);
+    state_->index = 0;
+  }
+
+  torch::optional<std::vector<size_t>> next(size_t batch_size) override {
+    std::lock_guard<std::mutex> _(state_->lock);
+    int64_t remaining = state_->indices.numel() - state_->index;
+    if (remaining <= 0) {
+      return torch::nullopt;
+    }
+    int64_t n = std::min(static_cast<int64_t>(batch_size), remaining);
+    auto accessor = state_->indices.accessor<int64_t, 1>();
+    std::vector<size_t> batch(n);
+    for (int64_t i = 0; i < n; i++) {
+      batch[i] = accessor[state_->index + i];
+    }
+    state_->index += n;
+    return batch;
+  }
+
+  void save(torch::serialize::OutputArchive& archive) const override {
+    save_at(archive, index());
+  }
+
+  /**
+   * 和save相同, 但读头保存为index. DataLoader和预取队列里的样本已经
+   * 交出去但还没训练, 续训时要从实际训练到的位置重新读
+   */
+  void save_at(torch::serialize::OutputArchive& archive,
+               int64_t index) const {
+    std::lock_guard<std::mutex> _(state_->lock);
+    archive.write("index", torch::tensor(index), /*is_buffer=*/true);
+    archive.write("indices", state_->indices, /*is_buffer=*/true);
+  }
+
+  // 已经交给DataLoader的样本数
+  int64_t index() const {
+    std::lock_guard<std::mutex> _(state_->lock);
+    return state_->index;
+  }
+
+  void load(torch::serialize::InputArchive& archive) override {
+    std::lock_guard<std::mutex> _(state_->lock);
+    Tensor index = torch::empty({1}, torch::kInt64);
+    archive.read("index", index, /*is_buffer=*/true);
+    state_->index = index.item<int64_t>();
+    archive.read("indices", state_->indices, /*is_buffer=*/true);
+    state_->indices = state_->indices.to(torch::kCPU).contiguous();
+    state_->resumed = state_->indices.numel() > 0;
+  }
+
+ private:
+  using Tensor = torch::Tensor;
+  struct State {
+    std::mutex lock;
+    int64_t size = 0;
+    int64_t index = 0;
+    Tensor indices = torch::empty({0}, torch::kInt64);
+    bool resumed = false;
+  };
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace data
+}  // namespace radish
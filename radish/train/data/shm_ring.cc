@@ -0,0 +1,247 @@
+/*
+ * File: shm_ring.cc
+ * Project: data
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-15 11:26:40
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/train/data/shm_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <new>
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace data {
+
+namespace {
+enum SlotState : int32_t {
+  kFree = 0,
+  kWriting = 1,
+  kReady = 2,
+  kReading = 3,
+};
+constexpr size_t kMaxSlots = 256;
+constexpr size_t kAlign = 64;
+}  // namespace
+
+struct ShmRing::Header {
+  pthread_mutex_t mutex;
+  pthread_cond_t writable;
+  pthread_cond_t readable;
+  int32_t producers;
+  int32_t producers_done;
+  int32_t failed;
+  int32_t shutdown;
+  int32_t epoch_arg;
+  int64_t epoch;
+  uint64_t next_seq;
+  int32_t state[kMaxSlots];
+  uint64_t seq[kMaxSlots];
+};
+
+ShmRing::ShmRing(size_t slots, size_t slotBytes)
+    : slots_(slots),
+      slot_bytes_((slotBytes + kAlign - 1) / kAlign * kAlign) {
+  CHECK_GT(slots_, 0);
+  CHECK_LE(slots_, kMaxSlots);
+  size_t headerBytes = (sizeof(Header) + kAlign - 1) / kAlign * kAlign;
+  mapped_bytes_ = headerBytes + slots_ * slot_bytes_;
+  void* mem = mmap(nullptr, mapped_bytes_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  CHECK(mem != MAP_FAILED) << "mmap " << mapped_bytes_ << " bytes failed";
+  header_ = new (mem) Header();
+  data_ = static_cast<char*>(mem) + headerBytes;
+
+  pthread_mutexattr_t mattr;
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&header_->mutex, &mattr);
+  pthread_mutexattr_destroy(&mattr);
+  pthread_condattr_t cattr;
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&header_->writable, &cattr);
+  pthread_cond_init(&header_->readable, &cattr);
+  pthread_condattr_destroy(&cattr);
+  header_->producers = 0;
+  header_->producers_done = 0;
+  header_->failed = 0;
+  header_->shutdown = 0;
+  header_->epoch_arg = 0;
+  header_->epoch = 0;
+  header_->next_seq = 0;
+  for (size_t i = 0; i < kMaxSlots; i++) {
+    header_->state[i] = kFree;
+    header_->seq[i] = 0;
+  }
+}
+
+ShmRing::~ShmRing() {
+  // 子进程已经退出, 这里只有本进程在用
+  pthread_cond_destroy(&header_->writable);
+  pthread_cond_destroy(&header_->readable);
+  pthread_mutex_destroy(&header_->mutex);
+  munmap(header_, mapped_bytes_);
+}
+
+char* ShmRing::slot_data(int slot) const {
+  return data_ + static_cast<size_t>(slot) * slot_bytes_;
+}
+
+void ShmRing::lock_() const {
+  int rc = pthread_mutex_lock(&header_->mutex);
+  if (rc == EOWNERDEAD) {
+    // 持锁的子进程死了, 它写到一半的slot不会变成就绪, 状态仍然一致
+    pthread_mutex_consistent(&header_->mutex);
+  } else {
+    CHECK_EQ(rc, 0) << "lock shm ring failed";
+  }
+}
+
+void ShmRing::unlock_() const { pthread_mutex_unlock(&header_->mutex); }
+
+void ShmRing::SetProducers(int producers) {
+  lock_();
+  header_->producers = producers;
+  header_->producers_done = 0;
+  unlock_();
+}
+
+int ShmRing::AcquireWrite() {
+  lock_();
+  int slot = -1;
+  while (!header_->shutdown) {
+    for (size_t i = 0; i < slots_; i++) {
+      if (header_->state[i] == kFree) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot >= 0) {
+      header_->state[slot] = kWriting;
+      break;
+    }
+    if (pthread_cond_wait(&header_->writable, &header_->mutex) ==
+        EOWNERDEAD) {
+      pthread_mutex_consistent(&header_->mutex);
+    }
+  }
+  unlock_();
+  return slot;
+}
+
+void ShmRing::CommitWrite(int slot) {
+  lock_();
+  header_->state[slot] = kReady;
+  header_->seq[slot] = header_->next_seq++;
+  unlock_();
+  pthread_cond_broadcast(&header_->readable);
+}
+
+void ShmRing::ProducerDone(bool ok) {
+  lock_();
+  header_->producers_done += 1;
+  if (!ok) {
+    header_->failed = 1;
+  }
+  unlock_();
+  pthread_cond_broadcast(&header_->readable);
+}
+
+void ShmRing::StartEpoch(int32_t arg) {
+  lock_();
+  header_->producers_done = 0;
+  header_->epoch += 1;
+  header_->epoch_arg = arg;
+  unlock_();
+  // 等待新epoch的生产者也睡在writable上
+  pthread_cond_broadcast(&header_->writable);
+}
+
+int64_t ShmRing::WaitEpoch(int64_t seen, int32_t* arg) {
+  lock_();
+  while (!header_->shutdown && header_->epoch == seen) {
+    if (pthread_cond_wait(&header_->writable, &header_->mutex) ==
+        EOWNERDEAD) {
+      pthread_mutex_consistent(&header_->mutex);
+    }
+  }
+  int64_t epoch = header_->shutdown ? -1 : header_->epoch;
+  *arg = header_->epoch_arg;
+  unlock_();
+  return epoch;
+}
+
+int ShmRing::AcquireRead(int timeoutMs) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeoutMs / 1000;
+  deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  lock_();
+  int slot = -1;
+  while (true) {
+    for (size_t i = 0; i < slots_; i++) {
+      if (header_->state[i] == kReady &&
+          (slot < 0 || header_->seq[i] < header_->seq[slot])) {
+        slot = i;
+      }
+    }
+    if (slot >= 0) {
+      header_->state[slot] = kReading;
+      break;
+    }
+    if (header_->producers_done >= header_->producers) {
+      break;
+    }
+    int rc = pthread_cond_timedwait(&header_->readable, &header_->mutex,
+                                    &deadline);
+    if (rc == EOWNERDEAD) {
+      pthread_mutex_consistent(&header_->mutex);
+    } else if (rc == ETIMEDOUT) {
+      slot = -2;
+      break;
+    }
+  }
+  unlock_();
+  return slot;
+}
+
+void ShmRing::Release(int slot) {
+  lock_();
+  header_->state[slot] = kFree;
+  unlock_();
+  pthread_cond_broadcast(&header_->writable);
+}
+
+bool ShmRing::failed() const {
+  lock_();
+  bool failed = header_->failed != 0;
+  unlock_();
+  return failed;
+}
+
+void ShmRing::Shutdown() {
+  lock_();
+  header_->shutdown = 1;
+  unlock_();
+  pthread_cond_broadcast(&header_->writable);
+  pthread_cond_broadcast(&header_->readable);
+}
+
+}  // namespace data
+}  // namespace radish
@@ -0,0 +1,82 @@
+/*
+ * File: shm_ring.h
+ * Project: data
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-15 10:03:27
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace radish {
+namespace data {
+
+/**
+ * 进程间共享内存上的定长slot环形缓冲, 用于预处理子进程向训练进程传batch.
+ * 用匿名共享映射, fork出来的子进程直接继承, 不需要名字也不用清理.
+ * 同步用进程间共享的robust mutex + 条件变量, 子进程崩溃不会把锁带走.
+ * slot的状态: 空闲 -> 写入中 -> 就绪 -> 读取中 -> 空闲,
+ * 读取方按写入完成的顺序取就绪的slot.
+ * 生产者可以跨多个epoch常驻: 消费者 StartEpoch 之后各生产者开始写这个
+ * epoch, 写完调用 ProducerDone, 再 WaitEpoch 等下一个.
+ */
+class ShmRing {
+ public:
+  ShmRing(size_t slots, size_t slotBytes);
+  ~ShmRing();
+  ShmRing(const ShmRing&) = delete;
+  ShmRing& operator=(const ShmRing&) = delete;
+
+  size_t slots() const { return slots_; }
+  size_t slot_bytes() const { return slot_bytes_; }
+  char* slot_data(int slot) const;
+
+  // 注册生产者的个数, 在fork之前调用
+  void SetProducers(int producers);
+
+  // 生产者: 等一个空闲slot, 关闭时返回-1
+  int AcquireWrite();
+  void CommitWrite(int slot);
+  // 生产者结束(当前epoch), ok=false表示出错退出
+  void ProducerDone(bool ok);
+
+  // 消费者: 开始新的epoch, arg 原样交给生产者
+  void StartEpoch(int32_t arg);
+  /**
+   * 生产者: 等编号大于 seen 的epoch开始, 返回它的编号(从1开始),
+   * 关闭时返回-1
+   */
+  int64_t WaitEpoch(int64_t seen, int32_t* arg);
+
+  /**
+   * 消费者: 等一个就绪的slot. 所有生产者结束且没有就绪slot时返回-1,
+   * 超时返回-2(调用方可以借机检查子进程是否还活着)
+   */
+  int AcquireRead(int timeoutMs);
+  void Release(int slot);
+
+  // 有生产者出错结束
+  bool failed() const;
+  // 让阻塞在AcquireWrite上的生产者退出
+  void Shutdown();
+
+ private:
+  struct Header;
+  void lock_() const;
+  void unlock_() const;
+
+  size_t slots_;
+  size_t slot_bytes_;
+  size_t mapped_bytes_;
+  Header* header_;
+  char* data_;
+};
+
+}  // namespace data
+}  // namespace radish
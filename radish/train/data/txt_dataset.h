@@ -12,15 +12,20 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <memory>
 #include <mutex>
 #include <random>
 #include <string>
 
+#include "absl/strings/match.h"
 #include "absl/strings/str_split.h"
+#include "json/json.h"
 #include "radish/train/data/example_parser.h"
 #include "radish/train/data/llb_example.h"
+#include "radish/train/data/pipeline_stats.h"
 #include "radish/utils/logging.h"
 #include "torch/torch.h"
 #include "torch/types.h"
@@ -37,10 +42,69 @@ class TxtFile {
       std::string line;
       CHECK(std::getline(infile_, line));
     }
+    chunk_offset_ = infile_.tellg();
   }
   ~TxtFile() { infile_.close(); }
   bool NextLine(std::string& line) {
     std::lock_guard<std::mutex> _(lock_);
+    while (next_line_(line)) {
+      int64_t lineNo = line_no_++;
+      if (shard_count_ <= 1 || lineNo % shard_count_ == shard_index_) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // 只读第 index, index+count, ... 行(按读出的顺序), 多进程预处理时分片
+  void SetShard(int index, int count) {
+    std::lock_guard<std::mutex> _(lock_);
+    shard_index_ = index;
+    shard_count_ = count;
+  }
+
+  /**
+   * 读到的位置, 不保存预读的内容:
+   * 预读的shuffle用的是固定种子, 从当前chunk的起点重新预读一遍,
+   * 再丢掉已经消费的行, 就能恢复到完全一样的状态
+   */
+  Json::Value SaveState() {
+    std::lock_guard<std::mutex> _(lock_);
+    Json::Value state;
+    if (hint_ > 0) {
+      state["offset"] = static_cast<Json::Int64>(chunk_offset_);
+      state["consumed"] = static_cast<Json::Int64>(consumed_);
+    } else {
+      state["offset"] = static_cast<Json::Int64>(infile_.tellg());
+    }
+    return state;
+  }
+
+  void LoadState(const Json::Value& state) {
+    std::lock_guard<std::mutex> _(lock_);
+    int64_t offset = state.get("offset", -1).asInt64();
+    infile_.clear();
+    preload_buffers_.clear();
+    if (offset < 0) {
+      // 已经读完
+      infile_.seekg(0, std::ios::end);
+      done_ = true;
+      return;
+    }
+    infile_.seekg(offset);
+    done_ = false;
+    if (hint_ > 0) {
+      int64_t consumed = state.get("consumed", 0).asInt64();
+      pre_load_();
+      CHECK_LE(consumed, static_cast<int64_t>(preload_buffers_.size()))
+          << path_ << " changed since the checkpoint?";
+      preload_buffers_.resize(preload_buffers_.size() - consumed);
+      consumed_ = consumed;
+    }
+  }
+
+ private:
+  bool next_line_(std::string& line) {
     if (hint_ > 0) {
       if (preload_buffers_.empty()) {
         if (done_) {
@@ -53,17 +117,19 @@ class TxtFile {
       line = preload_buffers_.back();
       preload_buffers_.erase(preload_buffers_.begin() +
                              preload_buffers_.size() - 1);
+      consumed_ += 1;
       return true;
     } else {
       return bool(std::getline(infile_, line));
     }
   }
 
- private:
   bool pre_load_() {
     if (done_) {
       return false;
     }
+    chunk_offset_ = infile_.tellg();
+    consumed_ = 0;
     for (int i = 0; i < hint_; i++) {
       std::string str;
       if (std::getline(infile_, str)) {
@@ -84,12 +150,19 @@ class TxtFile {
   int hint_;
   std::vector<std::string> preload_buffers_;
   bool done_;
+  // 当前预读chunk的起点, 以及chunk里已经消费的行数
+  std::streamoff chunk_offset_ = 0;
+  int64_t consumed_ = 0;
+  // 分片: 读出的行号, 只返回 行号%shard_count_==shard_index_ 的行
+  int64_t line_no_ = 0;
+  int shard_index_ = 0;
+  int shard_count_ = 1;
 };
 template <class Parser>
 class TxtDataset : public torch::data::Dataset<TxtDataset<Parser>, LlbExample> {
  public:
   explicit TxtDataset(std::string pathstr, const Json::Value& parserConf)
-      : gen_(std::random_device{}()) {
+      : cursor_(std::make_shared<Cursor>()) {
     parser_.reset(new Parser());
     CHECK(parser_->Init(parserConf));
     int preload = parserConf.get("parser.preload", 1000).asInt();
@@ -108,42 +181,143 @@ class TxtDataset : public torch::data::Dataset<TxtDataset<Parser>, LlbExample> {
         total_ += 1;
       }
       file_lists_.push_back(std::make_shared<TxtFile>(pathList[i], hint));
-      read_inds_.push_back(i);
+      cursor_->read_inds.push_back(i);
     }
     spdlog::info("total {} records", total_);
   }
   virtual ~TxtDataset() {}
 
   LlbExample get(size_t index) override {
-    size_t idx = 0;
     LlbExample ret;
-    bool gotIdx = false;
     std::string rawData;
-    while (!gotIdx && !read_inds_.empty()) {
-      std::uniform_int_distribution<size_t> rng(0, read_inds_.size() - 1);
-      idx = rng(gen_);
-      if (file_lists_[idx]->NextLine(rawData)) {
-        gotIdx = true;
-        if (!parser_->ParseOne(rawData, ret)) {
-          spdlog::warn("Parser example error");
-          ret.features.clear();
-        }
-      } else {
-        // 该文件读完了
-        read_inds_.erase(read_inds_.begin() + idx);
+    if (read_line_(rawData)) {
+      PipelineStats::Scope stage(PipelineStage::kParse);
+      if (!parser_->ParseOne(rawData, ret)) {
+        spdlog::warn("Parser example error");
+        ret.features.clear();
       }
     }
     return ret;
   }
-  torch::optional<size_t> size() const override { return {total_}; }
+
+  /**
+   * 续训时跳过已经训练过的n个样本: 和get一样选文件读行, 但不解析.
+   * 在 LoadState 之后, 交给DataLoader之前调用
+   */
+  void Skip(size_t n) {
+    std::string rawData;
+    for (size_t i = 0; i < n && read_line_(rawData); i++) {
+    }
+    skipped_ = cursor_->consumed;
+  }
+  torch::optional<size_t> size() const override {
+    return {total_ - std::min(total_, skipped_)};
+  }
+
+  /**
+   * 数据读到的位置, 断点续训时用. dataset会被move进DataLoader,
+   * 读头状态放在shared_ptr里, 调用方留一份拷贝就能随时保存.
+   * DataLoader预取但还没训练的batch在恢复后会被跳过.
+   */
+  void SaveState(Json::Value* state) const {
+    Json::Value files(Json::arrayValue);
+    for (auto& file : file_lists_) {
+      files.append(file->SaveState());
+    }
+    (*state)["files"] = files;
+    std::lock_guard<std::mutex> _(cursor_->lock);
+    Json::Value inds(Json::arrayValue);
+    for (size_t idx : cursor_->read_inds) {
+      inds.append(static_cast<Json::UInt64>(idx));
+    }
+    (*state)["read_inds"] = inds;
+    (*state)["gen"] = RngToString(cursor_->gen);
+    (*state)["consumed"] = static_cast<Json::UInt64>(cursor_->consumed);
+    Json::Value parserState;
+    parser_->SaveState(&parserState);
+    (*state)["parser"] = parserState;
+  }
+
+  void LoadState(const Json::Value& state) {
+    const Json::Value& files = state["files"];
+    CHECK_EQ(files.size(), file_lists_.size())
+        << "dataset files changed since the checkpoint";
+    for (Json::ArrayIndex i = 0; i < files.size(); i++) {
+      file_lists_[i]->LoadState(files[i]);
+    }
+    std::lock_guard<std::mutex> _(cursor_->lock);
+    cursor_->read_inds.clear();
+    for (auto& idx : state["read_inds"]) {
+      cursor_->read_inds.push_back(idx.asUInt64());
+    }
+    RngFromString(state.get("gen", "").asString(), &cursor_->gen);
+    cursor_->consumed = state.get("consumed", 0).asUInt64();
+    skipped_ = cursor_->consumed;
+    parser_->LoadState(state["parser"]);
+  }
+
+  // parser在拷贝间共享, 对拷贝调用同样作用于DataLoader里的dataset
+  bool SetMaxLength(int len) { return parser_->SetMaxLength(len); }
+
+  /**
+   * 多进程预处理时每个进程只读每个文件里属于自己的行, 文件内的预读
+   * 顺序是确定的, 所以各进程读到的行不重叠. 返回true表示分片由dataset负责
+   */
+  bool SetShard(int index, int count) {
+    for (auto& file : file_lists_) {
+      file->SetShard(index, count);
+    }
+    return true;
+  }
 
  private:
+  // 随机选一个没读完的文件读下一行, 全部读完时返回false
+  bool read_line_(std::string& rawData) {
+    while (true) {
+      std::shared_ptr<TxtFile> file;
+      {
+        std::lock_guard<std::mutex> _(cursor_->lock);
+        if (cursor_->read_inds.empty()) {
+          return false;
+        }
+        std::uniform_int_distribution<size_t> rng(
+            0, cursor_->read_inds.size() - 1);
+        file = file_lists_[cursor_->read_inds[rng(cursor_->gen)]];
+      }
+      bool gotLine = false;
+      {
+        PipelineStats::Scope stage(PipelineStage::kRead);
+        gotLine = file->NextLine(rawData);
+      }
+      if (gotLine) {
+        cursor_->consumed += 1;
+        return true;
+      }
+      // 该文件读完了
+      std::lock_guard<std::mutex> _(cursor_->lock);
+      auto& inds = cursor_->read_inds;
+      for (size_t i = 0; i < inds.size(); i++) {
+        if (file_lists_[inds[i]] == file) {
+          inds.erase(inds.begin() + i);
+          break;
+        }
+      }
+    }
+  }
+
+  struct Cursor {
+    std::mutex lock;
+    // 读头
+    std::vector<size_t> read_inds;
+    std::mt19937 gen{std::random_device{}()};
+    std::atomic<size_t> consumed{0};
+  };
   std::shared_ptr<ExampleParser> parser_;
   std::vector<std::shared_ptr<TxtFile>> file_lists_;
-  // 读头
-  std::vector<size_t> read_inds_;
+  std::shared_ptr<Cursor> cursor_;
   size_t total_;
-  std::mt19937 gen_;
+  // 恢复时已经读过的行数, 这部分不再计入size
+  size_t skipped_ = 0;
   static const size_t kMaxFiles = 128;
 };
 
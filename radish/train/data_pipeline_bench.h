@@ -0,0 +1,194 @@
+/*
+ * File: data_pipeline_bench.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-16 2:05:43
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "json/json.h"
+#include "torch/arg.h"
+#include "torch/torch.h"
+
+#include "radish/train/batch_prefetcher.h"
+#include "radish/train/collate.h"
+#include "radish/train/data/leveldb_dataset.h"
+#include "radish/train/data/pipeline_stats.h"
+#include "radish/train/data/resumable_sampler.h"
+#include "radish/train/data/txt_dataset.h"
+#include "radish/utils/logging.h"
+#include "radish/utils/runtime_config.h"
+
+namespace radish {
+namespace train {
+
+struct TORCH_API DataPipelineBenchOptions {
+  TORCH_ARG(int, batch_size) = 32;
+  // 每个取值跑一轮, 0表示在取数据的线程里同步读
+  TORCH_ARG(std::vector<int>, workers) = std::vector<int>({1, 2, 4});
+  // 不计时的预热batch数
+  TORCH_ARG(int, warmup_batches) = 10;
+  // 每轮最多计时的batch数和秒数, 0表示不限制(直到数据读完)
+  TORCH_ARG(int64_t, max_batches) = 500;
+  TORCH_ARG(double, max_seconds) = 60;
+  TORCH_ARG(int, prefetch_batches) = 2;
+  TORCH_ARG(bool, trim_padding) = false;
+  // 见 CollateOptions, 没有模型时由调用方按parser给出
+  TORCH_ARG(std::vector<size_t>, sequence_features);
+  TORCH_ARG(std::vector<size_t>, position_features);
+};
+
+struct DataPipelineResult {
+  int workers = 0;
+  int64_t batches = 0;
+  int64_t examples = 0;
+  int64_t tokens = 0;
+  double seconds = 0;
+  double examples_per_sec = 0;
+  double tokens_per_sec = 0;
+  data::PipelineStats::Snapshot stages;
+};
+
+/**
+ * 不带模型只跑数据管道, 看数据能不能喂饱训练. dataset, sampler,
+ * DataLoader和BatchPrefetcher的配置和 LlbTrainer::MainLoop 一样,
+ * batch留在CPU上, 取到就丢掉. 每个worker数跑一轮, 报告样本/秒,
+ * token/秒(第一个feature里非0的个数) 和各阶段的平均耗时.
+ * 各阶段的耗时是所有worker线程相加的, parse包含了tokenize/mask/tensorize.
+ */
+template <class SampleParser, bool usePlainTxt = true>
+class DataPipelineBench {
+ public:
+  typedef typename std::conditional<usePlainTxt, data::TxtDataset<SampleParser>,
+                                    data::LeveldbDataset<SampleParser>>::type
+      DatasetT;
+  typedef typename std::conditional<
+      usePlainTxt, torch::data::samplers::SequentialSampler,
+      data::ResumableRandomSampler>::type DataSamplerT;
+
+  DataPipelineBench(DataPipelineBenchOptions options,
+                    utils::RuntimeOptions runtime = utils::RuntimeOptions())
+      : options_(options), runtime_(runtime) {}
+
+  std::vector<DataPipelineResult> Run(const std::string& datasetPath,
+                                      const std::string& parserConfPath) {
+    Json::Value parserConf;
+    if (!parserConfPath.empty()) {
+      Json::Reader reader;
+      std::ifstream ifs(parserConfPath);
+      CHECK(ifs) << "can't read " << parserConfPath << " ?";
+      CHECK(reader.parse(ifs, parserConf)) << "config file can't be parsed!";
+    }
+    data::PipelineStats::Enable(true);
+    std::vector<DataPipelineResult> results;
+    for (int workers : options_.workers()) {
+      results.push_back(run_one_(datasetPath, parserConf, workers));
+      LogResult(results.back());
+    }
+    data::PipelineStats::Enable(false);
+    return results;
+  }
+
+  static void LogResult(const DataPipelineResult& r) {
+    spdlog::info(
+        "workers:{} batches:{} examples/s:{:.1f} tokens/s:{:.1f} in {:.2f}s",
+        r.workers, r.batches, r.examples_per_sec, r.tokens_per_sec,
+        r.seconds);
+    for (int i = 0; i < static_cast<int>(data::PipelineStage::kNumStages);
+         i++) {
+      int64_t count = r.stages.count[i];
+      if (count == 0) {
+        continue;
+      }
+      double totalMs = r.stages.nanos[i] / 1e6;
+      spdlog::info("  {:>9}: {:.1f}us/call, {:.2f}ms/batch, {} calls",
+                   data::PipelineStats::StageName(
+                       static_cast<data::PipelineStage>(i)),
+                   totalMs * 1000 / count,
+                   totalMs / std::max<int64_t>(1, r.batches), count);
+    }
+  }
+
+ private:
+  DataPipelineResult run_one_(const std::string& datasetPath,
+                              const Json::Value& parserConf, int workers) {
+    CollateOptions collateOpts;
+    collateOpts.trim_padding = options_.trim_padding();
+    collateOpts.sequence_features = options_.sequence_features();
+    collateOpts.position_features = options_.position_features();
+    collateOpts.count_tokens = [](const std::vector<torch::Tensor>& inputs) {
+      return std::make_pair(inputs[0].ne(0).sum().item<int64_t>(),
+                            static_cast<int64_t>(inputs[0].numel()));
+    };
+    DataPipelineResult result;
+    result.workers = workers;
+    DatasetT dataset(datasetPath, parserConf);
+    DataSamplerT sampler(dataset.size().value());
+    utils::ScopedCpuAffinity dataAffinity(runtime_.data_cpus());
+    auto loader = torch::data::make_data_loader(
+        std::move(dataset), std::move(sampler),
+        torch::data::DataLoaderOptions()
+            .batch_size(options_.batch_size())
+            .workers(workers)
+            .enforce_ordering(false));
+    BatchPrefetcher<typename decltype(loader)::element_type> prefetcher(
+        loader.get(), torch::kCPU, options_.prefetch_batches(), collateOpts);
+    dataAffinity.Restore();
+    CollatedBatch batch;
+    int64_t seen = 0;
+    auto start = std::chrono::steady_clock::now();
+    data::PipelineStats::Reset();
+    while (prefetcher.Next(&batch)) {
+      seen += 1;
+      if (seen == options_.warmup_batches()) {
+        // 预热期间prefetcher已经读在前面的几个batch也会计入, 影响很小
+        start = std::chrono::steady_clock::now();
+        data::PipelineStats::Reset();
+        continue;
+      } else if (seen < options_.warmup_batches()) {
+        continue;
+      }
+      result.batches += 1;
+      result.examples += batch.size;
+      result.tokens += batch.tokens;
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      if ((options_.max_batches() > 0 &&
+           result.batches >= options_.max_batches()) ||
+          (options_.max_seconds() > 0 &&
+           elapsed.count() >= options_.max_seconds())) {
+        break;
+      }
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    result.stages = data::PipelineStats::Get();
+    result.seconds = std::max(elapsed.count(), 1e-9);
+    result.examples_per_sec = result.examples / result.seconds;
+    result.tokens_per_sec = result.tokens / result.seconds;
+    if (result.batches == 0) {
+      spdlog::warn("no batch measured with {} workers, {} batches in dataset",
+                   workers, seen);
+    }
+    return result;
+  }
+
+  DataPipelineBenchOptions options_;
+  utils::RuntimeOptions runtime_;
+};
+
+}  // namespace train
+}  // namespace radish
@@ -0,0 +1,242 @@
+/*
+ * File: distillation.cc
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-22 10:36:18
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/train/distillation.h"
+
+#include <cstring>
+#include <fstream>
+
+#include "radish/train/model_io.h"
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace train {
+
+namespace {
+
+constexpr uint64_t kFnvOffset = 14695981039346656037ULL;
+constexpr uint64_t kFnvPrime = 1099511628211ULL;
+
+uint64_t HashBytes(uint64_t h, const void* data, size_t len) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= kFnvPrime;
+  }
+  return h;
+}
+
+}  // namespace
+
+std::vector<uint64_t> TeacherLogitCache::Keys(
+    const std::vector<torch::Tensor>& examples) {
+  CHECK(!examples.empty());
+  const int64_t batch = examples[0].size(0);
+  std::vector<uint64_t> keys(batch, kFnvOffset);
+  for (size_t f = 0; f < examples.size(); f++) {
+    torch::Tensor rows =
+        examples[f].detach().to(torch::kCPU).contiguous().view({batch, -1});
+    const int64_t width = rows.size(1);
+    const size_t elem = rows.element_size();
+    const char* base = static_cast<const char*>(rows.data_ptr());
+    static const char kZeros[16] = {0};
+    CHECK_LE(elem, sizeof(kZeros));
+    for (int64_t b = 0; b < batch; b++) {
+      const char* row = base + b * width * elem;
+      int64_t len = width;
+      while (len > 0 &&
+             std::memcmp(row + (len - 1) * elem, kZeros, elem) == 0) {
+        len -= 1;
+      }
+      // feature序号和长度也算进去, 不同feature的边界不会混
+      uint64_t header[2] = {static_cast<uint64_t>(f),
+                            static_cast<uint64_t>(len)};
+      keys[b] = HashBytes(keys[b], header, sizeof(header));
+      keys[b] = HashBytes(keys[b], row, len * elem);
+    }
+  }
+  return keys;
+}
+
+torch::Tensor TeacherLogitCache::Lookup(
+    const std::vector<uint64_t>& keys) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (classes_ == 0) {
+    return {};
+  }
+  torch::Tensor out =
+      torch::empty({static_cast<int64_t>(keys.size()), classes_});
+  float* dst = out.data_ptr<float>();
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto it = logits_.find(keys[i]);
+    if (it == logits_.end()) {
+      return {};
+    }
+    std::memcpy(dst + i * classes_, it->second.data(),
+                classes_ * sizeof(float));
+  }
+  return out;
+}
+
+void TeacherLogitCache::Insert(const std::vector<uint64_t>& keys,
+                               const torch::Tensor& logits) {
+  torch::Tensor rows = logits.detach()
+                           .to(torch::kCPU, torch::kFloat)
+                           .contiguous()
+                           .view({static_cast<int64_t>(keys.size()), -1});
+  const int64_t classes = rows.size(1);
+  const float* src = rows.data_ptr<float>();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (classes_ == 0) {
+    classes_ = classes;
+  }
+  CHECK_EQ(classes_, classes) << "teacher logits width changed";
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto& row = logits_[keys[i]];
+    if (row.empty()) {
+      row.assign(src + i * classes, src + (i + 1) * classes);
+      dirty_ = true;
+    }
+  }
+}
+
+bool TeacherLogitCache::Load(const std::string& path) {
+  if (!std::ifstream(path)) {
+    return false;
+  }
+  torch::serialize::InputArchive archive;
+  archive.load_from(path);
+  torch::Tensor keys;
+  torch::Tensor logits;
+  archive.read("keys", keys, /*is_buffer=*/true);
+  archive.read("logits", logits, /*is_buffer=*/true);
+  keys = keys.to(torch::kCPU).contiguous();
+  logits = logits.to(torch::kCPU, torch::kFloat).contiguous();
+  CHECK_EQ(keys.size(0), logits.size(0)) << "broken logit cache:" << path;
+  std::vector<uint64_t> ids(keys.numel());
+  std::memcpy(ids.data(), keys.data_ptr<int64_t>(),
+              ids.size() * sizeof(uint64_t));
+  Insert(ids, logits);
+  std::lock_guard<std::mutex> lock(mutex_);
+  dirty_ = false;
+  return true;
+}
+
+void TeacherLogitCache::Save(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!dirty_) {
+    return;
+  }
+  const int64_t n = static_cast<int64_t>(logits_.size());
+  torch::Tensor keys = torch::empty({n}, torch::kInt64);
+  torch::Tensor logits = torch::empty({n, classes_});
+  int64_t* k = keys.data_ptr<int64_t>();
+  float* l = logits.data_ptr<float>();
+  for (auto& kv : logits_) {
+    std::memcpy(k++, &kv.first, sizeof(uint64_t));
+    std::memcpy(l, kv.second.data(), classes_ * sizeof(float));
+    l += classes_;
+  }
+  torch::serialize::OutputArchive archive;
+  archive.write("keys", keys, /*is_buffer=*/true);
+  archive.write("logits", logits, /*is_buffer=*/true);
+  SaveArchiveAtomic(archive, path);
+  dirty_ = false;
+}
+
+size_t TeacherLogitCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return logits_.size();
+}
+
+Distiller::Distiller(std::shared_ptr<LlbModel> teacher,
+                     DistillOptions options)
+    : teacher_(teacher), options_(options) {
+  CHECK_GT(options_.temperature(), 0);
+  CHECK(options_.soft_weight() >= 0 && options_.soft_weight() <= 1);
+  CHECK(teacher_ || !options_.cache_path().empty())
+      << "distillation needs a teacher model or a logit cache";
+  CHECK(teacher_ || options_.hidden_weight() <= 0)
+      << "hidden state matching needs a teacher model";
+  if (teacher_) {
+    teacher_->eval();
+  }
+  if (!options_.cache_path().empty() && cache_.Load(options_.cache_path())) {
+    spdlog::info("loaded {} teacher logits from {}", cache_.size(),
+                 options_.cache_path());
+  }
+}
+
+void Distiller::to(torch::Device device) {
+  if (teacher_) {
+    teacher_->to(device);
+    teacher_->eval();
+  }
+}
+
+torch::Tensor Distiller::Loss(const std::vector<torch::Tensor>& examples,
+                              const std::vector<torch::Tensor>& student,
+                              const torch::Tensor& hardLoss) {
+  const bool useCache = !options_.cache_path().empty();
+  const bool matchHidden = options_.hidden_weight() > 0;
+  std::vector<uint64_t> keys;
+  torch::Tensor teacherLogits;
+  torch::Tensor teacherHidden;
+  // 隐层不缓存, 匹配隐层时每次都跑teacher
+  if (useCache && !matchHidden) {
+    keys = TeacherLogitCache::Keys(examples);
+    teacherLogits = cache_.Lookup(keys);
+  }
+  if (!teacherLogits.defined()) {
+    CHECK(teacher_) << "teacher logits not in cache:" << options_.cache_path();
+    torch::NoGradGuard guard;
+    std::vector<torch::Tensor> outs = teacher_->DistillForward(examples);
+    teacherLogits = outs[0];
+    if (matchHidden) {
+      CHECK_GT(outs.size(), 1) << "teacher returns no hidden state";
+      teacherHidden = outs[1];
+    }
+    if (useCache) {
+      if (keys.empty()) {
+        keys = TeacherLogitCache::Keys(examples);
+      }
+      cache_.Insert(keys, teacherLogits);
+    }
+  }
+  const torch::Tensor& logits = student[0];
+  const int64_t classes = logits.size(-1);
+  const double t = options_.temperature();
+  torch::Tensor studentLog = torch::log_softmax(logits.view({-1, classes}) / t,
+                                                -1);
+  torch::Tensor teacherProb = torch::softmax(
+      teacherLogits.to(logits.device()).view({-1, classes}) / t, -1);
+  // KL按样本平均, 乘T^2让soft loss的梯度量级不随温度变
+  torch::Tensor soft =
+      torch::kl_div(studentLog, teacherProb, at::Reduction::Sum) /
+      studentLog.size(0) * (t * t);
+  const double w = options_.soft_weight();
+  torch::Tensor loss = hardLoss * (1 - w) + soft * w;
+  if (matchHidden) {
+    CHECK_GT(student.size(), 1) << "student returns no hidden state";
+    loss = loss + torch::mse_loss(student[1],
+                                  teacherHidden.to(student[1].device())) *
+                      options_.hidden_weight();
+  }
+  return loss;
+}
+
+void Distiller::Flush() {
+  if (!options_.cache_path().empty()) {
+    cache_.Save(options_.cache_path());
+  }
+}
+
+}  // namespace train
+}  // namespace radish
@@ -0,0 +1,97 @@
+/*
+ * File: distillation.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-22 10:36:18
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "torch/torch.h"
+
+#include "radish/train/llb_model.h"
+
+namespace radish {
+namespace train {
+
+/// Options for `Distiller`.
+struct TORCH_API DistillOptions {
+  // soft target的温度
+  TORCH_ARG(double, temperature) = 2.0;
+  // loss = (1-soft_weight)*hard + soft_weight*T^2*KL(teacher||student)
+  //        + hidden_weight*MSE(student hidden, teacher hidden)
+  TORCH_ARG(double, soft_weight) = 0.5;
+  // 大于0时匹配 DistillForward 输出的隐层, 需要在线的teacher
+  TORCH_ARG(double, hidden_weight) = 0.0;
+  // 非空时teacher的logits缓存在这个文件里, 已有的缓存在构造时读入,
+  // 之后的epoch和训练不用再跑teacher
+  TORCH_ARG(std::string, cache_path) = "";
+};
+
+/**
+ * 按样本内容缓存teacher的logits. key是各feature去掉末尾的0(padding)后
+ * 的字节的hash, 截不截padding, 和哪些样本拼成batch都不影响.
+ * 可以在数据并行的多个线程里同时用
+ */
+class TORCH_API TeacherLogitCache {
+ public:
+  static std::vector<uint64_t> Keys(const std::vector<torch::Tensor>& examples);
+
+  // 全部命中时返回 [batch, classes], 否则返回未定义的tensor
+  torch::Tensor Lookup(const std::vector<uint64_t>& keys) const;
+  void Insert(const std::vector<uint64_t>& keys, const torch::Tensor& logits);
+
+  bool Load(const std::string& path);
+  // 有新插入的logits时才写
+  void Save(const std::string& path);
+  size_t size() const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, std::vector<float>> logits_;
+  int64_t classes_ = 0;
+  bool dirty_ = false;
+};
+
+/**
+ * 知识蒸馏: 冻结的teacher给出soft logits, 学生在hard/soft混合的loss上
+ * 训练. 学生和teacher都用 LlbModel::DistillForward, 输出[0]是logits,
+ * 匹配隐层时输出[1]是 [batch, D] 的隐层, 两边的D要相同.
+ * 见 LlbTrainer::SetDistiller
+ */
+class TORCH_API Distiller {
+ public:
+  // teacher可以为空, 这时全部logits都要在缓存里
+  Distiller(std::shared_ptr<LlbModel> teacher, DistillOptions options);
+
+  void to(torch::Device device);
+
+  // hardLoss 是学生的 CalcLoss, 返回合起来的loss
+  torch::Tensor Loss(const std::vector<torch::Tensor>& examples,
+                     const std::vector<torch::Tensor>& student,
+                     const torch::Tensor& hardLoss);
+
+  // 缓存写盘, 每个epoch结束时调用
+  void Flush();
+
+  const DistillOptions& options() const { return options_; }
+
+ private:
+  std::shared_ptr<LlbModel> teacher_;
+  DistillOptions options_;
+  TeacherLogitCache cache_;
+};
+
+}  // namespace train
+}  // namespace radish
@@ -14,6 +14,8 @@
 #include <torch/torch.h>
 #include <memory>
 #include <tuple>
+#include <utility>
+#include <vector>
 
 namespace radish {
 namespace train {
@@ -52,6 +54,47 @@ class TORCH_API LlbModel : public ::torch::nn::Module {
     auto rets = forward(inputs);
     return rets[0];
   }
+
+  // 知识蒸馏用: [0]是logits, 要匹配隐层时[1]是 [batch, D] 的隐层
+  // 默认就是forward, 见 Distiller
+  virtual std::vector<Tensor> DistillForward(std::vector<Tensor> inputs) {
+    return forward(inputs);
+  }
+
+  // trim_padding 时要截掉右边padding的 [batch, len] feature, 长度按第一个的
+  // 非0位置算. 默认为空, 不截
+  virtual std::vector<size_t> SequenceFeatures() const { return {}; }
+  // 存着序列位置下标的feature(比如mask的位置), 截padding后会检查它们
+  // 都在截后的长度内
+  virtual std::vector<size_t> PositionFeatures() const { return {}; }
+
+  /**
+   * 估算FLOPs用: 每个token实际乘过的矩阵参数个数, 即encoder各层Linear的
+   * 权重, 同一层执行几次就算几次. embedding查表和只在少数位置算的输出层
+   * 不算. 默认0, 不估算FLOPs
+   */
+  virtual int64_t MatmulParametersPerToken() const { return 0; }
+
+  // module里所有二维参数(Linear的权重)的元素个数
+  static int64_t MatrixParameters(const torch::nn::Module& module) {
+    int64_t n = 0;
+    for (auto& p : module.parameters()) {
+      if (p.dim() == 2) {
+        n += p.numel();
+      }
+    }
+    return n;
+  }
+
+  // 统计吞吐用: 返回batch里非padding的token数和padding后的总token数
+  // 默认第一个输入是[batch, len]的token id, 0是padding
+  virtual std::pair<int64_t, int64_t> CountTokens(
+      const std::vector<Tensor>& inputs) {
+    if (inputs.empty() || inputs[0].dim() != 2) {
+      return {0, 0};
+    }
+    return {inputs[0].ne(0).sum().item<int64_t>(), inputs[0].numel()};
+  }
 };
 
 }  // namespace train
@@ -11,7 +11,13 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
 #include <type_traits>
+#include <utility>
 
 #include "torch/data/samplers.h"
 #include "torch/nn/module.h"
@@ -20,12 +26,23 @@
 
 #include "radish/optimization/lamb.h"
 #include "radish/optimization/radam.h"
+#include "radish/train/async_evaluator.h"
+#include "radish/train/batch_prefetcher.h"
 #include "radish/train/benchmark_submiter.h"
+#include "radish/train/checkpoint_writer.h"
+#include "radish/train/collate.h"
 #include "radish/train/data/leveldb_dataset.h"
+#include "radish/train/data/resumable_sampler.h"
 #include "radish/train/data/txt_dataset.h"
+#include "radish/train/distillation.h"
+#include "radish/train/metrics_sink.h"
 #include "radish/train/model_io.h"
 #include "radish/train/progress_reporter.h"
+#include "radish/train/shm_batch_pool.h"
+#include "radish/train/step_profiler.h"
+#include "radish/train/trainer_options.h"
 #include "radish/utils/logging.h"
+#include "radish/utils/runtime_config.h"
 #include "torch/optim/adam.h"
 
 #ifndef GHC_USE_STD_FS
@@ -42,18 +59,37 @@ template <class SampleParser, class Model, bool use_eval_for_best_model = false,
           int64_t maxTrackHist = 8, bool usePlainTxt = true>
 class LlbTrainer {
  public:
-  LlbTrainer(std::string logdir)
-      : logdir_(logdir), best_loss_(1e9), no_best_track_times_(0) {
+  LlbTrainer(std::string logdir,
+             LlbTrainerOptions options = LlbTrainerOptions())
+      : logdir_(logdir),
+        options_(options),
+        best_loss_(1e9),
+        no_best_track_times_(0) {
     best_model_path_ = absl::StrCat(logdir_, "/best_model.ptc");
+    train_state_path_ = absl::StrCat(logdir_, "/train_state.ptc");
   }
   virtual ~LlbTrainer() {}
   typedef typename std::conditional<usePlainTxt, data::TxtDataset<SampleParser>,
                                     data::LeveldbDataset<SampleParser>>::type
       DatasetT;
+  typedef typename AsyncEvaluator<Model>::Result EvalResult;
 
   typedef typename std::conditional<
       usePlainTxt, torch::data::samplers::SequentialSampler,
-      torch::data::samplers::RandomSampler>::type DataSamplerT;
+      data::ResumableRandomSampler>::type DataSamplerT;
+  typedef decltype(torch::data::make_data_loader(
+      std::declval<DatasetT>(), std::declval<DataSamplerT>(),
+      torch::data::DataLoaderOptions())) TrainLoaderPtr;
+
+  // 用于创建异步eval的模型副本, 需要和训练的模型结构完全相同
+  void SetEvalReplicaFactory(std::function<Model()> factory) {
+    eval_replica_factory_ = factory;
+  }
+
+  // 蒸馏模式: 训练loss换成 Distiller 合起来的hard/soft loss, eval不变
+  void SetDistiller(std::shared_ptr<Distiller> distiller) {
+    distiller_ = distiller;
+  }
 
   void Benchmark(Model model, const std::string& datasetPath, int batchSize,
                  BenchmarkSubmiter* submiter, std::string parserConfPath) {
@@ -85,33 +121,18 @@ class LlbTrainer {
         std::move(DatasetT(datasetPath, parserConf)),
         torch::data::DataLoaderOptions()
             .batch_size(batchSize)
-            .workers(1)
+            .workers(options_.runtime().loader_workers())
             .enforce_ordering(true));
     int nexs = 0;
     for (auto inputs : *trainLoader) {
       model->eval();
-      std::vector<std::vector<Tensor>> batchDatas;
-      for (size_t i = 0; i < inputs.size(); i++) {
-        auto& ex = inputs[i];
-        if (ex.features.empty()) {
-          continue;
-        }
-        if (batchDatas.empty()) {
-          batchDatas.resize(ex.features.size());
-        } else {
-          CHECK_EQ(batchDatas.size(), ex.features.size());
-        }
-        for (size_t j = 0; j < ex.features.size(); j++) {
-          batchDatas[j].push_back(ex.features[j]);
-        }
-      }
-      if (batchDatas.empty()) {
+      CollatedBatch batch;
+      CollateOptions collateOpts;
+      collateOpts.with_target = false;
+      if (!CollateBatch(inputs, device, collateOpts, &batch)) {
         continue;
       }
-      std::vector<Tensor> examples;
-      for (size_t j = 0; j < batchDatas.size(); j++) {
-        examples.push_back(torch::stack(batchDatas[j], 0).to(device));
-      }
+      std::vector<Tensor>& examples = batch.examples;
       Tensor logits = model->Benchmark(examples);
       CHECK_EQ(logits.dim(), 2);
       for (int i = 0; i < logits.size(0); i++) {
@@ -138,6 +159,11 @@ class LlbTrainer {
                 int warmSteps = 1, int64_t maxTestNum = 0,
                 int64_t updatePerBatches = 1,
                 std::string pretrainModelPath = "") {
+    // 没有指定种子时随机选一个, 保存训练状态时在它上面加上step重新播种
+    seed_ = options_.seed() >= 0 ? options_.seed() : std::random_device{}();
+    if (options_.seed() >= 0) {
+      torch::manual_seed(seed_);
+    }
     Json::Value parserConf;
     if (!parserConfPath.empty()) {
       Json::Reader reader;
@@ -205,10 +231,25 @@ class LlbTrainer {
       names.push_back(kv.key());
     }
 
-    radish::optim::RAdam radam(paramters, names,
-                               radish::optim::RAdamOptions(learningRate)
-                                   .warmup_steps(warmSteps)
-                                   .weight_decay(0.01));
+    radish::optim::RAdam radam(
+        paramters, names,
+        radish::optim::RAdamOptions(learningRate)
+            .warmup_steps(warmSteps)
+            .weight_decay(0.01)
+            .state_format(options_.optim_state_format()));
+    int64_t nparams = 0;
+    for (auto& p : paramters) {
+      nparams += p.numel();
+    }
+    {
+      double bytesPerParam = radam.StateBytesPerParameter();
+      spdlog::info(
+          "optimizer state format:{}, {} bytes/param, {:.1f}MB for {} params, "
+          "saved {:.1f}MB compared to fp32",
+          optim::StateFormatName(options_.optim_state_format()), bytesPerParam,
+          nparams * bytesPerParam / 1048576.0, nparams,
+          nparams * (8.0 - bytesPerParam) / 1048576.0);
+    }
 
     // radish::optim::Lamb radam(
     //     paramters, names,
@@ -217,107 +258,539 @@ class LlbTrainer {
     // log目录初始化
     logdir_init_(model, pretrainModelPath, device);
     model->to(device);
+    if (distiller_) {
+      distiller_->to(device);
+    }
     radam.zero_grad();
     int64_t steps = 0;
     int64_t update_batch = 0;
-    std::vector<float> evals;
-    // first eval loss on test set
-    auto loss_v = _run_on_test(model, all_test_examples, all_test_targets,
-                               batchSize, device, evals);
-    reporter->UpdateProgress(0, absl::nullopt, {loss_v}, evals);
-    if (use_eval_for_best_model && evals.size() > 0) {
-      loss_v = 0 - evals[0];
-    }
-    best_loss_ = loss_v;
+    int startEpoch = 0;
+    Json::Value dataState;
+    int64_t dataSkip = 0;
+    torch::serialize::InputArchive resumeArchive;
+    bool resumed =
+        options_.resume() &&
+        load_train_state_(model, radam, device, resumeArchive, &steps,
+                          &startEpoch, &dataState, &dataSkip);
+    int64_t lastCheckpointStep = steps;
+    // 按token预算分batch时, 每个micro batch的loss按token数加权,
+    // 参数更新前再除以累计的token数
+    const bool tokenBudget = options_.max_tokens_per_batch() > 0;
+    int64_t stepTokens = 0;
+    CollateOptions collateOpts;
+    // 不截掉padding的话token预算限制不了显存
+    // 序列长度课程: 短序列阶段样本仍pad到最大长度, 也靠截padding提速
+    const int64_t curriculumEnd =
+        options_.curriculum_max_len() > 0 ? options_.curriculum_steps() : 0;
+    double shortPhaseSeconds = 0;
+    double fullPhaseSeconds = 0;
+    int64_t shortPhaseSteps = 0;
+    int64_t fullPhaseSteps = 0;
+    collateOpts.trim_padding =
+        options_.trim_padding() || tokenBudget || curriculumEnd > 0;
+    collateOpts.sequence_features = model->SequenceFeatures();
+    collateOpts.position_features = model->PositionFeatures();
+    if (collateOpts.trim_padding && collateOpts.sequence_features.empty()) {
+      spdlog::warn("model declares no sequence features, padding not trimmed");
+    }
+    auto modelPtr = model.ptr();
+    collateOpts.count_tokens = [modelPtr](const std::vector<Tensor>& inputs) {
+      return modelPtr->CountTokens(inputs);
+    };
     bool earlyReturn = false;
-    for (int e = 0; e < epochs; e++) {
-      auto trainLoader = torch::data::make_data_loader<DataSamplerT>(
-          std::move(DatasetT(trainDatasetPath, parserConf)),
-          torch::data::DataLoaderOptions()
-              .batch_size(batchSize)
-              .workers(2)
-              .enforce_ordering(false));
+    double dataWaitSeconds = 0;
+    const bool useShm = options_.preprocess_processes() > 0 && !tokenBudget;
+    if (options_.preprocess_processes() > 0 && tokenBudget) {
+      spdlog::warn("token budget batching needs the DataLoader path, "
+                   "preprocess processes disabled");
+    } else if (useShm) {
+      // 子进程里的读头不会回到训练进程
+      spdlog::warn(
+          "preprocess processes: checkpoints resume from the epoch start, "
+          "curriculum length switches at the next epoch");
+    }
+    // 预处理进程在训练的其他线程(异步eval, 数据并行, metrics等)创建之前
+    // 一次性fork出来, 之后每个epoch复用
+    std::unique_ptr<ShmBatchPool<DatasetT, DataSamplerT>> shmPool;
+    if (useShm) {
+      DatasetT poolDataset(trainDatasetPath, parserConf);
+      if (resumed) {
+        poolDataset.LoadState(dataState);
+        poolDataset.Skip(dataSkip);
+      }
+      DataSamplerT poolSampler(poolDataset.size().value());
+      if (resumed) {
+        torch::serialize::InputArchive samplerArchive;
+        resumeArchive.read("sampler", samplerArchive);
+        poolSampler.load(samplerArchive);
+      }
+      // 预处理进程继承数据线程的cpu绑定
+      utils::ScopedCpuAffinity dataAffinity(options_.runtime().data_cpus());
+      int processes = options_.preprocess_processes();
+      shmPool.reset(new ShmBatchPool<DatasetT, DataSamplerT>(
+          std::move(poolDataset), std::move(poolSampler),
+          [&trainDatasetPath, &parserConf]() {
+            return DatasetT(trainDatasetPath, parserConf);
+          },
+          batchSize, processes, options_.prefetch_batches() + 2 * processes,
+          options_.shm_slot_mb() << 20, device, collateOpts, seed_));
+    }
+    std::vector<float> evals;
+    if (!resumed) {
+      // first eval loss on test set
+      auto loss_v = _run_on_test(model, all_test_examples, all_test_targets,
+                                 batchSize, device, evals);
+      reporter->UpdateProgress(0, absl::nullopt, {loss_v}, evals);
+      if (use_eval_for_best_model && evals.size() > 0) {
+        loss_v = 0 - evals[0];
+      }
+      best_loss_ = loss_v;
+    }
+    std::unique_ptr<AsyncEvaluator<Model>> evaluator;
+    if (options_.async_eval()) {
+      if (eval_replica_factory_) {
+        Model replica = eval_replica_factory_();
+        replica->to(device);
+        evaluator.reset(new AsyncEvaluator<Model>(
+            replica, [&](Model m, std::vector<float>& tevals) {
+              return _run_on_test(m, all_test_examples, all_test_targets,
+                                  batchSize, device, tevals);
+            }));
+      } else {
+        spdlog::warn("no eval replica factory, fallback to blocking eval");
+      }
+    }
+    StepProfiler profiler(options_.trace_start_step(), options_.trace_steps(),
+                          absl::StrCat(logdir_, "/step_trace.json"),
+                          options_.trace_ops());
+    std::vector<std::unique_ptr<MetricsSink>> metricsSinks;
+    metricsSinks.emplace_back(new LogMetricsSink());
+    if (!options_.metrics_file().empty()) {
+      metricsSinks.emplace_back(new FileMetricsSink(options_.metrics_file()));
+    }
+    if (options_.metrics_port() > 0) {
+      metricsSinks.emplace_back(
+          new PrometheusMetricsSink(options_.metrics_port()));
+    }
+    const int64_t matmulParams = model->MatmulParametersPerToken();
+    if (matmulParams == 0) {
+      spdlog::warn("model doesn't report matmul parameters, FLOPs not counted");
+    }
+    ThroughputMeter meter(matmulParams);
+    auto trainStart = std::chrono::steady_clock::now();
+    train_start_ = trainStart;
+    for (int e = startEpoch; e < epochs; e++) {
+      DatasetT trainDataset(trainDatasetPath, parserConf);
+      if (resumed && e == startEpoch) {
+        trainDataset.LoadState(dataState);
+        trainDataset.Skip(dataSkip);
+      }
+      if (curriculumEnd > 0) {
+        CHECK(trainDataset.SetMaxLength(
+            steps < curriculumEnd ? options_.curriculum_max_len() : 0))
+            << "example parser doesn't support sequence length curriculum";
+      }
+      DataSamplerT sampler(trainDataset.size().value());
+      if (resumed && e == startEpoch) {
+        torch::serialize::InputArchive samplerArchive;
+        resumeArchive.read("sampler", samplerArchive);
+        sampler.load(samplerArchive);
+      }
+      if (useShm) {
+        // 预处理进程里的读头不会回到训练进程, 检查点保存这个epoch开头的
+        // sampler状态, 续训时从epoch开头重新读
+        sampler.reset();
+      }
+      // DataLoader和预取队列会读在训练前面, 检查点保存epoch开头(或续训处)
+      // 的dataset状态和之后实际训练过的样本数, 续训时从这里重新读
+      Json::Value baseDataState;
+      trainDataset.SaveState(&baseDataState);
+      const int64_t samplerBase = sampler_index_(sampler);
+      int64_t trainedExamples = 0;
+      // dataset/sampler会被move进DataLoader, 留一份共享状态的拷贝用于保存
+      DatasetT datasetCursor = trainDataset;
+      DataSamplerT samplerCursor = sampler;
+      // DataLoader worker和预取线程创建时继承数据线程的cpu绑定
+      utils::ScopedCpuAffinity dataAffinity(options_.runtime().data_cpus());
+      TrainLoaderPtr trainLoader;
+      std::unique_ptr<BatchSource> prefetcher;
+      BatchSource* source = shmPool.get();
+      if (useShm) {
+        shmPool->StartEpoch(curriculumEnd > 0
+                                ? (steps < curriculumEnd
+                                       ? options_.curriculum_max_len()
+                                       : 0)
+                                : -1);
+      } else {
+        trainLoader = torch::data::make_data_loader(
+            std::move(trainDataset), std::move(sampler),
+            torch::data::DataLoaderOptions()
+                .batch_size(batchSize)
+                .workers(options_.runtime().loader_workers())
+                .enforce_ordering(false));
+        prefetcher.reset(
+            new BatchPrefetcher<typename TrainLoaderPtr::element_type>(
+                trainLoader.get(), device, options_.prefetch_batches(),
+                collateOpts, &profiler, options_.max_tokens_per_batch(),
+                options_.budget_padded_tokens()));
+        source = prefetcher.get();
+      }
+      dataAffinity.Restore();
       spdlog::info("start epoch:{}", e);
-      for (auto inputs : *trainLoader) {
+      CollatedBatch batch;
+      while (true) {
+        auto stepStart = std::chrono::steady_clock::now();
+        profiler.BeginStep(steps + 1);
+        {
+          StepProfiler::ScopedPhase phase(&profiler, "data_wait");
+          if (!source->Next(&batch)) {
+            break;
+          }
+        }
         model->train();
-        std::vector<std::vector<Tensor>> batchDatas;
-        std::vector<Tensor> batchTargets;
-        for (size_t i = 0; i < inputs.size(); i++) {
-          auto& ex = inputs[i];
-          if (ex.features.empty()) {
-            continue;
+        Tensor target = batch.target;
+        std::vector<Tensor>& examples = batch.examples;
+        steps += 1;
+        trainedExamples += batch.consumed;
+        std::vector<Tensor> logits;
+        Tensor loss;
+        {
+          StepProfiler::ScopedPhase phase(&profiler, "forward");
+          logits = distiller_ ? model->DistillForward(examples)
+                              : model->forward(examples);
+        }
+        {
+          StepProfiler::ScopedPhase phase(&profiler, "loss");
+          evals.clear();
+          loss = model->CalcLoss(examples, logits, evals, target);
+          if (distiller_) {
+            loss = distiller_->Loss(examples, logits, loss);
           }
-          if (batchDatas.empty()) {
-            batchDatas.resize(ex.features.size());
+        }
+        {
+          StepProfiler::ScopedPhase phase(&profiler, "backward");
+          if (tokenBudget) {
+            (loss * static_cast<double>(batch.tokens)).backward();
+            stepTokens += batch.tokens;
           } else {
-            CHECK_EQ(batchDatas.size(), ex.features.size());
+            loss.backward();
           }
-          for (size_t j = 0; j < ex.features.size(); j++) {
-            batchDatas[j].push_back(ex.features[j]);
-          }
-          batchTargets.push_back(ex.target);
-        }
-        if (batchTargets.empty()) {
-          continue;
         }
-        Tensor target = torch::stack(batchTargets, 0).to(device);
-        std::vector<Tensor> examples;
-        for (size_t j = 0; j < batchDatas.size(); j++) {
-          examples.push_back(torch::stack(batchDatas[j], 0).to(device));
-        }
-        steps += 1;
-        std::vector<Tensor> logits = model->forward(examples);
-        evals.clear();
-        auto loss = model->CalcLoss(examples, logits, evals, target);
-        (void)evals;  // suppress warning
-        loss.backward();
         update_batch += 1;
         if (update_batch % updatePerBatches == 0) {
+          StepProfiler::ScopedPhase phase(&profiler, "optimizer");
+          auto optStart = std::chrono::steady_clock::now();
+          if (tokenBudget) {
+            normalize_grads_(paramters, stepTokens);
+            stepTokens = 0;
+          }
           radam.step();
           update_batch = 0;
           radam.zero_grad();
+          std::chrono::duration<double> optTime =
+              std::chrono::steady_clock::now() - optStart;
+          meter.AddOptimizerStep(optTime.count());
         }
-        float train_loss_v = ((Tensor)loss).item().to<float>();
-        if (steps % evalEvery == 0) {
-          std::vector<float> tevals;
-          auto loss_v = _run_on_test(model, all_test_examples, all_test_targets,
-                                     batchSize, device, tevals);
-          reporter->UpdateProgress(steps, train_loss_v, loss_v, tevals);
-          if (use_eval_for_best_model && tevals.size() > 0) {
-            loss_v = 0 - tevals[0];
-          }
-          if (loss_v < best_loss_) {
-            best_loss_ = loss_v;
-            no_best_track_times_ = 0;
-            SaveModel(model.ptr(), best_model_path_);
+        // 只在刚做完一次参数更新时保存, 不需要保存累积的梯度
+        if (options_.checkpoint_every() > 0 && update_batch == 0 &&
+            steps - lastCheckpointStep >= options_.checkpoint_every()) {
+          StepProfiler::ScopedPhase phase(&profiler, "checkpoint");
+          save_train_state_(model, radam, steps, e, baseDataState,
+                            trainedExamples, samplerCursor,
+                            samplerBase + trainedExamples);
+          lastCheckpointStep = steps;
+        }
+        float train_loss_v = 0;
+        {
+          // CUDA上前面的阶段都是异步提交, 这里才真正等计算完成
+          StepProfiler::ScopedPhase phase(&profiler, "sync");
+          train_loss_v = loss.item().to<float>();
+        }
+        if (curriculumEnd > 0) {
+          // 不含eval的单步耗时, 用来估算短序列阶段省下的时间
+          std::chrono::duration<double> stepTime =
+              std::chrono::steady_clock::now() - stepStart;
+          if (steps <= curriculumEnd) {
+            shortPhaseSeconds += stepTime.count();
+            shortPhaseSteps += 1;
           } else {
-            no_best_track_times_ += 1;
-            if (no_best_track_times_ > maxTrackHist) {
-              spdlog::warn(
-                  "always no improment after {} evals, minimal val is:{}!",
-                  maxTrackHist, best_loss_);
-              earlyReturn = true;
-              break;
-            }
+            fullPhaseSeconds += stepTime.count();
+            fullPhaseSteps += 1;
+          }
+          if (steps == curriculumEnd) {
+            // 已经预取的短batch照常训练, 之后读到的样本恢复完整长度
+            datasetCursor.SetMaxLength(0);
+            spdlog::info("curriculum: switch to full length at step:{}",
+                         steps);
+          }
+        }
+        meter.AddBatch(batch.size, batch.tokens, batch.padded_tokens);
+        if (options_.metrics_every() > 0 &&
+            steps % options_.metrics_every() == 0) {
+          TrainMetrics metrics = meter.Collect(steps, train_loss_v);
+          for (auto& sink : metricsSinks) {
+            sink->Write(metrics);
+          }
+        }
+        reporter->UpdateDataWait(
+            steps, dataWaitSeconds + source->wait_seconds(),
+            std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          trainStart)
+                .count());
+        if (evaluator) {
+          auto result = evaluator->Poll();
+          if (result && track_eval_(evaluator->replica(), *result, reporter)) {
+            earlyReturn = true;
+            break;
+          }
+        }
+        if (steps % evalEvery == 0 && evaluator) {
+          if (!evaluator->Submit(model, steps, train_loss_v)) {
+            spdlog::warn("last eval still running, skip eval at step:{}",
+                         steps);
+          }
+          reporter->UpdateProgress(steps, train_loss_v, absl::nullopt,
+                                   absl::nullopt);
+        } else if (steps % evalEvery == 0) {
+          StepProfiler::ScopedPhase phase(&profiler, "eval");
+          EvalResult result;
+          result.step = steps;
+          result.train_loss = train_loss_v;
+          result.loss =
+              _run_on_test(model, all_test_examples, all_test_targets,
+                           batchSize, device, result.evals);
+          if (track_eval_(model, result, reporter)) {
+            earlyReturn = true;
+            break;
           }
         } else {
           reporter->UpdateProgress(steps, train_loss_v, absl::nullopt,
                                    absl::nullopt);
         }
+        profiler.EndStep();
+        if (options_.profile_report_every() > 0 &&
+            steps % options_.profile_report_every() == 0) {
+          spdlog::info("step profile:\n{}", profiler.Summary());
+        }
+      }
+      dataWaitSeconds += source->wait_seconds();
+      if (distiller_) {
+        distiller_->Flush();
       }
       if (earlyReturn) {
         break;
       }
     }
     if (update_batch > 0) {
+      if (tokenBudget) {
+        normalize_grads_(paramters, stepTokens);
+      }
       radam.step();
       update_batch = 0;
       radam.zero_grad();
     }
+    spdlog::info("step profile:\n{}", profiler.Summary());
+    if (curriculumEnd > 0) {
+      log_curriculum_(shortPhaseSteps, shortPhaseSeconds, fullPhaseSteps,
+                      fullPhaseSeconds);
+    }
+    if (evaluator) {
+      auto result = evaluator->Wait();
+      if (result) {
+        track_eval_(evaluator->replica(), *result, reporter);
+      }
+      spdlog::info("async eval skipped {} times", evaluator->skipped());
+    }
+    if (checkpoint_writer_) {
+      checkpoint_writer_->Flush();
+      spdlog::info("checkpoint writer: {} written, {} stale skipped",
+                   checkpoint_writer_->written(),
+                   checkpoint_writer_->skipped());
+    }
     spdlog::info("done trainning,  early return ? = {}....", earlyReturn);
   }
 
  private:
+  void normalize_grads_(std::vector<Tensor>& params, int64_t tokens) {
+    if (tokens <= 0) {
+      return;
+    }
+    torch::NoGradGuard guard;
+    for (auto& p : params) {
+      if (p.grad().defined()) {
+        p.grad().div_(static_cast<double>(tokens));
+      }
+    }
+  }
+
+  /**
+   * 短序列阶段和完整长度阶段的平均单步耗时, 按完整长度的单步耗时
+   * 估算短序列阶段省下的wall clock. 达到同样MLM准确率的对比
+   * 看eval日志里的wall clock
+   */
+  void log_curriculum_(int64_t shortSteps, double shortSeconds,
+                       int64_t fullSteps, double fullSeconds) {
+    if (shortSteps == 0) {
+      return;
+    }
+    double shortAvg = shortSeconds / shortSteps;
+    if (fullSteps == 0) {
+      spdlog::info("curriculum: {} steps at max len {}, {:.1f}ms/step",
+                   shortSteps, options_.curriculum_max_len(),
+                   shortAvg * 1000);
+      return;
+    }
+    double fullAvg = fullSeconds / fullSteps;
+    spdlog::info(
+        "curriculum: {} steps at max len {}, {:.1f}ms/step vs {:.1f}ms/step "
+        "at full length, saved about {:.1f}s wall clock",
+        shortSteps, options_.curriculum_max_len(), shortAvg * 1000,
+        fullAvg * 1000, shortSteps * (fullAvg - shortAvg));
+  }
+
+  // 汇报eval结果, 更新最优模型; 返回true表示需要提前结束训练
+  bool track_eval_(Model model, const EvalResult& result,
+                   ProgressReporter* reporter) {
+    reporter->UpdateProgress(result.step, result.train_loss, result.loss,
+                             result.evals);
+    std::chrono::duration<double> wallClock =
+        std::chrono::steady_clock::now() - train_start_;
+    spdlog::info("eval at step:{}, wall clock:{:.1f}s, loss:{}, eval:{}",
+                 result.step, wallClock.count(), result.loss,
+                 result.evals.empty() ? 0.0f : result.evals[0]);
+    float loss_v = result.loss;
+    if (use_eval_for_best_model && result.evals.size() > 0) {
+      loss_v = 0 - result.evals[0];
+    }
+    if (loss_v < best_loss_) {
+      best_loss_ = loss_v;
+      no_best_track_times_ = 0;
+      save_best_model_(model);
+    } else {
+      no_best_track_times_ += 1;
+      if (no_best_track_times_ > maxTrackHist) {
+        spdlog::warn("always no improment after {} evals, minimal val is:{}!",
+                     maxTrackHist, best_loss_);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * 断点续训的状态: 模型参数, 优化器状态(含warmup进度), sampler位置,
+   * 以及训练计数, 随机种子, dataset读头等(json).
+   * dataState是epoch开头的dataset状态, 之后训练过dataSkip个样本
+   */
+  void save_train_state_(Model model, const optim::RAdam& radam,
+                         int64_t steps, int epoch,
+                         const Json::Value& dataState, int64_t dataSkip,
+                         const DataSamplerT& sampler, int64_t samplerIndex) {
+    torch::serialize::OutputArchive archive;
+    torch::serialize::OutputArchive modelArchive;
+    SaveModelToArchive(model.ptr(), modelArchive);
+    archive.write("model", modelArchive);
+    torch::serialize::OutputArchive optimArchive;
+    radam.save(optimArchive);
+    archive.write("optimizer", optimArchive);
+    torch::serialize::OutputArchive samplerArchive;
+    save_sampler_(sampler, samplerIndex, samplerArchive);
+    archive.write("sampler", samplerArchive);
+
+    // torch的随机状态拿不到, 保存时重新播种, 恢复时用同一个种子.
+    // 不续训时保存的状态用不上, 不打乱当前的随机数
+    uint64_t seed = seed_ + steps;
+    if (options_.resume()) {
+      torch::manual_seed(seed);
+    }
+    Json::Value state;
+    state["steps"] = static_cast<Json::Int64>(steps);
+    state["epoch"] = epoch;
+    state["best_loss"] = best_loss_;
+    state["no_best_track_times"] =
+        static_cast<Json::Int64>(no_best_track_times_);
+    state["seed"] = static_cast<Json::UInt64>(seed);
+    state["data"] = dataState;
+    state["data_skip"] = static_cast<Json::Int64>(dataSkip);
+    std::string stateStr = Json::FastWriter().write(state);
+    Tensor stateTensor =
+        torch::from_blob(&stateStr[0], {static_cast<int64_t>(stateStr.size())},
+                         torch::kUInt8)
+            .clone();
+    archive.write("trainer_state", stateTensor, /*is_buffer=*/true);
+    SaveArchiveAtomic(archive, train_state_path_);
+    spdlog::info("saved train state at step {} to {}", steps,
+                 train_state_path_);
+  }
+
+  // 只有 ResumableRandomSampler 有读头, SequentialSampler 配合
+  // TxtDataset 使用, 位置由 dataset.Skip 恢复
+  static int64_t sampler_index_(const data::ResumableRandomSampler& sampler) {
+    return sampler.index();
+  }
+  template <class SamplerT>
+  static int64_t sampler_index_(const SamplerT& sampler) {
+    return 0;
+  }
+  static void save_sampler_(const data::ResumableRandomSampler& sampler,
+                            int64_t index,
+                            torch::serialize::OutputArchive& archive) {
+    sampler.save_at(archive, index);
+  }
+  template <class SamplerT>
+  static void save_sampler_(const SamplerT& sampler, int64_t index,
+                            torch::serialize::OutputArchive& archive) {
+    sampler.save(archive);
+  }
+
+  bool load_train_state_(Model model, optim::RAdam& radam,
+                         torch::Device device,
+                         torch::serialize::InputArchive& archive,
+                         int64_t* steps, int* epoch, Json::Value* dataState,
+                         int64_t* dataSkip) {
+    if (!fs::exists(train_state_path_)) {
+      return false;
+    }
+    archive.load_from(train_state_path_, device);
+    torch::serialize::InputArchive modelArchive;
+    archive.read("model", modelArchive);
+    LoadModelFromArchive(model.ptr(), modelArchive);
+    torch::serialize::InputArchive optimArchive;
+    archive.read("optimizer", optimArchive);
+    radam.load(optimArchive);
+
+    Tensor stateTensor;
+    archive.read("trainer_state", stateTensor, /*is_buffer=*/true);
+    stateTensor = stateTensor.to(torch::kCPU).contiguous();
+    std::string stateStr(
+        reinterpret_cast<const char*>(stateTensor.data_ptr<uint8_t>()),
+        stateTensor.numel());
+    Json::Value state;
+    Json::Reader reader;
+    CHECK(reader.parse(stateStr, state))
+        << "broken train state:" << train_state_path_;
+    *steps = state["steps"].asInt64();
+    *epoch = state["epoch"].asInt();
+    best_loss_ = state["best_loss"].asFloat();
+    no_best_track_times_ = state["no_best_track_times"].asInt64();
+    torch::manual_seed(state["seed"].asUInt64());
+    *dataState = state["data"];
+    *dataSkip = state.get("data_skip", 0).asInt64();
+    spdlog::info("resumed from {}, epoch:{}, step:{}, best loss:{}",
+                 train_state_path_, *epoch, *steps, best_loss_);
+    return true;
+  }
+
+  void save_best_model_(Model model) {
+    if (!options_.async_checkpoint()) {
+      SaveModel(model.ptr(), best_model_path_);
+      return;
+    }
+    if (!checkpoint_writer_) {
+      checkpoint_writer_.reset(new AsyncCheckpointWriter());
+    }
+    checkpoint_writer_->Submit(model.ptr(), best_model_path_);
+  }
   Tensor select_range_(const Tensor& t, int off, int end) {
     std::vector<Tensor> ts;
     for (int i = off; i < end; i++) {
@@ -421,9 +894,17 @@ class LlbTrainer {
     return true;
   }
   std::string logdir_;
+  LlbTrainerOptions options_;
   std::string best_model_path_;
+  std::string train_state_path_;
   float best_loss_;
   int64_t no_best_track_times_;
+  uint64_t seed_ = 0;
+  // 本次训练开始的时间, eval日志里的wall clock从这里算
+  std::chrono::steady_clock::time_point train_start_;
+  std::unique_ptr<AsyncCheckpointWriter> checkpoint_writer_;
+  std::function<Model()> eval_replica_factory_;
+  std::shared_ptr<Distiller> distiller_;
 };
 }  // namespace train
 }  // namespace radish
@@ -0,0 +1,243 @@
+/*
+ * File: metrics_sink.cc
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-10 4:47:21
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/train/metrics_sink.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace train {
+
+int64_t CurrentRssBytes() {
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (fp == nullptr) {
+    return 0;
+  }
+  long pages = 0;  // NOLINT
+  long rss = 0;    // NOLINT
+  if (fscanf(fp, "%ld %ld", &pages, &rss) != 2) {
+    rss = 0;
+  }
+  fclose(fp);
+  return static_cast<int64_t>(rss) * sysconf(_SC_PAGESIZE);
+}
+
+int64_t PeakRssBytes() {
+  FILE* fp = fopen("/proc/self/status", "r");
+  if (fp == nullptr) {
+    return 0;
+  }
+  char line[256];
+  long kb = 0;  // NOLINT
+  while (fgets(line, sizeof(line), fp) != nullptr) {
+    if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(fp);
+  return static_cast<int64_t>(kb) * 1024;
+}
+
+bool ResetPeakRss() {
+  FILE* fp = fopen("/proc/self/clear_refs", "w");
+  if (fp == nullptr) {
+    return false;
+  }
+  bool ok = fputs("5", fp) >= 0;
+  return fclose(fp) == 0 && ok;
+}
+
+void LogMetricsSink::Write(const TrainMetrics& m) {
+  spdlog::info(
+      "Step:{}   {:.1f} ex/s, {:.0f} tok/s, pad {:.1f}%, {:.2f} TFLOP/s, "
+      "optimizer {:.1f}ms, rss {:.0f}MB",
+      m.step, m.examples_per_sec, m.tokens_per_sec, 100.0 * m.padding_ratio,
+      m.flops_per_sec / 1e12, m.optimizer_step_ms, m.rss_mb);
+}
+
+FileMetricsSink::FileMetricsSink(const std::string& path)
+    : ofs_(path, std::ios::app), csv_(absl::EndsWith(path, ".csv")) {
+  CHECK(ofs_) << "can't open metrics file:" << path;
+  if (csv_ && ofs_.tellp() == 0) {
+    ofs_ << "step,train_loss,examples_per_sec,tokens_per_sec,padding_ratio,"
+            "flops_per_step,flops_per_sec,optimizer_step_ms,rss_mb\n";
+  }
+}
+
+void FileMetricsSink::Write(const TrainMetrics& m) {
+  if (csv_) {
+    ofs_ << absl::StrFormat("%d,%g,%g,%g,%g,%g,%g,%g,%g\n", m.step,
+                            m.train_loss, m.examples_per_sec, m.tokens_per_sec,
+                            m.padding_ratio, m.flops_per_step, m.flops_per_sec,
+                            m.optimizer_step_ms, m.rss_mb);
+  } else {
+    ofs_ << absl::StrFormat(
+        "{\"step\":%d,\"train_loss\":%g,\"examples_per_sec\":%g,"
+        "\"tokens_per_sec\":%g,\"padding_ratio\":%g,\"flops_per_step\":%g,"
+        "\"flops_per_sec\":%g,\"optimizer_step_ms\":%g,\"rss_mb\":%g}\n",
+        m.step, m.train_loss, m.examples_per_sec, m.tokens_per_sec,
+        m.padding_ratio, m.flops_per_step, m.flops_per_sec,
+        m.optimizer_step_ms, m.rss_mb);
+  }
+  ofs_.flush();
+}
+
+PrometheusMetricsSink::PrometheusMetricsSink(int port) {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK_GE(listen_fd_, 0) << "create socket error";
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  // 只监听本机
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK_EQ(bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)),
+           0)
+      << "bind metrics port " << port << " error";
+  CHECK_EQ(listen(listen_fd_, 8), 0);
+  spdlog::info("serving prometheus metrics on 127.0.0.1:{}/metrics", port);
+  worker_ = std::thread(&PrometheusMetricsSink::serve_, this);
+}
+
+PrometheusMetricsSink::~PrometheusMetricsSink() {
+  stop_ = true;
+  worker_.join();
+  close(listen_fd_);
+}
+
+void PrometheusMetricsSink::Write(const TrainMetrics& metrics) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  latest_ = metrics;
+}
+
+std::string PrometheusMetricsSink::render_() {
+  TrainMetrics m;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    m = latest_;
+  }
+  std::string out;
+  auto gauge = [&out](const char* name, double value) {
+    absl::StrAppend(&out, "# TYPE radish_", name, " gauge\nradish_", name, " ",
+                    value, "\n");
+  };
+  gauge("step", m.step);
+  gauge("train_loss", m.train_loss);
+  gauge("examples_per_second", m.examples_per_sec);
+  gauge("tokens_per_second", m.tokens_per_sec);
+  gauge("padding_ratio", m.padding_ratio);
+  gauge("flops_per_step", m.flops_per_step);
+  gauge("flops_per_second", m.flops_per_sec);
+  gauge("optimizer_step_milliseconds", m.optimizer_step_ms);
+  gauge("resident_memory_megabytes", m.rss_mb);
+  return out;
+}
+
+void PrometheusMetricsSink::serve_() {
+  while (!stop_) {
+    pollfd pfd;
+    pfd.fd = listen_fd_;
+    pfd.events = POLLIN;
+    // 定时醒来检查是否需要退出
+    if (poll(&pfd, 1, 200) <= 0) {
+      continue;
+    }
+    int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    // 不解析请求, 任何路径都返回指标
+    char buf[1024];
+    pfd.fd = fd;
+    if (poll(&pfd, 1, 200) > 0) {
+      (void)read(fd, buf, sizeof(buf));
+    }
+    std::string body = render_();
+    std::string resp = absl::StrCat(
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: ",
+        body.size(), "\r\nConnection: close\r\n\r\n", body);
+    size_t off = 0;
+    while (off < resp.size()) {
+      ssize_t n = write(fd, resp.data() + off, resp.size() - off);
+      if (n <= 0) {
+        break;
+      }
+      off += n;
+    }
+    close(fd);
+  }
+}
+
+ThroughputMeter::ThroughputMeter(int64_t matmulParameters)
+    : matmul_parameters_(matmulParameters),
+      window_start_(std::chrono::steady_clock::now()) {}
+
+void ThroughputMeter::AddBatch(int64_t examples, int64_t tokens,
+                               int64_t paddedTokens) {
+  steps_ += 1;
+  examples_ += examples;
+  tokens_ += tokens;
+  padded_tokens_ += paddedTokens;
+}
+
+void ThroughputMeter::AddOptimizerStep(double seconds) {
+  optimizer_steps_ += 1;
+  optimizer_seconds_ += seconds;
+}
+
+TrainMetrics ThroughputMeter::Collect(int64_t step, float trainLoss) {
+  auto now = std::chrono::steady_clock::now();
+  double secs =
+      std::chrono::duration<double>(now - window_start_).count() + 1e-9;
+  TrainMetrics m;
+  m.step = step;
+  m.train_loss = trainLoss;
+  m.examples_per_sec = examples_ / secs;
+  m.tokens_per_sec = tokens_ / secs;
+  m.padding_ratio =
+      padded_tokens_ > 0 ? 1.0 - static_cast<double>(tokens_) / padded_tokens_
+                         : 0;
+  // forward 2次, backward 4次乘加; padding也要算, 用padding后的token数
+  double flops = 6.0 * matmul_parameters_ * padded_tokens_;
+  m.flops_per_step = steps_ > 0 ? flops / steps_ : 0;
+  m.flops_per_sec = flops / secs;
+  m.optimizer_step_ms = optimizer_steps_ > 0
+                            ? 1000.0 * optimizer_seconds_ / optimizer_steps_
+                            : 0;
+  m.rss_mb = CurrentRssBytes() / 1048576.0;
+
+  window_start_ = now;
+  steps_ = 0;
+  examples_ = 0;
+  tokens_ = 0;
+  padded_tokens_ = 0;
+  optimizer_steps_ = 0;
+  optimizer_seconds_ = 0;
+  return m;
+}
+
+}  // namespace train
+}  // namespace radish
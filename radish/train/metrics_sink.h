@@ -0,0 +1,117 @@
+/*
+ * File: metrics_sink.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-10 3:05:44
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace radish {
+namespace train {
+
+// 一个统计窗口内的训练吞吐和效率
+struct TrainMetrics {
+  int64_t step = 0;
+  float train_loss = 0;
+  double examples_per_sec = 0;
+  // 非padding的token
+  double tokens_per_sec = 0;
+  double padding_ratio = 0;
+  // 按 6 * 每个token乘过的矩阵参数 * token数 估算, 不含attention的那部分,
+  // 见 LlbModel::MatmulParametersPerToken
+  double flops_per_step = 0;
+  double flops_per_sec = 0;
+  double optimizer_step_ms = 0;
+  double rss_mb = 0;
+};
+
+class MetricsSink {
+ public:
+  virtual ~MetricsSink() {}
+  virtual void Write(const TrainMetrics& metrics) = 0;
+};
+
+// 滚动打印到日志
+class LogMetricsSink : public MetricsSink {
+ public:
+  void Write(const TrainMetrics& metrics) override;
+};
+
+// 按后缀写 .csv 或 .jsonl 文件, 每个窗口一行
+class FileMetricsSink : public MetricsSink {
+ public:
+  explicit FileMetricsSink(const std::string& path);
+  void Write(const TrainMetrics& metrics) override;
+
+ private:
+  std::ofstream ofs_;
+  bool csv_;
+};
+
+/**
+ * 在本地端口上提供Prometheus文本格式的 /metrics,
+ * 后台线程处理请求, 返回最近一次Write的数值
+ */
+class PrometheusMetricsSink : public MetricsSink {
+ public:
+  explicit PrometheusMetricsSink(int port);
+  ~PrometheusMetricsSink();
+  void Write(const TrainMetrics& metrics) override;
+
+ private:
+  void serve_();
+  std::string render_();
+
+  int listen_fd_ = -1;
+  std::atomic<bool> stop_{false};
+  std::mutex mutex_;
+  TrainMetrics latest_;
+  std::thread worker_;
+};
+
+/**
+ * 累计一个窗口内的样本数, token数和优化器耗时, Collect 时算出指标并开始新窗口
+ */
+class ThroughputMeter {
+ public:
+  // matmulParameters 是每个token实际乘过的矩阵参数个数, 0表示不估算FLOPs
+  explicit ThroughputMeter(int64_t matmulParameters);
+  void AddBatch(int64_t examples, int64_t tokens, int64_t paddedTokens);
+  void AddOptimizerStep(double seconds);
+  TrainMetrics Collect(int64_t step, float trainLoss);
+
+ private:
+  int64_t matmul_parameters_;
+  std::chrono::steady_clock::time_point window_start_;
+  int64_t steps_ = 0;
+  int64_t examples_ = 0;
+  int64_t tokens_ = 0;
+  int64_t padded_tokens_ = 0;
+  int64_t optimizer_steps_ = 0;
+  double optimizer_seconds_ = 0;
+};
+
+// 当前进程的常驻内存(字节), 读 /proc/self/statm
+int64_t CurrentRssBytes();
+
+// 常驻内存的峰值(字节), 读 /proc/self/status 的 VmHWM
+int64_t PeakRssBytes();
+// 把峰值重置为当前值(写 /proc/self/clear_refs), 失败返回false
+bool ResetPeakRss();
+
+}  // namespace train
+}  // namespace radish
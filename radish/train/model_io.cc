@@ -10,8 +10,10 @@
  */
 #include "radish/train/model_io.h"
 
+#include <cstdio>
 #include <iostream>
 #include <regex>
+#include <set>
 #include <stack>
 
 #include "rapidjson/error/en.h"
@@ -24,9 +26,70 @@
 namespace radish {
 namespace train {
 
+namespace {
+struct PackedParam {
+  const char* packed;
+  const char* parts[3];
+};
+const PackedParam kPackedParams[] = {
+    {"qkv.weight", {"query.weight", "key.weight", "value.weight"}},
+    {"qkv.bias", {"query.bias", "key.bias", "value.bias"}},
+    {"w_qkv.weight", {"w_qs.weight", "w_ks.weight", "w_vs.weight"}},
+    {"w_qkv.bias", {"w_qs.bias", "w_ks.bias", "w_vs.bias"}},
+};
+
+// 先按名字读, 找不到时再按旧的分开的参数读出来拼上
+void ReadParam(torch::serialize::InputArchive& archive,
+               const std::string& name, torch::Tensor& tensor,
+               bool isBuffer = false) {
+  std::vector<std::string> legacy = LegacyPackedParamNames(name);
+  if (legacy.empty() || isBuffer) {
+    archive.read(name, tensor, isBuffer);
+    return;
+  }
+  try {
+    archive.read(name, tensor);
+  } catch (const c10::Error&) {
+    std::vector<torch::Tensor> parts(legacy.size());
+    for (size_t i = 0; i < legacy.size(); i++) {
+      archive.read(legacy[i], parts[i]);
+    }
+    tensor.copy_(torch::cat(parts, 0));
+    spdlog::info("packed legacy params into {}", name);
+  }
+}
+}  // namespace
+
+std::vector<std::string> LegacyPackedParamNames(const std::string& name) {
+  for (const auto& p : kPackedParams) {
+    std::string packed = p.packed;
+    if (name.size() < packed.size() ||
+        name.compare(name.size() - packed.size(), packed.size(), packed) !=
+            0) {
+      continue;
+    }
+    std::string prefix = name.substr(0, name.size() - packed.size());
+    if (!prefix.empty() && prefix.back() != '.') {
+      continue;
+    }
+    std::vector<std::string> names;
+    for (const char* part : p.parts) {
+      names.push_back(prefix + part);
+    }
+    return names;
+  }
+  return {};
+}
+
 void SaveModel(std::shared_ptr<torch::nn::Module> module,
                const std::string& file_name) {
   torch::serialize::OutputArchive archive;
+  SaveModelToArchive(module, archive);
+  SaveArchiveAtomic(archive, file_name);
+}
+
+void SaveModelToArchive(std::shared_ptr<torch::nn::Module> module,
+                        torch::serialize::OutputArchive& archive) {
   auto params = module->named_parameters(true /*recurse*/);
   auto buffers = module->named_buffers(true /*recurse*/);
   for (const auto& val : params) {
@@ -39,7 +102,31 @@ void SaveModel(std::shared_ptr<torch::nn::Module> module,
       archive.write(val.key(), val.value(), /*is_buffer*/ true);
     }
   }
-  archive.save_to(file_name);
+}
+
+void LoadModelFromArchive(std::shared_ptr<torch::nn::Module> module,
+                          torch::serialize::InputArchive& archive) {
+  torch::NoGradGuard no_grad;
+  for (auto& val : module->named_parameters(true /*recurse*/)) {
+    if (!radish::utils::IsEmpty(val.value())) {
+      ReadParam(archive, val.key(), val.value());
+    }
+  }
+  for (auto& val : module->named_buffers(true /*recurse*/)) {
+    if (!radish::utils::IsEmpty(val.value())) {
+      archive.read(val.key(), val.value(), /*is_buffer*/ true);
+    }
+  }
+}
+
+void SaveArchiveAtomic(torch::serialize::OutputArchive& archive,
+                       const std::string& file_name) {
+  std::string tmpName = file_name + ".tmp";
+  archive.save_to(tmpName);
+  if (std::rename(tmpName.c_str(), file_name.c_str()) != 0) {
+    throw std::runtime_error("rename " + tmpName + " to " + file_name +
+                             " failed");
+  }
 }
 
 void LoadModel(std::shared_ptr<torch::nn::Module> module,
@@ -53,8 +140,12 @@ void LoadModel(std::shared_ptr<torch::nn::Module> module,
   auto params = module->named_parameters(true /*recurse*/);
   auto buffers = module->named_buffers(true /*recurse*/);
   for (auto& val : params) {
+    // 量化后释放了的float权重, 保存时也跳过了
+    if (radish::utils::IsEmpty(val.value())) {
+      continue;
+    }
     if (!std::regex_match(val.key(), m, re)) {
-      archive.read(val.key(), val.value());
+      ReadParam(archive, val.key(), val.value());
       if (log) {
         spdlog::info("load tensor :{}", val.key());
       }
@@ -83,7 +174,7 @@ void LoadModelEx(std::shared_ptr<torch::nn::Module> module,
     if (prefixVarName.empty() || (kn.size() >= prefixVarName.size() &&
                                   strncmp(kn.c_str(), prefixVarName.c_str(),
                                           prefixVarName.size()) == 0)) {
-      archive.read(kn, val.value());
+      ReadParam(archive, kn, val.value());
       spdlog::info("load pretrained weights:{}", kn);
     }
   }
@@ -272,9 +363,31 @@ void LoadStateDictJson(std::shared_ptr<torch::nn::Module> module,
     auto new_params = LoadStateDictJson(file_name);
     auto params = module->named_parameters(true /*recurse*/);
     auto buffers = module->named_buffers(true /*recurse*/);
+    // 导出的模型里分开的q/k/v参数先拼成融合参数
+    std::set<std::string> packedNames;
+    for (const auto& val : params) {
+      std::vector<std::string> legacy = LegacyPackedParamNames(val.key());
+      if (legacy.empty() || new_params.contains(val.key())) {
+        continue;
+      }
+      std::vector<torch::Tensor> parts;
+      for (const auto& name : legacy) {
+        auto* t = new_params.find(name);
+        if (t != nullptr) {
+          parts.push_back(*t);
+        }
+      }
+      if (parts.size() == legacy.size()) {
+        new_params.insert(val.key(), torch::cat(parts, 0));
+        packedNames.insert(legacy.begin(), legacy.end());
+      }
+    }
 
     for (auto& val : new_params) {
       auto name = val.key();
+      if (packedNames.count(name) > 0) {
+        continue;
+      }
       // fix naming
       // auto pos = name.find("running_var");
       // if (pos != std::string::npos) {
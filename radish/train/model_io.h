@@ -11,6 +11,8 @@
 
 #include <iostream>
 #include <regex>
+#include <string>
+#include <vector>
 
 #include "torch/torch.h"
 
@@ -19,6 +21,23 @@ namespace train {
 void SaveModel(std::shared_ptr<torch::nn::Module> module,
                const std::string& file_name);
 
+// 参数和buffer写入/读出一个(子)archive, 用于和优化器状态等一起保存
+void SaveModelToArchive(std::shared_ptr<torch::nn::Module> module,
+                        torch::serialize::OutputArchive& archive);
+void LoadModelFromArchive(std::shared_ptr<torch::nn::Module> module,
+                          torch::serialize::InputArchive& archive);
+
+// 先写 file_name.tmp 再rename, 中途被杀掉也不会留下半个文件
+void SaveArchiveAtomic(torch::serialize::OutputArchive& archive,
+                       const std::string& file_name);
+
+/**
+ * 融合的注意力投影参数(如 "xxx.qkv.weight") 对应的旧的分开保存的参数名,
+ * 按打包的顺序. 不是融合参数时返回空.
+ * 各Load函数在找不到融合参数时会读这几个旧参数拼起来, 旧checkpoint可以直接用
+ */
+std::vector<std::string> LegacyPackedParamNames(const std::string& name);
+
 void LoadModel(std::shared_ptr<torch::nn::Module> module,
                const std::string& file_name,
                const std::string& ignore_name_regex = "",
@@ -41,6 +41,17 @@ class ProgressReporter {
     }
     spdlog::info(toLog);
   }
+
+  // 训练线程等数据的累计时间, 占比高说明数据管道跟不上训练
+  virtual void UpdateDataWait(int64_t step, double waitSeconds,
+                              double totalSeconds) {
+    if (step % 100) {
+      return;
+    }
+    spdlog::info("Step:{}   data wait:{:.1f}s of {:.1f}s ({:.1f}%)", step,
+                 waitSeconds, totalSeconds,
+                 100.0 * waitSeconds / (totalSeconds + 1e-9));
+  }
 };
 
 }  // namespace train
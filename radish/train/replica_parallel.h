@@ -0,0 +1,306 @@
+/*
+ * File: replica_parallel.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-14 9:12:50
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ATen/Parallel.h"
+#include "absl/strings/str_format.h"
+#include "torch/torch.h"
+
+#include "radish/utils/logging.h"
+#include "radish/utils/runtime_config.h"
+
+namespace radish {
+namespace train {
+using Tensor = torch::Tensor;
+
+/**
+ * 进程内的数据并行: 小模型的GEMM太小, intra-op并行喂不满很多核,
+ * 改成N个模型副本各自绑定一组不相交的cpu, 每个副本算一个micro batch.
+ * 副本0就是训练的模型本身, backward之后各副本的梯度按树形两两相加,
+ * 最终累加到副本0上, 之后由调用方对副本0做一次优化器更新,
+ * 再调用 Broadcast 把新权重拷贝到其他副本.
+ * 每个副本在自己的线程上运行, 线程的intra-op线程数等于它那组cpu的个数.
+ *
+ * 限制: libtorch 1.3 的autograd引擎把所有CPU上的backward放在它唯一的
+ * CPU工作线程上执行, 各副本的backward是串行的, 只有forward和梯度归约
+ * 随副本数扩展. 构造时先在完整的cpu集合上触发一次backward, 让这个线程
+ * 不被绑在某个副本的cpu组上, 每个backward至少能用上全部的核.
+ * forward/backward各自的耗时见 Summary.
+ * 因为backward串行, 还没有接进 LlbTrainer, 等实测比单模型用满intra-op
+ * 线程更快再接
+ */
+template <class Model>
+class ReplicaParallel {
+ public:
+  // 在一个副本上算loss, evals只需要副本0的
+  typedef std::function<Tensor(Model, const std::vector<Tensor>&,
+                               const Tensor&, std::vector<float>&)>
+      LossFn;
+
+  /**
+   * `cpus` 会被平均分成 replicas.size()+1 组, 空表示当前线程允许的cpu.
+   * `replicas` 是除master以外的副本, 需要和master结构完全相同
+   */
+  ReplicaParallel(Model master, std::vector<Model> replicas,
+                  std::vector<int> cpus = {})
+      : done_(0) {
+    models_.push_back(master);
+    for (auto& r : replicas) {
+      models_.push_back(r);
+    }
+    if (cpus.empty()) {
+      cpus = utils::CurrentThreadAffinity();
+    }
+    const size_t n = models_.size();
+    for (auto& m : models_) {
+      params_.push_back(m->parameters());
+      CHECK_EQ(params_.back().size(), params_[0].size())
+          << "replica is not the same model";
+      buffers_.push_back(m->buffers());
+      CHECK_EQ(buffers_.back().size(), buffers_[0].size())
+          << "replica is not the same model";
+    }
+    forward_seconds_.assign(n, 0);
+    backward_seconds_.assign(n, 0);
+    {
+      // autograd的CPU工作线程在第一次backward时创建, 继承调用线程的cpu绑定
+      Tensor w = torch::ones({1}, torch::requires_grad());
+      (w * 2).sum().backward();
+    }
+    for (size_t i = 0; i < n; i++) {
+      std::vector<int> group;
+      for (size_t c = i * cpus.size() / n; c < (i + 1) * cpus.size() / n;
+           c++) {
+        group.push_back(cpus[c]);
+      }
+      groups_.push_back(group);
+    }
+    Broadcast();
+    for (size_t i = 0; i < n; i++) {
+      workers_.emplace_back(&ReplicaParallel::run_, this, i);
+    }
+    spdlog::info("data parallel with {} replicas on {} cpus", n, cpus.size());
+  }
+
+  ~ReplicaParallel() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    for (auto& w : workers_) {
+      w.join();
+    }
+  }
+
+  size_t size() const { return models_.size(); }
+
+  /**
+   * batch按第0维切成和副本数相同的份数, 各副本forward+backward,
+   * 每份的loss乘以 scale*份大小/总大小, 梯度归约到master上累加.
+   * 返回按样本数加权平均的loss(不带梯度)
+   */
+  Tensor ForwardBackward(const std::vector<Tensor>& examples,
+                         const Tensor& target, std::vector<float>& evals,
+                         LossFn lossFn, double scale = 1.0) {
+    const int64_t total = examples[0].size(0);
+    const size_t n = std::min<size_t>(models_.size(), total);
+    // 前 total%n 份各多一个样本
+    std::vector<int64_t> sizes(n, total / n);
+    for (size_t i = 0; i < static_cast<size_t>(total % n); i++) {
+      sizes[i] += 1;
+    }
+    std::vector<std::vector<Tensor>> shards(n);
+    std::vector<Tensor> targets(n);
+    for (auto& feature : examples) {
+      auto chunks = feature.split_with_sizes(sizes, 0);
+      for (size_t i = 0; i < n; i++) {
+        shards[i].push_back(chunks[i]);
+      }
+    }
+    if (target.defined()) {
+      auto chunks = target.split_with_sizes(sizes, 0);
+      for (size_t i = 0; i < n; i++) {
+        targets[i] = chunks[i];
+      }
+    }
+    std::vector<Tensor> losses(n);
+    run_all_([&](size_t i) {
+      if (i >= n) {
+        return;
+      }
+      Model model = models_[i];
+      model->train();
+      std::vector<float> replicaEvals;
+      auto start = std::chrono::steady_clock::now();
+      Tensor loss = lossFn(model, shards[i], targets[i], replicaEvals);
+      auto forwardEnd = std::chrono::steady_clock::now();
+      double weight = static_cast<double>(sizes[i]) / total * scale;
+      (loss * weight).backward();
+      forward_seconds_[i] +=
+          std::chrono::duration<double>(forwardEnd - start).count();
+      backward_seconds_[i] += std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - forwardEnd)
+                                  .count();
+      losses[i] = loss.detach() * (weight / scale);
+      if (i == 0) {
+        evals = replicaEvals;
+      }
+    });
+    reduce_grads_(n);
+    steps_ += 1;
+    Tensor loss = losses[0];
+    for (size_t i = 1; i < n; i++) {
+      loss = loss + losses[i];
+    }
+    return loss;
+  }
+
+  // master的权重和buffer拷贝到其他副本, 每次优化器更新之后调用
+  void Broadcast() {
+    torch::NoGradGuard guard;
+    for (size_t r = 1; r < models_.size(); r++) {
+      for (size_t i = 0; i < params_[0].size(); i++) {
+        params_[r][i].copy_(params_[0][i]);
+      }
+      for (size_t i = 0; i < buffers_[0].size(); i++) {
+        buffers_[r][i].copy_(buffers_[0][i]);
+      }
+    }
+  }
+
+  /**
+   * 每个副本平均每步forward(含loss)和backward的毫秒数. backward在autograd
+   * 的单个CPU线程上串行, 副本越多, 每个副本的backward等得越久
+   */
+  std::string Summary() const {
+    std::string out;
+    const double steps = std::max<int64_t>(1, steps_);
+    for (size_t i = 0; i < models_.size(); i++) {
+      out += absl::StrFormat("replica %d: forward %.2f ms, backward %.2f ms\n",
+                             i, forward_seconds_[i] * 1000 / steps,
+                             backward_seconds_[i] * 1000 / steps);
+    }
+    return out;
+  }
+
+ private:
+  /**
+   * 树形归约: 第k轮副本i(i是2^(k+1)的倍数)加上副本i+2^k的梯度,
+   * 同一轮里各对在各自的线程上并行, log2(n)轮后全部累加在副本0上.
+   * 其他副本的梯度加完后清零, 下一次backward重新累积
+   */
+  void reduce_grads_(size_t n) {
+    for (size_t stride = 1; stride < n; stride *= 2) {
+      run_all_([&](size_t i) {
+        if (i % (2 * stride) != 0 || i + stride >= n) {
+          return;
+        }
+        torch::NoGradGuard guard;
+        auto& dst = params_[i];
+        auto& src = params_[i + stride];
+        for (size_t p = 0; p < dst.size(); p++) {
+          Tensor& srcGrad = src[p].grad();
+          if (!srcGrad.defined()) {
+            continue;
+          }
+          if (!dst[p].grad().defined()) {
+            dst[p].grad() = srcGrad.clone();
+          } else {
+            dst[p].grad().add_(srcGrad);
+          }
+          srcGrad.zero_();
+        }
+      });
+    }
+  }
+
+  // 在所有副本线程上执行fn(副本编号), 等全部完成后返回
+  void run_all_(std::function<void(size_t)> fn) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ = fn;
+    done_ = 0;
+    generation_ += 1;
+    cond_.notify_all();
+    done_cond_.wait(lock, [this]() { return done_ == workers_.size(); });
+    job_ = nullptr;
+    if (error_) {
+      std::exception_ptr e = error_;
+      error_ = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+  void run_(size_t index) {
+    if (!groups_[index].empty()) {
+      utils::SetCurrentThreadAffinity(groups_[index]);
+      at::set_num_threads(groups_[index].size());
+    }
+    uint64_t seen = 0;
+    while (true) {
+      std::function<void(size_t)> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = generation_;
+        job = job_;
+      }
+      std::exception_ptr error;
+      try {
+        job(index);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error && !error_) {
+          error_ = error;
+        }
+        done_ += 1;
+      }
+      done_cond_.notify_one();
+    }
+  }
+
+  std::vector<Model> models_;
+  std::vector<std::vector<Tensor>> params_;
+  std::vector<std::vector<Tensor>> buffers_;
+  std::vector<double> forward_seconds_;
+  std::vector<double> backward_seconds_;
+  int64_t steps_ = 0;
+  std::vector<std::vector<int>> groups_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable done_cond_;
+  std::function<void(size_t)> job_;
+  uint64_t generation_ = 0;
+  size_t done_;
+  std::exception_ptr error_;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace train
+}  // namespace radish
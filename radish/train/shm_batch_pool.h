@@ -0,0 +1,316 @@
+/*
+ * File: shm_batch_pool.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-15 3:48:16
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "ATen/Parallel.h"
+#include "torch/torch.h"
+
+#include "radish/train/batch_prefetcher.h"
+#include "radish/train/collate.h"
+#include "radish/train/data/llb_example.h"
+#include "radish/train/data/shm_ring.h"
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace train {
+
+/**
+ * 在独立的预处理进程里读数据, 分词和mask, 拼好的batch写进共享内存的
+ * ShmRing, 训练进程用 torch::from_blob 直接引用slot里的数据, 不再拷贝.
+ * slot在引用它的tensor都释放后归还给预处理进程.
+ *
+ * 预处理进程是fork出来的, 继承了dataset和sampler的状态:
+ * sampler打乱的顺序在各进程里相同, TxtDataset按文件里的行分片,
+ * 其他dataset按batch编号分片. 子进程只用dataset/parser和memcpy拼batch,
+ * 不做多线程的torch计算(fork之后OpenMP线程池不可用).
+ * 子进程会写日志和调用torch, fork时别的线程持有的锁在子进程里永远不会
+ * 释放, 所以要在训练的其他线程(异步eval, 数据并行, metrics等)创建之前
+ * 构造, 整个训练只fork一次. 每个epoch由 StartEpoch 开始, 第一个epoch
+ * 用构造时传入的dataset/sampler(可以带断点续训的状态), 之后的epoch在
+ * 子进程里用 makeDataset 重新创建. sampler每个epoch按 seed 和epoch
+ * 打乱, 各进程的顺序一致; seed 由训练传入, 给定种子时数据顺序可复现.
+ * 一个batch的布局: ShmBatchHeader, 每个tensor一个ShmTensorMeta, 数据.
+ */
+template <class DatasetT, class SamplerT>
+class ShmBatchPool : public BatchSource {
+ public:
+  ShmBatchPool(DatasetT dataset, SamplerT sampler,
+               std::function<DatasetT()> makeDataset, size_t batchSize,
+               int processes, size_t slots, size_t slotBytes,
+               torch::Device device, CollateOptions collate, uint64_t seed)
+      : dataset_(std::move(dataset)),
+        sampler_(std::move(sampler)),
+        make_dataset_(makeDataset),
+        batch_size_(batchSize),
+        seed_(seed),
+        device_(device),
+        collate_(collate),
+        ring_(std::make_shared<data::ShmRing>(slots, slotBytes)) {
+    CHECK_GT(processes, 0);
+    ring_->SetProducers(processes);
+    fflush(nullptr);
+    for (int i = 0; i < processes; i++) {
+      pid_t pid = fork();
+      CHECK_GE(pid, 0) << "fork preprocess worker failed";
+      if (pid == 0) {
+        _exit(child_main_(i, processes));
+      }
+      pids_.push_back(pid);
+    }
+  }
+
+  ~ShmBatchPool() {
+    ring_->Shutdown();
+    for (pid_t pid : pids_) {
+      if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+      }
+    }
+  }
+
+  /**
+   * 开始下一个epoch, maxLen>=0 时子进程先 dataset.SetMaxLength(maxLen),
+   * 用于序列长度课程. 上一个epoch要先读完(Next返回false)
+   */
+  void StartEpoch(int maxLen = -1) {
+    wait_seconds_ = 0;
+    ring_->StartEpoch(maxLen);
+  }
+
+  bool Next(CollatedBatch* batch) override {
+    auto start = std::chrono::steady_clock::now();
+    int slot = -2;
+    while (slot == -2) {
+      slot = ring_->AcquireRead(1000);
+      if (slot == -2) {
+        check_workers_();
+      }
+    }
+    wait_seconds_ += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (slot < 0) {
+      CHECK(!ring_->failed()) << "preprocess worker failed";
+      return false;
+    }
+    read_slot_(slot, batch);
+    return true;
+  }
+
+  double wait_seconds() const override { return wait_seconds_; }
+
+ private:
+  static constexpr int kMaxDims = 6;
+  struct ShmBatchHeader {
+    int32_t num_tensors;
+    int32_t has_target;
+  };
+  struct ShmTensorMeta {
+    int32_t dtype;
+    int32_t ndim;
+    int64_t sizes[kMaxDims];
+    int64_t offset;
+  };
+
+  // slot归还给预处理进程, 由引用slot的tensor共同持有
+  struct SlotLease {
+    SlotLease(std::shared_ptr<data::ShmRing> ring, int slot)
+        : ring(ring), slot(slot) {}
+    ~SlotLease() { ring->Release(slot); }
+    std::shared_ptr<data::ShmRing> ring;
+    int slot;
+  };
+
+  int child_main_(int index, int count) {
+    at::set_num_threads(1);
+    int64_t epoch = 0;
+    int32_t maxLen = -1;
+    while ((epoch = ring_->WaitEpoch(epoch, &maxLen)) > 0) {
+      if (epoch > 1) {
+        // 上一个epoch已经把dataset读完了
+        dataset_ = make_dataset_();
+        sampler_ = SamplerT(dataset_.size().value());
+      }
+      bool sharded = dataset_.SetShard(index, count);
+      if (maxLen >= 0) {
+        dataset_.SetMaxLength(maxLen);
+      }
+      // 不按dataset分片时各进程按batch编号分, 打乱的顺序必须一样
+      torch::manual_seed(seed_ + epoch);
+      sampler_.reset();
+      // parser里的随机数(mask等)各进程不同
+      torch::manual_seed(seed_ * 31 + epoch * count + index);
+      bool ok = run_epoch_(index, count, sharded);
+      ring_->ProducerDone(ok);
+      if (!ok) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  // 子进程里读一个epoch, 写slot出错时返回false
+  bool run_epoch_(int index, int count, bool sharded) {
+    int64_t batchNo = 0;
+    bool ok = true;
+    while (auto indices = sampler_.next(batch_size_)) {
+      if (!sharded && (batchNo++ % count) != index) {
+        continue;
+      }
+      std::vector<data::LlbExample> examples;
+      for (size_t idx : *indices) {
+        data::LlbExample ex = dataset_.get(idx);
+        if (!ex.features.empty()) {
+          examples.push_back(std::move(ex));
+        }
+      }
+      if (examples.empty()) {
+        continue;
+      }
+      int slot = ring_->AcquireWrite();
+      if (slot < 0) {
+        break;
+      }
+      if (!write_slot_(examples, ring_->slot_data(slot))) {
+        ok = false;
+        break;
+      }
+      ring_->CommitWrite(slot);
+    }
+    return ok;
+  }
+
+  // 按feature把样本拷贝成连续的batch, 超出slot大小时返回false
+  bool write_slot_(const std::vector<data::LlbExample>& examples,
+                   char* base) {
+    const auto& first = examples[0];
+    std::vector<std::vector<torch::Tensor>> columns(first.features.size());
+    for (auto& ex : examples) {
+      if (ex.features.size() != columns.size()) {
+        fprintf(stderr, "inconsistent feature count in a batch\n");
+        return false;
+      }
+      for (size_t j = 0; j < columns.size(); j++) {
+        columns[j].push_back(ex.features[j]);
+      }
+    }
+    bool hasTarget = collate_.with_target && first.target.defined();
+    if (hasTarget) {
+      columns.emplace_back();
+      for (auto& ex : examples) {
+        columns.back().push_back(ex.target);
+      }
+    }
+    auto* header = reinterpret_cast<ShmBatchHeader*>(base);
+    auto* metas = reinterpret_cast<ShmTensorMeta*>(base + sizeof(*header));
+    size_t offset = sizeof(*header) + sizeof(ShmTensorMeta) * columns.size();
+    for (size_t j = 0; j < columns.size(); j++) {
+      const torch::Tensor& t0 = columns[j][0];
+      if (t0.dim() + 1 > kMaxDims) {
+        fprintf(stderr, "feature has too many dims:%d\n",
+                static_cast<int>(t0.dim()));
+        return false;
+      }
+      offset = (offset + 63) / 64 * 64;
+      ShmTensorMeta& meta = metas[j];
+      meta.dtype = static_cast<int32_t>(t0.scalar_type());
+      meta.ndim = t0.dim() + 1;
+      meta.sizes[0] = columns[j].size();
+      for (int64_t d = 0; d < t0.dim(); d++) {
+        meta.sizes[d + 1] = t0.size(d);
+      }
+      meta.offset = offset;
+      size_t rowBytes = t0.numel() * t0.element_size();
+      if (offset + rowBytes * columns[j].size() > ring_->slot_bytes()) {
+        fprintf(stderr, "batch doesn't fit in a %zu bytes shm slot\n",
+                ring_->slot_bytes());
+        return false;
+      }
+      for (auto& t : columns[j]) {
+        if (!t.sizes().equals(t0.sizes())) {
+          fprintf(stderr, "feature %zu has different shapes in a batch\n", j);
+          return false;
+        }
+        torch::Tensor c = t.contiguous();
+        memcpy(base + offset, c.data_ptr(), rowBytes);
+        offset += rowBytes;
+      }
+    }
+    header->num_tensors = columns.size();
+    header->has_target = hasTarget ? 1 : 0;
+    return true;
+  }
+
+  void read_slot_(int slot, CollatedBatch* batch) {
+    char* base = ring_->slot_data(slot);
+    auto lease = std::make_shared<SlotLease>(ring_, slot);
+    auto* header = reinterpret_cast<ShmBatchHeader*>(base);
+    auto* metas = reinterpret_cast<ShmTensorMeta*>(base + sizeof(*header));
+    std::vector<torch::Tensor> tensors;
+    for (int32_t j = 0; j < header->num_tensors; j++) {
+      const ShmTensorMeta& meta = metas[j];
+      tensors.push_back(torch::from_blob(
+          base + meta.offset,
+          torch::IntArrayRef(meta.sizes, meta.ndim), [lease](void*) {},
+          torch::TensorOptions().dtype(
+              static_cast<torch::ScalarType>(meta.dtype))));
+    }
+    torch::Tensor target;
+    if (header->has_target) {
+      target = tensors.back();
+      tensors.pop_back();
+    }
+    FinishBatch(std::move(tensors), target, device_, collate_, batch);
+  }
+
+  // 子进程异常退出时不会调用ProducerDone, 这里直接报错
+  void check_workers_() {
+    for (auto& pid : pids_) {
+      if (pid <= 0) {
+        continue;
+      }
+      int status = 0;
+      if (waitpid(pid, &status, WNOHANG) == pid) {
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            << "preprocess worker " << pid << " died";
+        pid = 0;
+      }
+    }
+  }
+
+  DatasetT dataset_;
+  SamplerT sampler_;
+  std::function<DatasetT()> make_dataset_;
+  size_t batch_size_;
+  uint64_t seed_;
+  torch::Device device_;
+  CollateOptions collate_;
+  std::shared_ptr<data::ShmRing> ring_;
+  std::vector<pid_t> pids_;
+  double wait_seconds_ = 0;
+};
+
+}  // namespace train
+}  // namespace radish
@@ -0,0 +1,114 @@
+/*
+ * File: shm_batch_pool_test.cc
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-15 4:12:30
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "radish/train/data/resumable_sampler.h"
+#include "radish/train/shm_batch_pool.h"
+
+namespace radish {
+namespace train {
+namespace {
+
+// 第i个样本是长度4的 [i+1, ...]
+class FakeDataset {
+ public:
+  explicit FakeDataset(size_t size) : size_(size) {}
+  data::LlbExample get(size_t index) {
+    data::LlbExample ex;
+    ex.features.push_back(
+        torch::full({4}, static_cast<int64_t>(index + 1), torch::kInt64));
+    return ex;
+  }
+  torch::optional<size_t> size() const { return size_; }
+  bool SetShard(int index, int count) { return false; }
+  bool SetMaxLength(int len) { return true; }
+
+ private:
+  size_t size_;
+};
+
+typedef ShmBatchPool<FakeDataset, data::ResumableRandomSampler> Pool;
+
+const size_t kExamples = 23;
+
+// 保存再加载sampler, 模拟续训
+data::ResumableRandomSampler Reload(const data::ResumableRandomSampler& s) {
+  torch::serialize::OutputArchive out;
+  s.save(out);
+  std::ostringstream os;
+  out.save_to(os);
+  std::istringstream is(os.str());
+  torch::serialize::InputArchive in;
+  in.load_from(is);
+  data::ResumableRandomSampler loaded(kExamples);
+  loaded.load(in);
+  return loaded;
+}
+
+std::unique_ptr<Pool> MakePool(data::ResumableRandomSampler sampler) {
+  CollateOptions collate;
+  collate.with_target = false;
+  return std::unique_ptr<Pool>(
+      new Pool(FakeDataset(kExamples), sampler,
+               []() { return FakeDataset(kExamples); }, 4, 2, 4, 1 << 16,
+               torch::kCPU, collate, 7));
+}
+
+// 读完一个epoch, 返回读到的样本编号
+std::multiset<int64_t> ReadEpoch(Pool* pool) {
+  pool->StartEpoch();
+  std::multiset<int64_t> seen;
+  CollatedBatch batch;
+  while (pool->Next(&batch)) {
+    Tensor first = batch.examples[0].select(1, 0);
+    for (int64_t i = 0; i < first.size(0); i++) {
+      seen.insert(first[i].item<int64_t>());
+    }
+  }
+  return seen;
+}
+
+void ExpectFullEpoch(const std::multiset<int64_t>& seen) {
+  ASSERT_EQ(seen.size(), kExamples);
+  for (size_t i = 1; i <= kExamples; i++) {
+    EXPECT_EQ(seen.count(i), 1) << "example " << i;
+  }
+}
+
+TEST(ShmBatchPoolTest, TestEveryEpochReadsAllExamples) {
+  auto pool = MakePool(data::ResumableRandomSampler(kExamples));
+  ExpectFullEpoch(ReadEpoch(pool.get()));
+  ExpectFullEpoch(ReadEpoch(pool.get()));
+}
+
+TEST(ShmBatchPoolTest, TestResumeFromEpochStart) {
+  // 训练进程保存的是epoch开头(reset之后)的sampler
+  data::ResumableRandomSampler saved(kExamples);
+  saved.reset();
+  auto pool = MakePool(Reload(saved));
+  ExpectFullEpoch(ReadEpoch(pool.get()));
+  ExpectFullEpoch(ReadEpoch(pool.get()));
+}
+
+TEST(ShmBatchPoolTest, TestResumeIgnoresEmptySamplerState) {
+  // 旧的检查点里sampler没有reset过, indices是空的
+  data::ResumableRandomSampler saved(kExamples);
+  auto pool = MakePool(Reload(saved));
+  ExpectFullEpoch(ReadEpoch(pool.get()));
+}
+
+}  // namespace
+}  // namespace train
+}  // namespace radish
@@ -0,0 +1,191 @@
+/*
+ * File: step_profiler.cc
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-09 5:30:17
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/train/step_profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace train {
+
+// 每个桶的宽度是 2^(1/4), 160个桶覆盖1us到2^40us(约12.7天),
+// 更长的都落在最后一个桶里, 按实际的最大值报告
+static int BucketOf(int64_t us, int buckets) {
+  if (us <= 1) {
+    return 0;
+  }
+  int b = static_cast<int>(4.0 * std::log2(static_cast<double>(us)));
+  return std::min(b, buckets - 1);
+}
+
+void StepProfiler::Histogram::Add(int64_t us) {
+  counts[BucketOf(us, kBuckets)] += 1;
+  n += 1;
+  sum += us;
+  if (us > max) {
+    max = us;
+  }
+}
+
+double StepProfiler::Histogram::Percentile(double q) const {
+  int64_t target = static_cast<int64_t>(std::ceil(q * n));
+  int64_t acc = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    acc += counts[i];
+    if (acc >= target && acc > 0) {
+      if (i == kBuckets - 1) {
+        return max;
+      }
+      // 取桶的上界, 不超过实际的最大值
+      return std::min(std::pow(2.0, (i + 1) / 4.0),
+                      static_cast<double>(max));
+    }
+  }
+  return max;
+}
+
+StepProfiler::StepProfiler(int64_t traceStart, int64_t traceSteps,
+                           std::string tracePath, bool traceOps)
+    : origin_(std::chrono::steady_clock::now()),
+      trace_start_(traceStart),
+      trace_steps_(traceSteps),
+      trace_path_(tracePath),
+      trace_ops_(traceOps) {}
+
+StepProfiler::~StepProfiler() {
+  if (tracing_) {
+    op_profile_.reset();
+    write_trace_();
+  }
+}
+
+int64_t StepProfiler::NowUs() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - origin_)
+      .count();
+}
+
+void StepProfiler::BeginStep(int64_t step) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  step_ = step;
+  step_start_ = NowUs();
+  if (trace_start_ >= 0 && trace_steps_ > 0 && step == trace_start_ &&
+      !trace_path_.empty()) {
+    tracing_ = true;
+    events_.clear();
+    if (trace_ops_) {
+      op_profile_.reset(new torch::autograd::profiler::RecordProfile(
+          trace_path_ + ".ops.json"));
+    }
+    spdlog::info("start tracing {} steps from step {}", trace_steps_, step);
+  }
+}
+
+void StepProfiler::EndStep() {
+  Record("step", step_start_, NowUs() - step_start_);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (tracing_ && step_ >= trace_start_ + trace_steps_ - 1) {
+    tracing_ = false;
+    op_profile_.reset();
+    write_trace_();
+  }
+}
+
+void StepProfiler::Record(const char* name, int64_t startUs, int64_t durUs) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Histogram* hist = nullptr;
+  for (auto& kv : phases_) {
+    if (kv.first == name) {
+      hist = &kv.second;
+      break;
+    }
+  }
+  if (hist == nullptr) {
+    phases_.emplace_back(name, Histogram());
+    hist = &phases_.back().second;
+  }
+  hist->Add(durUs);
+  if (tracing_) {
+    events_.push_back(TraceEvent{name, startUs, durUs,
+                                 thread_index_(std::this_thread::get_id())});
+  }
+}
+
+int StepProfiler::thread_index_(std::thread::id id) {
+  auto it = thread_ids_.find(id);
+  if (it != thread_ids_.end()) {
+    return it->second;
+  }
+  int idx = thread_ids_.size();
+  thread_ids_[id] = idx;
+  return idx;
+}
+
+void StepProfiler::write_trace_() {
+  std::ofstream ofs(trace_path_);
+  if (!ofs) {
+    spdlog::warn("can't write trace to {}", trace_path_);
+    return;
+  }
+  ofs << "{\"traceEvents\":[";
+  for (size_t i = 0; i < events_.size(); i++) {
+    const auto& ev = events_[i];
+    ofs << (i ? ",\n" : "\n")
+        << absl::StrFormat(
+               "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%d,\"dur\":%d,"
+               "\"pid\":0,\"tid\":%d}",
+               ev.name, ev.ts, ev.dur, ev.tid);
+  }
+  ofs << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  spdlog::info("wrote {} trace events to {}", events_.size(), trace_path_);
+  events_.clear();
+}
+
+std::string StepProfiler::Summary() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  double stepTotal = 0;
+  for (auto& kv : phases_) {
+    if (kv.first == "step") {
+      stepTotal = kv.second.sum;
+    }
+  }
+  std::string out = absl::StrFormat(
+      "%-12s %8s %9s %9s %9s %9s %9s %7s", "phase", "count", "mean(ms)",
+      "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)", "step%");
+  for (auto& kv : phases_) {
+    const Histogram& h = kv.second;
+    if (h.n == 0) {
+      continue;
+    }
+    absl::StrAppend(
+        &out, "\n",
+        absl::StrFormat("%-12s %8d %9.2f %9.2f %9.2f %9.2f %9.2f %6.1f%%",
+                        kv.first, h.n, h.sum / 1000.0 / h.n,
+                        h.Percentile(0.5) / 1000.0, h.Percentile(0.9) / 1000.0,
+                        h.Percentile(0.99) / 1000.0, h.max / 1000.0,
+                        100.0 * h.sum / (stepTotal + 1e-9)));
+  }
+  return out;
+}
+
+void StepProfiler::Reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  phases_.clear();
+}
+
+}  // namespace train
+}  // namespace radish
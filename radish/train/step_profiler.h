@@ -0,0 +1,106 @@
+/*
+ * File: step_profiler.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-09 4:12:50
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "torch/csrc/autograd/profiler.h"
+
+namespace radish {
+namespace train {
+
+/**
+ * 训练每一步各阶段(等数据, forward, loss, backward, 优化器, eval...)的耗时.
+ * 每个阶段用对数分桶的直方图累计, 记录一次只是几次整数运算, 可以一直开着.
+ * 设置了trace窗口时, 窗口内的每个阶段都会记下来, 窗口结束后写成
+ * chrome://tracing 格式的json; trace_ops 打开时同时用autograd profiler
+ * 记录窗口内每个算子(包括backward)的耗时, 写到 trace_path.ops.json.
+ */
+class StepProfiler {
+ public:
+  StepProfiler(int64_t traceStart = -1, int64_t traceSteps = 0,
+               std::string tracePath = "", bool traceOps = false);
+  ~StepProfiler();
+
+  void BeginStep(int64_t step);
+  void EndStep();
+
+  int64_t NowUs() const;
+  void Record(const char* name, int64_t startUs, int64_t durUs);
+
+  // 每个阶段的次数, 平均/p50/p90/p99/最大耗时, 以及占step的比例
+  std::string Summary() const;
+  void Reset();
+
+  class ScopedPhase {
+   public:
+    ScopedPhase(StepProfiler* profiler, const char* name)
+        : profiler_(profiler),
+          name_(name),
+          start_(profiler ? profiler->NowUs() : 0) {}
+    ~ScopedPhase() {
+      if (profiler_) {
+        profiler_->Record(name_, start_, profiler_->NowUs() - start_);
+      }
+    }
+
+   private:
+    StepProfiler* profiler_;
+    const char* name_;
+    int64_t start_;
+  };
+
+ private:
+  struct Histogram {
+    static const int kBuckets = 160;
+    int64_t counts[kBuckets] = {0};
+    int64_t n = 0;
+    int64_t sum = 0;
+    int64_t max = 0;
+    void Add(int64_t us);
+    double Percentile(double q) const;
+  };
+  struct TraceEvent {
+    std::string name;
+    int64_t ts;
+    int64_t dur;
+    int tid;
+  };
+
+  int thread_index_(std::thread::id id);
+  void write_trace_();
+
+  std::chrono::steady_clock::time_point origin_;
+  int64_t trace_start_;
+  int64_t trace_steps_;
+  std::string trace_path_;
+  bool trace_ops_;
+
+  int64_t step_ = 0;
+  int64_t step_start_ = 0;
+  bool tracing_ = false;
+  std::vector<std::pair<std::string, Histogram>> phases_;
+  std::vector<TraceEvent> events_;
+  std::map<std::thread::id, int> thread_ids_;
+  std::unique_ptr<torch::autograd::profiler::RecordProfile> op_profile_;
+  mutable std::mutex mutex_;
+};
+
+}  // namespace train
+}  // namespace radish
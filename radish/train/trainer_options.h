@@ -0,0 +1,78 @@
+/*
+ * File: trainer_options.h
+ * Project: train
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-04 5:02:11
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <string>
+
+#include "torch/arg.h"
+#include "torch/torch.h"
+
+#include "radish/optimization/compressed_state.h"
+#include "radish/utils/runtime_config.h"
+
+namespace radish {
+namespace train {
+
+/// Options for the `LlbTrainer`.
+struct TORCH_API LlbTrainerOptions {
+  // 优化器一阶/二阶矩的存储格式
+  TORCH_ARG(optim::StateFormat, optim_state_format) =
+      optim::StateFormat::kFloat32;
+  // 最优模型在后台线程写盘, 不阻塞训练
+  TORCH_ARG(bool, async_checkpoint) = false;
+  // 每隔多少步保存一次完整的训练状态(train_state.ptc), 0表示不保存
+  TORCH_ARG(int64_t, checkpoint_every) = 0;
+  // logdir里有train_state.ptc时从它继续训练
+  TORCH_ARG(bool, resume) = false;
+  // torch的随机种子, 小于0时不播种. resume时保存训练状态会按 seed+step
+  // 重新播种, 恢复后的随机数和不中断时一致
+  TORCH_ARG(int64_t, seed) = -1;
+  // 在模型副本上后台eval, 需要 LlbTrainer::SetEvalReplicaFactory
+  TORCH_ARG(bool, async_eval) = false;
+  // 后台线程提前拼好并拷贝到device的batch个数
+  TORCH_ARG(int64_t, prefetch_batches) = 2;
+  // 每隔多少步打印一次各阶段耗时的统计, 0表示只在训练结束时打印
+  TORCH_ARG(int64_t, profile_report_every) = 1000;
+  // 从这一步开始记录trace_steps步的chrome trace到logdir/step_trace.json
+  TORCH_ARG(int64_t, trace_start_step) = -1;
+  TORCH_ARG(int64_t, trace_steps) = 20;
+  // trace窗口内同时记录每个算子的耗时(autograd profiler, 开销较大)
+  TORCH_ARG(bool, trace_ops) = false;
+  // 每隔多少步汇报一次吞吐/效率指标
+  TORCH_ARG(int64_t, metrics_every) = 100;
+  // 指标另外写到这个文件, 后缀为 .csv 或 .jsonl
+  TORCH_ARG(std::string, metrics_file) = "";
+  // 大于0时在 127.0.0.1:port 上提供Prometheus格式的指标
+  TORCH_ARG(int, metrics_port) = 0;
+  // 大于0时按token数组batch, 每个micro batch不超过这么多token,
+  // MainLoop的batchSize变成分组用的样本池大小
+  TORCH_ARG(int64_t, max_tokens_per_batch) = 0;
+  // token预算按 样本数*最大长度 计算, 否则按真实token数
+  TORCH_ARG(bool, budget_padded_tokens) = true;
+  // 序列feature截到batch里最长的真实长度
+  TORCH_ARG(bool, trim_padding) = false;
+  // 序列长度课程: 前curriculum_steps步样本有效长度不超过curriculum_max_len,
+  // 之后恢复完整长度, 需要parser支持SetMaxLength. 0表示不启用
+  TORCH_ARG(int, curriculum_max_len) = 0;
+  TORCH_ARG(int64_t, curriculum_steps) = 0;
+  // 线程数和cpu绑定; 进程级的部分由binary调用ApplyRuntimeOptions生效,
+  // trainer用其中的loader_workers和data_cpus
+  TORCH_ARG(utils::RuntimeOptions, runtime) = utils::RuntimeOptions();
+  // 大于0时分词/mask放在这么多个独立的预处理进程里,
+  // batch通过共享内存传给训练进程; 不支持按token预算分batch
+  TORCH_ARG(int, preprocess_processes) = 0;
+  // 共享内存里每个batch slot的大小(MB)
+  TORCH_ARG(int64_t, shm_slot_mb) = 64;
+};
+
+}  // namespace train
+}  // namespace radish
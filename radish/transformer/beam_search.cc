@@ -0,0 +1,120 @@
+/*
+ * File: beam_search.cc
+ * Project: transformer
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-19 3:27:45
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#include "radish/transformer/beam_search.h"
+
+#include <algorithm>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+
+GenerateOptions::GenerateOptions(int64_t bos, int64_t eos)
+    : bos_(bos), eos_(eos) {}
+
+static int64_t MaxDecodeLength(Transformer model,
+                               const GenerateOptions& options) {
+  CHECK(!model->is_training()) << "call model->eval() before decoding";
+  CHECK_GT(options.max_len(), 0);
+  return std::min(options.max_len(), model->options.len_max_seq());
+}
+
+GenerateResult GreedySearch(Transformer model, const Tensor& src_seq,
+                            const Tensor& src_pos,
+                            const GenerateOptions& options) {
+  torch::NoGradGuard guard;
+  const int64_t maxLen = MaxDecodeLength(model, options);
+  const int64_t batch = src_seq.size(0);
+  auto longOpts =
+      torch::TensorOptions().dtype(torch::kLong).device(src_seq.device());
+  DecoderState state = model->init_state(src_seq, src_pos);
+  Tensor token = torch::full({batch}, options.bos(), longOpts);
+  Tensor finished = torch::zeros({batch}, longOpts.dtype(torch::kBool));
+  Tensor scores;
+  std::vector<Tensor> steps;
+  for (int64_t t = 0; t < maxLen; t++) {
+    Tensor logProbs =
+        torch::log_softmax(model->decode_step(token, &state), -1);
+    std::tuple<Tensor, Tensor> best = logProbs.max(-1);
+    Tensor score = std::get<0>(best).masked_fill(finished, 0);
+    // 已结束的序列补0, 分数不再变
+    Tensor next = std::get<1>(best).masked_fill(finished, 0);
+    scores = scores.defined() ? scores + score : score;
+    steps.push_back(next);
+    finished = finished | next.eq(options.eos());
+    if (finished.all().item<bool>()) {
+      break;
+    }
+    token = next;
+  }
+  return {torch::stack(steps, 1), scores};
+}
+
+GenerateResult BeamSearch(Transformer model, const Tensor& src_seq,
+                          const Tensor& src_pos,
+                          const GenerateOptions& options) {
+  torch::NoGradGuard guard;
+  const int64_t maxLen = MaxDecodeLength(model, options);
+  const int64_t batch = src_seq.size(0);
+  const int64_t beam = options.beam_size();
+  const int64_t vocab = model->options.n_tgt_vocab();
+  CHECK_GT(beam, 0);
+  const float inf = std::numeric_limits<float>::infinity();
+  auto longOpts =
+      torch::TensorOptions().dtype(torch::kLong).device(src_seq.device());
+  Tensor batchIndex = torch::arange(batch, longOpts);
+  // encoder只对原batch跑一次, 缓存复制成 batch*beam 份
+  DecoderState state = model->init_state(src_seq, src_pos);
+  state.Reorder(batchIndex.unsqueeze(1).expand({batch, beam}).reshape({-1}));
+  Tensor beamBase = batchIndex.mul(beam).unsqueeze(1);
+
+  Tensor token = torch::full({batch * beam}, options.bos(), longOpts);
+  Tensor finished = torch::zeros({batch * beam}, longOpts.dtype(torch::kBool));
+  Tensor seqs = torch::empty({batch * beam, 0}, longOpts);
+  // 开始时只有第0个beam有效, 避免各beam选出同样的token
+  Tensor scores = torch::full({batch, beam}, -inf,
+                              longOpts.dtype(torch::kFloat));
+  scores.select(1, 0).fill_(0);
+  for (int64_t t = 0; t < maxLen; t++) {
+    Tensor logProbs =
+        torch::log_softmax(model->decode_step(token, &state), -1);
+    // 结束的beam只有接0一个候选, 分数不变
+    logProbs.masked_fill_(finished.unsqueeze(1), -inf);
+    logProbs.select(1, 0).masked_fill_(finished, 0);
+    Tensor cand = (scores.view({-1, 1}) + logProbs).view({batch, -1});
+    std::tuple<Tensor, Tensor> top = cand.topk(beam, 1);
+    scores = std::get<0>(top);
+    Tensor flat = std::get<1>(top);
+    Tensor origin = (beamBase + flat.div(vocab)).view({-1});
+    Tensor next = flat.remainder(vocab).view({-1});
+    seqs = torch::cat({seqs.index_select(0, origin), next.unsqueeze(1)}, 1);
+    finished = finished.index_select(0, origin) | next.eq(options.eos());
+    state.Reorder(origin, false);
+    if (finished.all().item<bool>()) {
+      break;
+    }
+    token = next;
+  }
+
+  Tensor normed = scores;
+  if (options.length_penalty() > 0) {
+    Tensor lengths =
+        seqs.ne(0).sum(1).to(torch::kFloat).clamp_min(1).view({batch, beam});
+    normed = scores / lengths.pow(options.length_penalty());
+  }
+  Tensor pick = batchIndex.mul(beam) + std::get<1>(normed.max(1));
+  return {seqs.index_select(0, pick), scores.view({-1}).index_select(0, pick)};
+}
+
+}  // namespace radish
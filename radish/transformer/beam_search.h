@@ -0,0 +1,57 @@
+/*
+ * File: beam_search.h
+ * Project: transformer
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-19 2:41:09
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#pragma once
+
+#include <cstddef>
+
+#include "torch/types.h"
+
+#include "radish/transformer/transformer.h"
+
+namespace radish {
+using Tensor = torch::Tensor;
+/// Options for `GreedySearch` and `BeamSearch`.
+struct TORCH_API GenerateOptions {
+  GenerateOptions(int64_t bos, int64_t eos);
+  TORCH_ARG(int64_t, bos);
+  TORCH_ARG(int64_t, eos);
+  // 不含bos的最大生成长度, 还受 len_max_seq 限制
+  TORCH_ARG(int64_t, max_len) = 64;
+  TORCH_ARG(int64_t, beam_size) = 4;
+  // 最后按 score/len^length_penalty 选beam, 0表示不做长度归一
+  TORCH_ARG(double, length_penalty) = 1.0;
+};
+
+struct TORCH_API GenerateResult {
+  // b x t, 不含bos, eos之后补0
+  Tensor tokens;
+  // [b], 选中序列的对数概率之和
+  Tensor scores;
+};
+
+/**
+ * 用KV缓存逐个位置解码, 每步只算新位置, encoder只跑一次.
+ * 调用前需要 model->eval(). src_seq/src_pos 同 TransformerImpl::forward
+ */
+GenerateResult GreedySearch(Transformer model, const Tensor& src_seq,
+                            const Tensor& src_pos,
+                            const GenerateOptions& options);
+
+/**
+ * 批量的beam search: 每个样本展开成 beam_size 个序列一起解码,
+ * 每步在 beam_size*vocab 个候选里取topk, 自注意力缓存按来源beam重排.
+ * 结束的beam只能接0, 分数不变, 所有beam结束或到最大长度时停止
+ */
+GenerateResult BeamSearch(Transformer model, const Tensor& src_seq,
+                          const Tensor& src_pos,
+                          const GenerateOptions& options);
+
+}  // namespace radish
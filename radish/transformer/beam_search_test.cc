@@ -0,0 +1,59 @@
+/*
+ * File: beam_search_test.cc
+ * Project: transformer
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-19 4:05:31
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "gtest/gtest.h"
+
+#include "torch/torch.h"
+
+#include "radish/transformer/beam_search.h"
+
+TEST(BeamSearchTest, TestStepMatchesForward) {
+  const int64_t B = 3, Ls = 9, Lt = 7, V = 50;
+  radish::Transformer model(radish::TransformerOptions(V, V, 16)
+                                .d_word_vec(32)
+                                .d_model(32)
+                                .d_inner(64)
+                                .n_layers(2)
+                                .n_head(4)
+                                .d_k(8)
+                                .d_v(8));
+  model->eval();
+  torch::NoGradGuard guard;
+  torch::Tensor src = torch::randint(1, V, {B, Ls}, torch::kLong);
+  // 第二个样本的src带pad
+  src[1].narrow(0, 5, Ls - 5).fill_(0);
+  torch::Tensor srcPos =
+      torch::arange(1, Ls + 1, torch::kLong).unsqueeze(0).repeat({B, 1});
+  srcPos.masked_fill_(src.eq(0), 0);
+  torch::Tensor tgt = torch::randint(1, V, {B, Lt}, torch::kLong);
+  torch::Tensor tgtPos =
+      torch::arange(1, Lt + 1, torch::kLong).unsqueeze(0).repeat({B, 1});
+  torch::Tensor full = model->forward(src, srcPos, tgt, tgtPos);
+
+  radish::DecoderState state = model->init_state(src, srcPos);
+  for (int64_t t = 0; t < Lt; t++) {
+    torch::Tensor logits = model->decode_step(tgt.select(1, t), &state);
+    EXPECT_TRUE(torch::allclose(logits, full.select(1, t), 1e-4, 1e-5))
+        << "step " << t;
+  }
+
+  // beam_size=1 退化成greedy
+  radish::GenerateOptions opts(1, 2);
+  opts.max_len(10).beam_size(1).length_penalty(0);
+  radish::GenerateResult greedy =
+      radish::GreedySearch(model, src, srcPos, opts);
+  radish::GenerateResult beam = radish::BeamSearch(model, src, srcPos, opts);
+  EXPECT_TRUE(torch::equal(greedy.tokens, beam.tokens));
+  EXPECT_TRUE(torch::allclose(greedy.scores, beam.scores, 1e-4, 1e-5));
+  opts.beam_size(4);
+  beam = radish::BeamSearch(model, src, srcPos, opts);
+  EXPECT_EQ(beam.tokens.size(0), B);
+  EXPECT_EQ(beam.scores.size(0), B);
+}
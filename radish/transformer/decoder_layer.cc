@@ -59,11 +59,10 @@ void DecoderLayerImpl::pretty_print(std::ostream& stream) const {
          << ", d_v=" << options.d_v() << ")";
 }
 
-std::vector<Tensor> DecoderLayerImpl::forward(const Tensor& dec_input,
-                                              const Tensor& enc_output,
-                                              const Tensor& non_pad_mask,
-                                              const Tensor& slf_attn_mask,
-                                              const Tensor& dec_enc_attn_mask) {
+std::vector<Tensor> DecoderLayerImpl::forward(
+    const Tensor& dec_input, const Tensor& enc_output,
+    const Tensor& non_pad_mask, const AttentionMask& slf_attn_mask,
+    const AttentionMask& dec_enc_attn_mask) {
   std::vector<Tensor> rets =
       slf_attn->forward(dec_input, dec_input, dec_input, slf_attn_mask);
   Tensor dec_output = rets[0];
@@ -84,4 +83,13 @@ std::vector<Tensor> DecoderLayerImpl::forward(const Tensor& dec_input,
   }
   return {dec_output, dec_slf_attn, dec_enc_attn};
 }
+
+Tensor DecoderLayerImpl::forward_step(const Tensor& dec_input,
+                                      DecoderLayerCache* cache,
+                                      const AttentionMask& dec_enc_attn_mask) {
+  Tensor dec_output = slf_attn->forward_step(dec_input, &cache->slf, true);
+  dec_output = decenc_attn->forward_step(dec_output, &cache->enc, false,
+                                         dec_enc_attn_mask);
+  return pos_ffn.forward(dec_output);
+}
 }  // namespace radish
@@ -24,6 +24,13 @@
 
 namespace radish {
 using Tensor = torch::Tensor;
+
+// 增量解码时一层decoder的缓存: 自注意力和交叉注意力各一份
+struct TORCH_API DecoderLayerCache {
+  AttentionCache slf;
+  AttentionCache enc;
+};
+
 /// Options for the `DecoderLayer` module.
 struct TORCH_API DecoderLayerOptions {
   DecoderLayerOptions(int64_t d_model, int64_t d_inner, int64_t n_head,
@@ -52,8 +59,12 @@ class TORCH_API DecoderLayerImpl
 
   std::vector<Tensor> forward(const Tensor& dec_input, const Tensor& enc_output,
                               const Tensor& non_pad_mask = {},
-                              const Tensor& slf_attn_mask = {},
-                              const Tensor& dec_enc_attn_mask = {});
+                              const AttentionMask& slf_attn_mask = {},
+                              const AttentionMask& dec_enc_attn_mask = {});
+
+  // 增量解码一步, dec_input 是 b x 1 x d_model, 新位置都不是pad
+  Tensor forward_step(const Tensor& dec_input, DecoderLayerCache* cache,
+                      const AttentionMask& dec_enc_attn_mask);
 
   /// The options used to configure this module.
   DecoderLayerOptions options;
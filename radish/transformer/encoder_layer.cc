@@ -55,9 +55,9 @@ void EncoderLayerImpl::pretty_print(std::ostream& stream) const {
          << ", d_v=" << options.d_v() << ")";
 }
 
-std::vector<Tensor> EncoderLayerImpl::forward(const Tensor& enc_input,
-                                              const Tensor& non_pad_mask,
-                                              const Tensor& slf_attn_mask) {
+std::vector<Tensor> EncoderLayerImpl::forward(
+    const Tensor& enc_input, const Tensor& non_pad_mask,
+    const AttentionMask& slf_attn_mask) {
   std::vector<Tensor> rets =
       slf_attn->forward(enc_input, enc_input, enc_input, slf_attn_mask);
   Tensor& enc_output = rets[0];
@@ -50,9 +50,11 @@ class TORCH_API EncoderLayerImpl
   /// Pretty prints the `Linear` module into the given `stream`.
   void pretty_print(std::ostream& stream) const override;
 
+  // enc_input 是打包的 [T, d_model] 时, slf_attn_mask 带 cu_seqlens,
+  // non_pad_mask 为空, 见 MultiheadAttentionImpl::forward
   std::vector<Tensor> forward(const Tensor& enc_input,
                               const Tensor& non_pad_mask = {},
-                              const Tensor& slf_attn_mask = {});
+                              const AttentionMask& slf_attn_mask = {});
 
   /// The options used to configure this module.
   EncoderLayerOptions options;
@@ -11,6 +11,7 @@
 
 #include "radish/transformer/multihead_attention.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <ostream>
 #include <utility>
@@ -22,10 +23,38 @@
 #include "torch/utils.h"
 
 #include "radish/layers/layer_norm.h"
+#include "radish/layers/unpad.h"
 #include "radish/utils/logging.h"
 
 namespace radish {
 
+void AttentionCache::Append(const Tensor& newK, const Tensor& newV) {
+  const int64_t add = newK.size(2);
+  if (!k.defined() || length + add > k.size(2)) {
+    const int64_t capacity = std::max<int64_t>(16, 2 * (length + add));
+    Tensor bigK = torch::empty(
+        {newK.size(0), newK.size(1), capacity, newK.size(3)}, newK.options());
+    Tensor bigV = torch::empty(
+        {newV.size(0), newV.size(1), capacity, newV.size(3)}, newV.options());
+    if (length > 0) {
+      bigK.narrow(2, 0, length).copy_(keys());
+      bigV.narrow(2, 0, length).copy_(values());
+    }
+    k = bigK;
+    v = bigV;
+  }
+  k.narrow(2, length, add).copy_(newK);
+  v.narrow(2, length, add).copy_(newV);
+  length += add;
+}
+
+void AttentionCache::Reorder(const Tensor& index) {
+  if (k.defined()) {
+    k = k.index_select(0, index);
+    v = v.index_select(0, index);
+  }
+}
+
 MultiheadAttentionOptions::MultiheadAttentionOptions(int64_t n_head,
                                                      int64_t d_model,
                                                      int64_t d_k, int64_t d_v,
@@ -43,14 +72,13 @@ MultiheadAttentionImpl::MultiheadAttentionImpl(
 }
 
 void MultiheadAttentionImpl::reset() {
-  w_qs = torch::nn::Linear(options.d_model(), options.n_head() * options.d_k());
-  register_module("w_qs", w_qs);
-  w_ks = torch::nn::Linear(options.d_model(), options.n_head() * options.d_k());
-  register_module("w_ks", w_ks);
-  w_vs = torch::nn::Linear(options.d_model(), options.n_head() * options.d_v());
-  register_module("w_vs", w_vs);
-  attention = radish::ScaleProductAttention(std::sqrt(options.d_k()),
-                                            options.dropout());
+  w_qkv = torch::nn::Linear(
+      options.d_model(),
+      options.n_head() * (2 * options.d_k() + options.d_v()));
+  register_module("w_qkv", w_qkv);
+  attention = radish::ScaleProductAttention(
+      ScaleProductAttentionOptions(std::sqrt(options.d_k()), options.dropout())
+          .flash(options.flash_attention()));
   register_module("attention", attention);
   fc = torch::nn::Linear(options.n_head() * options.d_v(), options.d_model());
   register_module("fc", fc);
@@ -59,18 +87,15 @@ void MultiheadAttentionImpl::reset() {
   dropout = register_module("dropout", torch::nn::Dropout(options.dropout()));
 
   torch::NoGradGuard guard;
+  const int64_t qk = options.n_head() * options.d_k();
+  const int64_t vsize = options.n_head() * options.d_v();
   torch::nn::init::normal_(
-      w_qs->weight, 0,
+      w_qkv->weight.narrow(0, 0, 2 * qk), 0,
       std::sqrt(2.0 / (options.d_model() + options.d_k() + 0.000001)));
-  torch::nn::init::constant_(w_qs->bias, 0);
   torch::nn::init::normal_(
-      w_ks->weight, 0,
-      std::sqrt(2.0 / (options.d_model() + options.d_k() + 0.000001)));
-  torch::nn::init::constant_(w_ks->bias, 0);
-  torch::nn::init::normal_(
-      w_vs->weight, 0,
+      w_qkv->weight.narrow(0, 2 * qk, vsize), 0,
       std::sqrt(2.0 / (options.d_model() + options.d_v() + 0.000001)));
-  torch::nn::init::constant_(w_vs->bias, 0);
+  torch::nn::init::constant_(w_qkv->bias, 0);
   torch::nn::init::xavier_normal_(fc->weight);
   torch::nn::init::constant_(fc->bias, 0);
 }
@@ -78,20 +103,39 @@ void MultiheadAttentionImpl::reset() {
 void MultiheadAttentionImpl::pretty_print(std::ostream& stream) const {
   stream << "transformer::MultiheadAttention(dropout=" << options.dropout()
          << ", n_head=" << options.n_head() << ", d_model=" << options.d_model()
-         << ", d_k=" << options.d_k() << ", d_v=" << options.d_v() << ")";
+         << ", d_k=" << options.d_k() << ", d_v=" << options.d_v()
+         << ", flash=" << options.flash_attention() << ")";
 }
 
 std::vector<Tensor> MultiheadAttentionImpl::forward(const Tensor& q,
                                                     const Tensor& k,
                                                     const Tensor& v,
-                                                    const Tensor& mask) {
-  CHECK_EQ(q.sizes(), k.sizes());
-  CHECK_EQ(q.sizes(), v.sizes());
-  CHECK_EQ(q.ndimension(), 3);
+                                                    const AttentionMask& mask) {
+  CHECK_EQ(k.sizes(), v.sizes());
+  CHECK_EQ(q.size(0), k.size(0));
 
   int64_t n_head = options.n_head();
   int64_t d_k = options.d_k();
   int64_t d_v = options.d_v();
+  if (q.ndimension() == 2) {
+    CHECK(q.is_same(k) && k.is_same(v)) << "packed input is self attention";
+    const int64_t qk = n_head * d_k;
+    // 打包权重的输出按列切开, 都是最后一维连续的 T x n x d view
+    auto qkv = w_qkv_int8.is_empty() ? w_qkv->forward(q) : w_qkv_int8(q);
+    auto output = VarlenAttention(
+        qkv.narrow(1, 0, qk).view({-1, n_head, d_k}),
+        qkv.narrow(1, qk, qk).view({-1, n_head, d_k}),
+        qkv.narrow(1, 2 * qk, n_head * d_v).view({-1, n_head, d_v}),
+        mask.cu_seqlens,
+        1.0 / attention->options.temperature(),
+        attention->options.att_dropout(), is_training());
+    output = output.view({-1, n_head * d_v});
+    output = dropout.forward(fc_int8.is_empty() ? fc->forward(output)
+                                                : fc_int8(output));
+    output.add_(q);
+    return {layernorm.forward(output), Tensor()};
+  }
+  CHECK_EQ(q.ndimension(), 3);
 
   int64_t len_q = q.size(1);
   int64_t len_k = k.size(1);
@@ -99,32 +143,110 @@ std::vector<Tensor> MultiheadAttentionImpl::forward(const Tensor& q,
   int64_t sz_b = q.size(0);
 
   const auto residual = q;
-  auto q_ = w_qs->forward(q).view({sz_b, len_q, n_head, d_k});
-  auto k_ = w_ks->forward(k).view({sz_b, len_k, n_head, d_k});
-  auto v_ = w_vs->forward(v).view({sz_b, len_v, n_head, d_v});
-
-  q_ = q_.permute({2, 0, 1, 3})
-           .contiguous()
-           .view({-1, len_q, d_k});  // (n*b) x lq x dk
-  k_ = k_.permute({2, 0, 1, 3})
-           .contiguous()
-           .view({-1, len_k, d_k});  // (n*b) x lk x dk
-  v_ = v_.permute({2, 0, 1, 3})
-           .contiguous()
-           .view({-1, len_v, d_v});  // (n*b) x lv x dv
-
-  auto mask_ = mask.repeat({n_head, 1, 1});  // (n*b) x .. x ..
-  std::vector<Tensor> rets = attention(q_, k_, v_, mask_);
-  auto& output = rets[0];
-  const auto& attn = rets[1];
-  output = output.view({n_head, sz_b, len_q, d_v});
-  output = output.permute({1, 2, 0, 3})
-               .contiguous()
-               .view({sz_b, len_q, -1});  //  b x lq x (n*dv)
-
-  output = dropout.forward(fc->forward(output));
+  const int64_t qk = n_head * d_k;
+  // b x n x l x d 的view, 这里还没有拷贝
+  Tensor q4, k4, v4;
+  if (d_k == d_v && q.is_same(k) && k.is_same(v)) {
+    // 自注意力: 一次GEMM
+    auto qkv = (w_qkv_int8.is_empty() ? w_qkv->forward(q) : w_qkv_int8(q))
+                   .view({sz_b, len_q, 3, n_head, d_k});
+    q4 = qkv.select(2, 0).permute({0, 2, 1, 3});
+    k4 = qkv.select(2, 1).permute({0, 2, 1, 3});
+    v4 = qkv.select(2, 2).permute({0, 2, 1, 3});
+  } else {
+    // 交叉注意力或d_k != d_v: 用打包权重的切片分别投影
+    CHECK(w_qkv_int8.is_empty()) << "int8 attention is self attention only";
+    const auto& weight = w_qkv->weight;
+    const auto& bias = w_qkv->bias;
+    q4 = torch::linear(q, weight.narrow(0, 0, qk), bias.narrow(0, 0, qk))
+             .view({sz_b, len_q, n_head, d_k})
+             .permute({0, 2, 1, 3});
+    k4 = torch::linear(k, weight.narrow(0, qk, qk), bias.narrow(0, qk, qk))
+             .view({sz_b, len_k, n_head, d_k})
+             .permute({0, 2, 1, 3});
+    v4 = torch::linear(v, weight.narrow(0, 2 * qk, n_head * d_v),
+                       bias.narrow(0, 2 * qk, n_head * d_v))
+             .view({sz_b, len_v, n_head, d_v})
+             .permute({0, 2, 1, 3});
+  }
+
+  // flash时输出是 b x lq x n x dv 连续的view, reshape不拷贝
+  std::vector<Tensor> rets = attention(q4, k4, v4, mask);
+  Tensor output = rets[0].permute({0, 2, 1, 3}).reshape(
+      {sz_b, len_q, -1});  //  b x lq x (n*dv)
+  Tensor attn = rets[1];
+
+  output = dropout.forward(fc_int8.is_empty() ? fc->forward(output)
+                                              : fc_int8(output));
   output.add_(residual);
   output = layernorm.forward(output);
   return {output, attn};
 }
+
+Tensor MultiheadAttentionImpl::forward_step(const Tensor& q,
+                                           AttentionCache* cache,
+                                           bool self_attention,
+                                           const AttentionMask& mask) {
+  CHECK_EQ(q.ndimension(), 3);
+  CHECK_EQ(q.size(1), 1) << "incremental decoding takes one position a step";
+  CHECK(w_qkv_int8.is_empty()) << "int8 attention is self attention only";
+  const int64_t n_head = options.n_head();
+  const int64_t d_k = options.d_k();
+  const int64_t d_v = options.d_v();
+  const int64_t qk = n_head * d_k;
+  const int64_t sz_b = q.size(0);
+  Tensor q4;
+  if (self_attention) {
+    auto qkv = w_qkv->forward(q);
+    q4 = qkv.narrow(2, 0, qk)
+             .view({sz_b, 1, n_head, d_k})
+             .permute({0, 2, 1, 3});
+    cache->Append(qkv.narrow(2, qk, qk)
+                      .view({sz_b, 1, n_head, d_k})
+                      .permute({0, 2, 1, 3}),
+                  qkv.narrow(2, 2 * qk, n_head * d_v)
+                      .view({sz_b, 1, n_head, d_v})
+                      .permute({0, 2, 1, 3}));
+  } else {
+    CHECK(cache->k.defined()) << "cross attention cache is not projected";
+    q4 = torch::linear(q, w_qkv->weight.narrow(0, 0, qk),
+                       w_qkv->bias.narrow(0, 0, qk))
+             .view({sz_b, 1, n_head, d_k})
+             .permute({0, 2, 1, 3});
+  }
+  std::vector<Tensor> rets =
+      attention(q4, cache->keys(), cache->values(), mask);
+  Tensor output = rets[0].permute({0, 2, 1, 3}).reshape({sz_b, 1, -1});
+  output = dropout.forward(fc->forward(output));
+  output.add_(q);
+  return layernorm.forward(output);
+}
+
+AttentionCache MultiheadAttentionImpl::project_kv(const Tensor& kv) {
+  CHECK_EQ(kv.ndimension(), 3);
+  const int64_t n_head = options.n_head();
+  const int64_t d_k = options.d_k();
+  const int64_t d_v = options.d_v();
+  const int64_t qk = n_head * d_k;
+  const int64_t sz_b = kv.size(0);
+  const int64_t len = kv.size(1);
+  const auto& weight = w_qkv->weight;
+  const auto& bias = w_qkv->bias;
+  AttentionCache cache;
+  cache.k = torch::linear(kv, weight.narrow(0, qk, qk), bias.narrow(0, qk, qk))
+                .view({sz_b, len, n_head, d_k})
+                .permute({0, 2, 1, 3});
+  cache.v = torch::linear(kv, weight.narrow(0, 2 * qk, n_head * d_v),
+                          bias.narrow(0, 2 * qk, n_head * d_v))
+                .view({sz_b, len, n_head, d_v})
+                .permute({0, 2, 1, 3});
+  cache.length = len;
+  return cache;
+}
+
+void MultiheadAttentionImpl::quantize_int8() {
+  CHECK_EQ(options.d_k(), options.d_v());
+  w_qkv_int8 = register_module("w_qkv_int8", QuantizeLinear(w_qkv));
+  fc_int8 = register_module("fc_int8", QuantizeLinear(fc));
+}
 }  // namespace radish
@@ -21,10 +21,29 @@
 #include "torch/nn/pimpl.h"
 #include "torch/types.h"
 
+#include "radish/layers/quantized_linear.h"
 #include "radish/transformer/scale_product_attention.h"
 
 namespace radish {
 using Tensor = torch::Tensor;
+
+/**
+ * 增量解码时一个attention层缓存的key/value, b x n x capacity x d,
+ * 前 length 个位置有效. 自注意力每步追加一个位置, 容量不够时翻倍,
+ * 摊下来每步不用重新拷贝前缀; 交叉注意力的缓存是encoder输出投影一次的结果
+ */
+struct TORCH_API AttentionCache {
+  void Append(const Tensor& newK, const Tensor& newV);
+  // beam search时按 index 重排batch里的序列
+  void Reorder(const Tensor& index);
+  Tensor keys() const { return k.narrow(2, 0, length); }
+  Tensor values() const { return v.narrow(2, 0, length); }
+
+  Tensor k;
+  Tensor v;
+  int64_t length = 0;
+};
+
 /// Options for the `MultiheadAttention` module.
 struct TORCH_API MultiheadAttentionOptions {
   MultiheadAttentionOptions(int64_t n_head, int64_t d_model, int64_t d_k,
@@ -34,6 +53,8 @@ struct TORCH_API MultiheadAttentionOptions {
   TORCH_ARG(int64_t, d_k);
   TORCH_ARG(int64_t, d_v);
   TORCH_ARG(double, dropout) = 0.1;
+  // 见 ScaleProductAttentionOptions::flash, 打开时forward返回的attn为空
+  TORCH_ARG(bool, flash_attention) = false;
 };
 
 class TORCH_API MultiheadAttentionImpl
@@ -50,17 +71,39 @@ class TORCH_API MultiheadAttentionImpl
   /// Pretty prints the `Linear` module into the given `stream`.
   void pretty_print(std::ostream& stream) const override;
 
+  /**
+   * mask 是key长度加因果标记的紧凑表示, 不再传 [B, Lq, Lk] 的mask.
+   * 返回 {输出, attn}, attn 是 b x n x lq x lk, flash时为空.
+   * q/k/v 是同一个打包的 [T, d_model] 时按不补齐的自注意力算,
+   * mask.cu_seqlens 给各序列的起点(见 layers/unpad.h), 返回的attn为空
+   */
   std::vector<Tensor> forward(const Tensor& q, const Tensor& k, const Tensor& v,
-                              const Tensor& mask = {});
+                              const AttentionMask& mask = {});
+
+  /**
+   * 增量解码一步, q 是 b x 1 x d_model. self_attention 时新位置的k/v
+   * 追加到 cache, 再和全部已解码的位置做attention(不需要因果mask);
+   * 否则 cache 是 project_kv 预先算好的, mask 给src的长度
+   */
+  Tensor forward_step(const Tensor& q, AttentionCache* cache,
+                      bool self_attention, const AttentionMask& mask = {});
+
+  // 交叉注意力的key/value投影, 整个解码过程只算一次
+  AttentionCache project_kv(const Tensor& kv);
+
+  // 推理时把w_qkv/fc换成int8的, 只支持 d_k == d_v 的自注意力
+  void quantize_int8();
 
   /// The options used to configure this module.
   MultiheadAttentionOptions options;
-  torch::nn::Linear w_qs = nullptr;
-  torch::nn::Linear w_ks = nullptr;
-  torch::nn::Linear w_vs = nullptr;
+  // w_qs/w_ks/w_vs 按行打包: [n_head*(2*d_k+d_v), d_model], 自注意力时
+  // 一次GEMM. 旧的分开保存的checkpoint在加载时拼起来, 见 train/model_io.h
+  torch::nn::Linear w_qkv = nullptr;
   radish::ScaleProductAttention attention = nullptr;
   torch::nn::AnyModule layernorm;
   torch::nn::Linear fc = nullptr;
+  QuantizedLinear w_qkv_int8 = nullptr;
+  QuantizedLinear fc_int8 = nullptr;
   torch::nn::AnyModule dropout;
 };
 
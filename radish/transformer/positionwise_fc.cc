@@ -50,11 +50,30 @@ void PositionwiseFCImpl::pretty_print(std::ostream& stream) const {
 }
 
 Tensor PositionwiseFCImpl::forward(const Tensor& input) {
+  if (input.dim() == 2) {
+    // 不补齐的打包输入 [T, d_in]
+    return forward(input.unsqueeze(0)).squeeze(0);
+  }
   const auto residual = input;
+  if (!in2hidden_int8.is_empty()) {
+    // 1x1卷积就是最后一维上的Linear, 不用转置
+    Tensor output = hidden2in_int8(torch::gelu(in2hidden_int8(input)));
+    output = dropout.forward(output);
+    return layernorm.forward(output.add_(residual));
+  }
   Tensor output = input.transpose(1, 2);
   output = hidden2in.forward(torch::gelu(in2hidden.forward(output)));
   output.transpose_(1, 2);
   output = dropout.forward(output);
   return layernorm.forward(output.add_(residual));
 }
+
+void PositionwiseFCImpl::quantize_int8() {
+  auto w1 = in2hidden.ptr<torch::nn::Conv1dImpl>();
+  auto w2 = hidden2in.ptr<torch::nn::Conv1dImpl>();
+  in2hidden_int8 = register_module("in2hidden_int8",
+                                   QuantizeLinear(w1->weight, w1->bias));
+  hidden2in_int8 = register_module("hidden2in_int8",
+                                   QuantizeLinear(w2->weight, w2->bias));
+}
 }  // namespace radish
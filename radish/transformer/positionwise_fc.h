@@ -19,6 +19,8 @@
 #include "torch/nn/pimpl.h"
 #include "torch/types.h"
 
+#include "radish/layers/quantized_linear.h"
+
 namespace radish {
 using Tensor = ::torch::Tensor;
 /// Options for the `ScaleProductAttention` module.
@@ -43,12 +45,17 @@ class TORCH_API PositionwiseFCImpl
 
   Tensor forward(const Tensor& input);
 
+  // 推理时把两个1x1卷积换成int8的Linear
+  void quantize_int8();
+
   /// The `Options` used to configure this  module.
   PositionwiseFCOptions options;
   torch::nn::AnyModule in2hidden;
   torch::nn::AnyModule hidden2in;
   torch::nn::AnyModule dropout;
   torch::nn::AnyModule layernorm;
+  QuantizedLinear in2hidden_int8 = nullptr;
+  QuantizedLinear hidden2in_int8 = nullptr;
 };
 
 /// A `ModuleHolder` subclass for `PositionwiseFCImpl`.
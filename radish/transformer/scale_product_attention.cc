@@ -19,6 +19,8 @@
 #include <utility>
 #include <vector>
 
+#include "radish/layers/flash_attention.h"
+
 namespace radish {
 
 ScaleProductAttentionOptions::ScaleProductAttentionOptions(double temperature,
@@ -39,20 +41,27 @@ void ScaleProductAttentionImpl::reset() {
 void ScaleProductAttentionImpl::pretty_print(std::ostream& stream) const {
   stream << "transformer::ScaleProductAttention(dropout="
          << options.att_dropout() << ", temperature=" << options.temperature()
-         << ")";
+         << ", flash=" << options.flash() << ")";
 }
 
-std::vector<Tensor> ScaleProductAttentionImpl::forward(const Tensor& q,
-                                                       const Tensor& k,
-                                                       const Tensor& v,
-                                                       const Tensor& mask) {
-  Tensor attn = ::torch::bmm(q, k.transpose(1, 2));
-  attn.div_(options.temperature());
-  if (mask.numel() != 0) {
-    attn.masked_fill_(mask, -INFINITY);
+std::vector<Tensor> ScaleProductAttentionImpl::forward(
+    const Tensor& q, const Tensor& k, const Tensor& v,
+    const AttentionMask& mask) {
+  if (options.flash() && FlashAttentionAvailable(q)) {
+    // 没有head维时当作只有一个head
+    const bool noHead = q.dim() == 3;
+    Tensor out = FlashAttention(
+        noHead ? q.unsqueeze(1) : q, noHead ? k.unsqueeze(1) : k,
+        noHead ? v.unsqueeze(1) : v, Tensor(), Tensor(),
+        1.0 / options.temperature(), options.att_dropout(), is_training(),
+        mask.key_lengths, mask.causal);
+    return {noHead ? out.squeeze(1) : out, Tensor()};
   }
-  attn = ::torch::softmax(attn, 2);
+  Tensor attn = ::torch::matmul(q, k.transpose(-1, -2));
+  attn.div_(options.temperature());
+  MaskScores(attn, mask);
+  attn = ::torch::softmax(attn, -1);
   attn = dropout.forward(attn);
-  return {torch::bmm(attn, v), attn};
+  return {torch::matmul(attn, v), attn};
 }
 }  // namespace radish
@@ -19,6 +19,8 @@
 #include "torch/nn/pimpl.h"
 #include "torch/types.h"
 
+#include "radish/layers/attention_mask.h"
+
 namespace radish {
 using Tensor = ::torch::Tensor;
 /// Options for the `ScaleProductAttention` module.
@@ -26,6 +28,9 @@ struct TORCH_API ScaleProductAttentionOptions {
   ScaleProductAttentionOptions(double temperature, double att_dropout);
   TORCH_ARG(double, temperature) = 1.0;
   TORCH_ARG(double, att_dropout) = 0.1;
+  // CPU上用分块的attention kernel(layers/flash_attention.h),
+  // 不生成 L*L 的分数矩阵, forward 返回的attn为空
+  TORCH_ARG(bool, flash) = false;
 };
 
 class TORCH_API ScaleProductAttentionImpl
@@ -41,8 +46,12 @@ class TORCH_API ScaleProductAttentionImpl
   /// Pretty prints the `LayerNorm` module into the given `stream`.
   void pretty_print(std::ostream& stream) const override;
 
+  /**
+   * q/k/v 是 [B, L, d] 或 [B, heads, L, d], 可以是strided的view.
+   * 返回 {输出, attention概率}, flash时概率为空
+   */
   std::vector<Tensor> forward(const Tensor& q, const Tensor& k, const Tensor& v,
-                              const Tensor& mask = {});
+                              const AttentionMask& mask = {});
 
   /// The `Options` used to configure this  module.
   ScaleProductAttentionOptions options;
@@ -85,6 +85,8 @@ void TransformerImpl::reset() {
     CHECK_EQ(options.n_src_vocab(), options.n_tgt_vocab())
         << "To share word embedding table, the vocabulary size of src/tgt "
            "shall be the same.";
+    CHECK(!encoder->options.sparse_embedding())
+        << "sparse_embedding doesn't work with shared src/tgt embeddings";
     encoder->src_word_emb->weight = decoder->tgt_word_emb->weight;
   }
 }
@@ -114,4 +116,16 @@ Tensor TransformerImpl::forward(const Tensor& src_seq, const Tensor& src_pos,
   return seq_logit;
 }
 
+DecoderState TransformerImpl::init_state(const Tensor& src_seq,
+                                         const Tensor& src_pos) {
+  std::vector<Tensor> encodeRets = encoder(src_seq, src_pos);
+  return decoder->init_state(src_seq, encodeRets[0]);
+}
+
+Tensor TransformerImpl::decode_step(const Tensor& tgt_token,
+                                    DecoderState* state) {
+  return tgt_word_prj(decoder->forward_step(tgt_token, state))
+      .mul(x_logit_scale);
+}
+
 }  // namespace radish
@@ -63,6 +63,12 @@ class TORCH_API TransformerImpl
   Tensor forward(const Tensor& src_seq, const Tensor& src_pos,
                  const Tensor& tgt_seq, const Tensor& tgt_pos);
 
+  // 增量解码: encoder只跑一次, 之后每步调用 decode_step
+  DecoderState init_state(const Tensor& src_seq, const Tensor& src_pos);
+
+  // 下一个token的logits, b x n_tgt_vocab
+  Tensor decode_step(const Tensor& tgt_token, DecoderState* state);
+
   /// The options used to configure this module.
   TransformerOptions options;
   torch::nn::Linear tgt_word_prj = nullptr;
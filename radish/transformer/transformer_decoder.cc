@@ -19,8 +19,22 @@
 #include <utility>
 #include <vector>
 
+#include "radish/layers/attention_mask.h"
+
 namespace radish {
 
+void DecoderState::Reorder(const Tensor& index, bool cross) {
+  for (auto& layer : layers) {
+    layer.slf.Reorder(index);
+    if (cross) {
+      layer.enc.Reorder(index);
+    }
+  }
+  if (cross && enc_mask.key_lengths.defined()) {
+    enc_mask.key_lengths = enc_mask.key_lengths.index_select(0, index);
+  }
+}
+
 TransformerDecoderOptions::TransformerDecoderOptions(
     int64_t n_tgt_vocab, int64_t len_max_seq, int64_t d_word_vec,
     int64_t n_layers, int64_t n_head, int64_t d_k, int64_t d_v, int64_t d_model,
@@ -74,30 +88,10 @@ void TransformerDecoderImpl::pretty_print(std::ostream& stream) const {
          << ", n_layers=" << options.n_layers() << ")";
 }
 
-static Tensor get_attn_key_pad_mask(const Tensor& seq_k, const Tensor& seq_q) {
-  //  Expand to fit the shape of key query attention matrix.
-  int64_t len_q = seq_q.size(1);
-  Tensor padding_mask = seq_k.eq(0);
-  padding_mask = padding_mask.unsqueeze(1).expand({-1, len_q, -1});
-  return padding_mask;
-}
-
 static Tensor get_non_pad_mask(const Tensor& seq) {
   CHECK_EQ(seq.ndimension(), 2);
   return seq.ne(0).toType(c10::ScalarType::Float).unsqueeze(-1);
 }
-static Tensor get_subsequent_mask(const Tensor& seq) {
-  //  For masking out the subsequent info.
-  CHECK_EQ(seq.dim(), 2);
-  int64_t sz_b = seq.size(0);
-  int64_t len_s = seq.size(1);
-  torch::TensorOptions topt(torch::ScalarType::QUInt8);
-  topt = topt.device(seq.device());
-  Tensor subsequent_mask = torch::triu(torch::ones({len_s, len_s}, topt), 1);
-  subsequent_mask =
-      subsequent_mask.unsqueeze(0).expand({sz_b, -1, -1});  // b x ls x ls
-  return subsequent_mask;
-}
 
 std::vector<Tensor> TransformerDecoderImpl::forward(const Tensor& tgt_seq,
                                                     const Tensor& tgt_pos,
@@ -108,11 +102,9 @@ std::vector<Tensor> TransformerDecoderImpl::forward(const Tensor& tgt_seq,
   std::vector<Tensor> dec_enc_attn_list;
   // -- Prepare masks
   Tensor non_pad_mask = get_non_pad_mask(tgt_seq);
-  Tensor slf_attn_mask_subseq = get_subsequent_mask(tgt_seq);
-  Tensor slf_attn_mask_keypad = get_attn_key_pad_mask(tgt_seq, tgt_seq);
-  Tensor slf_attn_mask = (slf_attn_mask_keypad + slf_attn_mask_subseq).gt(0);
-
-  Tensor dec_enc_attn_mask = get_attn_key_pad_mask(src_seq, tgt_seq);
+  // 自注意力: tgt的长度加上因果; 交叉注意力: src的长度
+  AttentionMask slf_attn_mask(SequenceLengths(tgt_seq), true);
+  AttentionMask dec_enc_attn_mask(SequenceLengths(src_seq));
 
   // -- Forward
   Tensor dec_output = tgt_word_emb->forward(tgt_seq) + pos_emb(tgt_pos);
@@ -140,4 +132,34 @@ std::vector<Tensor> TransformerDecoderImpl::forward(const Tensor& tgt_seq,
     return {dec_output};
   }
 }
+
+DecoderState TransformerDecoderImpl::init_state(const Tensor& src_seq,
+                                                const Tensor& enc_output) {
+  DecoderState state;
+  state.enc_mask = AttentionMask(SequenceLengths(src_seq));
+  for (auto i = 0; i < options.n_layers(); i++) {
+    auto layer = decoder_stack->ptr<DecoderLayerImpl>(i);
+    DecoderLayerCache cache;
+    cache.enc = layer->decenc_attn->project_kv(enc_output);
+    state.layers.push_back(cache);
+  }
+  return state;
+}
+
+Tensor TransformerDecoderImpl::forward_step(const Tensor& tgt_token,
+                                            DecoderState* state) {
+  CHECK_EQ(tgt_token.ndimension(), 1);
+  CHECK_LT(state->steps, options.len_max_seq()) << "decoded past len_max_seq";
+  Tensor pos = torch::full({tgt_token.size(0), 1}, state->steps + 1,
+                           tgt_token.options().dtype(torch::kLong));
+  Tensor dec_output =
+      tgt_word_emb->forward(tgt_token.unsqueeze(1)) + pos_emb(pos);
+  for (auto i = 0; i < options.n_layers(); i++) {
+    auto layer = decoder_stack->ptr<DecoderLayerImpl>(i);
+    dec_output =
+        layer->forward_step(dec_output, &state->layers[i], state->enc_mask);
+  }
+  state->steps += 1;
+  return dec_output.squeeze(1);
+}
 }  // namespace radish
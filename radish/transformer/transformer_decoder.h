@@ -21,10 +21,26 @@
 #include "torch/nn/pimpl.h"
 #include "torch/types.h"
 
+#include "radish/layers/attention_mask.h"
 #include "radish/transformer/decoder_layer.h"
 
 namespace radish {
 using Tensor = torch::Tensor;
+
+/**
+ * 增量解码的状态: 每层自注意力的key/value缓存, 预先投影好的encoder
+ * key/value和src的长度. 每步只算新位置, 不重算已解码的前缀
+ */
+struct TORCH_API DecoderState {
+  // 按 index 选出/重排batch里的序列, cross=false时只重排自注意力的缓存
+  // (beam search里同一个样本的各beam共用一份encoder输出)
+  void Reorder(const Tensor& index, bool cross = true);
+
+  std::vector<DecoderLayerCache> layers;
+  AttentionMask enc_mask;
+  int64_t steps = 0;
+};
+
 /// Options for the `TransformerDecoder` module.
 struct TORCH_API TransformerDecoderOptions {
   TransformerDecoderOptions(int64_t n_tgt_vocab, int64_t len_max_seq,
@@ -64,6 +80,12 @@ class TORCH_API TransformerDecoderImpl
                               const Tensor& src_seq, const Tensor& enc_output,
                               bool return_attns = false);
 
+  // 投影每层交叉注意力的key/value, 之后用 forward_step 逐个位置解码
+  DecoderState init_state(const Tensor& src_seq, const Tensor& enc_output);
+
+  // tgt_token 是 [b] 的当前输入, 位置是 state->steps+1, 返回 b x d_model
+  Tensor forward_step(const Tensor& tgt_token, DecoderState* state);
+
   /// The options used to configure this module.
   TransformerDecoderOptions options;
   torch::nn::Embedding tgt_word_emb = nullptr;
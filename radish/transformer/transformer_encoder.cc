@@ -19,6 +19,9 @@
 #include <utility>
 #include <vector>
 
+#include "radish/layers/attention_mask.h"
+#include "radish/layers/unpad.h"
+#include "radish/transformer/positionwise_fc.h"
 #include "radish/utils/logging.h"
 
 namespace radish {
@@ -44,14 +47,6 @@ TransformerEncoderImpl::TransformerEncoderImpl(
   reset();
 }
 
-static Tensor get_attn_key_pad_mask(const Tensor& seq_k, const Tensor& seq_q) {
-  //  Expand to fit the shape of key query attention matrix.
-  int64_t len_q = seq_q.size(1);
-  Tensor padding_mask = seq_k.eq(0);
-  padding_mask = padding_mask.unsqueeze(1).expand({-1, len_q, -1});
-  return padding_mask;
-}
-
 static Tensor get_non_pad_mask(const Tensor& seq) {
   CHECK_EQ(seq.dim(), 2);
   return seq.ne(0).toType(torch::kFloat32).unsqueeze(-1);
@@ -59,8 +54,9 @@ static Tensor get_non_pad_mask(const Tensor& seq) {
 
 void TransformerEncoderImpl::reset() {
   int64_t n_position = options.len_max_seq() + 1;
-  src_word_emb = torch::nn::Embedding(
-      torch::nn::EmbeddingOptions(options.n_src_vocab(), options.d_word_vec()));
+  src_word_emb = radish::Embedding(
+      radish::EmbeddingOptions(options.n_src_vocab(), options.d_word_vec())
+          .sparse(options.sparse_embedding()));
   register_module("src_word_emb", src_word_emb);
   pos_emb = torch::nn::Embedding(
       torch::nn::EmbeddingOptions(n_position, options.d_word_vec()));
@@ -112,7 +108,8 @@ std::vector<Tensor> TransformerEncoderImpl::forward(const Tensor& src_seq,
   CHECK_EQ(src_seq.sizes(), src_pos.sizes());
 
   // -- Prepare masks
-  Tensor slf_attn_mask = get_attn_key_pad_mask(src_seq, src_seq);
+  // 只记每个序列的长度, 不生成 [B, L, L] 的mask
+  AttentionMask slf_attn_mask(SequenceLengths(src_seq));
   Tensor non_pad_mask = get_non_pad_mask(src_seq);
   // # -- Forward
   Tensor enc_output = src_word_emb->forward(src_seq);
@@ -121,6 +118,21 @@ std::vector<Tensor> TransformerEncoderImpl::forward(const Tensor& src_seq,
     CHECK_EQ(src_seq.sizes(), types.sizes());
     enc_output.add_(type_emb->forward(types));
   }
+  if (options.unpad_input() && !return_attns) {
+    // 打包之后再做投影, pad的位置不参与任何GEMM
+    UnpadIndex index = MakeUnpadIndex(src_seq);
+    enc_output = UnpadInput(enc_output, index);
+    if (options.need_factor_embedding()) {
+      enc_output = embedding_to_hidden_proj(enc_output);
+    }
+    AttentionMask packedMask;
+    packedMask.cu_seqlens = index.cu_seqlens;
+    for (auto i = 0; i < options.n_layers(); i++) {
+      auto elayer = encoder_stack->ptr<EncoderLayerImpl>(i);
+      enc_output = elayer->forward(enc_output, {}, packedMask)[0];
+    }
+    return {PadOutput(enc_output, index)};
+  }
   if (options.need_factor_embedding()) {
     enc_output = embedding_to_hidden_proj(enc_output);
   }
@@ -141,4 +153,13 @@ std::vector<Tensor> TransformerEncoderImpl::forward(const Tensor& src_seq,
   }
   return enc_slf_attn_list;
 }
+
+void TransformerEncoderImpl::quantize_int8() {
+  for (auto i = 0; i < options.n_layers(); i++) {
+    auto elayer = encoder_stack->ptr<EncoderLayerImpl>(i);
+    elayer->slf_attn->quantize_int8();
+    elayer->pos_ffn.ptr<PositionwiseFCImpl>()->quantize_int8();
+  }
+}
+
 }  // namespace radish
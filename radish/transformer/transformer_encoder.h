@@ -21,6 +21,7 @@
 #include "torch/nn/pimpl.h"
 #include "torch/types.h"
 
+#include "radish/layers/embedding_layer.h"
 #include "radish/transformer/encoder_layer.h"
 
 namespace radish {
@@ -44,6 +45,12 @@ struct TORCH_API TransformerEncoderOptions {
   TORCH_ARG(bool, need_factor_embedding) = false;
   TORCH_ARG(double, dropout) = 0.1;
   TORCH_ARG(int64_t, max_types) = 32;
+  // src word embedding输出稀疏梯度, 配合优化器只更新出现过的行.
+  // 和输出层绑定权重时(SpanBERT, Transformer)不支持, 见 BertOptions
+  TORCH_ARG(bool, sparse_embedding) = false;
+  // 不补齐执行: 真实token打包成 [T, d_model] 跑各层, 出口再补齐,
+  // return_attns=true 时仍走补齐的实现
+  TORCH_ARG(bool, unpad_input) = false;
 };
 
 class TORCH_API TransformerEncoderImpl
@@ -66,9 +73,15 @@ class TORCH_API TransformerEncoderImpl
                               const Tensor& type_emb = {},
                               bool return_attns = false);
 
+  /**
+   * 动态int8量化, 只用于推理: 各层attention和前馈网络的投影换成
+   * 按通道量化的int8权重, 原来的float权重被释放, 在加载完模型之后调用
+   */
+  void quantize_int8();
+
   /// The options used to configure this module.
   TransformerEncoderOptions options;
-  torch::nn::Embedding src_word_emb = nullptr;
+  radish::Embedding src_word_emb = nullptr;
   torch::nn::Embedding pos_emb = nullptr;
   torch::nn::Embedding type_emb = nullptr;
   torch::nn::Linear embedding_to_hidden_proj = nullptr;
@@ -0,0 +1,211 @@
+/*
+ * File: runtime_config.cc
+ * Project: utils
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-12 3:05:12
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/utils/runtime_config.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+
+#include "ATen/Parallel.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "json/json.h"
+
+#include "radish/utils/logging.h"
+
+namespace radish {
+namespace utils {
+
+namespace {
+// linux/mempolicy.h, 避免依赖libnuma
+constexpr int kMpolBind = 2;
+
+bool BindMemoryToNode(int node) {
+  unsigned long mask[16] = {0};
+  const int bits = sizeof(unsigned long) * 8;
+  if (node < 0 || node >= bits * 16) {
+    return false;
+  }
+  mask[node / bits] |= 1UL << (node % bits);
+  return syscall(SYS_set_mempolicy, kMpolBind, mask, bits * 16) == 0;
+}
+}  // namespace
+
+bool ParseCpuList(const std::string& spec, std::vector<int>* cpus) {
+  cpus->clear();
+  for (absl::string_view part :
+       absl::StrSplit(spec, ',', absl::SkipWhitespace())) {
+    part = absl::StripAsciiWhitespace(part);
+    std::vector<absl::string_view> range = absl::StrSplit(part, '-');
+    int begin = 0;
+    int end = 0;
+    if (range.size() == 1) {
+      if (!absl::SimpleAtoi(range[0], &begin)) {
+        return false;
+      }
+      end = begin;
+    } else if (range.size() == 2) {
+      if (!absl::SimpleAtoi(range[0], &begin) ||
+          !absl::SimpleAtoi(range[1], &end)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+    if (begin < 0 || end < begin || end >= CPU_SETSIZE) {
+      return false;
+    }
+    for (int i = begin; i <= end; i++) {
+      cpus->push_back(i);
+    }
+  }
+  return true;
+}
+
+std::vector<int> NumaNodeCpus(int node) {
+  std::vector<int> cpus;
+  std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) +
+                    "/cpulist");
+  std::string line;
+  if (!ifs || !std::getline(ifs, line) || !ParseCpuList(line, &cpus)) {
+    cpus.clear();
+  }
+  return cpus;
+}
+
+std::vector<int> CurrentThreadAffinity() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    return cpus;
+  }
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, &set)) {
+      cpus.push_back(i);
+    }
+  }
+  return cpus;
+}
+
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus) {
+  if (cpus.empty()) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void ApplyRuntimeOptions(const RuntimeOptions& options) {
+  if (options.numa_node() >= 0) {
+    if (!BindMemoryToNode(options.numa_node())) {
+      spdlog::warn("can't bind memory to numa node:{}", options.numa_node());
+    }
+  }
+  std::vector<int> computeCpus;
+  if (!options.compute_cpus().empty()) {
+    CHECK(ParseCpuList(options.compute_cpus(), &computeCpus))
+        << "bad compute cpu list:" << options.compute_cpus();
+  } else if (options.numa_node() >= 0) {
+    computeCpus = NumaNodeCpus(options.numa_node());
+  }
+  // 先绑定主线程, OpenMP线程池在第一次并行计算时创建, 会继承这个绑定
+  if (!computeCpus.empty() && !SetCurrentThreadAffinity(computeCpus)) {
+    spdlog::warn("can't set compute cpu affinity:{}",
+                 absl::StrJoin(computeCpus, ","));
+  }
+  if (options.inter_op_threads() > 0) {
+    try {
+      at::set_num_interop_threads(options.inter_op_threads());
+    } catch (const c10::Error&) {
+      spdlog::warn("inter-op threads already started, keep {}",
+                   at::get_num_interop_threads());
+    }
+  }
+  int intraThreads = options.intra_op_threads();
+  if (intraThreads <= 0 && !computeCpus.empty()) {
+    // 绑定了cpu时默认每个cpu一个计算线程, 避免超订
+    intraThreads = computeCpus.size();
+  }
+  if (intraThreads > 0) {
+    torch::set_num_threads(intraThreads);
+  }
+  spdlog::info("runtime: {}, intra-op threads:{}, inter-op threads:{}",
+               RuntimeOptionsDebugString(options), at::get_num_threads(),
+               at::get_num_interop_threads());
+}
+
+void RuntimeOptionsFromJson(const Json::Value& json, RuntimeOptions* options) {
+  options->intra_op_threads(
+      json.get("intra_op_threads", options->intra_op_threads()).asInt());
+  options->inter_op_threads(
+      json.get("inter_op_threads", options->inter_op_threads()).asInt());
+  options->loader_workers(
+      json.get("loader_workers", options->loader_workers()).asInt());
+  options->compute_cpus(
+      json.get("compute_cpus", options->compute_cpus()).asString());
+  options->data_cpus(json.get("data_cpus", options->data_cpus()).asString());
+  options->numa_node(json.get("numa_node", options->numa_node()).asInt());
+}
+
+void RuntimeOptionsToJson(const RuntimeOptions& options, Json::Value* json) {
+  (*json)["intra_op_threads"] = options.intra_op_threads();
+  (*json)["inter_op_threads"] = options.inter_op_threads();
+  (*json)["loader_workers"] = options.loader_workers();
+  (*json)["compute_cpus"] = options.compute_cpus();
+  (*json)["data_cpus"] = options.data_cpus();
+  (*json)["numa_node"] = options.numa_node();
+}
+
+std::string RuntimeOptionsDebugString(const RuntimeOptions& options) {
+  Json::Value json;
+  RuntimeOptionsToJson(options, &json);
+  Json::FastWriter writer;
+  std::string str = writer.write(json);
+  if (!str.empty() && str.back() == '\n') {
+    str.pop_back();
+  }
+  return str;
+}
+
+ScopedCpuAffinity::ScopedCpuAffinity(const std::string& cpus) {
+  if (cpus.empty()) {
+    return;
+  }
+  std::vector<int> target;
+  CHECK(ParseCpuList(cpus, &target)) << "bad cpu list:" << cpus;
+  saved_ = CurrentThreadAffinity();
+  active_ = !saved_.empty() && SetCurrentThreadAffinity(target);
+  if (!active_) {
+    spdlog::warn("can't set cpu affinity:{}", cpus);
+  }
+}
+
+ScopedCpuAffinity::~ScopedCpuAffinity() { Restore(); }
+
+void ScopedCpuAffinity::Restore() {
+  if (active_) {
+    SetCurrentThreadAffinity(saved_);
+    active_ = false;
+  }
+}
+
+}  // namespace utils
+}  // namespace radish
@@ -0,0 +1,84 @@
+/*
+ * File: runtime_config.h
+ * Project: utils
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-12 2:18:40
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "torch/arg.h"
+#include "torch/torch.h"
+
+namespace Json {
+class Value;
+}  // namespace Json
+
+namespace radish {
+namespace utils {
+
+/**
+ * 进程级的运行时配置: libtorch线程数, 计算/数据线程的CPU绑定, NUMA内存绑定.
+ * cpu列表的格式和 /sys/devices/system/node/nodeN/cpulist 相同, 如 "0-15,32-47"
+ */
+struct TORCH_API RuntimeOptions {
+  // intra-op(OpenMP/MKL)线程数, 0表示用libtorch的默认值
+  TORCH_ARG(int, intra_op_threads) = 0;
+  // inter-op线程池大小, 0表示默认值; 只能在第一次并行计算前设置
+  TORCH_ARG(int, inter_op_threads) = 0;
+  // DataLoader的worker数
+  TORCH_ARG(int, loader_workers) = 2;
+  // 主线程和计算线程绑定的cpu, 空表示不绑定
+  TORCH_ARG(std::string, compute_cpus) = "";
+  // DataLoader worker和预取线程绑定的cpu, 空表示不绑定
+  TORCH_ARG(std::string, data_cpus) = "";
+  // 大于等于0时内存分配绑定到这个NUMA节点; 没有指定cpu时同时用这个节点的cpu
+  TORCH_ARG(int, numa_node) = -1;
+};
+
+/// 解析 "0-3,8,10-11" 格式的cpu列表, 格式错误返回false
+bool ParseCpuList(const std::string& spec, std::vector<int>* cpus);
+
+/// NUMA节点上的cpu列表, 读不到时返回空
+std::vector<int> NumaNodeCpus(int node);
+
+/// 当前线程允许运行的cpu
+std::vector<int> CurrentThreadAffinity();
+
+/// 把当前线程绑定到这些cpu, 之后当前线程创建的线程继承这个绑定
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus);
+
+/// 应用线程数, 计算线程绑定和NUMA内存策略. 需要在模型创建和第一次计算前调用
+void ApplyRuntimeOptions(const RuntimeOptions& options);
+
+/// 从json读取, 缺少的字段保留 `options` 里原来的值
+void RuntimeOptionsFromJson(const Json::Value& json, RuntimeOptions* options);
+void RuntimeOptionsToJson(const RuntimeOptions& options, Json::Value* json);
+
+std::string RuntimeOptionsDebugString(const RuntimeOptions& options);
+
+/**
+ * 作用域内把当前线程绑定到 `cpus`, 析构时恢复原来的绑定.
+ * 在作用域内创建DataLoader/预取线程, 新线程就会继承数据线程的绑定
+ */
+class ScopedCpuAffinity {
+ public:
+  explicit ScopedCpuAffinity(const std::string& cpus);
+  ~ScopedCpuAffinity();
+  // 提前恢复原来的绑定
+  void Restore();
+
+ private:
+  std::vector<int> saved_;
+  bool active_ = false;
+};
+
+}  // namespace utils
+}  // namespace radish
@@ -0,0 +1,41 @@
+/*
+ * File: runtime_config_test.cc
+ * Project: utils
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-12 4:10:45
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "gtest/gtest.h"
+
+#include "json/json.h"
+#include "radish/utils/runtime_config.h"
+
+using radish::utils::ParseCpuList;
+using radish::utils::RuntimeOptions;
+
+TEST(RuntimeConfigTest, TestParseCpuList) {
+  std::vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("0-3, 8,10-11", &cpus));
+  EXPECT_EQ(cpus, std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_TRUE(ParseCpuList("", &cpus));
+  EXPECT_TRUE(cpus.empty());
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("a-b", &cpus));
+  EXPECT_FALSE(ParseCpuList("1-2-3", &cpus));
+}
+
+TEST(RuntimeConfigTest, TestJsonRoundTrip) {
+  RuntimeOptions options;
+  options.intra_op_threads(12).loader_workers(3).data_cpus("12-15");
+  Json::Value json;
+  radish::utils::RuntimeOptionsToJson(options, &json);
+  RuntimeOptions back;
+  radish::utils::RuntimeOptionsFromJson(json, &back);
+  EXPECT_EQ(back.intra_op_threads(), 12);
+  EXPECT_EQ(back.loader_workers(), 3);
+  EXPECT_EQ(back.data_cpus(), "12-15");
+  EXPECT_EQ(back.numa_node(), -1);
+}
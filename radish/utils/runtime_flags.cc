@@ -0,0 +1,97 @@
+/*
+ * File: runtime_flags.cc
+ * Project: utils
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-12 3:52:09
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+#include "radish/utils/runtime_flags.h"
+
+#include <fstream>
+#include <string>
+
+#include "absl/flags/flag.h"
+#include "json/json.h"
+
+#include "radish/utils/logging.h"
+
+ABSL_FLAG(std::string, runtime_config, "",
+          "json file with runtime options, e.g. written by the autotuner");
+ABSL_FLAG(int32_t, intra_op_threads, 0,
+          "intra-op threads, 0 to use the default");
+ABSL_FLAG(int32_t, inter_op_threads, 0,
+          "inter-op threads, 0 to use the default");
+ABSL_FLAG(int32_t, loader_workers, 0,
+          "data loader workers, 0 to use the default");
+ABSL_FLAG(std::string, compute_cpus, "",
+          "pin compute threads to these cpus, e.g. 0-15,32-47");
+ABSL_FLAG(std::string, data_cpus, "",
+          "pin data loader threads to these cpus");
+ABSL_FLAG(int32_t, numa_node, -1,
+          "bind memory (and cpus if not given) to this numa node");
+
+namespace radish {
+namespace utils {
+
+namespace {
+bool ReadRuntimeConfig(Json::Value* json) {
+  std::string path = absl::GetFlag(FLAGS_runtime_config);
+  if (path.empty()) {
+    return false;
+  }
+  Json::Reader reader;
+  std::ifstream ifs(path);
+  CHECK(ifs) << "can't read " << path << " ?";
+  CHECK(reader.parse(ifs, *json)) << "runtime config can't be parsed!";
+  return true;
+}
+}  // namespace
+
+RuntimeOptions RuntimeOptionsFromFlags() {
+  RuntimeOptions options;
+  Json::Value json;
+  if (ReadRuntimeConfig(&json)) {
+    RuntimeOptionsFromJson(json, &options);
+  }
+  if (absl::GetFlag(FLAGS_intra_op_threads) > 0) {
+    options.intra_op_threads(absl::GetFlag(FLAGS_intra_op_threads));
+  }
+  if (absl::GetFlag(FLAGS_inter_op_threads) > 0) {
+    options.inter_op_threads(absl::GetFlag(FLAGS_inter_op_threads));
+  }
+  if (absl::GetFlag(FLAGS_loader_workers) > 0) {
+    options.loader_workers(absl::GetFlag(FLAGS_loader_workers));
+  }
+  if (!absl::GetFlag(FLAGS_compute_cpus).empty()) {
+    options.compute_cpus(absl::GetFlag(FLAGS_compute_cpus));
+  }
+  if (!absl::GetFlag(FLAGS_data_cpus).empty()) {
+    options.data_cpus(absl::GetFlag(FLAGS_data_cpus));
+  }
+  if (absl::GetFlag(FLAGS_numa_node) >= 0) {
+    options.numa_node(absl::GetFlag(FLAGS_numa_node));
+  }
+  return options;
+}
+
+void TunedTrainConfigFromFlags(int* batchSize, int64_t* updatePerBatches) {
+  Json::Value json;
+  if (!ReadRuntimeConfig(&json)) {
+    return;
+  }
+  // 命令行显式给出(大于0)的值优先
+  if (*batchSize <= 0 && json.isMember("batch_size")) {
+    *batchSize = json["batch_size"].asInt();
+  }
+  if (*updatePerBatches <= 0 && json.isMember("update_per_batches")) {
+    *updatePerBatches = json["update_per_batches"].asInt64();
+  }
+  spdlog::info("tuned batch size:{}, update per batches:{}", *batchSize,
+               *updatePerBatches);
+}
+
+}  // namespace utils
+}  // namespace radish
@@ -0,0 +1,32 @@
+/*
+ * File: runtime_flags.h
+ * Project: utils
+ * Author: koth (Koth Chen)
+ * -----
+ * Last Modified: 2019-11-12 3:40:27
+ * Modified By: koth (nobody@verycool.com)
+ * -----
+ * Copyright 2020 - 2019
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "radish/utils/runtime_config.h"
+
+namespace radish {
+namespace utils {
+
+/**
+ * 各个训练/推理binary共用的运行时flags:
+ * --runtime_config 指定的json作为基础, 其余显式给出的flag覆盖json里的值
+ */
+RuntimeOptions RuntimeOptionsFromFlags();
+
+/// --runtime_config 里autotuner给出的batch_size/update_per_batches,
+/// 只填不大于0(没有在命令行给出)的那个, 其余保持原值
+void TunedTrainConfigFromFlags(int* batchSize, int64_t* updatePerBatches);
+
+}  // namespace utils
+}  // namespace radish
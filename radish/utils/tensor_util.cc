@@ -27,6 +27,10 @@ void ClipGradienNorm(std::vector<at::Tensor>& parameters, float max_norm) {
     if (p.requires_grad()) {
       auto param_norm = p.grad();
       if (!IsEmpty(param_norm)) {
+        if (param_norm.is_sparse()) {
+          // 稀疏梯度里可能有重复的行, 先合并再算norm
+          param_norm = param_norm.coalesce()._values();
+        }
         param_norm = param_norm.norm();
         total_norm += std::pow(param_norm.item<float>(), 2.f);
       }